@@ -25,6 +25,28 @@ glm::mat4 getViewMatrix() {
 glm::mat4 getProjectionMatrix() {
 	return ProjectionMatrix;
 }
+glm::vec3 getCameraPosition() {
+	return position;
+}
+
+void getPickRay(GLFWwindow* window, glm::vec3& origin, glm::vec3& direction) {
+	double xpos, ypos;
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	glfwGetCursorPos(window, &xpos, &ypos);
+
+	// Unproject the cursor on the near and far planes
+	const float x = 2.0f * float(xpos) / width - 1.0f;
+	const float y = 1.0f - 2.0f * float(ypos) / height;
+	const glm::mat4 inverse = glm::inverse(ProjectionMatrix * ViewMatrix);
+	glm::vec4 nearPoint = inverse * glm::vec4(x, y, -1.0f, 1.0f);
+	glm::vec4 farPoint = inverse * glm::vec4(x, y, 1.0f, 1.0f);
+	nearPoint /= nearPoint.w;
+	farPoint /= farPoint.w;
+
+	origin = glm::vec3(nearPoint);
+	direction = glm::normalize(glm::vec3(farPoint - nearPoint));
+}
 
 glm::vec3 getOrbitPos(glm::vec3 origin, glm::vec3 distance, float speed, float iTime) {
 	return glm::vec3(cos(iTime * speed) * distance.x + origin.x, sin(iTime * speed) * distance.y + origin.y, sin(iTime * speed) * distance.z + origin.z);
@@ -9,4 +9,9 @@ glm::mat4 getViewMatrix();
 
 glm::mat4 getProjectionMatrix();
 
+glm::vec3 getCameraPosition();
+
+// World space ray from the camera through the cursor, for picking
+void getPickRay(GLFWwindow* window, glm::vec3& origin, glm::vec3& direction);
+
 void computeMatricesFromInputs(GLFWwindow* window);
\ No newline at end of file
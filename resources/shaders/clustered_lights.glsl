@@ -0,0 +1,48 @@
+// Point lights binned in view space clusters by LightClusters, see
+// clustered_lighting.h. Each fragment only loops over the lights of its
+// cluster. The grid parameters come with the frame data.
+#include "frame_data.glsl"
+
+struct ClusterLight {
+	vec4 positionRadius; // view space
+	vec4 colorIntensity;
+};
+
+layout(std430, binding = 0) readonly buffer ClusterLights { ClusterLight clusterLights[]; };
+layout(std430, binding = 1) readonly buffer ClusterRanges { uvec2 clusterRanges[]; }; // offset, count
+layout(std430, binding = 2) readonly buffer ClusterIndices { uint clusterIndices[]; };
+
+// Windowed inverse square falloff, reaching zero at the radius
+vec3 shadePointLight(ClusterLight light, vec3 position, vec3 n, vec3 E, vec3 diffuseColor, vec3 specularColor) {
+	vec3 toLight = light.positionRadius.xyz - position;
+	float distanceSquared = dot(toLight, toLight);
+	float radiusSquared = light.positionRadius.w * light.positionRadius.w;
+	if (distanceSquared >= radiusSquared) {
+		return vec3(0.0);
+	}
+
+	float ratio = distanceSquared / radiusSquared;
+	float window = (1.0 - ratio * ratio) * (1.0 - ratio * ratio);
+	vec3 radiance = light.colorIntensity.rgb * (light.colorIntensity.w * window / (distanceSquared + 1.0));
+
+	vec3 l = toLight * (1.0 / sqrt(max(distanceSquared, 1e-8)));
+	float cosTheta = clamp(dot(n, l), 0, 1);
+	float cosAlpha = clamp(dot(E, reflect(-l, n)), 0, 1);
+	float cosAlpha2 = cosAlpha * cosAlpha;
+
+	return diffuseColor * radiance * cosTheta + specularColor * radiance * (cosAlpha2 * cosAlpha2 * cosAlpha);
+}
+
+// Sum of the cluster's lights at a camera space position
+vec3 clusteredLighting(vec3 position, vec3 n, vec3 E, vec3 diffuseColor, vec3 specularColor) {
+	uvec2 tile = min(uvec2(gl_FragCoord.xy * clusterTileScale), clusterCount.xy - 1u);
+	float slice = log(-position.z) * clusterDepthScaleBias.x + clusterDepthScaleBias.y;
+	uint z = uint(clamp(int(slice), 0, int(clusterCount.z) - 1));
+	uvec2 range = clusterRanges[(z * clusterCount.y + tile.y) * clusterCount.x + tile.x];
+
+	vec3 lighting = vec3(0.0);
+	for (uint i = 0u; i < range.y; i++) {
+		lighting += shadePointLight(clusterLights[clusterIndices[range.x + i]], position, n, E, diffuseColor, specularColor);
+	}
+	return lighting;
+}
@@ -0,0 +1,12 @@
+// Per frame values, written by the CPU into the frame ring. The std140
+// layout is mirrored by FrameUniforms in main.cpp.
+layout(std140, binding = 0) uniform FrameData {
+	mat4 V;
+	mat4 VP;
+	vec3 lightPosition;
+	float lightIntensity;
+	vec3 lightColor;
+	uvec3 clusterCount; // tiles x, tiles y, slices
+	vec2 clusterTileScale; // tiles per pixel
+	vec2 clusterDepthScaleBias; // slice = log(depth) * scale + bias
+};
@@ -3,6 +3,7 @@
 out vec4 color;
 
 in vec2 UV;
+in vec3 baseColor;
 
 
 in vec3 normal;
@@ -12,40 +13,50 @@ in vec3 position_worldspace;
 in vec3 normal_cameraspace;
 in vec3 lightDirection_cameraspace;
 in vec3 eyeDirection_cameraspace;
-in vec3 vertexColor;
 
+#ifdef NORMAL_MAP
+in vec3 vertexNormal_cameraspace;
+in vec3 vertexTangent_cameraspace;
+in vec3 vertexBitangent_cameraspace;
 in vec3 lightDirection_tangentspace;
 in vec3 eyeDirection_tangentspace;
+#endif
 
-uniform mat4 MVP;
 uniform sampler2D cubeTexture;
+#ifdef NORMAL_MAP
 uniform sampler2D normalTexture;
+#endif
 
-uniform vec3 lightPosition;
-uniform vec3 lightColor;
-uniform float lightIntensity;
+#include "frame_data.glsl"
+#include "clustered_lights.glsl"
 
 void main() {
 
 
 
     vec3 n = normalize(normal_cameraspace);
+    vec3 n_cameraspace = n;
     vec3 l = normalize(lightDirection_cameraspace);
     
     vec3 E = normalize(eyeDirection_cameraspace);
 
     
-    if (length(eyeDirection_tangentspace) > 0) {
-        vec3 textureNormal_tangentspace = normalize(texture( normalTexture, UV ).rgb*2.0 - 1.0);
+#ifdef NORMAL_MAP
+    {
+        // Only x and y are read, so BC5 normal maps work as well: z is rebuilt
+        vec2 textureNormal_xy = texture( normalTexture, UV ).rg*2.0 - 1.0;
+        vec3 textureNormal_tangentspace = vec3(textureNormal_xy, sqrt(max(0.0, 1.0 - dot(textureNormal_xy, textureNormal_xy))));
 
         n = normalize(textureNormal_tangentspace);
+        n_cameraspace = normalize(mat3(vertexTangent_cameraspace, vertexBitangent_cameraspace, vertexNormal_cameraspace) * n);
         l = normalize(lightDirection_tangentspace);
     
         E = normalize(eyeDirection_cameraspace);
     }
+#endif
     vec3 R = reflect(-l,n);
 
-    vec3 materialDiffuseColor = texture(cubeTexture, UV).rgb + vertexColor;
+    vec3 materialDiffuseColor = texture(cubeTexture, UV).rgb + baseColor;
     vec3 materialAmbientColor = vec3(0.15,0.15,0.15) * materialDiffuseColor;
     vec3 materialSpecularColor = vec3(0.3,0.3,0.3);
 
@@ -57,5 +68,6 @@ void main() {
     color = vec4(
         materialAmbientColor +
         materialDiffuseColor * lightColor * lightIntensity * cosTheta / (distanceLight * distanceLight) +
-        materialSpecularColor * lightColor * lightIntensity * pow(cosAlpha,5) / (distanceLight * distanceLight), 1);
+        materialSpecularColor * lightColor * lightIntensity * pow(cosAlpha,5) / (distanceLight * distanceLight) +
+        clusteredLighting(-eyeDirection_cameraspace, n_cameraspace, E, materialDiffuseColor, materialSpecularColor), 1);
 }
\ No newline at end of file
@@ -4,60 +4,75 @@ layout(location = 0) in vec3 vertexPosition_modelspace;
 
 layout(location = 1) in vec2 vertexUV_modelspace;
 
-layout(location = 2) in vec3 vertexNormal_modelspace;
+// xyz, or octahedral coordinates in xy with OCTAHEDRAL_NORMALS
+layout(location = 2) in vec4 vertexNormal_modelspace;
 
-layout(location = 3) in vec3 vertexColor_modelspace;
+#ifdef NORMAL_MAP
+// Bitangent handedness in w
+layout(location = 4) in vec4 vertexTangent_modelspace;
+#endif
 
-layout(location = 4) in vec3 vertexTangent_modelspace;
-
-layout(location = 5) in vec3 vertexBitangent_modelspace;
+// Per instance
+layout(location = 6) in mat4 instanceModel;
+layout(location = 10) in vec4 instanceColor;
 
 out vec2 UV;
+out vec3 baseColor;
 out vec3 normal;
 out vec3 lightDirection;
 out vec3 position_worldspace;
 out vec3 normal_cameraspace;
 out vec3 lightDirection_cameraspace;
 out vec3 eyeDirection_cameraspace;
-out vec3 vertexColor;
 
+#ifdef NORMAL_MAP
 out vec3 vertexNormal_cameraspace;
 out vec3 vertexTangent_cameraspace;
 out vec3 vertexBitangent_cameraspace;
 out vec3 lightDirection_tangentspace;
 out vec3 eyeDirection_tangentspace;
+#endif
 
-uniform mat4 MVP;
-uniform mat4 M;
-uniform mat4 V;
-uniform mat3 MV3x3;
-
-uniform vec3 lightPosition;
-uniform vec3 lightColor;
-uniform float lightIntensity;
+#include "frame_data.glsl"
+#ifdef OCTAHEDRAL_NORMALS
+#include "octahedral.glsl"
+#endif
 
 void main() {
-	vec3 vertexPosition_cameraspace = ( V * M * vec4(vertexPosition_modelspace,1)).xyz;
+#ifdef OCTAHEDRAL_NORMALS
+	vec3 vertexNormal = decodeOctahedral(vertexNormal_modelspace.xy);
+#else
+	vec3 vertexNormal = vertexNormal_modelspace.xyz;
+#endif
+
+	mat4 model = instanceModel;
+	mat3 modelView3x3 = mat3(V * model);
+
+	vec3 vertexPosition_cameraspace = ( V * model * vec4(vertexPosition_modelspace,1)).xyz;
 	eyeDirection_cameraspace = vec3(0,0,0) - vertexPosition_cameraspace;
 	
 	vec3 lightPosition_cameraspace = ( V * vec4(lightPosition,1)).xyz;
 	lightDirection_cameraspace = lightPosition_cameraspace + eyeDirection_cameraspace;
 
-	position_worldspace = (M * vec4(vertexPosition_modelspace, 1)).xyz;
-	normal_cameraspace = (V * M * vec4(vertexNormal_modelspace, 0)).xyz;
+	position_worldspace = (model * vec4(vertexPosition_modelspace, 1)).xyz;
+	normal_cameraspace = (V * model * vec4(vertexNormal, 0)).xyz;
  
-	if (length(vertexTangent_modelspace) > 0) {
-		vertexNormal_cameraspace = MV3x3 * normalize(vertexNormal_modelspace);
-		vertexTangent_cameraspace = MV3x3 * normalize(vertexTangent_modelspace);
-		vertexBitangent_cameraspace = MV3x3 * normalize(vertexBitangent_modelspace);
+#ifdef NORMAL_MAP
+	{
+		vec3 vertexBitangent = cross(vertexNormal, vertexTangent_modelspace.xyz) * vertexTangent_modelspace.w;
+		vertexNormal_cameraspace = modelView3x3 * normalize(vertexNormal);
+		vertexTangent_cameraspace = modelView3x3 * normalize(vertexTangent_modelspace.xyz);
+		vertexBitangent_cameraspace = modelView3x3 * normalize(vertexBitangent);
 	}
+#endif
 
 	lightDirection = normalize(lightPosition - gl_Position.xyz);
-	gl_Position = MVP * vec4(vertexPosition_modelspace, 1.0);
+	gl_Position = VP * model * vec4(vertexPosition_modelspace, 1.0);
 	UV = vertexUV_modelspace;
-	normal = vertexNormal_modelspace;
-	vertexColor = vertexColor_modelspace;
+	baseColor = instanceColor.rgb;
+	normal = vertexNormal;
 
+#ifdef NORMAL_MAP
 	mat3 TBN = transpose(mat3(
         vertexTangent_cameraspace,
         vertexBitangent_cameraspace,
@@ -66,4 +81,5 @@ void main() {
 
 	lightDirection_tangentspace = TBN * lightDirection_cameraspace;
     eyeDirection_tangentspace =  TBN * eyeDirection_cameraspace;
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,602 @@
+#include "asset_manager.h"
+#include "profiler.h"
+
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// Piece of an asset to copy into a buffer or a texture level. Texture
+// pieces are split on rows, or on rows of blocks when compressed.
+struct AssetManager::Upload
+{
+	struct Piece
+	{
+		const unsigned char * data;
+		size_t size;
+		GLuint * buffer; // null for a texture level
+		int level;
+		int width, height; // of the level
+		size_t rowSize; // bytes of a row, or of a row of blocks
+		int rowHeight; // 1, or 4 for blocks
+	};
+
+	MeshAsset * mesh = nullptr;
+	TextureAsset * texture = nullptr;
+	std::exception_ptr error;
+
+	std::vector<Piece> pieces;
+	size_t piece = 0; // first piece not fully copied
+	size_t offset = 0; // bytes of it already copied
+	bool created = false;
+	double loadMs = 0.0;
+
+	// A reload loads into its own asset, swapped into the reloaded one
+	std::unique_ptr<MeshAsset> freshMesh;
+	std::unique_ptr<TextureAsset> freshTexture;
+	MeshAsset * reloadedMesh = nullptr;
+	TextureAsset * reloadedTexture = nullptr;
+	bool superseded = false; // by a newer reload of the same asset
+};
+
+namespace
+{
+	const size_t STAGING_ALIGNMENT = 16;
+
+	Image loadImageFile(const std::string & path, ThreadPool & pool)
+	{
+		const bool bmp = path.size() > 4 && path.compare(path.size() - 4, 4, ".bmp") == 0;
+		return bmp ? LoadBMP(path.c_str(), pool) : LoadImage(path.c_str(), 3, nullptr, pool);
+	}
+
+	double elapsedMs(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+AssetManager::AssetManager(unsigned workerCount, size_t uploadBudget)
+	: finished(256), uploadBudget(uploadBudget)
+{
+	if (workerCount == 0)
+	{
+		workerCount = std::max(2u, std::thread::hardware_concurrency());
+	}
+	for (unsigned i = 0; i < workerCount; ++i)
+	{
+		workers.emplace_back(&AssetManager::workerLoop, this);
+	}
+
+	// Written by the CPU, read by the copies: coherent so no flush is needed
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &staging);
+	glBindBuffer(GL_COPY_READ_BUFFER, staging);
+	glBufferStorage(GL_COPY_READ_BUFFER, uploadBudget * SLICES, nullptr, flags);
+	stagingMemory = (unsigned char *) glMapBufferRange(GL_COPY_READ_BUFFER, 0, uploadBudget * SLICES, flags);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	if (!stagingMemory)
+	{
+		throw std::runtime_error("AssetManager: cannot map the staging buffer");
+	}
+}
+
+AssetManager::~AssetManager()
+{
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		stopping = true;
+	}
+	jobReady.notify_all();
+	for (std::thread & worker : workers)
+	{
+		worker.join();
+	}
+
+	for (GLsync & fence : fences)
+	{
+		if (fence)
+		{
+			glDeleteSync(fence);
+		}
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, staging);
+	glUnmapBuffer(GL_COPY_READ_BUFFER);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glDeleteBuffers(1, &staging);
+}
+
+void AssetManager::workerLoop()
+{
+	for (;;)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+			if (stopping)
+			{
+				return;
+			}
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+	}
+}
+
+void AssetManager::submit(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		jobs.push_back(std::move(job));
+	}
+	jobReady.notify_one();
+}
+
+void AssetManager::publish(Upload * upload, double loadMs)
+{
+	upload->loadMs = loadMs;
+	const uint64_t ns = (uint64_t) (loadMs * 1e6);
+	loadNs += ns;
+	for (uint64_t slowest = slowestLoadNs.load(); ns > slowest && !slowestLoadNs.compare_exchange_weak(slowest, ns);)
+	{
+	}
+
+	// Only full when the render thread stopped updating for a long time
+	while (!finished.push(upload))
+	{
+		std::this_thread::yield();
+	}
+}
+
+MeshAsset & AssetManager::loadMesh(const std::string & path, const MeshOptions & options, const VertexLayout & layout, bool buildBvh)
+{
+	meshes.emplace_back(new MeshAsset());
+	MeshAsset & mesh = *meshes.back();
+	mesh.path = path;
+	mesh.options = options;
+	mesh.format = MakeVertexFormat(layout);
+	mesh.buildBvh = buildBvh;
+
+	uploads.emplace_back(new Upload());
+	Upload * upload = uploads.back().get();
+	upload->mesh = &mesh;
+	submitMesh(upload);
+	return mesh;
+}
+
+void AssetManager::submitMesh(Upload * upload)
+{
+	MeshAsset & mesh = *upload->mesh;
+	submit([this, upload, &mesh] {
+		PROFILE_SCOPE("Load mesh");
+		const auto start = std::chrono::steady_clock::now();
+		try
+		{
+			mesh.cache.reset(new MeshCache(LoadMeshCached(mesh.path.c_str(), mesh.options, mesh.format.layout, pool)));
+			const MeshStreams streams = mesh.cache->streams();
+			mesh.bounds = ComputeBounds(streams.positions, streams.vertexCount);
+			if (mesh.buildBvh)
+			{
+				const std::vector<unsigned int> indices = mesh.cache->lodIndices(0);
+				mesh.bvh.reset(new Bvh(streams.positions, indices.data(), indices.size(), pool));
+			}
+
+			// Both staged straight from the mapped cache
+			upload->pieces.push_back({(const unsigned char *) mesh.cache->data(MeshCache::VERTICES), mesh.cache->size(MeshCache::VERTICES),
+				&mesh.vertexBuffer, 0, 0, 0, 0, 0});
+			upload->pieces.push_back({(const unsigned char *) mesh.cache->data(MeshCache::INDICES), mesh.cache->size(MeshCache::INDICES),
+				&mesh.elementBuffer, 0, 0, 0, 0, 0});
+		}
+		catch (...)
+		{
+			upload->error = std::current_exception();
+		}
+
+		publish(upload, elapsedMs(start));
+	});
+}
+
+TextureAsset & AssetManager::loadTexture(const std::string & path, BlockFormat format, bool keepLevels)
+{
+	textures.emplace_back(new TextureAsset());
+	TextureAsset & texture = *textures.back();
+	texture.path = path;
+	texture.format = format;
+	texture.compressed = CompressedFormatSupported(format); // needs the context, so asked here
+	texture.keepLevels = keepLevels;
+
+	uploads.emplace_back(new Upload());
+	Upload * upload = uploads.back().get();
+	upload->texture = &texture;
+	submitTexture(upload);
+	return texture;
+}
+
+void AssetManager::submitTexture(Upload * upload)
+{
+	TextureAsset & texture = *upload->texture;
+	submit([this, upload, &texture] {
+		PROFILE_SCOPE("Load texture");
+		const auto start = std::chrono::steady_clock::now();
+		try
+		{
+			if (texture.compressed)
+			{
+				texture.cache.reset(new TextureCache(LoadTextureCached(texture.path.c_str(), texture.format, pool)));
+				if (texture.keepLevels)
+				{
+					texture.levels = texture.cache->decode();
+				}
+				const size_t blockSize = BlockSize(texture.format);
+				for (size_t level = 0; level < texture.cache->levelCount(); ++level)
+				{
+					const int width = texture.cache->width(level), height = texture.cache->height(level);
+					upload->pieces.push_back({texture.cache->data(level), texture.cache->size(level), nullptr, (int) level,
+						width, height, (size_t) (width + 3) / 4 * blockSize, 4});
+				}
+			}
+			else
+			{
+				const MipFilter filter = texture.format == BlockFormat::BC5 ? MipFilter::NormalMap : MipFilter::Color;
+				texture.levels = BuildMipChain(loadImageFile(texture.path, pool), filter, pool);
+				for (size_t level = 0; level < texture.levels.size(); ++level)
+				{
+					const Image & image = texture.levels[level];
+					upload->pieces.push_back({image.data.data(), image.data.size(), nullptr, (int) level,
+						image.width, image.height, (size_t) image.width * image.channels, 1});
+				}
+			}
+		}
+		catch (...)
+		{
+			upload->error = std::current_exception();
+		}
+
+		publish(upload, elapsedMs(start));
+	});
+}
+
+bool AssetManager::reload(const std::string & path)
+{
+	bool found = false;
+	for (const std::unique_ptr<MeshAsset> & mesh : meshes)
+	{
+		if (mesh->path != path || !mesh->resident)
+		{
+			continue;
+		}
+		for (const std::unique_ptr<Upload> & pending : reloads)
+		{
+			pending->superseded = pending->superseded || pending->reloadedMesh == mesh.get();
+		}
+
+		reloads.emplace_back(new Upload());
+		Upload * upload = reloads.back().get();
+		upload->freshMesh.reset(new MeshAsset());
+		upload->freshMesh->path = mesh->path;
+		upload->freshMesh->options = mesh->options;
+		upload->freshMesh->format = mesh->format;
+		upload->freshMesh->buildBvh = mesh->buildBvh;
+		upload->mesh = upload->freshMesh.get();
+		upload->reloadedMesh = mesh.get();
+		submitMesh(upload);
+		found = true;
+	}
+
+	for (const std::unique_ptr<TextureAsset> & texture : textures)
+	{
+		if (texture->path != path || !texture->resident)
+		{
+			continue;
+		}
+		for (const std::unique_ptr<Upload> & pending : reloads)
+		{
+			pending->superseded = pending->superseded || pending->reloadedTexture == texture.get();
+		}
+
+		reloads.emplace_back(new Upload());
+		Upload * upload = reloads.back().get();
+		upload->freshTexture.reset(new TextureAsset());
+		upload->freshTexture->path = texture->path;
+		upload->freshTexture->format = texture->format;
+		upload->freshTexture->compressed = texture->compressed;
+		upload->freshTexture->keepLevels = texture->keepLevels;
+		upload->texture = upload->freshTexture.get();
+		upload->reloadedTexture = texture.get();
+		submitTexture(upload);
+		found = true;
+	}
+	return found;
+}
+
+void AssetManager::update()
+{
+	Upload * upload;
+	while (finished.pop(upload))
+	{
+		const bool reloading = upload->reloadedMesh || upload->reloadedTexture;
+		if (upload->error && reloading)
+		{
+			try
+			{
+				std::rethrow_exception(upload->error);
+			}
+			catch (const std::exception & e)
+			{
+				std::cerr << "Reload failed, keeping the previous version: " << e.what() << std::endl;
+			}
+			failedReloadCount++;
+			discard(upload);
+			continue;
+		}
+		if (upload->error)
+		{
+			std::rethrow_exception(upload->error);
+		}
+		if (upload->superseded)
+		{
+			discard(upload);
+			continue;
+		}
+		streaming.push_back(upload);
+	}
+	if (streaming.empty())
+	{
+		return;
+	}
+
+	PROFILE_SCOPE("Asset uploads");
+	const auto start = std::chrono::steady_clock::now();
+
+	// The slice written three updates ago must have been read by now
+	slice = (slice + 1) % SLICES;
+	if (fences[slice])
+	{
+		GLenum status;
+		do
+		{
+			status = glClientWaitSync(fences[slice], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		} while (status == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fences[slice]);
+		fences[slice] = nullptr;
+		if (status == GL_WAIT_FAILED)
+		{
+			throw std::runtime_error("AssetManager: glClientWaitSync failed");
+		}
+	}
+
+	size_t budget = uploadBudget;
+	while (!streaming.empty() && budget > 0)
+	{
+		Upload & current = *streaming.front();
+		stage(current, budget);
+		if (current.piece < current.pieces.size())
+		{
+			break;
+		}
+		streaming.pop_front();
+		complete(current);
+	}
+
+	fences[slice] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	uploadFrames++;
+	uploadMs += elapsedMs(start);
+}
+
+void AssetManager::stage(Upload & upload, size_t & budget)
+{
+	if (!upload.created)
+	{
+		// Immutable storage up front, filled by the copies below
+		if (upload.mesh)
+		{
+			for (const Upload::Piece & piece : upload.pieces)
+			{
+				glGenBuffers(1, piece.buffer);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, *piece.buffer);
+				glBufferStorage(GL_COPY_WRITE_BUFFER, std::max<size_t>(piece.size, 1), nullptr, GL_DYNAMIC_STORAGE_BIT);
+			}
+		}
+		else
+		{
+			TextureAsset & texture = *upload.texture;
+			const GLenum internalFormat = texture.compressed ? BlockGLFormat(texture.format) : texture.levels[0].channels == 4 ? GL_RGBA8 : GL_RGB8;
+			glGenTextures(1, &texture.texture);
+			glBindTexture(GL_TEXTURE_2D, texture.texture);
+			glTexStorage2D(GL_TEXTURE_2D, (GLsizei) upload.pieces.size(), internalFormat, upload.pieces[0].width, upload.pieces[0].height);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		}
+		upload.created = true;
+	}
+
+	unsigned char * sliceMemory = stagingMemory + slice * uploadBudget;
+	const size_t sliceOffset = slice * uploadBudget;
+	glBindBuffer(GL_COPY_READ_BUFFER, staging);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (upload.texture)
+	{
+		glBindTexture(GL_TEXTURE_2D, upload.texture->texture);
+	}
+
+	for (; upload.piece < upload.pieces.size(); upload.piece++, upload.offset = 0)
+	{
+		const Upload::Piece & piece = upload.pieces[upload.piece];
+
+		// Whole rows for textures. A row larger than a slice goes straight
+		// from memory, alone in its update.
+		const size_t granularity = piece.buffer ? 1 : piece.rowSize;
+		const size_t used = uploadBudget - budget;
+		const bool direct = granularity > uploadBudget;
+		const size_t size = direct ? granularity : std::min(piece.size - upload.offset, budget / granularity * granularity);
+		if (direct ? used > 0 : size == 0 && piece.size > upload.offset)
+		{
+			break;
+		}
+
+		const unsigned char * source = piece.data + upload.offset;
+		const size_t stagingOffset = sliceOffset + used;
+		if (!direct)
+		{
+			memcpy(sliceMemory + used, source, size);
+		}
+		if (piece.buffer)
+		{
+			glBindBuffer(GL_COPY_WRITE_BUFFER, *piece.buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, stagingOffset, upload.offset, size);
+		}
+		else
+		{
+			const int y = (int) (upload.offset / piece.rowSize) * piece.rowHeight;
+			const int rows = std::min((int) (size / piece.rowSize) * piece.rowHeight, piece.height - y);
+			if (direct)
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+			const void * pixels = direct ? (const void *) source : (const void *) stagingOffset;
+			if (upload.texture->compressed)
+			{
+				glCompressedTexSubImage2D(GL_TEXTURE_2D, piece.level, 0, y, piece.width, rows, BlockGLFormat(upload.texture->format),
+					(GLsizei) size, pixels);
+			}
+			else
+			{
+				glTexSubImage2D(GL_TEXTURE_2D, piece.level, 0, y, piece.width, rows,
+					upload.texture->levels[0].channels == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, pixels);
+			}
+			if (direct)
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging);
+			}
+		}
+
+		upload.offset += size;
+		uploadedBytes += size;
+		budget -= direct ? budget : std::min(budget, (size + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1));
+		if (upload.offset < piece.size)
+		{
+			break;
+		}
+	}
+
+	// Client memory uploads elsewhere expect no unpack buffer and 4-byte rows
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void AssetManager::complete(Upload & upload)
+{
+	if (upload.mesh)
+	{
+		upload.mesh->resident = true;
+	}
+	else
+	{
+		// The GPU copy is the only one needed, unless kept for the CPU
+		TextureAsset & texture = *upload.texture;
+		if (!texture.keepLevels)
+		{
+			texture.levels.clear();
+			texture.levels.shrink_to_fit();
+		}
+		texture.resident = true;
+	}
+	upload.pieces.clear();
+
+	if (upload.reloadedMesh || upload.reloadedTexture)
+	{
+		swap(upload);
+	}
+	else
+	{
+		residentCount++;
+	}
+}
+
+void AssetManager::swap(Upload & upload)
+{
+	// At the start of a frame. The previous frames drew with the objects
+	// deleted here, GL keeps them alive until those draws are over.
+	if (upload.reloadedMesh)
+	{
+		MeshAsset & target = *upload.reloadedMesh;
+		MeshAsset & fresh = *upload.freshMesh;
+		if (!upload.superseded)
+		{
+			std::swap(target.vertexBuffer, fresh.vertexBuffer);
+			std::swap(target.elementBuffer, fresh.elementBuffer);
+			*target.cache = std::move(*fresh.cache);
+			target.bounds = fresh.bounds;
+			if (target.bvh && fresh.bvh)
+			{
+				*target.bvh = std::move(*fresh.bvh);
+			}
+			target.version++;
+		}
+		glDeleteBuffers(1, &fresh.vertexBuffer);
+		glDeleteBuffers(1, &fresh.elementBuffer);
+	}
+	else
+	{
+		TextureAsset & target = *upload.reloadedTexture;
+		TextureAsset & fresh = *upload.freshTexture;
+		if (!upload.superseded)
+		{
+			std::swap(target.texture, fresh.texture);
+			std::swap(target.cache, fresh.cache);
+			target.levels = std::move(fresh.levels);
+			target.version++;
+		}
+		glDeleteTextures(1, &fresh.texture);
+	}
+
+	if (!upload.superseded)
+	{
+		std::cout << "Reloaded " << (upload.mesh ? upload.mesh->path : upload.texture->path) << ", " << upload.loadMs << " ms on a worker" << std::endl;
+		reloadCount++;
+	}
+	discard(&upload);
+}
+
+void AssetManager::discard(Upload * upload)
+{
+	reloads.erase(std::find_if(reloads.begin(), reloads.end(), [upload](const std::unique_ptr<Upload> & pending) {
+		return pending.get() == upload;
+	}));
+}
+
+void AssetManager::finish()
+{
+	while (!done())
+	{
+		update();
+		if (!done() && streaming.empty())
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
+bool AssetManager::done() const
+{
+	return residentCount == uploads.size();
+}
+
+AssetStats AssetManager::stats() const
+{
+	AssetStats stats;
+	stats.loaded = residentCount;
+	stats.pending = uploads.size() - residentCount;
+	stats.slowestLoadMs = slowestLoadNs.load() / 1e6;
+	stats.totalLoadMs = loadNs.load() / 1e6;
+	stats.uploadMs = uploadMs;
+	stats.uploadedBytes = uploadedBytes;
+	stats.uploadFrames = uploadFrames;
+	stats.reloads = reloadCount;
+	stats.failedReloads = failedReloadCount;
+	return stats;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+#include "mesh_cache.h"
+#include "vertex_format.h"
+#include "scene.h"
+#include "bvh.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include "lock_free_queue.h"
+#include "thread_pool.h"
+
+// Mesh loaded by AssetManager. The CPU fields are filled on a worker, the
+// buffers on the render thread; nothing may be read before resident.
+struct MeshAsset
+{
+	std::string path;
+	MeshOptions options;
+	VertexFormat format;
+	bool buildBvh = false;
+
+	std::unique_ptr<MeshCache> cache; // VERTICES interleaved with format
+	Aabb bounds;
+	std::unique_ptr<Bvh> bvh; // over the full resolution LOD, when asked for
+
+	GLuint vertexBuffer = 0;
+	GLuint elementBuffer = 0;
+	bool resident = false;
+
+	// Reloads swapped in. The fields above change in place then: cache and
+	// bvh keep their addresses, the buffers are new.
+	unsigned version = 0;
+};
+
+// Texture loaded by AssetManager: block compressed through the texture
+// cache when the driver takes the format, otherwise as RGB mip levels
+struct TextureAsset
+{
+	std::string path;
+	BlockFormat format;
+	bool compressed = false;
+	bool keepLevels = false;
+
+	std::unique_ptr<TextureCache> cache;
+	std::vector<Image> levels; // as sampled, kept only with keepLevels
+
+	GLuint texture = 0;
+	bool resident = false;
+	unsigned version = 0; // reloads swapped in, each with a new texture
+};
+
+struct AssetStats
+{
+	size_t loaded = 0; // assets resident
+	size_t pending = 0; // still loading or uploading
+	double slowestLoadMs = 0.0; // longest single load on a worker
+	double totalLoadMs = 0.0; // sum of the worker times, what a serial start would take
+	double uploadMs = 0.0; // render thread time spent in update
+	size_t uploadedBytes = 0;
+	size_t uploadFrames = 0; // update calls that uploaded something
+	size_t reloads = 0; // swapped in
+	size_t failedReloads = 0; // the previous version was kept
+};
+
+// Loads and processes meshes and textures on its own worker threads, while
+// the render thread keeps drawing. Finished CPU data is handed back through
+// a lock-free queue, and update() streams it to GL through a persistently
+// mapped staging buffer, at most uploadBudget bytes per call, so a frame
+// never stalls on a large asset. The loads run their parallel loops on a pool
+// of their own, never on ThreadPool::global() where the frames run theirs.
+class AssetManager
+{
+public:
+	// 0 workers means one per core, at least two so that loads overlap
+	explicit AssetManager(unsigned workerCount = 0, size_t uploadBudget = 8 << 20);
+
+	// Drops the loads not started yet and waits for the running ones
+	~AssetManager();
+
+	AssetManager(const AssetManager&) = delete;
+	AssetManager& operator=(const AssetManager&) = delete;
+
+	// Render thread only. The assets live as long as the manager.
+	MeshAsset & loadMesh(const std::string & path, const MeshOptions & options, const VertexLayout & layout, bool buildBvh = false);
+	TextureAsset & loadTexture(const std::string & path, BlockFormat format, bool keepLevels = false);
+
+	// Render thread. Loads the assets read from path again, into new objects
+	// swapped in by update once uploaded; the frames keep drawing the current
+	// ones until then, and for good if the load fails. Only resident assets
+	// are reloaded, returns whether any was.
+	bool reload(const std::string & path);
+
+	// Render thread, once per frame: creates the GL objects of finished
+	// loads and copies their data, within the budget, then swaps in the
+	// finished reloads
+	void update();
+
+	// Runs update until every asset is resident, rethrowing load errors
+	void finish();
+
+	bool done() const;
+	AssetStats stats() const;
+
+private:
+	struct Upload;
+
+	void workerLoop();
+	void submit(std::function<void()> job);
+	void submitMesh(Upload * upload);
+	void submitTexture(Upload * upload);
+	void publish(Upload * upload, double loadMs); // worker side, once a load is over
+	void stage(Upload & upload, size_t & budget);
+	void complete(Upload & upload);
+	void swap(Upload & upload);
+	void discard(Upload * upload); // a reload, after its failure or once swapped
+
+	std::vector<std::thread> workers;
+	ThreadPool pool; // parallel loops of the loads
+	std::mutex jobMutex;
+	std::condition_variable jobReady;
+	std::deque<std::function<void()>> jobs;
+	bool stopping = false;
+
+	// Filled by the workers, drained by update
+	LockFreeQueue<Upload *> finished;
+	std::vector<std::unique_ptr<Upload>> uploads; // every asset, render thread only
+	std::vector<std::unique_ptr<Upload>> reloads; // in flight
+	std::deque<Upload *> streaming; // popped, partly uploaded
+
+	std::vector<std::unique_ptr<MeshAsset>> meshes;
+	std::vector<std::unique_ptr<TextureAsset>> textures;
+
+	// Staging ring in three slices, each fenced after the copies reading it
+	static const int SLICES = 3;
+	const size_t uploadBudget;
+	GLuint staging = 0;
+	unsigned char * stagingMemory = nullptr;
+	GLsync fences[SLICES] = {};
+	int slice = 0;
+
+	std::atomic<uint64_t> loadNs{0};
+	std::atomic<uint64_t> slowestLoadNs{0};
+	double uploadMs = 0.0;
+	size_t uploadedBytes = 0;
+	size_t uploadFrames = 0;
+	size_t residentCount = 0;
+	size_t reloadCount = 0;
+	size_t failedReloadCount = 0;
+};
@@ -0,0 +1,134 @@
+#include "batching.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+void BatchStats::add(const BatchStats & other)
+{
+	items += other.items;
+	commands += other.commands;
+	batches += other.batches;
+}
+
+void DrawBatcher::build(const Scene & scene, const std::vector<BatchMesh> & meshes, const std::vector<BatchMaterial> & materials,
+	const DrawItem * items, size_t count, const TriangleRange * ranges, ThreadPool & pool)
+{
+	drawCommands.clear();
+	drawBatches.clear();
+	itemCount = count;
+
+	// Group of an item: whole mesh draws of a (mesh, material) pair are
+	// instanced together, ranged draws of the pair follow them
+	const size_t materialCount = materials.size();
+	auto groupOf = [&](const DrawItem & item) {
+		return ((size_t) item.mesh * materialCount + item.material) * 2 + (item.rangeCount ? 1 : 0);
+	};
+
+	groupOffsets.assign(meshes.size() * materialCount * 2, 0);
+	usedGroups.clear();
+	for (size_t i = 0; i < count; ++i)
+	{
+		const DrawItem & item = items[i];
+		if (item.mesh >= meshes.size() || item.material >= materials.size() || item.object >= scene.size())
+		{
+			throw std::runtime_error("Draw item out of range");
+		}
+		if (item.rangeCount && !ranges)
+		{
+			throw std::runtime_error("Draw item has ranges but none were given");
+		}
+		const size_t group = groupOf(item);
+		if (groupOffsets[group]++ == 0)
+		{
+			usedGroups.push_back((uint32_t) group);
+		}
+	}
+
+	// Batch order, only over the groups in use
+	auto meshOf = [&](uint32_t group) -> const BatchMesh & { return meshes[group / 2 / materialCount]; };
+	auto materialOf = [&](uint32_t group) -> const BatchMaterial & { return materials[group / 2 % materialCount]; };
+	groupKeys.resize(usedGroups.size());
+	for (size_t g = 0; g < usedGroups.size(); ++g)
+	{
+		groupKeys[g] = {meshOf(usedGroups[g]).buffer, materialOf(usedGroups[g]).state, usedGroups[g]};
+	}
+	std::sort(groupKeys.begin(), groupKeys.end(), [](const GroupKey & a, const GroupKey & b) {
+		if (a.buffer != b.buffer) return a.buffer < b.buffer;
+		if (a.state != b.state) return a.state < b.state;
+		return a.group < b.group;
+	});
+	for (size_t g = 0; g < usedGroups.size(); ++g)
+	{
+		usedGroups[g] = groupKeys[g].group;
+	}
+
+	// Counts to first instance slots, then items to slots (stable)
+	groupCounts.resize(usedGroups.size());
+	uint32_t slot = 0;
+	for (size_t g = 0; g < usedGroups.size(); ++g)
+	{
+		uint32_t & offset = groupOffsets[usedGroups[g]];
+		groupCounts[g] = offset;
+		const uint32_t size = offset;
+		offset = slot;
+		slot += size;
+	}
+
+	slotItems.resize(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		slotItems[groupOffsets[groupOf(items[i])]++] = (uint32_t) i;
+	}
+
+	instanceData.resize(count);
+	pool.parallelRanges(count, 4096, [&](size_t begin, size_t end) {
+		for (size_t s = begin; s < end; ++s)
+		{
+			const DrawItem & item = items[slotItems[s]];
+			instanceData[s].model = scene.transform(item.object);
+			instanceData[s].color = materials[item.material].color;
+		}
+	});
+
+	// One command per group, or per range for ranged groups, and a batch per (buffer, state) run
+	uint32_t firstSlot = 0;
+	for (size_t g = 0; g < usedGroups.size(); ++g)
+	{
+		const uint32_t group = usedGroups[g];
+		const BatchMesh & mesh = meshOf(group);
+		const uint32_t state = materialOf(group).state;
+
+		if (drawBatches.empty() || drawBatches.back().buffer != mesh.buffer || drawBatches.back().state != state)
+		{
+			drawBatches.push_back({mesh.buffer, state, (uint32_t) drawCommands.size(), 0});
+		}
+
+		if (group % 2 == 0)
+		{
+			drawCommands.push_back({mesh.indexCount, groupCounts[g], mesh.firstIndex, mesh.baseVertex, firstSlot});
+		}
+		else
+		{
+			for (uint32_t s = firstSlot; s < firstSlot + groupCounts[g]; ++s)
+			{
+				const DrawItem & item = items[slotItems[s]];
+				for (uint32_t r = item.firstRange; r < item.firstRange + item.rangeCount; ++r)
+				{
+					drawCommands.push_back({ranges[r].triangleCount * 3, 1, mesh.firstIndex + ranges[r].firstTriangle * 3, mesh.baseVertex, s});
+				}
+			}
+		}
+
+		firstSlot += groupCounts[g];
+		drawBatches.back().commandCount = (uint32_t) drawCommands.size() - drawBatches.back().firstCommand;
+	}
+}
+
+BatchStats DrawBatcher::stats() const
+{
+	BatchStats stats;
+	stats.items = itemCount;
+	stats.commands = drawCommands.size();
+	stats.batches = drawBatches.size();
+	return stats;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "scene.h"
+#include "meshlets.h"
+#include "vertex_format.h"
+#include "thread_pool.h"
+
+// Layout read by glMultiDrawElementsIndirect from GL_DRAW_INDIRECT_BUFFER
+struct DrawElementsIndirectCommand
+{
+	uint32_t count;
+	uint32_t instanceCount;
+	uint32_t firstIndex;
+	int32_t baseVertex;
+	uint32_t baseInstance;
+};
+
+// Where a mesh (or one of its LODs) lives in the shared vertex and index
+// buffers. Meshes of the same buffer can share a draw call.
+struct BatchMesh
+{
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	int32_t baseVertex;
+	uint32_t buffer;
+};
+
+// Instance color, and the GL state (textures...) the material binds.
+// Materials sharing a state can share a draw call.
+struct BatchMaterial
+{
+	glm::vec4 color;
+	uint32_t state;
+};
+
+// One object to draw. When rangeCount is not 0, only the triangle ranges
+// [firstRange, firstRange + rangeCount) of the mesh are drawn, which keeps
+// the result of meshlet culling at the cost of one command per range.
+struct DrawItem
+{
+	Scene::ObjectId object;
+	uint32_t mesh;
+	uint32_t material;
+	uint32_t firstRange;
+	uint32_t rangeCount;
+};
+
+// Commands [firstCommand, firstCommand + commandCount) go out in one
+// glMultiDrawElementsIndirect call with buffer and state bound
+struct DrawBatch
+{
+	uint32_t buffer;
+	uint32_t state;
+	uint32_t firstCommand;
+	uint32_t commandCount;
+};
+
+struct BatchStats
+{
+	size_t items = 0;
+	size_t commands = 0;
+	size_t batches = 0;
+
+	void add(const BatchStats & other);
+};
+
+// Turns a list of draws into indirect commands and instance data, without
+// touching GL. Items are grouped by mesh and material with a counting sort,
+// each group becomes one instanced command, and groups are ordered by buffer,
+// state and material so neighbours merge into batches.
+class DrawBatcher
+{
+public:
+	// ranges is what DrawItem::firstRange indexes, it may be null when no item uses ranges
+	void build(const Scene & scene, const std::vector<BatchMesh> & meshes, const std::vector<BatchMaterial> & materials,
+		const DrawItem * items, size_t itemCount, const TriangleRange * ranges, ThreadPool & pool = ThreadPool::global());
+
+	const std::vector<DrawElementsIndirectCommand> & commands() const { return drawCommands; }
+	const std::vector<InstanceData> & instances() const { return instanceData; }
+	const std::vector<DrawBatch> & batches() const { return drawBatches; }
+	BatchStats stats() const;
+
+private:
+	std::vector<DrawElementsIndirectCommand> drawCommands;
+	std::vector<InstanceData> instanceData;
+	std::vector<DrawBatch> drawBatches;
+
+	// Scratch kept between frames
+	std::vector<uint32_t> groupOffsets; // per (mesh, material, ranged)
+	struct GroupKey
+	{
+		uint32_t buffer;
+		uint32_t state;
+		uint32_t group;
+	};
+	std::vector<uint32_t> usedGroups;
+	std::vector<GroupKey> groupKeys;
+	std::vector<uint32_t> groupCounts; // instances of each used group
+	std::vector<uint32_t> slotItems; // item drawn by each instance
+	size_t itemCount = 0;
+};
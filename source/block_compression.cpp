@@ -0,0 +1,569 @@
+#include "block_compression.h"
+#include "profiler.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLOCK_SSE 1
+#endif
+
+namespace
+{
+	// Texels of a block in 0-255, one array per channel so that four texels
+	// are handled at once
+	struct alignas(16) Block
+	{
+		float channels[4][16];
+	};
+
+	// Block at (blockX, blockY), the texels past the edges clamped to them
+	void loadBlock(const Image & image, int blockX, int blockY, Block & block)
+	{
+		for (int y = 0; y < 4; y++)
+		{
+			const int row = std::min(blockY * 4 + y, image.height - 1);
+			for (int x = 0; x < 4; x++)
+			{
+				const int column = std::min(blockX * 4 + x, image.width - 1);
+				const unsigned char * texel = &image.data[((size_t) row * image.width + column) * image.channels];
+				for (int channel = 0; channel < 4; channel++)
+				{
+					block.channels[channel][y * 4 + x] = channel < image.channels ? texel[channel] : 255.0f;
+				}
+			}
+		}
+	}
+
+	uint16_t pack565(const float color[3])
+	{
+		const int r = (int) std::floor(std::min(std::max(color[0], 0.0f), 255.0f) * (31.0f / 255.0f) + 0.5f);
+		const int g = (int) std::floor(std::min(std::max(color[1], 0.0f), 255.0f) * (63.0f / 255.0f) + 0.5f);
+		const int b = (int) std::floor(std::min(std::max(color[2], 0.0f), 255.0f) * (31.0f / 255.0f) + 0.5f);
+		return (uint16_t) (r << 11 | g << 5 | b);
+	}
+
+	// Bits replicated into the low ones, as the GPU expands them
+	void unpack565(uint16_t packed, int color[3])
+	{
+		const int r = packed >> 11 & 31, g = packed >> 5 & 63, b = packed & 31;
+		color[0] = r << 3 | r >> 2;
+		color[1] = g << 2 | g >> 4;
+		color[2] = b << 3 | b >> 2;
+	}
+
+	// Four colors of a block in 4-color mode: both endpoints, then their
+	// mixes at one and two thirds
+	void blockPalette(uint16_t color0, uint16_t color1, int palette[4][3])
+	{
+		unpack565(color0, palette[0]);
+		unpack565(color1, palette[1]);
+		for (int channel = 0; channel < 3; channel++)
+		{
+			palette[2][channel] = (2 * palette[0][channel] + palette[1][channel]) / 3;
+			palette[3][channel] = (palette[0][channel] + 2 * palette[1][channel]) / 3;
+		}
+	}
+
+	// Nearest palette color of every texel; returns the squared error
+	float selectIndices(const Block & block, const int palette[4][3], uint8_t indices[16])
+	{
+		float error = 0.0f;
+#ifdef BLOCK_SSE
+		__m128 total = _mm_setzero_ps();
+		for (int group = 0; group < 16; group += 4)
+		{
+			const __m128 r = _mm_load_ps(&block.channels[0][group]);
+			const __m128 g = _mm_load_ps(&block.channels[1][group]);
+			const __m128 b = _mm_load_ps(&block.channels[2][group]);
+			__m128 best = _mm_set1_ps(1e30f);
+			__m128i bestIndex = _mm_setzero_si128();
+			for (int entry = 0; entry < 4; entry++)
+			{
+				const __m128 dr = _mm_sub_ps(r, _mm_set1_ps((float) palette[entry][0]));
+				const __m128 dg = _mm_sub_ps(g, _mm_set1_ps((float) palette[entry][1]));
+				const __m128 db = _mm_sub_ps(b, _mm_set1_ps((float) palette[entry][2]));
+				const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+				const __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, best));
+				best = _mm_min_ps(distance, best);
+				bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(entry)), _mm_andnot_si128(closer, bestIndex));
+			}
+			total = _mm_add_ps(total, best);
+			alignas(16) int32_t lanes[4];
+			_mm_store_si128((__m128i *) lanes, bestIndex);
+			for (int lane = 0; lane < 4; lane++)
+			{
+				indices[group + lane] = (uint8_t) lanes[lane];
+			}
+		}
+		alignas(16) float sums[4];
+		_mm_store_ps(sums, total);
+		error = sums[0] + sums[1] + sums[2] + sums[3];
+#else
+		for (int texel = 0; texel < 16; texel++)
+		{
+			float best = 1e30f;
+			for (int entry = 0; entry < 4; entry++)
+			{
+				float distance = 0.0f;
+				for (int channel = 0; channel < 3; channel++)
+				{
+					const float d = block.channels[channel][texel] - palette[entry][channel];
+					distance += d * d;
+				}
+				if (distance < best)
+				{
+					best = distance;
+					indices[texel] = (uint8_t) entry;
+				}
+			}
+			error += best;
+		}
+#endif
+		return error;
+	}
+
+	// Sums over the 16 texels of products of the centered color channels:
+	// rr, rg, rb, gg, gb, bb
+	void covariance(const Block & block, const float mean[3], float sums[6])
+	{
+#ifdef BLOCK_SSE
+		__m128 accumulators[6];
+		for (__m128 & accumulator : accumulators)
+		{
+			accumulator = _mm_setzero_ps();
+		}
+		for (int group = 0; group < 16; group += 4)
+		{
+			const __m128 r = _mm_sub_ps(_mm_load_ps(&block.channels[0][group]), _mm_set1_ps(mean[0]));
+			const __m128 g = _mm_sub_ps(_mm_load_ps(&block.channels[1][group]), _mm_set1_ps(mean[1]));
+			const __m128 b = _mm_sub_ps(_mm_load_ps(&block.channels[2][group]), _mm_set1_ps(mean[2]));
+			accumulators[0] = _mm_add_ps(accumulators[0], _mm_mul_ps(r, r));
+			accumulators[1] = _mm_add_ps(accumulators[1], _mm_mul_ps(r, g));
+			accumulators[2] = _mm_add_ps(accumulators[2], _mm_mul_ps(r, b));
+			accumulators[3] = _mm_add_ps(accumulators[3], _mm_mul_ps(g, g));
+			accumulators[4] = _mm_add_ps(accumulators[4], _mm_mul_ps(g, b));
+			accumulators[5] = _mm_add_ps(accumulators[5], _mm_mul_ps(b, b));
+		}
+		for (int i = 0; i < 6; i++)
+		{
+			alignas(16) float lanes[4];
+			_mm_store_ps(lanes, accumulators[i]);
+			sums[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		}
+#else
+		std::fill(sums, sums + 6, 0.0f);
+		for (int texel = 0; texel < 16; texel++)
+		{
+			const float r = block.channels[0][texel] - mean[0];
+			const float g = block.channels[1][texel] - mean[1];
+			const float b = block.channels[2][texel] - mean[2];
+			sums[0] += r * r;
+			sums[1] += r * g;
+			sums[2] += r * b;
+			sums[3] += g * g;
+			sums[4] += g * b;
+			sums[5] += b * b;
+		}
+#endif
+	}
+
+	// Endpoints ordered for 4-color mode, with the palette and the indices
+	// they give; returns the squared error
+	float fitEndpoints(const Block & block, const float endpoint0[3], const float endpoint1[3],
+		uint16_t & color0, uint16_t & color1, uint8_t indices[16])
+	{
+		color0 = pack565(endpoint0);
+		color1 = pack565(endpoint1);
+		if (color0 < color1)
+		{
+			std::swap(color0, color1);
+		}
+
+		int palette[4][3];
+		blockPalette(color0, color1, palette);
+		if (color0 == color1)
+		{
+			// Equal endpoints switch to 3-color mode, where only index 0 is safe
+			std::fill(indices, indices + 16, (uint8_t) 0);
+			const int single[4][3] = {
+				{palette[0][0], palette[0][1], palette[0][2]}, {palette[0][0], palette[0][1], palette[0][2]},
+				{palette[0][0], palette[0][1], palette[0][2]}, {palette[0][0], palette[0][1], palette[0][2]},
+			};
+			uint8_t ignored[16];
+			return selectIndices(block, single, ignored);
+		}
+		return selectIndices(block, palette, indices);
+	}
+
+	// Endpoints along the principal axis of the colors, then refined by
+	// least squares on the indices they gave
+	void encodeColorBlock(const Block & block, unsigned char out[8])
+	{
+		float mean[3];
+		for (int channel = 0; channel < 3; channel++)
+		{
+			float sum = 0.0f;
+			for (int texel = 0; texel < 16; texel++)
+			{
+				sum += block.channels[channel][texel];
+			}
+			mean[channel] = sum / 16.0f;
+		}
+
+		float sums[6];
+		covariance(block, mean, sums);
+
+		// Power iteration from the covariance column of the channel varying
+		// most, which is never orthogonal to the principal axis
+		const int diagonal[3] = {0, 3, 5};
+		int widest = 0;
+		for (int channel = 1; channel < 3; channel++)
+		{
+			if (sums[diagonal[channel]] > sums[diagonal[widest]])
+			{
+				widest = channel;
+			}
+		}
+		float axis[3] = {0.0f, 0.0f, 0.0f};
+		axis[widest] = 1.0f;
+		for (int iteration = 0; iteration < 8; iteration++)
+		{
+			const float next[3] = {
+				sums[0] * axis[0] + sums[1] * axis[1] + sums[2] * axis[2],
+				sums[1] * axis[0] + sums[3] * axis[1] + sums[4] * axis[2],
+				sums[2] * axis[0] + sums[4] * axis[1] + sums[5] * axis[2],
+			};
+			const float largest = std::max(std::fabs(next[0]), std::max(std::fabs(next[1]), std::fabs(next[2])));
+			if (largest < 1e-6f)
+			{
+				break;
+			}
+			for (int channel = 0; channel < 3; channel++)
+			{
+				axis[channel] = next[channel] / largest;
+			}
+		}
+		const float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		for (float & component : axis)
+		{
+			component /= length;
+		}
+
+		float lowest = 0.0f, highest = 0.0f;
+		for (int texel = 0; texel < 16; texel++)
+		{
+			float projection = 0.0f;
+			for (int channel = 0; channel < 3; channel++)
+			{
+				projection += (block.channels[channel][texel] - mean[channel]) * axis[channel];
+			}
+			lowest = std::min(lowest, projection);
+			highest = std::max(highest, projection);
+		}
+
+		float endpoint0[3], endpoint1[3];
+		for (int channel = 0; channel < 3; channel++)
+		{
+			endpoint0[channel] = mean[channel] + axis[channel] * highest;
+			endpoint1[channel] = mean[channel] + axis[channel] * lowest;
+		}
+
+		uint16_t color0, color1;
+		uint8_t indices[16];
+		float error = fitEndpoints(block, endpoint0, endpoint1, color0, color1, indices);
+
+		for (int iteration = 0; iteration < 2 && error > 0.0f; iteration++)
+		{
+			// Weight of color0 for each index of the 4-color palette
+			static const float weights[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+			float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = {}, bx[3] = {};
+			for (int texel = 0; texel < 16; texel++)
+			{
+				const float a = weights[indices[texel]], b = 1.0f - a;
+				aa += a * a;
+				ab += a * b;
+				bb += b * b;
+				for (int channel = 0; channel < 3; channel++)
+				{
+					ax[channel] += a * block.channels[channel][texel];
+					bx[channel] += b * block.channels[channel][texel];
+				}
+			}
+			const float determinant = aa * bb - ab * ab;
+			if (std::fabs(determinant) < 1e-6f)
+			{
+				break;
+			}
+			for (int channel = 0; channel < 3; channel++)
+			{
+				endpoint0[channel] = (bb * ax[channel] - ab * bx[channel]) / determinant;
+				endpoint1[channel] = (aa * bx[channel] - ab * ax[channel]) / determinant;
+			}
+
+			uint16_t refined0, refined1;
+			uint8_t refinedIndices[16];
+			const float refinedError = fitEndpoints(block, endpoint0, endpoint1, refined0, refined1, refinedIndices);
+			if (refinedError >= error)
+			{
+				break;
+			}
+			error = refinedError;
+			color0 = refined0;
+			color1 = refined1;
+			memcpy(indices, refinedIndices, sizeof(indices));
+		}
+
+		uint32_t bits = 0;
+		for (int texel = 0; texel < 16; texel++)
+		{
+			bits |= (uint32_t) indices[texel] << (texel * 2);
+		}
+		out[0] = (unsigned char) color0;
+		out[1] = (unsigned char) (color0 >> 8);
+		out[2] = (unsigned char) color1;
+		out[3] = (unsigned char) (color1 >> 8);
+		for (int i = 0; i < 4; i++)
+		{
+			out[4 + i] = (unsigned char) (bits >> (i * 8));
+		}
+	}
+
+	// BC4 block in its 8 value mode, between the lowest and highest value
+	void encodeChannelBlock(const float values[16], unsigned char out[8])
+	{
+		float lowest = values[0], highest = values[0];
+		for (int texel = 1; texel < 16; texel++)
+		{
+			lowest = std::min(lowest, values[texel]);
+			highest = std::max(highest, values[texel]);
+		}
+		const int value0 = (int) highest, value1 = (int) lowest;
+		out[0] = (unsigned char) value0;
+		out[1] = (unsigned char) value1;
+
+		// Steps from value0 towards value1: 0 is index 0, 7 is index 1 and
+		// the six mixes in between are indices 2 to 7
+		int steps[16] = {};
+		if (value0 > value1)
+		{
+			const float scale = 7.0f / (value0 - value1);
+#ifdef BLOCK_SSE
+			for (int group = 0; group < 16; group += 4)
+			{
+				const __m128 step = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps((float) value0), _mm_loadu_ps(&values[group])),
+					_mm_set1_ps(scale)), _mm_set1_ps(0.5f));
+				_mm_storeu_si128((__m128i *) &steps[group], _mm_cvttps_epi32(step));
+			}
+#else
+			for (int texel = 0; texel < 16; texel++)
+			{
+				steps[texel] = (int) ((value0 - values[texel]) * scale + 0.5f);
+			}
+#endif
+		}
+
+		uint64_t bits = 0;
+		for (int texel = 0; texel < 16; texel++)
+		{
+			const int step = std::min(std::max(steps[texel], 0), 7);
+			const uint64_t index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+			bits |= index << (texel * 3);
+		}
+		for (int i = 0; i < 6; i++)
+		{
+			out[2 + i] = (unsigned char) (bits >> (i * 8));
+		}
+	}
+
+	void decodeColorBlock(const unsigned char * in, int palette[4][3], uint8_t indices[16])
+	{
+		const uint16_t color0 = (uint16_t) (in[0] | in[1] << 8), color1 = (uint16_t) (in[2] | in[3] << 8);
+		blockPalette(color0, color1, palette);
+		if (color0 <= color1)
+		{
+			// 3-color mode: the middle color and black
+			for (int channel = 0; channel < 3; channel++)
+			{
+				palette[2][channel] = (palette[0][channel] + palette[1][channel]) / 2;
+				palette[3][channel] = 0;
+			}
+		}
+		const uint32_t bits = (uint32_t) in[4] | (uint32_t) in[5] << 8 | (uint32_t) in[6] << 16 | (uint32_t) in[7] << 24;
+		for (int texel = 0; texel < 16; texel++)
+		{
+			indices[texel] = bits >> (texel * 2) & 3;
+		}
+	}
+
+	void decodeChannelBlock(const unsigned char * in, int values[16])
+	{
+		const int value0 = in[0], value1 = in[1];
+		int palette[8] = {value0, value1};
+		for (int i = 2; i < 8; i++)
+		{
+			palette[i] = value0 > value1
+				? ((8 - i) * value0 + (i - 1) * value1 + 3) / 7
+				: i < 6 ? ((6 - i) * value0 + (i - 1) * value1 + 2) / 5 : (i == 6 ? 0 : 255);
+		}
+		uint64_t bits = 0;
+		for (int i = 0; i < 6; i++)
+		{
+			bits |= (uint64_t) in[2 + i] << (i * 8);
+		}
+		for (int texel = 0; texel < 16; texel++)
+		{
+			values[texel] = palette[bits >> (texel * 3) & 7];
+		}
+	}
+}
+
+size_t BlockSize(BlockFormat format)
+{
+	return format == BlockFormat::BC1 ? 8 : 16;
+}
+
+GLenum BlockGLFormat(BlockFormat format)
+{
+	switch (format)
+	{
+	case BlockFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case BlockFormat::BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	default: return GL_COMPRESSED_RG_RGTC2;
+	}
+}
+
+size_t CompressedSize(BlockFormat format, int width, int height)
+{
+	return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * BlockSize(format);
+}
+
+bool CompressedFormatSupported(BlockFormat format)
+{
+	// RGTC is core since GL 3.0, S3TC is still an extension
+	if (format == BlockFormat::BC5)
+	{
+		return true;
+	}
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++)
+	{
+		const char * extension = (const char *) glGetStringi(GL_EXTENSIONS, i);
+		if (extension && strcmp(extension, "GL_EXT_texture_compression_s3tc") == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<unsigned char> CompressImage(const Image & image, BlockFormat format, ThreadPool & pool)
+{
+	PROFILE_SCOPE("CompressImage");
+	if (image.width <= 0 || image.height <= 0 || (image.channels != 3 && image.channels != 4)
+		|| image.data.size() != (size_t) image.width * image.height * image.channels)
+	{
+		throw std::runtime_error("CompressImage: image is not RGB or RGBA");
+	}
+
+	const int blocksX = (image.width + 3) / 4, blocksY = (image.height + 3) / 4;
+	const size_t blockSize = BlockSize(format);
+	std::vector<unsigned char> blocks(CompressedSize(format, image.width, image.height));
+
+	pool.parallelRanges(blocksY, std::max(1, 64 / blocksX), [&](size_t begin, size_t end) {
+		Block block;
+		for (size_t blockY = begin; blockY < end; blockY++)
+		{
+			for (int blockX = 0; blockX < blocksX; blockX++)
+			{
+				loadBlock(image, blockX, (int) blockY, block);
+				unsigned char * out = &blocks[(blockY * blocksX + blockX) * blockSize];
+				switch (format)
+				{
+				case BlockFormat::BC1:
+					encodeColorBlock(block, out);
+					break;
+				case BlockFormat::BC3:
+					encodeChannelBlock(block.channels[3], out);
+					encodeColorBlock(block, out + 8);
+					break;
+				case BlockFormat::BC5:
+					encodeChannelBlock(block.channels[0], out);
+					encodeChannelBlock(block.channels[1], out + 8);
+					break;
+				}
+			}
+		}
+	});
+	return blocks;
+}
+
+Image DecompressImage(const unsigned char * blocks, BlockFormat format, int width, int height)
+{
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.channels = format == BlockFormat::BC3 ? 4 : 3;
+	image.data.resize((size_t) width * height * image.channels);
+
+	const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	for (int blockY = 0; blockY < blocksY; blockY++)
+	{
+		for (int blockX = 0; blockX < blocksX; blockX++)
+		{
+			const unsigned char * in = blocks + ((size_t) blockY * blocksX + blockX) * BlockSize(format);
+			int texels[16][4];
+			if (format == BlockFormat::BC5)
+			{
+				int x[16], y[16];
+				decodeChannelBlock(in, x);
+				decodeChannelBlock(in + 8, y);
+				for (int texel = 0; texel < 16; texel++)
+				{
+					const float nx = x[texel] * (2.0f / 255.0f) - 1.0f, ny = y[texel] * (2.0f / 255.0f) - 1.0f;
+					const float nz = std::sqrt(std::max(0.0f, 1.0f - nx * nx - ny * ny));
+					texels[texel][0] = x[texel];
+					texels[texel][1] = y[texel];
+					texels[texel][2] = (int) std::floor((nz * 0.5f + 0.5f) * 255.0f + 0.5f);
+				}
+			}
+			else
+			{
+				int palette[4][3];
+				uint8_t indices[16];
+				int alpha[16];
+				decodeColorBlock(format == BlockFormat::BC3 ? in + 8 : in, palette, indices);
+				if (format == BlockFormat::BC3)
+				{
+					decodeChannelBlock(in, alpha);
+				}
+				for (int texel = 0; texel < 16; texel++)
+				{
+					for (int channel = 0; channel < 3; channel++)
+					{
+						texels[texel][channel] = palette[indices[texel]][channel];
+					}
+					texels[texel][3] = format == BlockFormat::BC3 ? alpha[texel] : 255;
+				}
+			}
+
+			for (int y = 0; y < 4 && blockY * 4 + y < height; y++)
+			{
+				for (int x = 0; x < 4 && blockX * 4 + x < width; x++)
+				{
+					unsigned char * out = &image.data[((size_t) (blockY * 4 + y) * width + blockX * 4 + x) * image.channels];
+					for (int channel = 0; channel < image.channels; channel++)
+					{
+						out[channel] = (unsigned char) texels[y * 4 + x][channel];
+					}
+				}
+			}
+		}
+	}
+	return image;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <cstddef>
+
+#include "texture.h"
+#include "thread_pool.h"
+
+// S3TC is an extension the GL headers do not define
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// 4x4 texel block formats
+enum class BlockFormat
+{
+	BC1, // RGB, 8 bytes per block
+	BC3, // RGBA: BC1 colors and an 8 byte alpha block
+	BC5, // two 8 byte single channel blocks, the x and y of normal maps
+};
+
+size_t BlockSize(BlockFormat format);
+
+// Internal format for glCompressedTexImage2D
+GLenum BlockGLFormat(BlockFormat format);
+
+// Bytes of a level, partial blocks included
+size_t CompressedSize(BlockFormat format, int width, int height);
+
+// Whether the driver lists the format in GL_COMPRESSED_TEXTURE_FORMATS
+bool CompressedFormatSupported(BlockFormat format);
+
+// Encodes RGB or RGBA rows in the order glCompressedTexImage2D reads them.
+// Rows of blocks are encoded in parallel, with SSE2 for the endpoint
+// search and the texel indices; results do not depend on threading. BC5
+// keeps red and green, so normal maps should be unit length already.
+std::vector<unsigned char> CompressImage(const Image & image, BlockFormat format, ThreadPool & pool = ThreadPool::global());
+
+// Decodes as the GPU samples it: RGB for BC1, RGBA for BC3, and for BC5
+// the normal z rebuilt from x and y in blue, like shader.frag does
+Image DecompressImage(const unsigned char * blocks, BlockFormat format, int width, int height);
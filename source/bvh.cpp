@@ -0,0 +1,620 @@
+#include "bvh.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_SSE 1
+#endif
+
+namespace
+{
+	const int BINS = 16;
+	const uint32_t MAX_LEAF = 16;
+	const float TRAVERSAL_COST = 1.0f; // relative to testing one block of 4 triangles
+
+	struct Bounds
+	{
+		glm::vec3 low = glm::vec3(std::numeric_limits<float>::max());
+		glm::vec3 high = glm::vec3(-std::numeric_limits<float>::max());
+
+		void grow(const glm::vec3 & p) { low = glm::min(low, p); high = glm::max(high, p); }
+		void grow(const Bounds & b) { low = glm::min(low, b.low); high = glm::max(high, b.high); }
+
+		float area() const
+		{
+			const glm::vec3 e = high - low;
+			return e.x < 0.0f ? 0.0f : 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+		}
+	};
+
+	size_t groupsOf(size_t count)
+	{
+		return (count + 3) / 4;
+	}
+
+	struct Primitives
+	{
+		std::vector<Bounds> bounds;
+		std::vector<glm::vec3> centroids;
+		std::vector<uint32_t> ids; // permuted so every node owns a contiguous range
+	};
+
+	struct Range
+	{
+		uint32_t node;
+		uint32_t begin, end;
+	};
+
+	struct Bin
+	{
+		Bounds bounds;
+		uint32_t count = 0;
+	};
+
+	struct Binning
+	{
+		Bounds bounds; // of the primitives
+		Bounds centroids;
+		Bin bins[3][BINS];
+	};
+
+	// Bins the centroids of ids[begin, end) within centroids, which must bound them
+	void binRange(const Primitives & prims, uint32_t begin, uint32_t end, const Bounds & centroids, Binning & binning)
+	{
+		const glm::vec3 extent = centroids.high - centroids.low;
+		glm::vec3 scale;
+		for (int a = 0; a < 3; ++a) scale[a] = extent[a] > 0.0f ? BINS / extent[a] : 0.0f;
+
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			const uint32_t id = prims.ids[i];
+			const glm::vec3 & c = prims.centroids[id];
+			for (int a = 0; a < 3; ++a)
+			{
+				const int b = std::min(BINS - 1, (int)((c[a] - centroids.low[a]) * scale[a]));
+				binning.bins[a][b].bounds.grow(prims.bounds[id]);
+				++binning.bins[a][b].count;
+			}
+		}
+	}
+
+	void boundRange(const Primitives & prims, uint32_t begin, uint32_t end, Binning & binning)
+	{
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			binning.bounds.grow(prims.bounds[prims.ids[i]]);
+			binning.centroids.grow(prims.centroids[prims.ids[i]]);
+		}
+	}
+
+	// Bounds and bins of a range, split over the pool when it is large
+	Binning binNode(const Primitives & prims, uint32_t begin, uint32_t end, ThreadPool * pool)
+	{
+		const uint32_t count = end - begin;
+		const size_t GRAIN = 16384;
+		if (!pool || count < GRAIN * 2)
+		{
+			Binning binning;
+			boundRange(prims, begin, end, binning);
+			binRange(prims, begin, end, binning.centroids, binning);
+			return binning;
+		}
+
+		const size_t chunks = std::min<size_t>(pool->size() * 4, count / GRAIN);
+		std::vector<Binning> partial(chunks);
+		auto chunkBegin = [&](size_t c) { return begin + (uint32_t)(count * c / chunks); };
+
+		pool->parallelFor(chunks, [&](size_t c) {
+			boundRange(prims, chunkBegin(c), chunkBegin(c + 1), partial[c]);
+		});
+		Binning binning;
+		for (const auto & p : partial)
+		{
+			binning.bounds.grow(p.bounds);
+			binning.centroids.grow(p.centroids);
+		}
+
+		pool->parallelFor(chunks, [&](size_t c) {
+			binRange(prims, chunkBegin(c), chunkBegin(c + 1), binning.centroids, partial[c]);
+		});
+		for (const auto & p : partial)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				for (int b = 0; b < BINS; ++b)
+				{
+					binning.bins[a][b].bounds.grow(p.bins[a][b].bounds);
+					binning.bins[a][b].count += p.bins[a][b].count;
+				}
+			}
+		}
+		return binning;
+	}
+
+	// Splits the range of node in two children, or makes it a leaf.
+	// Returns the index of the first primitive of the right child, or end for a leaf.
+	uint32_t splitNode(Primitives & prims, std::vector<BvhNode> & nodes, const Range & range, ThreadPool * pool)
+	{
+		const uint32_t count = range.end - range.begin;
+		const Binning binning = binNode(prims, range.begin, range.end, pool);
+
+		BvhNode & node = nodes[range.node];
+		node.boundsMin = binning.bounds.low;
+		node.boundsMax = binning.bounds.high;
+		node.leftOrFirst = range.begin;
+		node.count = count;
+
+		if (count <= 4)
+		{
+			return range.end;
+		}
+
+		// Sweep the bins of every axis for the cheapest plane
+		int bestAxis = -1, bestBin = 0;
+		float bestCost = std::numeric_limits<float>::max();
+		for (int a = 0; a < 3; ++a)
+		{
+			if (binning.centroids.high[a] <= binning.centroids.low[a]) continue;
+
+			float rightArea[BINS];
+			uint32_t rightCount[BINS];
+			Bounds right;
+			uint32_t sum = 0;
+			for (int b = BINS - 1; b > 0; --b)
+			{
+				right.grow(binning.bins[a][b].bounds);
+				sum += binning.bins[a][b].count;
+				rightArea[b] = right.area();
+				rightCount[b] = sum;
+			}
+
+			Bounds left;
+			sum = 0;
+			for (int b = 0; b < BINS - 1; ++b)
+			{
+				left.grow(binning.bins[a][b].bounds);
+				sum += binning.bins[a][b].count;
+				if (sum == 0 || rightCount[b + 1] == 0) continue;
+
+				const float cost = left.area() * groupsOf(sum) + rightArea[b + 1] * groupsOf(rightCount[b + 1]);
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = a;
+					bestBin = b;
+				}
+			}
+		}
+
+		const float nodeArea = binning.bounds.area();
+		const float leafCost = nodeArea * groupsOf(count);
+		const float splitCost = nodeArea * TRAVERSAL_COST + bestCost;
+
+		uint32_t middle;
+		if (bestAxis < 0)
+		{
+			// Every centroid at the same place: only a forced split by count remains
+			if (count <= MAX_LEAF) return range.end;
+			middle = range.begin + count / 2;
+		}
+		else
+		{
+			if (count <= MAX_LEAF && leafCost <= splitCost) return range.end;
+
+			const float low = binning.centroids.low[bestAxis];
+			const float scale = BINS / (binning.centroids.high[bestAxis] - low);
+			middle = (uint32_t)(std::partition(prims.ids.begin() + range.begin, prims.ids.begin() + range.end, [&](uint32_t id) {
+				return std::min(BINS - 1, (int)((prims.centroids[id][bestAxis] - low) * scale)) <= bestBin;
+			}) - prims.ids.begin());
+		}
+
+		node.leftOrFirst = (uint32_t) nodes.size();
+		node.count = 0;
+		nodes.emplace_back();
+		nodes.emplace_back();
+		return middle;
+	}
+
+	// Builds the subtree of range into nodes, root first
+	void buildSubtree(Primitives & prims, std::vector<BvhNode> & nodes, Range root)
+	{
+		std::vector<Range> stack(1, root);
+		while (!stack.empty())
+		{
+			const Range range = stack.back();
+			stack.pop_back();
+
+			const uint32_t middle = splitNode(prims, nodes, range, nullptr);
+			if (middle == range.end) continue;
+
+			const uint32_t left = nodes[range.node].leftOrFirst;
+			stack.push_back({left + 1, middle, range.end});
+			stack.push_back({left, range.begin, middle});
+		}
+	}
+
+	float surfaceArea(const BvhNode & node)
+	{
+		Bounds b;
+		b.low = node.boundsMin;
+		b.high = node.boundsMax;
+		return b.area();
+	}
+}
+
+Bvh::Bvh(const std::vector<Triangle> & source, ThreadPool & pool)
+{
+	build(source, pool);
+}
+
+Bvh::Bvh(const glm::vec3 * positions, const unsigned int * indices, size_t indexCount, ThreadPool & pool)
+{
+	std::vector<Triangle> source(indexCount / 3);
+	pool.parallelRanges(source.size(), 16384, [&](size_t begin, size_t end) {
+		for (size_t t = begin; t < end; ++t)
+		{
+			source[t] = {positions[indices[t * 3]], positions[indices[t * 3 + 1]], positions[indices[t * 3 + 2]]};
+		}
+	});
+	build(std::move(source), pool);
+}
+
+void Bvh::build(std::vector<Triangle> source, ThreadPool & pool)
+{
+	PROFILE_SCOPE("Bvh::build");
+	triangles = source.size();
+	nodes.assign(1, BvhNode{glm::vec3(0.0f), 0, glm::vec3(0.0f), 0});
+	if (source.empty())
+	{
+		return;
+	}
+
+	Primitives prims;
+	prims.bounds.resize(triangles);
+	prims.centroids.resize(triangles);
+	prims.ids.resize(triangles);
+	pool.parallelRanges(triangles, 16384, [&](size_t begin, size_t end) {
+		for (size_t t = begin; t < end; ++t)
+		{
+			Bounds b;
+			b.grow(source[t].p0);
+			b.grow(source[t].p1);
+			b.grow(source[t].p2);
+			prims.bounds[t] = b;
+			prims.centroids[t] = (b.low + b.high) * 0.5f;
+			prims.ids[t] = (uint32_t) t;
+		}
+	});
+
+	// Split the top of the tree until there are enough independent subtrees for every thread
+	const uint32_t subtreeSize = (uint32_t) std::max<size_t>(triangles / (pool.size() * 8), 4096);
+	std::vector<Range> pending(1, Range{0, 0, (uint32_t) triangles});
+	std::vector<Range> subtrees;
+	while (!pending.empty())
+	{
+		const Range range = pending.back();
+		pending.pop_back();
+		if (range.end - range.begin <= subtreeSize)
+		{
+			subtrees.push_back(range);
+			continue;
+		}
+
+		const uint32_t middle = splitNode(prims, nodes, range, &pool);
+		if (middle == range.end) continue;
+
+		const uint32_t left = nodes[range.node].leftOrFirst;
+		pending.push_back({left, range.begin, middle});
+		pending.push_back({left + 1, middle, range.end});
+	}
+
+	std::vector<std::vector<BvhNode>> local(subtrees.size());
+	pool.parallelFor(subtrees.size(), [&](size_t s) {
+		local[s].emplace_back();
+		buildSubtree(prims, local[s], Range{0, subtrees[s].begin, subtrees[s].end});
+	});
+
+	// Splice each subtree in place of its root: its other nodes go at the end,
+	// shifted by one as the root itself is not copied there
+	for (size_t s = 0; s < subtrees.size(); ++s)
+	{
+		const uint32_t offset = (uint32_t) nodes.size() - 1;
+		for (size_t i = 0; i < local[s].size(); ++i)
+		{
+			BvhNode node = local[s][i];
+			if (node.count == 0) node.leftOrFirst += offset;
+			if (i == 0) nodes[subtrees[s].node] = node;
+			else nodes.push_back(node);
+		}
+	}
+
+	// Sizes the traversal stack, which holds at most one node per level
+	std::vector<std::pair<uint32_t, uint32_t>> levels(1, std::make_pair(0u, 0u));
+	while (!levels.empty())
+	{
+		const std::pair<uint32_t, uint32_t> level = levels.back();
+		levels.pop_back();
+		treeDepth = std::max(treeDepth, level.second);
+		const BvhNode & node = nodes[level.first];
+		if (node.count == 0)
+		{
+			levels.push_back(std::make_pair(node.leftOrFirst, level.second + 1));
+			levels.push_back(std::make_pair(node.leftOrFirst + 1, level.second + 1));
+		}
+	}
+
+	// Leaves point at primitive ranges: give each its blocks of 4 triangles
+	std::vector<uint32_t> leaves;
+	uint32_t blockCount = 0;
+	for (uint32_t n = 0; n < nodes.size(); ++n)
+	{
+		if (nodes[n].count == 0) continue;
+		leaves.push_back(n);
+		blockCount += (uint32_t) groupsOf(nodes[n].count);
+	}
+
+	std::vector<uint32_t> firstBlock(leaves.size());
+	blockCount = 0;
+	for (size_t l = 0; l < leaves.size(); ++l)
+	{
+		firstBlock[l] = blockCount;
+		blockCount += (uint32_t) groupsOf(nodes[leaves[l]].count);
+	}
+
+	blocks.assign(blockCount, TriangleBlock());
+	pool.parallelRanges(leaves.size(), 1024, [&](size_t begin, size_t end) {
+		for (size_t l = begin; l < end; ++l)
+		{
+			BvhNode & leaf = nodes[leaves[l]];
+			for (uint32_t i = 0; i < groupsOf(leaf.count) * 4; ++i)
+			{
+				TriangleBlock & block = blocks[firstBlock[l] + i / 4];
+				const int lane = i % 4;
+
+				// Padding lanes get null edges, which no ray hits
+				Triangle t = {glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f)};
+				uint32_t id = RayHit::NONE;
+				if (i < leaf.count)
+				{
+					id = prims.ids[leaf.leftOrFirst + i];
+					t = source[id];
+				}
+
+				const glm::vec3 e1 = t.p1 - t.p0, e2 = t.p2 - t.p0;
+				for (int a = 0; a < 3; ++a)
+				{
+					block.v0[a][lane] = t.p0[a];
+					block.e1[a][lane] = e1[a];
+					block.e2[a][lane] = e2[a];
+				}
+				block.ids[lane] = id;
+			}
+			leaf.leftOrFirst = firstBlock[l];
+		}
+	});
+}
+
+float Bvh::sahCost() const
+{
+	const float rootArea = surfaceArea(nodes[0]);
+	if (rootArea <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	float cost = 0.0f;
+	for (const auto & node : nodes)
+	{
+		cost += surfaceArea(node) / rootArea * (node.count ? (float) groupsOf(node.count) : TRAVERSAL_COST);
+	}
+	return cost;
+}
+
+namespace
+{
+#ifdef BVH_SSE
+	// Entry distance of the ray into the box, or infinity when it misses or is already beaten
+	inline float intersectBox(const BvhNode & node, __m128 origin, __m128 inverse, float tBest)
+	{
+		const __m128 low = _mm_set_ps(0.0f, node.boundsMin.z, node.boundsMin.y, node.boundsMin.x);
+		const __m128 high = _mm_set_ps(0.0f, node.boundsMax.z, node.boundsMax.y, node.boundsMax.x);
+		const __m128 t1 = _mm_mul_ps(_mm_sub_ps(low, origin), inverse);
+		const __m128 t2 = _mm_mul_ps(_mm_sub_ps(high, origin), inverse);
+		const __m128 near4 = _mm_min_ps(t1, t2);
+		const __m128 far4 = _mm_max_ps(t1, t2);
+
+		// Lane 3 is padding, only x, y and z take part
+		const __m128 nearYZ = _mm_max_ss(_mm_shuffle_ps(near4, near4, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(near4, near4, _MM_SHUFFLE(2, 2, 2, 2)));
+		const __m128 farYZ = _mm_min_ss(_mm_shuffle_ps(far4, far4, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(far4, far4, _MM_SHUFFLE(2, 2, 2, 2)));
+		const float entry = _mm_cvtss_f32(_mm_max_ss(_mm_max_ss(near4, nearYZ), _mm_setzero_ps()));
+		const float exit = _mm_cvtss_f32(_mm_min_ss(_mm_min_ss(far4, farYZ), _mm_set_ss(tBest)));
+		return entry <= exit ? entry : std::numeric_limits<float>::infinity();
+	}
+
+	// Moller-Trumbore on the 4 lanes of a block at once
+	inline void intersectBlock(const Bvh::TriangleBlock & block, const Ray & ray, RayHit & hit)
+	{
+		const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+		const __m128 e1x = _mm_loadu_ps(block.e1[0]), e1y = _mm_loadu_ps(block.e1[1]), e1z = _mm_loadu_ps(block.e1[2]);
+		const __m128 e2x = _mm_loadu_ps(block.e2[0]), e2y = _mm_loadu_ps(block.e2[1]), e2z = _mm_loadu_ps(block.e2[2]);
+
+		// p = d x e2, det = e1 . p
+		const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		const __m128 inverse = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+		// s = o - v0, u = s . p / det
+		const __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(block.v0[0]));
+		const __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(block.v0[1]));
+		const __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(block.v0[2]));
+		const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverse);
+
+		// q = s x e1, v = d . q / det, t = e2 . q / det
+		const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+		const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverse);
+		const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverse);
+
+		// NaN from a null determinant fails every comparison
+		const __m128 zero = _mm_setzero_ps();
+		__m128 mask = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, _mm_set1_ps(hit.t))));
+
+		int lanes = _mm_movemask_ps(mask);
+		if (!lanes) return;
+
+		float ts[4], us[4], vs[4];
+		_mm_storeu_ps(ts, t);
+		_mm_storeu_ps(us, u);
+		_mm_storeu_ps(vs, v);
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if ((lanes >> lane & 1) && ts[lane] < hit.t)
+			{
+				hit.t = ts[lane];
+				hit.u = us[lane];
+				hit.v = vs[lane];
+				hit.triangle = block.ids[lane];
+			}
+		}
+	}
+#else
+	inline float intersectBox(const BvhNode & node, const glm::vec3 & origin, const glm::vec3 & inverse, float tBest)
+	{
+		const glm::vec3 t1 = (node.boundsMin - origin) * inverse;
+		const glm::vec3 t2 = (node.boundsMax - origin) * inverse;
+		const glm::vec3 near3 = glm::min(t1, t2), far3 = glm::max(t1, t2);
+		const float entry = std::max(std::max(near3.x, near3.y), std::max(near3.z, 0.0f));
+		const float exit = std::min(std::min(far3.x, far3.y), std::min(far3.z, tBest));
+		return entry <= exit ? entry : std::numeric_limits<float>::infinity();
+	}
+
+	inline void intersectBlock(const Bvh::TriangleBlock & block, const Ray & ray, RayHit & hit)
+	{
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			const glm::vec3 v0(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+			const glm::vec3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+			const glm::vec3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+
+			const glm::vec3 p = glm::cross(ray.direction, e2);
+			const float det = glm::dot(e1, p);
+			if (det == 0.0f) continue;
+			const float inverse = 1.0f / det;
+
+			const glm::vec3 s = ray.origin - v0;
+			const float u = glm::dot(s, p) * inverse;
+			const glm::vec3 q = glm::cross(s, e1);
+			const float v = glm::dot(ray.direction, q) * inverse;
+			const float t = glm::dot(e2, q) * inverse;
+			if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f && t < hit.t)
+			{
+				hit.t = t;
+				hit.u = u;
+				hit.v = v;
+				hit.triangle = block.ids[lane];
+			}
+		}
+	}
+#endif
+}
+
+RayHit Bvh::intersect(const Ray & ray) const
+{
+	RayHit hit;
+	hit.t = ray.tMax;
+	if (triangles == 0)
+	{
+		return hit;
+	}
+
+	// Axes the ray is parallel to get a huge inverse, which keeps the slab test meaningful
+	glm::vec3 inverse;
+	for (int a = 0; a < 3; ++a)
+	{
+		const float d = ray.direction[a];
+		inverse[a] = std::fabs(d) > 1e-30f ? 1.0f / d : std::copysign(1e30f, d);
+	}
+
+#ifdef BVH_SSE
+	const __m128 origin = _mm_set_ps(0.0f, ray.origin.z, ray.origin.y, ray.origin.x);
+	const __m128 inverse4 = _mm_set_ps(0.0f, inverse.z, inverse.y, inverse.x);
+#define BOX(node) intersectBox(node, origin, inverse4, hit.t)
+#else
+#define BOX(node) intersectBox(node, ray.origin, inverse, hit.t)
+#endif
+
+	if (BOX(nodes[0]) == std::numeric_limits<float>::infinity())
+	{
+		return hit;
+	}
+
+	// Deep unbalanced trees get a stack on the heap rather than losing nodes
+	const uint32_t FIXED_STACK = 64;
+	uint32_t fixedStack[FIXED_STACK];
+	std::vector<uint32_t> deepStack;
+	uint32_t * stack = fixedStack;
+	if (treeDepth > FIXED_STACK)
+	{
+		deepStack.resize(treeDepth);
+		stack = deepStack.data();
+	}
+	int depth = 0;
+	uint32_t current = 0;
+	while (true)
+	{
+		const BvhNode & node = nodes[current];
+		if (node.count)
+		{
+			const uint32_t end = node.leftOrFirst + (uint32_t) groupsOf(node.count);
+			for (uint32_t b = node.leftOrFirst; b < end; ++b)
+			{
+				intersectBlock(blocks[b], ray, hit);
+			}
+		}
+		else
+		{
+			// Nearer child first, the other one waits on the stack
+			uint32_t nearChild = node.leftOrFirst, farChild = node.leftOrFirst + 1;
+			float nearT = BOX(nodes[nearChild]), farT = BOX(nodes[farChild]);
+			if (farT < nearT)
+			{
+				std::swap(nearChild, farChild);
+				std::swap(nearT, farT);
+			}
+
+			if (nearT != std::numeric_limits<float>::infinity())
+			{
+				if (farT != std::numeric_limits<float>::infinity())
+				{
+					stack[depth++] = farChild;
+				}
+				current = nearChild;
+				continue;
+			}
+		}
+
+		// Pop, skipping the nodes a closer hit now hides
+		bool found = false;
+		while (depth > 0 && !found)
+		{
+			current = stack[--depth];
+			found = BOX(nodes[current]) != std::numeric_limits<float>::infinity();
+		}
+		if (!found)
+		{
+			break;
+		}
+	}
+#undef BOX
+
+	return hit;
+}
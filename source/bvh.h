@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "stl.h"
+#include "thread_pool.h"
+
+struct Ray
+{
+	glm::vec3 origin;
+	glm::vec3 direction; // need not be normalized, t is measured in its length
+	float tMax = 1e30f;
+};
+
+struct RayHit
+{
+	static const uint32_t NONE = 0xFFFFFFFF;
+
+	float t = 1e30f;
+	float u = 0.0f, v = 0.0f; // barycentric coordinates of the hit along edges p0p1 and p0p2
+	uint32_t triangle = NONE; // index in the array, or index / 3 in the index buffer, the BVH was built from
+
+	bool hit() const { return triangle != NONE; }
+};
+
+// Flattened node: children are stored next to each other, so an inner node
+// only keeps the index of its left child
+struct BvhNode
+{
+	glm::vec3 boundsMin;
+	uint32_t leftOrFirst; // left child when count is 0, else first triangle block
+	glm::vec3 boundsMax;
+	uint32_t count; // triangles of a leaf, 0 for inner nodes
+};
+
+// Bounding volume hierarchy over triangles, built with a binned surface area
+// heuristic. The top of the tree is split with parallel binning, then the
+// subtrees are built in parallel. Leaf triangles are stored by groups of 4 in
+// SoA form so rays test them together.
+class Bvh
+{
+public:
+	explicit Bvh(const std::vector<Triangle> & triangles, ThreadPool & pool = ThreadPool::global());
+	Bvh(const glm::vec3 * positions, const unsigned int * indices, size_t indexCount, ThreadPool & pool = ThreadPool::global());
+
+	// Closest hit with t in (0, ray.tMax)
+	RayHit intersect(const Ray & ray) const;
+
+	size_t nodeCount() const { return nodes.size(); }
+	size_t depth() const { return treeDepth; } // edges from the root to the deepest leaf
+	size_t triangleCount() const { return triangles; }
+	const BvhNode & root() const { return nodes[0]; }
+
+	// Expected cost of a random ray, in node visits, from the surface area heuristic
+	float sahCost() const;
+
+	// Four triangles as a vertex and two edges each, lane by lane
+	struct TriangleBlock
+	{
+		float v0[3][4];
+		float e1[3][4];
+		float e2[3][4];
+		uint32_t ids[4];
+	};
+
+private:
+	void build(std::vector<Triangle> source, ThreadPool & pool);
+
+	std::vector<BvhNode> nodes;
+	std::vector<TriangleBlock> blocks;
+	size_t triangles = 0;
+	uint32_t treeDepth = 0;
+};
@@ -0,0 +1,86 @@
+#include "camera_path.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+
+CameraPath LoadCameraPath(const char * path)
+{
+	std::ifstream file(path);
+	if (!file.good())
+	{
+		throw std::runtime_error(std::string("File not found: ") + path);
+	}
+
+	CameraPath result;
+	std::string line;
+	size_t lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		++lineNumber;
+		const size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+		{
+			continue;
+		}
+
+		std::istringstream stream(line);
+		CameraKey key;
+		if (!(stream >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.target.x >> key.target.y >> key.target.z))
+		{
+			throw std::runtime_error(std::string(path) + ":" + std::to_string(lineNumber) + ": expected time px py pz tx ty tz");
+		}
+		result.keys.push_back(key);
+	}
+
+	if (result.keys.empty())
+	{
+		throw std::runtime_error(std::string("No camera key in ") + path);
+	}
+	std::stable_sort(result.keys.begin(), result.keys.end(), [](const CameraKey & a, const CameraKey & b) { return a.time < b.time; });
+	return result;
+}
+
+CameraPath OrbitCameraPath(const glm::vec3 & center, float radius, float height, float duration)
+{
+	const int steps = 64;
+	CameraPath result;
+	for (int i = 0; i <= steps; ++i)
+	{
+		const float angle = 6.2831853f * i / steps;
+		CameraKey key;
+		key.time = duration * i / steps;
+		key.position = center + glm::vec3(std::sin(angle) * radius, height, std::cos(angle) * radius);
+		key.target = center;
+		result.keys.push_back(key);
+	}
+	return result;
+}
+
+void SampleCameraPath(const CameraPath & path, float time, glm::vec3 & position, glm::vec3 & target)
+{
+	const auto & keys = path.keys;
+	if (keys.empty())
+	{
+		throw std::runtime_error("Empty camera path");
+	}
+
+	// First key after time
+	const auto next = std::upper_bound(keys.begin(), keys.end(), time, [](float t, const CameraKey & key) { return t < key.time; });
+	if (next == keys.begin() || next == keys.end())
+	{
+		const CameraKey & key = next == keys.begin() ? keys.front() : keys.back();
+		position = key.position;
+		target = key.target;
+		return;
+	}
+
+	const CameraKey & a = *(next - 1);
+	const CameraKey & b = *next;
+	const float blend = (time - a.time) / std::max(b.time - a.time, 1e-6f);
+	position = glm::mix(a.position, b.position, blend);
+	target = glm::mix(a.target, b.target, blend);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Camera position and look-at target at a time, in seconds or any unit
+struct CameraKey
+{
+	float time;
+	glm::vec3 position;
+	glm::vec3 target;
+};
+
+// Keys sorted by time, played back with linear interpolation
+struct CameraPath
+{
+	std::vector<CameraKey> keys;
+
+	float duration() const { return keys.empty() ? 0.0f : keys.back().time - keys.front().time; }
+};
+
+// One key per line: time px py pz tx ty tz. Empty lines and lines starting with # are skipped.
+CameraPath LoadCameraPath(const char * path);
+
+// One turn around center at the given radius and height, over duration
+CameraPath OrbitCameraPath(const glm::vec3 & center, float radius, float height, float duration);
+
+// Position and target at time, clamped to the ends of the path
+void SampleCameraPath(const CameraPath & path, float time, glm::vec3 & position, glm::vec3 & target);
@@ -0,0 +1,281 @@
+#include "clustered_lighting.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	int tileOf(float ndc, int tiles)
+	{
+		return std::min(std::max((int) std::floor((ndc * 0.5f + 0.5f) * tiles), 0), tiles - 1);
+	}
+}
+
+glm::vec3 ShadePointLight(const ClusterLight & light, const glm::vec3 & position, const glm::vec3 & n, const glm::vec3 & eye,
+	const glm::vec3 & diffuseColor, const glm::vec3 & specularColor)
+{
+	const glm::vec3 toLight = glm::vec3(light.positionRadius) - position;
+	const float distanceSquared = glm::dot(toLight, toLight);
+	const float radiusSquared = light.positionRadius.w * light.positionRadius.w;
+	if (distanceSquared >= radiusSquared)
+	{
+		return glm::vec3(0.0f);
+	}
+
+	// Inverse square falloff, windowed to reach zero at the radius
+	const float ratio = distanceSquared / radiusSquared;
+	const float window = (1.0f - ratio * ratio) * (1.0f - ratio * ratio);
+	const glm::vec3 radiance = glm::vec3(light.colorIntensity) * (light.colorIntensity.w * window / (distanceSquared + 1.0f));
+
+	const glm::vec3 l = toLight * (1.0f / std::sqrt(std::max(distanceSquared, 1e-8f)));
+	const float cosTheta = glm::clamp(glm::dot(n, l), 0.0f, 1.0f);
+	const glm::vec3 R = glm::reflect(-l, n);
+	const float cosAlpha = glm::clamp(glm::dot(eye, R), 0.0f, 1.0f);
+	const float cosAlpha2 = cosAlpha * cosAlpha;
+
+	return diffuseColor * radiance * cosTheta + specularColor * radiance * (cosAlpha2 * cosAlpha2 * cosAlpha);
+}
+
+LightClusters::LightClusters(int tilesX, int tilesY, int slices)
+	: tilesX(tilesX), tilesY(tilesY), slices(slices), sliceBins(slices),
+	ranges((size_t) tilesX * tilesY * slices)
+{
+}
+
+int LightClusters::sliceOf(float depth) const
+{
+	const float slice = std::log(depth) * depthScale + depthBias;
+	return std::min(std::max((int) slice, 0), slices - 1);
+}
+
+size_t LightClusters::clusterAt(const glm::vec2 & fragCoord, int width, int height, float depth) const
+{
+	const int x = std::min((int) (fragCoord.x * ((float) tilesX / width)), tilesX - 1);
+	const int y = std::min((int) (fragCoord.y * ((float) tilesY / height)), tilesY - 1);
+	return ((size_t) sliceOf(depth) * tilesY + y) * tilesX + x;
+}
+
+void LightClusters::build(const std::vector<PointLight> & lights, const glm::mat4 & view, const glm::mat4 & projection,
+	ThreadPool & pool)
+{
+	PROFILE_SCOPE("LightClusters::build");
+
+	// The cluster boxes only depend on the projection
+	if (projection != lastProjection)
+	{
+		lastProjection = projection;
+		nearPlane = projection[3][2] / (projection[2][2] - 1.0f);
+		farPlane = projection[3][2] / (projection[2][2] + 1.0f);
+		tanX = 1.0f / projection[0][0];
+		tanY = 1.0f / projection[1][1];
+		depthScale = slices / std::log(farPlane / nearPlane);
+		depthBias = -std::log(nearPlane) * depthScale;
+
+		clusterMin.resize(ranges.size());
+		clusterMax.resize(ranges.size());
+		for (int s = 0; s < slices; s++)
+		{
+			const float d0 = nearPlane * std::pow(farPlane / nearPlane, (float) s / slices);
+			const float d1 = nearPlane * std::pow(farPlane / nearPlane, (float) (s + 1) / slices);
+			for (int y = 0; y < tilesY; y++)
+			{
+				const float y0 = (2.0f * y / tilesY - 1.0f) * tanY;
+				const float y1 = (2.0f * (y + 1) / tilesY - 1.0f) * tanY;
+				for (int x = 0; x < tilesX; x++)
+				{
+					const float x0 = (2.0f * x / tilesX - 1.0f) * tanX;
+					const float x1 = (2.0f * (x + 1) / tilesX - 1.0f) * tanX;
+					// The tile's side planes go through the eye, so the box
+					// spans both ends of the slice
+					const size_t cluster = ((size_t) s * tilesY + y) * tilesX + x;
+					clusterMin[cluster] = glm::vec3(std::min(x0 * d0, x0 * d1), std::min(y0 * d0, y0 * d1), -d1);
+					clusterMax[cluster] = glm::vec3(std::max(x1 * d0, x1 * d1), std::max(y1 * d0, y1 * d1), -d0);
+				}
+			}
+		}
+	}
+
+	// Lights in view space, culled against the frustum and bounded in the grid
+	viewLights.resize(lights.size());
+	bounds.resize(lights.size());
+	const float sideX = 1.0f / std::sqrt(1.0f + tanX * tanX);
+	const float sideY = 1.0f / std::sqrt(1.0f + tanY * tanY);
+	pool.parallelRanges(lights.size(), 1024, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			const PointLight & light = lights[i];
+			const glm::vec3 c = glm::vec3(view * glm::vec4(light.position, 1.0f));
+			const float r = light.radius;
+			const float depth = -c.z;
+			viewLights[i].positionRadius = glm::vec4(c, r);
+			viewLights[i].colorIntensity = glm::vec4(light.color, light.intensity);
+
+			LightBounds & b = bounds[i];
+			b.visible = depth + r > nearPlane && depth - r < farPlane
+				&& (c.x + tanX * depth) * sideX > -r && (tanX * depth - c.x) * sideX > -r
+				&& (c.y + tanY * depth) * sideY > -r && (tanY * depth - c.y) * sideY > -r;
+			if (!b.visible)
+			{
+				continue;
+			}
+
+			const float d0 = std::max(depth - r, nearPlane);
+			const float d1 = std::min(depth + r, farPlane);
+			b.slice0 = sliceOf(d0);
+			b.slice1 = sliceOf(d1);
+
+			// The screen extent of the sphere's box is reached at its corners
+			float x0 = 1.0f, x1 = -1.0f, y0 = 1.0f, y1 = -1.0f;
+			for (float d : {d0, d1})
+			{
+				for (float sign : {-1.0f, 1.0f})
+				{
+					const float x = (c.x + sign * r) / (d * tanX);
+					const float y = (c.y + sign * r) / (d * tanY);
+					x0 = std::min(x0, x);
+					x1 = std::max(x1, x);
+					y0 = std::min(y0, y);
+					y1 = std::max(y1, y);
+				}
+			}
+			b.tileX0 = tileOf(x0, tilesX);
+			b.tileX1 = tileOf(x1, tilesX);
+			b.tileY0 = tileOf(y0, tilesY);
+			b.tileY1 = tileOf(y1, tilesY);
+		}
+	});
+
+	// The slices only walk the lights on screen
+	visible.clear();
+	for (uint32_t i = 0; i < (uint32_t) bounds.size(); i++)
+	{
+		if (bounds[i].visible)
+		{
+			visible.push_back(i);
+		}
+	}
+
+	pool.parallelFor(slices, [&](size_t s) {
+		binSlice((int) s);
+	});
+
+	// Slices concatenated in order
+	std::vector<size_t> sliceOffsets(slices + 1, 0);
+	LightClusterStats stats;
+	stats.lights = lights.size();
+	for (int s = 0; s < slices; s++)
+	{
+		sliceOffsets[s + 1] = sliceOffsets[s] + sliceBins[s].sorted.size();
+		stats.occupiedClusters += sliceBins[s].occupied;
+		stats.maxClusterLights = std::max(stats.maxClusterLights, sliceBins[s].maxLights);
+	}
+	stats.visibleLights = visible.size();
+	stats.references = sliceOffsets[slices];
+
+	indices.resize(stats.references);
+	pool.parallelFor(slices, [&](size_t s) {
+		const SliceBins & bins = sliceBins[s];
+		const uint32_t offset = (uint32_t) sliceOffsets[s];
+		std::copy(bins.sorted.begin(), bins.sorted.end(), indices.begin() + offset);
+
+		const size_t tileCount = (size_t) tilesX * tilesY;
+		for (size_t t = 0; t < tileCount; t++)
+		{
+			const uint32_t begin = t == 0 ? 0 : bins.counts[t - 1];
+			ranges[s * tileCount + t] = {offset + begin, bins.counts[t] - begin};
+		}
+	});
+
+	lastStats = stats;
+}
+
+void LightClusters::binSlice(int s)
+{
+	SliceBins & bins = sliceBins[s];
+	const size_t tileCount = (size_t) tilesX * tilesY;
+	bins.tiles.clear();
+	bins.lights.clear();
+	bins.counts.assign(tileCount + 1, 0);
+
+	for (const uint32_t i : visible)
+	{
+		const LightBounds & b = bounds[i];
+		if (s < b.slice0 || s > b.slice1)
+		{
+			continue;
+		}
+
+		const glm::vec3 c = glm::vec3(viewLights[i].positionRadius);
+		const float radiusSquared = viewLights[i].positionRadius.w * viewLights[i].positionRadius.w;
+		for (int y = b.tileY0; y <= b.tileY1; y++)
+		{
+			for (int x = b.tileX0; x <= b.tileX1; x++)
+			{
+				// Sphere against the cluster box
+				const uint32_t tile = (uint32_t) (y * tilesX + x);
+				const size_t cluster = s * tileCount + tile;
+				const glm::vec3 d = c - glm::clamp(c, clusterMin[cluster], clusterMax[cluster]);
+				if (glm::dot(d, d) <= radiusSquared)
+				{
+					bins.tiles.push_back(tile);
+					bins.lights.push_back(i);
+					bins.counts[tile + 1]++;
+				}
+			}
+		}
+	}
+
+	// Counting sort by tile, stable so each list keeps the light order
+	bins.occupied = 0;
+	bins.maxLights = 0;
+	for (size_t t = 0; t < tileCount; t++)
+	{
+		bins.occupied += bins.counts[t + 1] > 0 ? 1 : 0;
+		bins.maxLights = std::max(bins.maxLights, (size_t) bins.counts[t + 1]);
+		bins.counts[t + 1] += bins.counts[t];
+	}
+	bins.sorted.resize(bins.lights.size());
+	for (size_t p = 0; p < bins.lights.size(); p++)
+	{
+		bins.sorted[bins.counts[bins.tiles[p]]++] = bins.lights[p];
+	}
+	// counts[t] now ends tile t's list, and starts tile t + 1's
+}
+
+ClusterBuffers::ClusterBuffers()
+{
+	glGenBuffers(3, buffers);
+}
+
+ClusterBuffers::~ClusterBuffers()
+{
+	glDeleteBuffers(3, buffers);
+}
+
+void ClusterBuffers::update(const LightClusters & clusters)
+{
+	PROFILE_SCOPE("ClusterBuffers::update");
+
+	const void * data[3] = {clusters.lights().data(), clusters.clusters().data(), clusters.lightIndices().data()};
+	const size_t sizes[3] = {
+		clusters.lights().size() * sizeof(ClusterLight),
+		clusters.clusters().size() * sizeof(ClusterRange),
+		clusters.lightIndices().size() * sizeof(uint32_t)
+	};
+	const GLuint bindings[3] = {LIGHTS_BINDING, CLUSTERS_BINDING, INDICES_BINDING};
+
+	for (int b = 0; b < 3; b++)
+	{
+		// Orphaned every frame, so the driver does not wait on the last draws.
+		// Empty lists still get storage to bind.
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[b]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(sizes[b], (size_t) 16), nullptr, GL_STREAM_DRAW);
+		if (sizes[b] > 0)
+		{
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizes[b], data[b]);
+		}
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindings[b], buffers[b]);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "thread_pool.h"
+
+// Point light reaching radius, where its falloff ends at zero
+struct PointLight
+{
+	glm::vec3 position;
+	float radius;
+	glm::vec3 color;
+	float intensity;
+};
+
+// Light of a cluster as the shader reads it, in view space
+struct ClusterLight
+{
+	glm::vec4 positionRadius;
+	glm::vec4 colorIntensity;
+};
+
+// Lights of a cluster: [offset, offset + count) of the index list
+struct ClusterRange
+{
+	uint32_t offset;
+	uint32_t count;
+};
+
+struct LightClusterStats
+{
+	size_t lights = 0;
+	size_t visibleLights = 0; // touching the view frustum
+	size_t references = 0; // light and cluster pairs
+	size_t occupiedClusters = 0;
+	size_t maxClusterLights = 0;
+};
+
+// Shading term of one point light, as clustered_lights.glsl computes it. n and
+// eye are unit vectors in the space of position.
+glm::vec3 ShadePointLight(const ClusterLight & light, const glm::vec3 & position, const glm::vec3 & n, const glm::vec3 & eye,
+	const glm::vec3 & diffuseColor, const glm::vec3 & specularColor);
+
+// View frustum split in tilesX x tilesY screen tiles and slices depth slices,
+// exponentially spaced between the near and far planes of a symmetric
+// perspective projection. build() bins the lights into the clusters each
+// sphere touches: spheres are culled and bounded on the pool, then each
+// slice finds its pairs on its own and the slices are concatenated. Lists
+// keep the light order, so the result does not depend on threading.
+class LightClusters
+{
+public:
+	LightClusters(int tilesX = 32, int tilesY = 16, int slices = 32);
+
+	void build(const std::vector<PointLight> & lights, const glm::mat4 & view, const glm::mat4 & projection,
+		ThreadPool & pool = ThreadPool::global());
+
+	const int tilesX, tilesY, slices;
+	size_t clusterCount() const { return ranges.size(); }
+
+	// Index of the cluster at window position (in pixels of a width x height
+	// viewport) and view space depth (positive), clamped to the grid
+	size_t clusterAt(const glm::vec2 & fragCoord, int width, int height, float depth) const;
+
+	// Slice of a depth: log(depth) * scale + bias, for the shader
+	glm::vec2 depthScaleBias() const { return glm::vec2(depthScale, depthBias); }
+
+	// Lights of the last build, in view space, and the cluster lists
+	const std::vector<ClusterLight> & lights() const { return viewLights; }
+	const std::vector<ClusterRange> & clusters() const { return ranges; }
+	const std::vector<uint32_t> & lightIndices() const { return indices; }
+
+	const LightClusterStats & stats() const { return lastStats; }
+
+private:
+	struct LightBounds
+	{
+		bool visible;
+		int slice0, slice1, tileX0, tileX1, tileY0, tileY1;
+	};
+
+	struct SliceBins
+	{
+		std::vector<uint32_t> tiles, lights; // pairs, in light order
+		std::vector<uint32_t> counts; // per tile, then offsets
+		std::vector<uint32_t> sorted;
+		size_t occupied, maxLights;
+	};
+
+	int sliceOf(float depth) const;
+	void binSlice(int slice);
+
+	std::vector<ClusterLight> viewLights;
+	std::vector<LightBounds> bounds;
+	std::vector<uint32_t> visible; // indices of the lights touching the frustum
+	std::vector<SliceBins> sliceBins;
+	std::vector<glm::vec3> clusterMin, clusterMax; // view space boxes
+	std::vector<ClusterRange> ranges;
+	std::vector<uint32_t> indices;
+
+	glm::mat4 lastProjection = glm::mat4(0.0f);
+	float nearPlane = 0.1f, farPlane = 100.0f;
+	float tanX = 1.0f, tanY = 1.0f; // half extents of the view at depth 1
+	float depthScale = 0.0f, depthBias = 0.0f;
+	LightClusterStats lastStats;
+};
+
+// The storage buffers clustered_lights.glsl reads, refilled every frame
+class ClusterBuffers
+{
+public:
+	static const GLuint LIGHTS_BINDING = 0;
+	static const GLuint CLUSTERS_BINDING = 1;
+	static const GLuint INDICES_BINDING = 2;
+
+	ClusterBuffers();
+	~ClusterBuffers();
+
+	ClusterBuffers(const ClusterBuffers&) = delete;
+	ClusterBuffers& operator=(const ClusterBuffers&) = delete;
+
+	// Uploads and binds the buffers to their binding points
+	void update(const LightClusters & clusters);
+
+private:
+	GLuint buffers[3];
+};
@@ -0,0 +1,158 @@
+#include "file_watcher.h"
+
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	// How often the thread checks for stop, and the polling period elsewhere
+	const int WAKE_MS = 100;
+
+	long long modificationTime(const std::string & path)
+	{
+		struct stat status;
+		return stat(path.c_str(), &status) == 0 ? (long long) status.st_mtime : 0;
+	}
+}
+
+FileWatcher::FileWatcher(int settleMs)
+	: settle(settleMs)
+{
+#ifdef __linux__
+	inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify < 0)
+	{
+		throw std::runtime_error("FileWatcher: inotify is not available");
+	}
+#endif
+	thread = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher()
+{
+	stopping = true;
+	thread.join();
+#ifdef __linux__
+	close(inotify);
+#endif
+}
+
+void FileWatcher::watch(const std::string & path)
+{
+	const size_t slash = path.find_last_of("/\\");
+	const std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+	Entry entry;
+	entry.name = slash == std::string::npos ? path : path.substr(slash + 1);
+	entry.modified = modificationTime(path);
+
+	std::lock_guard<std::mutex> lock(mutex);
+#ifdef __linux__
+	// One watch per directory: inotify returns the same descriptor again,
+	// also for another spelling of the path ("img" and "./img")
+	entry.descriptor = inotify_add_watch(inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	if (entry.descriptor < 0)
+	{
+		throw std::runtime_error("FileWatcher: cannot watch " + directory);
+	}
+#endif
+	files[path] = entry;
+}
+
+std::vector<std::string> FileWatcher::poll()
+{
+	const auto now = std::chrono::steady_clock::now();
+	std::vector<std::string> changed;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto & file : files)
+	{
+		if (file.second.changed && now - file.second.changeTime >= settle)
+		{
+			file.second.changed = false;
+			changed.push_back(file.first);
+		}
+	}
+	return changed;
+}
+
+void FileWatcher::notify(int descriptor, const std::string & name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto & file : files)
+	{
+		if (file.second.descriptor == descriptor && file.second.name == name)
+		{
+			file.second.changed = true;
+			file.second.changeTime = std::chrono::steady_clock::now();
+		}
+	}
+}
+
+#ifdef __linux__
+
+void FileWatcher::run()
+{
+	alignas(inotify_event) char buffer[16 * 1024];
+	while (!stopping)
+	{
+		pollfd descriptor = {inotify, POLLIN, 0};
+		if (::poll(&descriptor, 1, WAKE_MS) <= 0)
+		{
+			continue;
+		}
+
+		ssize_t length;
+		while ((length = read(inotify, buffer, sizeof(buffer))) > 0)
+		{
+			for (char * event = buffer; event < buffer + length; event += sizeof(inotify_event) + ((inotify_event *) event)->len)
+			{
+				const inotify_event & e = *(const inotify_event *) event;
+				if (e.len > 0)
+				{
+					notify(e.wd, e.name);
+				}
+			}
+		}
+	}
+}
+
+#else
+
+void FileWatcher::run()
+{
+	while (!stopping)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(WAKE_MS));
+
+		std::vector<std::pair<std::string, long long>> paths;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (const auto & file : files)
+			{
+				paths.emplace_back(file.first, file.second.modified);
+			}
+		}
+
+		for (const auto & path : paths)
+		{
+			const long long modified = modificationTime(path.first);
+			if (modified != path.second)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				Entry & entry = files[path.first];
+				entry.modified = modified;
+				entry.changed = true;
+				entry.changeTime = std::chrono::steady_clock::now();
+			}
+		}
+	}
+}
+
+#endif
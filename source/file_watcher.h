@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+// Reports the watched files that changed on disk, from its own thread.
+// On Linux it listens to inotify events on their directories, since editors
+// and the cache writers often replace a file by renaming a new one over it;
+// elsewhere it polls modification times. A change is only reported once the
+// file has been quiet for settleMs, so a save in several writes shows once.
+// Throws std::runtime_error if inotify is not available.
+class FileWatcher
+{
+public:
+	explicit FileWatcher(int settleMs = 100);
+	~FileWatcher();
+
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator=(const FileWatcher&) = delete;
+
+	void watch(const std::string & path);
+
+	// Paths as given to watch, each changed and settled since the last call
+	std::vector<std::string> poll();
+
+private:
+	struct Entry
+	{
+		std::string name;
+		bool changed = false;
+		std::chrono::steady_clock::time_point changeTime;
+		int descriptor = -1; // inotify watch of the directory, the same for every spelling of it
+		long long modified = 0; // polling only
+	};
+
+	void run();
+	void notify(int descriptor, const std::string & name);
+
+	const std::chrono::milliseconds settle;
+	std::mutex mutex;
+	std::unordered_map<std::string, Entry> files;
+
+#ifdef __linux__
+	int inotify = -1;
+#endif
+
+	std::atomic<bool> stopping{false};
+	std::thread thread;
+};
@@ -0,0 +1,128 @@
+#include "frame_ring.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+FrameRing::FrameRing(size_t frameCapacity)
+{
+	GLint alignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	uniformOffsetAlignment = std::max<GLint>(alignment, 1);
+	create(frameCapacity);
+}
+
+FrameRing::~FrameRing()
+{
+	destroy();
+}
+
+void FrameRing::create(size_t frameCapacity)
+{
+	// Regions start on a uniform block boundary
+	capacity = (frameCapacity + uniformOffsetAlignment - 1) / uniformOffsetAlignment * uniformOffsetAlignment;
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &name);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+	glBufferStorage(GL_COPY_WRITE_BUFFER, capacity * FRAMES, nullptr, flags);
+	mapped = (unsigned char *) glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity * FRAMES, flags);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	if (!mapped)
+	{
+		glDeleteBuffers(1, &name);
+		name = 0;
+		throw std::runtime_error("FrameRing: cannot map a persistent buffer");
+	}
+}
+
+void FrameRing::destroy()
+{
+	for (int r = 0; r < FRAMES; r++)
+	{
+		if (fences[r])
+		{
+			glDeleteSync(fences[r]);
+			fences[r] = nullptr;
+		}
+	}
+	if (name)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		glDeleteBuffers(1, &name);
+		name = 0;
+		mapped = nullptr;
+	}
+}
+
+void FrameRing::wait(int r)
+{
+	if (!fences[r])
+	{
+		return;
+	}
+
+	// Polled first, then waited on with a flush so the fence is sure to signal
+	GLenum status = glClientWaitSync(fences[r], 0, 0);
+	if (status == GL_TIMEOUT_EXPIRED)
+	{
+		PROFILE_SCOPE("FrameRing wait");
+		const auto start = std::chrono::steady_clock::now();
+		do
+		{
+			status = glClientWaitSync(fences[r], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		} while (status == GL_TIMEOUT_EXPIRED);
+		counters.waits++;
+		counters.waitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+	glDeleteSync(fences[r]);
+	fences[r] = nullptr;
+	if (status == GL_WAIT_FAILED)
+	{
+		throw std::runtime_error("FrameRing: glClientWaitSync failed");
+	}
+}
+
+void FrameRing::begin(size_t bytes)
+{
+	if (bytes > capacity)
+	{
+		// Every region may still be read
+		for (int r = 0; r < FRAMES; r++)
+		{
+			wait(r);
+		}
+		destroy();
+		create(std::max(bytes, capacity * 2));
+		counters.grows++;
+	}
+
+	region = (region + 1) % FRAMES;
+	wait(region);
+	cursor = 0;
+	limit = bytes;
+	counters.frames++;
+}
+
+size_t FrameRing::write(const void * data, size_t size, size_t alignment)
+{
+	const size_t start = (cursor + alignment - 1) / alignment * alignment;
+	if (start + size > limit)
+	{
+		throw std::runtime_error("FrameRing: frame writes past the size given to begin");
+	}
+	const size_t offset = region * capacity + start;
+	memcpy(mapped + offset, data, size);
+	cursor = start + size;
+	counters.bytes += size;
+	counters.peakFrameBytes = std::max(counters.peakFrameBytes, cursor);
+	return offset;
+}
+
+void FrameRing::end()
+{
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <cstddef>
+
+struct FrameRingStats
+{
+	size_t frames = 0;
+	size_t waits = 0; // begin() found the GPU still reading the region
+	double waitMs = 0.0;
+	size_t bytes = 0; // written
+	size_t peakFrameBytes = 0;
+	size_t grows = 0;
+};
+
+// Buffer for the data written every frame (uniform blocks, instances,
+// indirect commands), persistently and coherently mapped once and split in
+// FRAMES regions. A frame writes its region with memcpy and binds ranges of
+// buffer(), and end() fences it; the region is only written again FRAMES
+// frames later, once its fence has signaled, so the CPU never waits on the
+// driver unless it runs that far ahead.
+class FrameRing
+{
+public:
+	static const int FRAMES = 3;
+
+	explicit FrameRing(size_t frameCapacity = 1 << 20);
+	~FrameRing();
+
+	FrameRing(const FrameRing&) = delete;
+	FrameRing& operator=(const FrameRing&) = delete;
+
+	// Starts the next region, waiting for its fence. bytes bounds what the
+	// frame writes, alignment included; when it does not fit, the buffer is
+	// recreated larger after the GPU is done with every region.
+	void begin(size_t bytes);
+
+	// Copies data at the next multiple of alignment (any value, not only
+	// powers of two) and returns its offset in buffer(). Throws
+	// std::runtime_error past the size given to begin().
+	size_t write(const void * data, size_t size, size_t alignment);
+
+	// Fences the region, after the frame's draws
+	void end();
+
+	GLuint buffer() const { return name; }
+	size_t frameCapacity() const { return capacity; }
+
+	// GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, what glBindBufferRange needs for uniform blocks
+	size_t uniformAlignment() const { return uniformOffsetAlignment; }
+
+	const FrameRingStats & stats() const { return counters; }
+
+private:
+	void create(size_t frameCapacity);
+	void destroy();
+	void wait(int region);
+
+	GLuint name = 0;
+	unsigned char * mapped = nullptr;
+	size_t capacity = 0; // per region
+	size_t uniformOffsetAlignment = 256;
+	GLsync fences[FRAMES] = {};
+	int region = FRAMES - 1;
+	size_t cursor = 0; // in the region
+	size_t limit = 0;
+	FrameRingStats counters;
+};
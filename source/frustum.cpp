@@ -0,0 +1,31 @@
+#include "frustum.h"
+
+Frustum ExtractFrustum(const glm::mat4 & viewProjection)
+{
+	Frustum frustum;
+	const glm::mat4 & m = viewProjection;
+	const glm::vec4 w(m[0][3], m[1][3], m[2][3], m[3][3]);
+	for (int row = 0; row < 3; ++row)
+	{
+		const glm::vec4 r(m[0][row], m[1][row], m[2][row], m[3][row]);
+		frustum.planes[row * 2 + 0] = w + r;
+		frustum.planes[row * 2 + 1] = w - r;
+	}
+	for (auto & plane : frustum.planes)
+	{
+		plane /= glm::length(glm::vec3(plane));
+	}
+	return frustum;
+}
+
+bool SphereInFrustum(const Frustum & frustum, const glm::vec3 & center, float radius)
+{
+	for (const auto & plane : frustum.planes)
+	{
+		if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+		{
+			return false;
+		}
+	}
+	return true;
+}
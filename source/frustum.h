@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Six planes as (normal, distance), normals pointing inside, in the space the
+// matrix was applied to: left, right, bottom, top, near, far
+struct Frustum
+{
+	glm::vec4 planes[6];
+};
+
+// Planes from the rows of a (model) view projection matrix, normalized so
+// distances are in the units of the input space
+Frustum ExtractFrustum(const glm::mat4 & viewProjection);
+
+// False when the sphere is entirely outside one plane
+bool SphereInFrustum(const Frustum & frustum, const glm::vec3 & center, float radius);
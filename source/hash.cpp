@@ -0,0 +1,64 @@
+#include "hash.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#include <cstring>
+#include <vector>
+
+namespace
+{
+	const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+	const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+
+	uint64_t mix(uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= PRIME2;
+		h ^= h >> 29;
+		h *= PRIME1;
+		h ^= h >> 32;
+		return h;
+	}
+}
+
+uint64_t HashBytes(const void * data, size_t size, uint64_t seed)
+{
+	const unsigned char * bytes = (const unsigned char *) data;
+	uint64_t h = seed ^ (size * PRIME1);
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		h ^= mix(word);
+		h = (h << 27 | h >> 37) * PRIME1 + PRIME2;
+	}
+
+	if (i < size)
+	{
+		uint64_t tail = 0;
+		memcpy(&tail, bytes + i, size - i);
+		h ^= mix(tail);
+	}
+
+	return mix(h);
+}
+
+uint64_t HashFile(const char * path, ThreadPool & pool)
+{
+	const MappedFile file(path);
+
+	// Fixed size blocks keep the hash independent from the thread count
+	const size_t blockSize = 1 << 20;
+	const size_t blockCount = (file.size() + blockSize - 1) / blockSize;
+
+	std::vector<uint64_t> blockHashes(blockCount);
+	pool.parallelFor(blockCount, [&](size_t i) {
+		const size_t offset = i * blockSize;
+		const size_t length = file.size() - offset < blockSize ? file.size() - offset : blockSize;
+		blockHashes[i] = HashBytes(file.data() + offset, length, i);
+	});
+
+	return HashBytes(blockHashes.data(), blockHashes.size() * sizeof(uint64_t), file.size());
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "thread_pool.h"
+
+// Fast non cryptographic 64-bit hash, used to key the on-disk caches
+uint64_t HashBytes(const void * data, size_t size, uint64_t seed = 0);
+
+// Hash of a whole file, computed on the mapped file in parallel blocks.
+// The result does not depend on the number of threads.
+// Throws std::runtime_error if the file can't be opened.
+uint64_t HashFile(const char * path, ThreadPool & pool = ThreadPool::global());
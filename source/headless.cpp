@@ -0,0 +1,147 @@
+#include "headless.h"
+
+#include <stdexcept>
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#ifdef HAVE_EGL
+
+HeadlessContext::HeadlessContext()
+{
+	// Surfaceless platform first, it needs neither X nor a GPU
+	EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+	const auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+	{
+		eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	}
+	if (eglDisplay == EGL_NO_DISPLAY)
+	{
+		eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	EGLint major, minor;
+	if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, &major, &minor))
+	{
+		throw std::runtime_error("No EGL display available");
+	}
+	display = eglDisplay;
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		eglTerminate(eglDisplay);
+		throw std::runtime_error("EGL cannot create desktop OpenGL contexts");
+	}
+
+	const EGLint configAttributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint configCount = 0;
+	eglChooseConfig(eglDisplay, configAttributes, &config, 1, &configCount);
+
+	const EGLint contextAttributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext eglContext = eglCreateContext(eglDisplay, configCount ? config : (EGLConfig) nullptr, EGL_NO_CONTEXT, contextAttributes);
+	if (eglContext == EGL_NO_CONTEXT)
+	{
+		eglTerminate(eglDisplay);
+		throw std::runtime_error("Cannot create an OpenGL 4.5 core EGL context");
+	}
+	context = eglContext;
+
+	// No surface at all, everything goes to framebuffer objects
+	if (!eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext))
+	{
+		eglDestroyContext(eglDisplay, eglContext);
+		eglTerminate(eglDisplay);
+		throw std::runtime_error("Cannot make the EGL context current without a surface");
+	}
+}
+
+HeadlessContext::~HeadlessContext()
+{
+	eglMakeCurrent((EGLDisplay) display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext((EGLDisplay) display, (EGLContext) context);
+	eglTerminate((EGLDisplay) display);
+}
+
+void * HeadlessContext::getProcAddress(const char * name)
+{
+	return (void *) eglGetProcAddress(name);
+}
+
+#else
+
+HeadlessContext::HeadlessContext()
+{
+	throw std::runtime_error("Headless rendering needs EGL, which this build does not have");
+}
+
+HeadlessContext::~HeadlessContext()
+{
+}
+
+void * HeadlessContext::getProcAddress(const char *)
+{
+	return nullptr;
+}
+
+#endif
+
+OffscreenTarget::OffscreenTarget(int width, int height)
+	: width(width), height(height)
+{
+	glGenRenderbuffers(1, &color);
+	glBindRenderbuffer(GL_RENDERBUFFER, color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+	glGenRenderbuffers(1, &depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		throw std::runtime_error("Offscreen framebuffer is incomplete");
+	}
+}
+
+OffscreenTarget::~OffscreenTarget()
+{
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(1, &depth);
+	glDeleteRenderbuffers(1, &color);
+}
+
+void OffscreenTarget::bind() const
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+}
+
+Image OffscreenTarget::readPixels() const
+{
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.data.resize((size_t) width * height * 3);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, image.data.data());
+	return image;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include "texture.h"
+
+// OpenGL 4.5 core context without window or display server, through EGL
+// (surfaceless Mesa platform when available, so llvmpipe works on GPU-less
+// machines). Current on the calling thread until destroyed.
+class HeadlessContext
+{
+public:
+	HeadlessContext();
+	~HeadlessContext();
+
+	HeadlessContext(const HeadlessContext&) = delete;
+	HeadlessContext& operator=(const HeadlessContext&) = delete;
+
+	// For gladLoadGLLoader
+	static void * getProcAddress(const char * name);
+
+private:
+	void * display = nullptr;
+	void * context = nullptr;
+};
+
+// Framebuffer with an RGBA8 color and a 24-bit depth renderbuffer, to render
+// without a default framebuffer
+class OffscreenTarget
+{
+public:
+	OffscreenTarget(int width, int height);
+	~OffscreenTarget();
+
+	OffscreenTarget(const OffscreenTarget&) = delete;
+	OffscreenTarget& operator=(const OffscreenTarget&) = delete;
+
+	void bind() const;
+
+	// Color buffer as RGB rows, bottom row first like LoadImage
+	Image readPixels() const;
+
+	int width, height;
+
+private:
+	GLuint framebuffer = 0;
+	GLuint color = 0;
+	GLuint depth = 0;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+// Bounded multi-producer multi-consumer queue without locks (D. Vyukov's
+// ring): each slot carries a sequence number telling producers and
+// consumers whose turn it is, so both sides only contend on one counter.
+template <typename T>
+class LockFreeQueue
+{
+public:
+	// capacity is rounded up to a power of two
+	explicit LockFreeQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+		{
+			size *= 2;
+		}
+		mask = size - 1;
+		slots = std::vector<Slot>(size);
+		for (size_t i = 0; i < size; ++i)
+		{
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	LockFreeQueue(const LockFreeQueue&) = delete;
+	LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+	// False when the queue is full, value is left untouched then
+	bool push(T & value)
+	{
+		size_t position = tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Slot & slot = slots[position & mask];
+			const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			const ptrdiff_t difference = (ptrdiff_t) sequence - (ptrdiff_t) position;
+			if (difference == 0)
+			{
+				if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					slot.value = std::move(value);
+					slot.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// False when the queue is empty
+	bool pop(T & value)
+	{
+		size_t position = head.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Slot & slot = slots[position & mask];
+			const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			const ptrdiff_t difference = (ptrdiff_t) sequence - (ptrdiff_t) (position + 1);
+			if (difference == 0)
+			{
+				if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					value = std::move(slot.value);
+					slot.sequence.store(position + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<size_t> sequence;
+		T value;
+
+		Slot() = default;
+		Slot(Slot && other) : sequence(other.sequence.load()), value(std::move(other.value)) {}
+	};
+
+	std::vector<Slot> slots;
+	size_t mask = 0;
+
+	// On their own cache lines, producers and consumers do not share them
+	alignas(64) std::atomic<size_t> tail{0};
+	alignas(64) std::atomic<size_t> head{0};
+};
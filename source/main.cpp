@@ -9,16 +9,36 @@
 #include <sstream>
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <memory>
 
 #include "shader.h"
-#include "../vbo_indexer.h"
 
 #define TINYPLY_IMPLEMENTATION
 //#include <tinyply.h>
 
 #include "stl.h"
+#include "mesh_cache.h"
+#include "vertex_format.h"
+#include "meshlets.h"
+#include "simplify.h"
+#include "bvh.h"
+#include "scene.h"
+#include "batching.h"
+#include "headless.h"
+#include "camera_path.h"
+#include "profiler.h"
+#include "rasterizer.h"
 #include "../Light.h"
 #include "texture.h"
+#include "texture_cache.h"
+#include "asset_manager.h"
+#include "file_watcher.h"
+#include "clustered_lighting.h"
+#include "render_queue.h"
+#include "frame_ring.h"
 #include "../controls.h"
 
 using namespace std;
@@ -47,238 +67,264 @@ void APIENTRY opengl_error_callback(GLenum source,
 
 
 
-GLuint loadBMP_custom(const char* path) {
-	
-	// Data read from the header of the BMP file
-	unsigned char header[54]; // Each BMP file begins by a 54-bytes header
-	unsigned int dataPos;     // Position in the file where the actual data begins
-	unsigned int width, height;
-	unsigned int imageSize;   // = width*height*3
-	// Actual RGB data
-	unsigned char* data;
+// Uniform locations of a shader permutation, for what changes per draw
+struct ShadingProgram {
+	GLuint program;
+	GLint colorTexture, normalTexture;
+};
 
-	// Open the file
-	FILE* file = fopen(path, "rb");
-	if (!file) { printf("Image could not be opened\n"); return 0; }
-
-	if (fread(header, 1, 54, file) != 54) { // If not 54 bytes read : problem
-		printf("Not a correct BMP file\n");
-		return 0;
-	}
-
-	if (header[0] != 'B' || header[1] != 'M') {
-		printf("Not a correct BMP file\n");
-		return 0;
-	}
-
-	// Read ints from the byte array
-	dataPos = *(int*)&(header[0x0A]);
-	imageSize = *(int*)&(header[0x22]);
-	width = *(int*)&(header[0x12]);
-	height = *(int*)&(header[0x16]);
-
-	// Some BMP files are misformatted, guess missing information
-	if (imageSize == 0)    imageSize = width * height * 3; // 3 : one byte for each Red, Green and Blue component
-	if (dataPos == 0)      dataPos = 54; // The BMP header is done that way
-
-	// Create a buffer
-	data = new unsigned char[imageSize];
-
-	// Read the actual data from the file into the buffer
-	fread(data, 1, imageSize, file);
-
-	//Everything is in memory now, the file can be closed
-	fclose(file);
-
-	// Create one OpenGL texture
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-
-	// "Bind" the newly created texture : all future texture functions will modify this texture
-	glBindTexture(GL_TEXTURE_2D, textureID);
-
-	// Give the image to OpenGL
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-
-	// When MAGnifying the image (no bigger mipmap available), use LINEAR filtering
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	// When MINifying the image, use a LINEAR blend of two mipmaps, each filtered LINEARLY too
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	// Generate mipmaps, by the way.
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	return textureID;
+// Shader permutation reading a vertex format: the normal map needs the
+// tangents, octahedral normals are decoded
+static ShaderDefines vertexShaderDefines(const VertexLayout& layout) {
+	ShaderDefines defines;
+	if (layout.tangents)
+		defines.push_back("NORMAL_MAP");
+	if (layout.normals == NormalEncoding::Octahedral)
+		defines.push_back("OCTAHEDRAL_NORMALS");
+	return defines;
 }
 
-bool loadOBJ(char* path, std::vector<glm::vec3>& out_vertices, std::vector<glm::vec2>& out_uvs, std::vector<glm::vec3>& out_normals) {
-	std::vector<unsigned int> vertexIndices, uvIndices, normalIndices;
-	std::vector<glm::vec3> temp_vertices;
-	std::vector<glm::vec2> temp_uvs;
-	std::vector<glm::vec3> temp_normals;
+static ShadingProgram makeShadingProgram(GLuint program) {
+	ShadingProgram shading;
+	shading.program = program;
+	shading.colorTexture = glGetUniformLocation(program, "cubeTexture");
+	shading.normalTexture = glGetUniformLocation(program, "normalTexture"); // -1 without NORMAL_MAP
+	return shading;
+}
 
-	FILE* file = fopen(path, "r");
-	if (file == NULL) {
-		printf("Impossible to open the file !\n");
-		return false;
-	}
+// The FrameData block of frame_data.glsl, in its std140 layout
+struct FrameUniforms {
+	static const GLuint BINDING = 0;
+
+	glm::mat4 view;
+	glm::mat4 viewProjection;
+	glm::vec3 lightPosition;
+	float lightIntensity;
+	glm::vec3 lightColor;
+	float padding0;
+	uint32_t clusterCount[3];
+	uint32_t padding1;
+	glm::vec2 clusterTileScale;
+	glm::vec2 clusterDepthScaleBias;
+};
+static_assert(sizeof(FrameUniforms) == 192, "FrameUniforms must match the std140 layout of FrameData");
+
+// Options of the offscreen mode, for farm and CI runs
+struct HeadlessOptions {
+	bool enabled = false;
+	int frames = 120;
+	std::string output; // directory the frames are written to as BMP, none when empty
+	std::string cameraPath; // LoadCameraPath file, an orbit around the scene when empty
+	bool raster = false; // also draw every frame with the software Rasterizer and compare it to GL
+	bool watch = false; // hot reload changed assets, always on with a window
+};
+
+static void usage() {
+	std::cerr << "Usage: GamagoraGL [--headless] [--frames N] [--size WIDTHxHEIGHT] [--output DIRECTORY] [--camera-path FILE] [--raster] [--watch] [--lights N] [--profile FILE]" << std::endl
+		<< "  --headless     render offscreen through EGL along a camera path, without window, and print frame timings" << std::endl
+		<< "  --frames       frames spread over the camera path (120)" << std::endl
+		<< "  --size         framebuffer size (1024x768)" << std::endl
+		<< "  --output       write every frame to DIRECTORY/frame_NNNN.bmp" << std::endl
+		<< "  --camera-path  keys of 'time px py pz tx ty tz' per line, instead of an orbit around the scene" << std::endl
+		<< "  --raster       also render every frame on the CPU with the software rasterizer, and report its time and difference to GL" << std::endl
+		<< "  --watch        reload the shaders, meshes and textures changed on disk between frames" << std::endl
+		<< "  --lights       dynamic point lights moving over the scene, shaded through view space clusters (10000)" << std::endl
+		<< "  --profile      print per scope timings on exit and write them to FILE as a Chrome trace" << std::endl;
+}
 
-	while (1) {
-		char lineHeader[128];
-		// read the first word of the line
-		int res = fscanf(file, "%s", lineHeader);
-		if (res == EOF)
-			break; // EOF = End Of File. Quit the loop.
-
-		if (strcmp(lineHeader, "v") == 0) {
-			glm::vec3 vertex;
-			fscanf(file, "%f %f %f\n", &vertex.x, &vertex.y, &vertex.z);
-			temp_vertices.push_back(vertex);
-		} else if (strcmp(lineHeader, "vt") == 0) {
-			glm::vec2 uv;
-			fscanf(file, "%f %f\n", &uv.x, &uv.y);
-			temp_uvs.push_back(uv);
-		} else if (strcmp(lineHeader, "vn") == 0) {
-			glm::vec3 normal;
-			fscanf(file, "%f %f %f\n", &normal.x, &normal.y, &normal.z);
-			temp_normals.push_back(normal);
-		} else if (strcmp(lineHeader, "f") == 0) {
-			std::string vertex1, vertex2, vertex3;
-			unsigned int vertexIndex[3], uvIndex[3], normalIndex[3];
-			int matches = fscanf(file, "%d/%d/%d %d/%d/%d %d/%d/%d\n", &vertexIndex[0], &uvIndex[0], &normalIndex[0], &vertexIndex[1], &uvIndex[1], &normalIndex[1], &vertexIndex[2], &uvIndex[2], &normalIndex[2]);
-			if (matches != 9) {
-				printf("File can't be read by our simple parser : ( Try exporting with other options\n");
-				return false;
-			}
-			vertexIndices.push_back(vertexIndex[0]);
-			vertexIndices.push_back(vertexIndex[1]);
-			vertexIndices.push_back(vertexIndex[2]);
-			uvIndices.push_back(uvIndex[0]);
-			uvIndices.push_back(uvIndex[1]);
-			uvIndices.push_back(uvIndex[2]);
-			normalIndices.push_back(normalIndex[0]);
-			normalIndices.push_back(normalIndex[1]);
-			normalIndices.push_back(normalIndex[2]);
-		} else {
-			// Probably a comment, eat up the rest of the line
-			char stupidBuffer[1000];
-			fgets(stupidBuffer, 1000, file);
+static bool parseArguments(int argc, char** argv, HeadlessOptions& headless, std::string& profilePath, int& width, int& height, int& pointLightCount) {
+	for (int i = 1; i < argc; i++) {
+		const std::string argument = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (argument == "--headless") {
+			headless.enabled = true;
+		}
+		else if (argument == "--frames" && hasValue) {
+			headless.frames = std::max(1, atoi(argv[++i]));
+		}
+		else if (argument == "--size" && hasValue && sscanf(argv[i + 1], "%dx%d", &width, &height) == 2 && width > 0 && height > 0) {
+			i++;
+		}
+		else if (argument == "--output" && hasValue) {
+			headless.output = argv[++i];
+		}
+		else if (argument == "--camera-path" && hasValue) {
+			headless.cameraPath = argv[++i];
+		}
+		else if (argument == "--raster") {
+			headless.raster = true;
+		}
+		else if (argument == "--watch") {
+			headless.watch = true;
+		}
+		else if (argument == "--lights" && hasValue) {
+			pointLightCount = std::max(0, atoi(argv[++i]));
+		}
+		else if (argument == "--profile" && hasValue) {
+			profilePath = argv[++i];
+		}
+		else {
+			usage();
+			return false;
 		}
 	}
-
-	for (unsigned int i = 0; i < vertexIndices.size(); i++) {
-
-		// Get the indices of its attributes
-		unsigned int vertexIndex = vertexIndices[i];
-		unsigned int uvIndex = uvIndices[i];
-		unsigned int normalIndex = normalIndices[i];
-
-		// Get the attributes thanks to the index
-		glm::vec3 vertex = temp_vertices[vertexIndex - 1];
-		glm::vec2 uv = temp_uvs[uvIndex - 1];
-		glm::vec3 normal = temp_normals[normalIndex - 1];
-
-		// Put the attributes in buffers
-		out_vertices.push_back(vertex);
-		out_uvs.push_back(uv);
-		out_normals.push_back(normal);
-
+	if (headless.raster && !headless.enabled) {
+		usage();
+		return false;
 	}
-	fclose(file);
 	return true;
 }
 
-void computeTangentBasis(
-	// inputs
-	std::vector<glm::vec3>& vertices,
-	std::vector<glm::vec2>& uvs,
-	std::vector<glm::vec3>& normals,
-	// outputs
-	std::vector<glm::vec3>& tangents,
-	std::vector<glm::vec3>& bitangents
-) {
-	for (int i = 0; i < vertices.size(); i += 3) {
-		// Shortcuts for vertices
-		glm::vec3& v0 = vertices[i + 0];
-		glm::vec3& v1 = vertices[i + 1];
-		glm::vec3& v2 = vertices[i + 2];
-
-		// Shortcuts for UVs
-		glm::vec2& uv0 = uvs[i + 0];
-		glm::vec2& uv1 = uvs[i + 1];
-		glm::vec2& uv2 = uvs[i + 2];
-
-		// Edges of the triangle : postion delta
-		glm::vec3 deltaPos1 = v1 - v0;
-		glm::vec3 deltaPos2 = v2 - v0;
-
-		// UV delta
-		glm::vec2 deltaUV1 = uv1 - uv0;
-		glm::vec2 deltaUV2 = uv2 - uv0;
-
-		float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
-		glm::vec3 tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * r;
-		glm::vec3 bitangent = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * r;
-
-		// Set the same tangent for all three vertices of the triangle.
-		tangents.push_back(tangent);
-		tangents.push_back(tangent);
-		tangents.push_back(tangent);
-
-		// Same thing for binormals
-		bitangents.push_back(bitangent);
-		bitangents.push_back(bitangent);
-		bitangents.push_back(bitangent);
-	}
-}
-
-
-int main(void) {
+int main(int argc, char** argv) {
 
 	int width = 1024;
 	int height = 768;
 
-	GLFWwindow* window;
-	glfwSetErrorCallback(error_callback);
-
-	// Initialise GLFW
-	if (!glfwInit())
+	HeadlessOptions headless;
+	std::string profilePath;
+	int pointLightCount = 10000;
+	if (!parseArguments(argc, argv, headless, profilePath, width, height, pointLightCount))
 		exit(EXIT_FAILURE);
 
-	glfwWindowHint(GLFW_SAMPLES, 4); // 4x antialiasing
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
-	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+	// Before anything loads, so the loaders show up too
+	Profiler::global().setEnabled(!profilePath.empty());
 
-	window = glfwCreateWindow(width, height, "Tutorials", NULL, NULL);
+	GLFWwindow* window = nullptr;
+	std::unique_ptr<HeadlessContext> headlessContext;
 
-	if (!window) {
-		glfwTerminate();
-		exit(EXIT_FAILURE);
+	if (headless.enabled) {
+		try {
+			headlessContext.reset(new HeadlessContext());
+		}
+		catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+
+		if (!gladLoadGLLoader((GLADloadproc)HeadlessContext::getProcAddress)) {
+			std::cerr << "Something went wrong!" << std::endl;
+			exit(-1);
+		}
+		std::cout << "Headless on " << glGetString(GL_RENDERER) << ", OpenGL " << glGetString(GL_VERSION) << std::endl;
 	}
+	else {
+		glfwSetErrorCallback(error_callback);
 
-	glfwSetKeyCallback(window, key_callback);
-	glfwMakeContextCurrent(window); // Initialise GLEW
-	glfwSwapInterval(1);
+		// Initialise GLFW
+		if (!glfwInit())
+			exit(EXIT_FAILURE);
 
-	if(!gladLoadGL()) {
-		std::cerr << "Something went wrong!" << std::endl;
-		exit(-1);
-	}
+		glfwWindowHint(GLFW_SAMPLES, 4); // 4x antialiasing
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+		glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
 
-	// Callbacks
-	glDebugMessageCallback(opengl_error_callback, nullptr);
+		window = glfwCreateWindow(width, height, "Tutorials", NULL, NULL);
 
-	// Shader
-	const auto vertex = MakeShader(GL_VERTEX_SHADER, "resources/shaders/shader.vert");
-	const auto fragment = MakeShader(GL_FRAGMENT_SHADER, "resources/shaders/shader.frag");
+		if (!window) {
+			glfwTerminate();
+			exit(EXIT_FAILURE);
+		}
 
-	const auto program = AttachAndLink({vertex, fragment});
+		glfwSetKeyCallback(window, key_callback);
+		glfwMakeContextCurrent(window); // Initialise GLEW
+		glfwSwapInterval(1);
 
-	glUseProgram(program);
+		if(!gladLoadGL()) {
+			std::cerr << "Something went wrong!" << std::endl;
+			exit(-1);
+		}
+	}
 
+	// Callbacks
+	glDebugMessageCallback(opengl_error_callback, nullptr);
 
-	GLuint Texture = loadBMP_custom("./img/uvtemplate.bmp");
-	GLuint TextureID = glGetUniformLocation(program, "cubeTexture");
+	// Shader permutations, linked once then loaded from their program binary
+	const std::vector<ShaderStage> shaderStages = {
+		{GL_VERTEX_SHADER, "resources/shaders/shader.vert"},
+		{GL_FRAGMENT_SHADER, "resources/shaders/shader.frag"},
+	};
+	std::vector<std::string> shaderFiles; // with their includes, for hot reload
+	auto loadProgram = [&](const char* name, const ShaderDefines& defines) {
+		ProgramInfo info;
+		const GLuint program = LoadProgram(shaderStages, defines, &info);
+		std::cout << "Program " << name << ": " << info.ms << " ms, " << (info.cached ? "from the binary cache (warm)" : "compiled (cold)") << std::endl;
+		for (const std::string& file : info.files) {
+			if (std::find(shaderFiles.begin(), shaderFiles.end(), file) == shaderFiles.end())
+				shaderFiles.push_back(file);
+		}
+		return makeShadingProgram(program);
+	};
+	// lego2 is drawn without texture coordinates, the cube is normal mapped
+	VertexLayout lego2_layout;
+	lego2_layout.uvs = false;
+	VertexLayout cube_layout;
+	cube_layout.tangents = true;
+
+	// One permutation per vertex format
+	const ShaderDefines plainDefines = vertexShaderDefines(lego2_layout);
+	const ShaderDefines normalMappedDefines = vertexShaderDefines(cube_layout);
+	ShadingProgram plainProgram = loadProgram("plain", plainDefines);
+	ShadingProgram normalMappedProgram = loadProgram("normal mapped", normalMappedDefines);
+
+
+	// Meshes and textures load on the asset workers while the window shows
+	// the clear color. Textures are block compressed through the .texcache
+	// files next to the images, or uncompressed when the driver lacks the
+	// format; the levels as the GPU samples them are kept for the software
+	// rasterizer.
+	const auto loadStart = std::chrono::steady_clock::now();
+	std::unique_ptr<AssetManager> assets(new AssetManager());
+
+	TextureAsset& uvtemplate = assets->loadTexture("./img/uvtemplate.bmp", BlockFormat::BC1, headless.raster);
+
+	// Parsed and welded once, then mapped from the .meshcache file next to the OBJ.
+	// lego2 is picked through its BVH.
+	MeshOptions lego2Options;
+	lego2Options.lodRatios = {0.5f, 0.25f, 0.125f};
+	MeshAsset& lego2Asset = assets->loadMesh("resources/models/lego2.obj", lego2Options, lego2_layout, true);
+
+	TextureAsset& normalMap = assets->loadTexture("./img/normal.bmp", BlockFormat::BC5, headless.raster);
+
+	MeshOptions cubeOptions;
+	cubeOptions.tangents = true;
+	// Reset the position
+	cubeOptions.offset = glm::vec3(0, -1, 0);
+	MeshAsset& cubeAsset = assets->loadMesh("resources/models/cube.obj", cubeOptions, cube_layout);
+
+	const glm::vec3 clearColor(0.2f, 0.2f, 0.3f);
+	glClearColor(clearColor.r, clearColor.g, clearColor.b, 0);
+	try {
+		if (window) {
+			while (!assets->done() && !glfwWindowShouldClose(window)) {
+				assets->update();
+				glClear(GL_COLOR_BUFFER_BIT);
+				glfwSwapBuffers(window);
+				glfwPollEvents();
+			}
+			if (glfwWindowShouldClose(window)) {
+				// Closed while loading: the loads not started yet are dropped
+				assets.reset();
+				glfwDestroyWindow(window);
+				glfwTerminate();
+				exit(EXIT_SUCCESS);
+			}
+		}
+		// Headless frames start once everything is resident, also rethrows load errors
+		assets->finish();
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		// The workers still loading are waited for
+		assets.reset();
+		exit(-1);
+	}
+
+	const AssetStats assetStats = assets->stats();
+	std::cout << "Assets: " << assetStats.loaded << " loaded in "
+		<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count() << " ms, slowest "
+		<< assetStats.slowestLoadMs << " ms, " << assetStats.totalLoadMs << " ms serially, " << assetStats.uploadedBytes / 1024 << " KB uploaded in "
+		<< assetStats.uploadMs << " ms over " << assetStats.uploadFrames << " frames" << std::endl;
 
 	// Buffers //
 	GLuint VertexArrayID;
@@ -287,256 +333,650 @@ int main(void) {
 
 #pragma region lego2 buffers
 
-	std::vector<glm::vec3> inlego2_vertices;
-	std::vector<glm::vec2> inlego2_uvs;
-	std::vector<glm::vec3> inlego2_normals;
-
-	std::vector<glm::vec3> lego2_vertices;
-	std::vector<glm::vec2> lego2_uvs;
-	std::vector<glm::vec3> lego2_normals;
-
-	std::vector<glm::vec3> lego2_color;
-
-	std::vector<unsigned short> indicesLego2;
-
-	if (!loadOBJ("resources/models/lego2.obj", inlego2_vertices, inlego2_uvs, inlego2_normals)) {
-		std::cout << "Can't load lego2 :(";
-		return -1;
-	}
-
-	indexVBO(inlego2_vertices, inlego2_uvs, inlego2_normals, indicesLego2, lego2_vertices, lego2_uvs, lego2_normals);
-
-	for (int i = 0; i < lego2_vertices.size(); i++) {
-		lego2_color.push_back(glm::vec3(0.7, 0.5, 0.1));
-	}
+	const MeshCache& lego2 = *lego2Asset.cache;
+	const Aabb& lego2_bounds = lego2Asset.bounds;
+	const VertexFormat& lego2_format = lego2Asset.format;
+	const GLuint& lego2_vertexbuffer = lego2Asset.vertexBuffer;
+	const GLuint& lego2_elementbuffer = lego2Asset.elementBuffer;
 
-	GLuint lego2_vertexbuffer;
-	glGenBuffers(1, &lego2_vertexbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, lego2_vertexbuffer);
-	glBufferData(GL_ARRAY_BUFFER, lego2_vertices.size() * sizeof(glm::vec3), &lego2_vertices[0], GL_STATIC_DRAW);
-
-	GLuint lego2_uvbuffer;
-	glGenBuffers(1, &lego2_uvbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, lego2_uvbuffer);
-	glBufferData(GL_ARRAY_BUFFER, lego2_uvs.size() * sizeof(glm::vec2), &lego2_uvs[0], GL_STATIC_DRAW);
-
-	GLuint lego2_normalbuffer;
-	glGenBuffers(1, &lego2_normalbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, lego2_normalbuffer);
-	glBufferData(GL_ARRAY_BUFFER, lego2_normals.size() * sizeof(glm::vec3), &lego2_normals[0], GL_STATIC_DRAW);
-
-	GLuint lego2_elementbuffer;
-	glGenBuffers(1, &lego2_elementbuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lego2_elementbuffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesLego2.size() * sizeof(unsigned short), &indicesLego2[0], GL_STATIC_DRAW);
-
-	GLuint lego2_colorbuffer;
-	glGenBuffers(1, &lego2_colorbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, lego2_colorbuffer);
-	glBufferData(GL_ARRAY_BUFFER, lego2_color.size() * sizeof(glm::vec3), &lego2_color[0], GL_STATIC_DRAW);
+	// For mouse picking, over the full resolution LOD
+	const Bvh& lego2_bvh = *lego2Asset.bvh;
+	std::cout << "lego2 BVH: " << lego2_bvh.nodeCount() << " nodes, " << lego2_bvh.depth() << " levels" << std::endl;
 
 #pragma endregion
 #pragma region cube buffers
 
-	GLuint normalTexture = loadBMP_custom("./img/normal.bmp");
-
-	GLuint normalTextureID = glGetUniformLocation(program, "normalTexture");
-
-	GLuint ModelView3x3MatrixID = glGetUniformLocation(program, "MV3x3");
-
-	std::vector<glm::vec3> incube_vertices;
-	std::vector<glm::vec2> incube_uvs;
-	std::vector<glm::vec3> incube_normals;
-	std::vector<glm::vec3> incube_tangents;
-	std::vector<glm::vec3> incube_bitangents;
-
-	std::vector<glm::vec3> cube_vertices;
-	std::vector<glm::vec2> cube_uvs;
-	std::vector<glm::vec3> cube_normals;
-	std::vector<glm::vec3> cube_tangents;
-	std::vector<glm::vec3> cube_bitangents;
-
-	std::vector<unsigned short> indicesCube;
+	const GLuint& Texture = uvtemplate.texture;
+	const GLuint& normalTexture = normalMap.texture;
 
-	if (!loadOBJ("resources/models/cube.obj", incube_vertices, incube_uvs, incube_normals)) {
-		return -1;
-	}
-	// Reset the position
-	for (int i = 0; i < incube_vertices.size(); i++) {
-		incube_vertices[i] += glm::vec3(0, -1, 0);
+	const MeshCache& cube = *cubeAsset.cache;
+	const Aabb& cube_bounds = cubeAsset.bounds;
+	const VertexFormat& cube_format = cubeAsset.format;
+	const GLuint& cube_vertexbuffer = cubeAsset.vertexBuffer;
+	const GLuint& cube_elementbuffer = cubeAsset.elementBuffer;
+#pragma endregion
+#pragma region scene
+
+	// Meshes objects can use
+	enum SceneMesh { LEGO2_MESH, CUBE_MESH };
+
+	// Draw calls are split by vertex buffer and by state
+	enum BatchBuffer { LEGO2_BUFFER, CUBE_BUFFER };
+	enum BatchState { PLAIN_STATE, TEXTURED_STATE };
+
+	// Batch meshes: every lego2 LOD, then the cube. Built again when a mesh is reloaded.
+	std::vector<BatchMesh> batchMeshes;
+	uint32_t cube_batchMesh = 0;
+	auto buildBatchMeshes = [&]() {
+		batchMeshes.clear();
+		for (size_t lod = 0; lod < lego2.lodCount(); lod++) {
+			batchMeshes.push_back({lego2.lods()[lod].firstIndex, lego2.lods()[lod].indexCount, 0, LEGO2_BUFFER});
+		}
+		cube_batchMesh = (uint32_t)batchMeshes.size();
+		batchMeshes.push_back({0, cube.lods()[0].indexCount, 0, CUBE_BUFFER});
+	};
+	buildBatchMeshes();
+
+	const std::vector<BatchMaterial> materials = {
+		{glm::vec4(0.0f), TEXTURED_STATE}, // cube, color comes from the texture
+		{glm::vec4(0.7f, 0.5f, 0.1f, 1.0f), PLAIN_STATE},
+		{glm::vec4(0.6f, 0.1f, 0.1f, 1.0f), PLAIN_STATE},
+		{glm::vec4(0.1f, 0.3f, 0.6f, 1.0f), PLAIN_STATE},
+		{glm::vec4(0.2f, 0.5f, 0.2f, 1.0f), PLAIN_STATE},
+	};
+
+	Scene scene;
+	const Scene::ObjectId lego2_object = scene.add(LEGO2_MESH, lego2_bounds, glm::mat4(1.0f), 1);
+	scene.add(CUBE_MESH, cube_bounds, glm::mat4(1.0f), 0);
+
+	// A field of lego2 copies behind the original, drawn as instances
+	const float lego2_spacing = glm::length(lego2_bounds.max - lego2_bounds.min) * 1.2f;
+	for (int row = 1; row <= 10; row++) {
+		for (int column = -5; column < 5; column++) {
+			const glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(column * lego2_spacing, 0.0f, -row * lego2_spacing));
+			scene.add(LEGO2_MESH, lego2_bounds, transform, 1 + (row + column + 10) % 4);
+		}
 	}
 
-	computeTangentBasis(incube_vertices, incube_uvs, incube_normals, incube_tangents, incube_bitangents);
-
-	indexVBO_TBN(incube_vertices, incube_uvs, incube_normals, incube_tangents, incube_bitangents, indicesCube, cube_vertices, cube_uvs, cube_normals, cube_tangents, cube_bitangents);
-
-
-	GLuint cube_vertexbuffer;
-	glGenBuffers(1, &cube_vertexbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, cube_vertexbuffer);
-	glBufferData(GL_ARRAY_BUFFER, cube_vertices.size() * sizeof(glm::vec3), &cube_vertices[0], GL_STATIC_DRAW);
-
-	GLuint cube_uvbuffer;
-	glGenBuffers(1, &cube_uvbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, cube_uvbuffer);
-	glBufferData(GL_ARRAY_BUFFER, cube_uvs.size() * sizeof(glm::vec2), &cube_uvs[0], GL_STATIC_DRAW);
-
-	GLuint cube_normalbuffer;
-	glGenBuffers(1, &cube_normalbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, cube_normalbuffer);
-	glBufferData(GL_ARRAY_BUFFER, cube_normals.size() * sizeof(glm::vec3), &cube_normals[0], GL_STATIC_DRAW);
-
-	GLuint cube_elementbuffer;
-	glGenBuffers(1, &cube_elementbuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_elementbuffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesCube.size() * sizeof(unsigned short), &indicesCube[0], GL_STATIC_DRAW);
-
-	GLuint cube_tangentbuffer;
-	glGenBuffers(1, &cube_tangentbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, cube_tangentbuffer);
-	glBufferData(GL_ARRAY_BUFFER, cube_tangents.size() * sizeof(glm::vec3), &cube_tangents[0], GL_STATIC_DRAW);
-
-	GLuint cube_bitangentbuffer;
-	glGenBuffers(1, &cube_bitangentbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, cube_bitangentbuffer);
-	glBufferData(GL_ARRAY_BUFFER, cube_bitangents.size() * sizeof(glm::vec3), &cube_bitangents[0], GL_STATIC_DRAW);
+	// Around everything, for the headless camera and the point lights
+	Aabb sceneBounds = scene.worldBounds(0);
+	for (size_t object = 1; object < scene.size(); object++) {
+		const Aabb bounds = scene.worldBounds((Scene::ObjectId)object);
+		sceneBounds.min = glm::min(sceneBounds.min, bounds.min);
+		sceneBounds.max = glm::max(sceneBounds.max, bounds.max);
+	}
+	const glm::vec3 sceneCenter = (sceneBounds.min + sceneBounds.max) * 0.5f;
+	const float sceneRadius = glm::length(sceneBounds.max - sceneBounds.min) * 0.5f;
+
+	// Rebuilt every frame by culling the scene against the camera
+	std::vector<Scene::ObjectId> visibleObjects;
+	std::vector<DrawItem> drawItems;
+	std::vector<TriangleRange> meshletRanges;
+	DrawBatcher batcher;
+	RenderQueue renderQueue;
+	RenderState renderState;
+
+	// Frame uniforms, instances and indirect commands, written in place
+	// while the GPU still reads the two previous frames
+	FrameRing frameRing;
 #pragma endregion
 
 	// Enable depth test
 	glEnable(GL_DEPTH_TEST);
 	// Accept fragment if it closer to the camera than the former one
 	glDepthFunc(GL_LESS);
-	// Cull triangles which normal is not towards the camera
-	//glEnable(GL_CULL_FACE);
+	// Cull triangles which normal is not towards the camera. Off, so the
+	// meshlets facing away are kept too.
+	const bool faceCulling = false;
+	if (faceCulling)
+		glEnable(GL_CULL_FACE);
 
 	// Enable transparencies
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glEnable(GL_BLEND);
 
-	glClearColor(0.2, 0.2, 0.3, 0);
+	Light light = Light(glm::vec3(2, 10, 5), glm::vec3(0.9, 0.9, 0.8), 200);
 
-	GLuint MatrixID = glGetUniformLocation(program, "MVP");
+#pragma region point lights
+
+	// Lights circling around random spots of the scene. They are binned every
+	// frame into view space clusters, and a fragment only shades the lights
+	// of its cluster.
+	struct PointLightPath {
+		glm::vec3 center;
+		float phase;
+		float speed; // radians per second
+	};
+	std::vector<PointLightPath> pointLightPaths(pointLightCount);
+	std::vector<PointLight> pointLights(pointLightCount);
+	{
+		std::mt19937 random(1234);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const glm::vec3 lightsMin = sceneBounds.min;
+		const glm::vec3 lightsMax = sceneBounds.max + glm::vec3(0.0f, lego2_spacing * 0.25f, 0.0f);
+		for (int i = 0; i < pointLightCount; i++) {
+			PointLightPath& path = pointLightPaths[i];
+			path.center = lightsMin + (lightsMax - lightsMin) * glm::vec3(unit(random), unit(random), unit(random));
+			path.phase = unit(random) * 6.2831853f;
+			path.speed = 0.5f + unit(random);
+
+			PointLight& pointLight = pointLights[i];
+			pointLight.radius = lego2_spacing * (0.1f + 0.15f * unit(random));
+			pointLight.color = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + 0.1f);
+			// Radiance around 0.25 at half the radius, whatever the scene scale
+			pointLight.intensity = 0.3f * (1.0f + pointLight.radius * pointLight.radius * 0.25f);
+		}
+	}
+	const float pointLightWander = lego2_spacing * 0.3f;
 
-	GLuint ModelMatrixID = glGetUniformLocation(program, "M");
-	GLuint ViewMatrixID = glGetUniformLocation(program, "V");
+	LightClusters lightClusters;
+	ClusterBuffers clusterBuffers;
+	LightClusterStats lightStats;
+	double lightBuildMs = 0.0;
 
-	Light light = Light(glm::vec3(2, 10, 5), glm::vec3(0.9, 0.9, 0.8), 200);
-	GLuint LightPositionID = glGetUniformLocation(program, "lightPosition");
-	GLuint LightColorID = glGetUniformLocation(program, "lightColor");
-	GLuint LightIntensityID = glGetUniformLocation(program, "lightIntensity");
+#pragma endregion
+
+	std::unique_ptr<OffscreenTarget> offscreen;
+	CameraPath cameraPath;
+	glm::mat4 headlessProjection;
+	// Frame start and end timestamps, read FrameRing::FRAMES - 1 frames later so
+	// fetching them never waits on the frame just submitted
+	GLuint timerQueries[FrameRing::FRAMES][2] = {};
+	std::vector<double> cpuTimes, gpuTimes;
+	auto readFrameTimes = [&](int timedFrame) {
+		GLuint64 gpuStart = 0, gpuEnd = 0;
+		glGetQueryObjectui64v(timerQueries[timedFrame % FrameRing::FRAMES][0], GL_QUERY_RESULT, &gpuStart);
+		glGetQueryObjectui64v(timerQueries[timedFrame % FrameRing::FRAMES][1], GL_QUERY_RESULT, &gpuEnd);
+		gpuTimes.push_back((double)(gpuEnd - gpuStart) / 1e6);
+		std::cout << "Frame " << timedFrame << ": cpu " << cpuTimes[timedFrame] << " ms, gpu " << gpuTimes.back() << " ms" << std::endl;
+	};
+
+	// Reference renderer fed with the same buffers and texture levels
+	std::unique_ptr<Rasterizer> rasterizer;
+	std::unique_ptr<RasterTexture> rasterTexture, rasterNormalTexture;
+	std::vector<double> rasterTimes;
+	size_t rasterWorstPixels = 0;
+
+	if (headless.enabled) {
+		offscreen.reset(new OffscreenTarget(width, height));
+		offscreen->bind();
+
+		// Scripted camera, or a turn around everything in the scene
+		cameraPath = headless.cameraPath.empty()
+			? OrbitCameraPath(sceneCenter, sceneRadius * 1.2f, sceneRadius * 0.4f, 1.0f)
+			: LoadCameraPath(headless.cameraPath.c_str());
+		headlessProjection = glm::perspective(glm::radians(45.0f), (float)width / height, 0.1f, std::max(100.0f, sceneRadius * 4.0f));
+
+		glGenQueries(2 * FrameRing::FRAMES, &timerQueries[0][0]);
+
+		if (headless.raster) {
+			rasterizer.reset(new Rasterizer(width, height));
+			rasterTexture.reset(new RasterTexture(std::move(uvtemplate.levels)));
+			rasterNormalTexture.reset(new RasterTexture(std::move(normalMap.levels)));
+		}
+	}
+	else {
+		glfwSetCursorPos(window, width / 2, height / 2);
 
-	glfwSetCursorPos(window, width / 2, height / 2);
-	
-	// Hide the mouse and enable unlimited mouvement
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+		// Hide the mouse and enable unlimited mouvement
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	}
+	uvtemplate.levels.clear();
+	normalMap.levels.clear();
+
+#pragma region hot reload
+
+	// Changed files are loaded again off the render thread, by the asset
+	// workers on their own thread pool or by the driver's compiler threads,
+	// and swapped in at the start of a frame. A failed load or compile keeps the previous version, and
+	// a file that cannot be watched is simply not reloaded.
+	std::unique_ptr<FileWatcher> watcher;
+	auto watchFile = [&](const std::string& path) {
+		try {
+			watcher->watch(path);
+		}
+		catch (const std::exception& e) {
+			std::cerr << e.what() << ", " << path << " will not be reloaded" << std::endl;
+		}
+	};
+	if (!headless.enabled || headless.watch) {
+		try {
+			watcher.reset(new FileWatcher());
+		}
+		catch (const std::exception& e) {
+			std::cerr << e.what() << ", hot reload disabled" << std::endl;
+		}
+	}
+	if (watcher) {
+		for (const std::string& path : shaderFiles)
+			watchFile(path);
+		for (const char* path : {"./img/uvtemplate.bmp", "./img/normal.bmp", "resources/models/lego2.obj", "resources/models/cube.obj"})
+			watchFile(path);
+	}
 
-	while (!glfwWindowShouldClose(window)) {
-		float u_time = glfwGetTime();
+	struct ProgramReload {
+		const char* name;
+		const ShaderDefines& defines;
+		ShadingProgram& shading;
+		ProgramBuild build;
+		bool building;
+	};
+	std::vector<ProgramReload> programReloads = {
+		{"plain", plainDefines, plainProgram, ProgramBuild(), false},
+		{"normal mapped", normalMappedDefines, normalMappedProgram, ProgramBuild(), false},
+	};
+
+	// Data derived from the meshes is refreshed when their version changes
+	unsigned lego2Version = lego2Asset.version;
+	unsigned cubeVersion = cubeAsset.version;
 
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+#pragma endregion
 
-#pragma region draw lego2
+	bool wasPicking = false;
+
+	MeshletCullStats cullStats;
+	SceneCullStats sceneStats;
+	BatchStats batchStats;
+	RenderStateStats renderStats;
+	FrameRingStats frameRingReported;
+	int cullFrames = 0;
+	const auto startTime = std::chrono::steady_clock::now();
+	double cullReportTime = 0.0;
+	int frame = 0;
+
+	while (headless.enabled ? frame < headless.frames : !glfwWindowShouldClose(window)) {
+		PROFILE_SCOPE("Frame");
+		const auto frameStart = std::chrono::steady_clock::now();
+		const double u_time = std::chrono::duration<double>(frameStart - startTime).count();
+
+		if (watcher) {
+			PROFILE_SCOPE("Hot reload");
+			for (const std::string& path : watcher->poll()) {
+				std::cout << "Changed " << path << std::endl;
+				if (std::find(shaderFiles.begin(), shaderFiles.end(), path) == shaderFiles.end()) {
+					assets->reload(path);
+					continue;
+				}
+				for (ProgramReload& reload : programReloads) {
+					if (reload.building)
+						glDeleteProgram(reload.build.program);
+					reload.building = false;
+					try {
+						reload.build = StartProgram(shaderStages, reload.defines);
+						reload.building = true;
+					}
+					catch (const std::exception& e) {
+						std::cerr << "Reload failed, keeping the previous " << reload.name << " program: " << e.what() << std::endl;
+					}
+				}
+			}
 
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, lego2_vertexbuffer);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+			for (ProgramReload& reload : programReloads) {
+				try {
+					if (!reload.building || !FinishProgram(reload.build))
+						continue;
+				}
+				catch (const std::exception& e) {
+					std::cerr << "Reload failed, keeping the previous " << reload.name << " program: " << e.what() << std::endl;
+					reload.building = false;
+					continue;
+				}
+				glDeleteProgram(reload.shading.program);
+				reload.shading = makeShadingProgram(reload.build.program);
+				reload.building = false;
+				std::cout << "Reloaded the " << reload.name << " program, " << reload.build.info.ms << " ms" << std::endl;
+
+				// Includes may have been added
+				for (const std::string& file : reload.build.info.files) {
+					if (std::find(shaderFiles.begin(), shaderFiles.end(), file) == shaderFiles.end()) {
+						shaderFiles.push_back(file);
+						watchFile(file);
+					}
+				}
+			}
+		}
 
-		/*glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, lego2_uvbuffer);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);*/
+		// Uploads, and the reloads they finish
+		assets->update();
+		if (lego2Asset.version != lego2Version || cubeAsset.version != cubeVersion) {
+			buildBatchMeshes();
+			for (size_t object = 0; object < scene.size(); object++) {
+				scene.setBounds((Scene::ObjectId)object, scene.mesh((Scene::ObjectId)object) == LEGO2_MESH ? lego2_bounds : cube_bounds);
+			}
+			lego2Version = lego2Asset.version;
+			cubeVersion = cubeAsset.version;
+		}
 
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, lego2_normalbuffer);
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		// Average culling and batching results, once per second
+		if (u_time - cullReportTime >= 1.0 && cullFrames > 0) {
+			std::cout << "Objects: " << sceneStats.visibleObjects / cullFrames << "/" << sceneStats.objects / cullFrames << " drawn" << std::endl;
+			std::cout << "Batches: " << batchStats.batches / cullFrames << " draw calls, " << batchStats.commands / cullFrames << " commands for "
+				<< batchStats.items / cullFrames << " objects" << std::endl;
+			std::cout << "State: " << renderStats.changes() / cullFrames << " changes for " << renderStats.draws / cullFrames << " draws ("
+				<< renderStats.programs / cullFrames << " programs, " << renderStats.textures / cullFrames << " textures, "
+				<< renderStats.vertexInputs / cullFrames << " vertex inputs, " << renderStats.attributeToggles / cullFrames << " attribute toggles, "
+				<< renderStats.buffers / cullFrames << " buffers, " << renderStats.uniforms / cullFrames << " uniforms), "
+				<< renderStats.skipped / cullFrames << " redundant skipped" << std::endl;
+			std::cout << "Lights: " << lightStats.visibleLights / cullFrames << "/" << lightStats.lights / cullFrames << " visible, "
+				<< lightStats.references / cullFrames << " cluster references in " << lightStats.occupiedClusters / cullFrames << "/" << lightClusters.clusterCount()
+				<< " clusters, up to " << lightStats.maxClusterLights << " per cluster, binned in " << lightBuildMs / cullFrames << " ms" << std::endl;
+			std::cout << "Meshlets: " << cullStats.visibleMeshlets / cullFrames << "/" << cullStats.meshlets / cullFrames << " drawn, "
+				<< cullStats.rejectedTriangles() / cullFrames << "/" << cullStats.triangles / cullFrames << " triangles rejected per frame ("
+				<< cullStats.backfaceTriangles / cullFrames << " back facing, " << cullStats.frustumTriangles / cullFrames << " off screen)" << std::endl;
+			const FrameRingStats& ring = frameRing.stats();
+			std::cout << "Frame data: " << (ring.bytes - frameRingReported.bytes) / cullFrames << " bytes per frame in " << FrameRing::FRAMES << " x "
+				<< frameRing.frameCapacity() << " bytes, " << ring.waits - frameRingReported.waits << " fence waits ("
+				<< ring.waitMs - frameRingReported.waitMs << " ms), " << ring.grows << " grows" << std::endl;
+			frameRingReported = ring;
+			cullStats = MeshletCullStats();
+			sceneStats = SceneCullStats();
+			batchStats = BatchStats();
+			renderStats = RenderStateStats();
+			lightStats = LightClusterStats();
+			lightBuildMs = 0.0;
+			cullFrames = 0;
+			cullReportTime = u_time;
+		}
+		cullFrames++;
 
-		glEnableVertexAttribArray(3);
-		glBindBuffer(GL_ARRAY_BUFFER, lego2_colorbuffer);
-		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		glm::mat4 ProjectionMatrix, ViewMatrix;
+		glm::vec3 cameraPosition;
+		if (headless.enabled) {
+			PROFILE_SCOPE("SampleCameraPath");
 
-		// Draw the triangle !
-		//glDrawArrays(GL_TRIANGLES, 0, lego2_vertices.size() * sizeof(glm::vec3));
+			// Frames spread evenly over the whole path
+			glm::vec3 target;
+			const float pathTime = cameraPath.keys.front().time + cameraPath.duration() * frame / std::max(headless.frames - 1, 1);
+			SampleCameraPath(cameraPath, pathTime, cameraPosition, target);
+			ViewMatrix = glm::lookAt(cameraPosition, target, glm::vec3(0, 1, 0));
+			ProjectionMatrix = headlessProjection;
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lego2_elementbuffer);
+			glQueryCounter(timerQueries[frame % FrameRing::FRAMES][0], GL_TIMESTAMP);
+		}
+		else {
+			PROFILE_SCOPE("computeMatricesFromInputs");
+			computeMatricesFromInputs(window);
+			ProjectionMatrix = getProjectionMatrix();
+			ViewMatrix = getViewMatrix();
+			cameraPosition = getCameraPosition();
+		}
+		const glm::mat4 ViewProjectionMatrix = ProjectionMatrix * ViewMatrix;
+
+		// Point lights moved, binned for this view and uploaded
+		{
+			PROFILE_SCOPE("Point lights");
+			const float lightTime = headless.enabled ? frame / 30.0f : (float)u_time;
+			ThreadPool::global().parallelRanges(pointLights.size(), 4096, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					const PointLightPath& path = pointLightPaths[i];
+					const float angle = path.phase + lightTime * path.speed;
+					pointLights[i].position = path.center + glm::vec3(std::cos(angle), 0.5f * std::sin(2.0f * angle), std::sin(angle)) * pointLightWander;
+				}
+			});
+
+			const auto buildStart = std::chrono::steady_clock::now();
+			lightClusters.build(pointLights, ViewMatrix, ProjectionMatrix);
+			lightBuildMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+			clusterBuffers.update(lightClusters);
+
+			const LightClusterStats& stats = lightClusters.stats();
+			lightStats.lights += stats.lights;
+			lightStats.visibleLights += stats.visibleLights;
+			lightStats.references += stats.references;
+			lightStats.occupiedClusters += stats.occupiedClusters;
+			lightStats.maxClusterLights = std::max(lightStats.maxClusterLights, stats.maxClusterLights);
+		}
 
+		// Report the lego2 triangle under the cursor on click
+		const bool picking = !headless.enabled && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+		if (picking && !wasPicking) {
+			PROFILE_SCOPE("Pick");
+			glm::vec3 origin, direction;
+			getPickRay(window, origin, direction);
+
+			// The BVH is in model space
+			const glm::mat4 worldToModel = glm::inverse(scene.transform(lego2_object));
+			Ray ray;
+			ray.origin = glm::vec3(worldToModel * glm::vec4(origin, 1.0f));
+			ray.direction = glm::vec3(worldToModel * glm::vec4(direction, 0.0f));
+			const auto pickStart = std::chrono::steady_clock::now();
+			const RayHit hit = lego2_bvh.intersect(ray);
+			const double pickUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - pickStart).count();
+			if (hit.hit()) {
+				std::cout << "Picked lego2 triangle " << hit.triangle << " at distance " << hit.t << " (" << pickUs << " us)" << std::endl;
+			}
+			else {
+				std::cout << "Nothing picked (" << pickUs << " us)" << std::endl;
+			}
+		}
+		wasPicking = picking;
 
-		// Draw the triangles !
-		glDrawElements(GL_TRIANGLES, indicesLego2.size(), GL_UNSIGNED_SHORT, (void*)0);
+		{
+			PROFILE_SCOPE("Scene cull");
+			visibleObjects.clear();
+			scene.cull(ViewProjectionMatrix, visibleObjects, &sceneStats);
+		}
 
-		glDisableVertexAttribArray(0);
-		//glDisableVertexAttribArray(1);
-		glDisableVertexAttribArray(2);
-		glDisableVertexAttribArray(3);
-#pragma endregion
+		// Pick a mesh for each visible object: a lego2 LOD, culled by meshlet at full resolution
+		{
+			PROFILE_SCOPE("LOD and meshlet cull");
+			drawItems.clear();
+			meshletRanges.clear();
+			for (const Scene::ObjectId object : visibleObjects) {
+				DrawItem item = {object, cube_batchMesh, scene.material(object), 0, 0};
+				if (scene.mesh(object) == LEGO2_MESH) {
+					// Coarsest LOD whose error stays under a pixel, measured from the world box
+					const Aabb bounds = scene.worldBounds(object);
+					const float radius = glm::length(bounds.max - bounds.min) * 0.5f;
+					const float distance = std::max(glm::length(cameraPosition - (bounds.min + bounds.max) * 0.5f) - radius, 0.1f);
+					const size_t lod = SelectLod(lego2.lods(), lego2.lodCount(), distance, height * 0.5f * ProjectionMatrix[1][1]);
+					item.mesh = (uint32_t)lod;
+
+					if (lod == 0) {
+						// Only the meshlets inside the frustum, and facing the camera with face culling, tested in model space
+						const glm::mat4 & ModelMatrix = scene.transform(object);
+						const glm::vec3 modelCamera = glm::vec3(glm::inverse(ModelMatrix) * glm::vec4(cameraPosition, 1.0f));
+						item.firstRange = (uint32_t)meshletRanges.size();
+						CullMeshlets(lego2.meshlets(), lego2.meshletCount(), ViewProjectionMatrix * ModelMatrix, modelCamera, faceCulling, meshletRanges, &cullStats);
+						item.rangeCount = (uint32_t)meshletRanges.size() - item.firstRange;
+						if (item.rangeCount == 0) {
+							continue;
+						}
+					}
+				}
+				drawItems.push_back(item);
+			}
+		}
 
-#pragma region cube
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, Texture);
-		glUniform1i(TextureID, 0);
+		{
+			PROFILE_SCOPE("Batch build");
+			batcher.build(scene, batchMeshes, materials, drawItems.data(), drawItems.size(), meshletRanges.data());
+			batchStats.add(batcher.stats());
+		}
 
-		// Bind our normal texture in Texture Unit 1
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, normalTexture);
-		// Set our "Normal    TextureSampler" sampler to user Texture Unit 0
-		glUniform1i(normalTextureID, 1);
+		size_t instanceOffset, indirectOffset;
+		{
+			PROFILE_SCOPE("Upload");
+			PROFILE_GPU_SCOPE("Upload");
+			FrameUniforms uniforms;
+			uniforms.view = ViewMatrix;
+			uniforms.viewProjection = ViewProjectionMatrix;
+			uniforms.lightPosition = light.position;
+			uniforms.lightIntensity = light.intensity;
+			uniforms.lightColor = light.color;
+			uniforms.clusterCount[0] = lightClusters.tilesX;
+			uniforms.clusterCount[1] = lightClusters.tilesY;
+			uniforms.clusterCount[2] = lightClusters.slices;
+			uniforms.clusterTileScale = glm::vec2((float)lightClusters.tilesX / width, (float)lightClusters.tilesY / height);
+			uniforms.clusterDepthScaleBias = lightClusters.depthScaleBias();
+
+			// Every write with its worst alignment padding
+			const size_t instanceBytes = batcher.instances().size() * sizeof(InstanceData);
+			const size_t indirectBytes = batcher.commands().size() * sizeof(DrawElementsIndirectCommand);
+			frameRing.begin(sizeof(uniforms) + instanceBytes + indirectBytes + frameRing.uniformAlignment() + 16 + 4);
+			const size_t frameOffset = frameRing.write(&uniforms, sizeof(uniforms), frameRing.uniformAlignment());
+			instanceOffset = frameRing.write(batcher.instances().data(), instanceBytes, 16);
+			indirectOffset = frameRing.write(batcher.commands().data(), indirectBytes, 4);
+			glBindBufferRange(GL_UNIFORM_BUFFER, FrameUniforms::BINDING, frameRing.buffer(), frameOffset, sizeof(uniforms));
+		}
 
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, cube_vertexbuffer);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		{
+			PROFILE_SCOPE("Draw");
+			PROFILE_GPU_SCOPE("Draw");
+
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+			// Batches mix objects at every depth, so they are only sorted by
+			// state, and the queue skips the bindings neighbours share
+			renderQueue.clear();
+			for (const DrawBatch & batch : batcher.batches()) {
+				const bool lego2Buffer = batch.buffer == LEGO2_BUFFER;
+				const VertexFormat & format = lego2Buffer ? lego2_format : cube_format;
+				const ShadingProgram & shading = lego2Buffer ? plainProgram : normalMappedProgram;
+				const bool textured = batch.state == TEXTURED_STATE;
+
+				RenderDraw draw;
+				draw.program = shading.program;
+				draw.vertexBuffer = lego2Buffer ? lego2_vertexbuffer : cube_vertexbuffer;
+				draw.format = &format;
+				draw.instanceBuffer = frameRing.buffer();
+				draw.instanceOffset = instanceOffset;
+				draw.elementBuffer = lego2Buffer ? lego2_elementbuffer : cube_elementbuffer;
+				draw.indexType = lego2Buffer ? lego2.indexType() : cube.indexType();
+				draw.textures[0] = textured ? Texture : 0;
+				draw.textures[1] = textured ? normalTexture : 0;
+				draw.uniforms[0] = {shading.colorTexture, 0};
+				draw.uniforms[1] = {shading.normalTexture, 1};
+				draw.indirectBuffer = frameRing.buffer();
+				draw.indirectOffset = indirectOffset;
+				draw.firstCommand = batch.firstCommand;
+				draw.commandCount = batch.commandCount;
+				renderQueue.push(RenderSortKey(RENDER_PASS_OPAQUE, lego2Buffer ? 0 : 1, batch.state, batch.buffer, 0.0f), draw);
+			}
+			renderQueue.sort();
 
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, cube_uvbuffer);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+			renderState.reset();
+			renderQueue.execute(renderState);
+			renderStats.add(renderState.stats());
+			frameRing.end();
+		}
 
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, cube_normalbuffer);
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		if (headless.enabled) {
+			// CPU time to submit the frame, GPU time to execute it, no vsync in the way
+			const double cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+			glQueryCounter(timerQueries[frame % FrameRing::FRAMES][1], GL_TIMESTAMP);
+			cpuTimes.push_back(cpuMs);
+			if (frame >= FrameRing::FRAMES - 1)
+				readFrameTimes(frame - (FrameRing::FRAMES - 1));
+
+			Image glFrame;
+			if (!headless.output.empty() || rasterizer) {
+				PROFILE_SCOPE("Read frame");
+				glFrame = offscreen->readPixels();
+			}
+			if (!headless.output.empty()) {
+				char name[32];
+				snprintf(name, sizeof(name), "/frame_%04d.bmp", frame);
+				PROFILE_SCOPE("Write frame");
+				SaveBMP((headless.output + name).c_str(), glFrame);
+			}
 
-		glEnableVertexAttribArray(4);
-		glBindBuffer(GL_ARRAY_BUFFER, cube_tangentbuffer);
-		glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+			// The same batches through the software rasterizer
+			if (rasterizer) {
+				PROFILE_SCOPE("Raster");
+				const auto rasterStart = std::chrono::steady_clock::now();
+				rasterizer->clear(clearColor);
+				for (const DrawBatch & batch : batcher.batches()) {
+					const bool lego2Buffer = batch.buffer == LEGO2_BUFFER;
+					RasterDraw draw;
+					const MeshCache& cache = lego2Buffer ? lego2 : cube;
+					draw.vertices = (const unsigned char*)cache.data(MeshCache::VERTICES);
+					draw.format = lego2Buffer ? &lego2_format : &cube_format;
+					draw.indices = cache.data(MeshCache::INDICES);
+					draw.indexType = cache.indexType();
+					draw.commands = batcher.commands().data() + batch.firstCommand;
+					draw.commandCount = batch.commandCount;
+					draw.instances = batcher.instances().data();
+					if (batch.state == TEXTURED_STATE) {
+						draw.colorTexture = rasterTexture.get();
+						draw.normalTexture = rasterNormalTexture.get();
+					}
+					rasterizer->draw(draw);
+				}
+				const RasterUniforms uniforms = {ViewMatrix, ViewProjectionMatrix, light.position, light.color, light.intensity, &lightClusters};
+				rasterizer->render(uniforms);
+				const Image rasterFrame = rasterizer->readPixels();
+				const double rasterMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - rasterStart).count();
+				rasterTimes.push_back(rasterMs);
+
+				const ImageDifference difference = CompareImages(rasterFrame, glFrame, 8);
+				rasterWorstPixels = std::max(rasterWorstPixels, difference.differingPixels);
+				const RasterStats & stats = rasterizer->stats();
+				std::cout << "Raster " << frame << ": " << rasterMs << " ms (front " << stats.frontEndMs << ", back " << stats.backEndMs << "), "
+					<< stats.setupTriangles << "/" << stats.triangles << " triangles, " << stats.fragments << " fragments, "
+					<< 100.0 * difference.differingPixels / ((size_t) width * height) << "% pixels off GL by more than 8, mean error "
+					<< difference.meanError << ", max " << difference.maxError << std::endl;
+
+				if (!headless.output.empty()) {
+					char name[32];
+					snprintf(name, sizeof(name), "/raster_%04d.bmp", frame);
+					SaveBMP((headless.output + name).c_str(), rasterFrame);
+				}
+			}
+			frame++;
+		}
+		else {
+			PROFILE_SCOPE("Swap");
 
-		glEnableVertexAttribArray(5);
-		glBindBuffer(GL_ARRAY_BUFFER, cube_bitangentbuffer);
-		glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+			// Swap buffers
+			glfwSwapBuffers(window);
+			glfwPollEvents();
+		}
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_elementbuffer);
+		Profiler::global().endFrame();
+	}
 
-		// Draw the triangles !
-		glDrawElements(GL_TRIANGLES, indicesCube.size(), GL_UNSIGNED_SHORT, (void*)0);
+	if (!profilePath.empty()) {
+		Profiler::global().flushGpu();
+		Profiler::global().printStats(std::cout);
+		Profiler::global().writeChromeTrace(profilePath.c_str());
+		std::cout << "Trace written to " << profilePath << std::endl;
+	}
 
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-		glDisableVertexAttribArray(2);
-		glDisableVertexAttribArray(4);
-		glDisableVertexAttribArray(5);
-#pragma endregion
+	// Their GL objects go with the context
+	assets.reset();
+	Profiler::global().shutdown();
+
+	if (headless.enabled) {
+		// Timestamps of the last frames still in flight
+		for (int timedFrame = (int)gpuTimes.size(); timedFrame < frame; timedFrame++)
+			readFrameTimes(timedFrame);
+
+		const double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		auto summary = [](const char* name, const std::vector<double>& times) {
+			double sum = 0.0;
+			for (double t : times) sum += t;
+			std::cout << name << " ms: average " << sum / times.size() << ", min " << *std::min_element(times.begin(), times.end())
+				<< ", max " << *std::max_element(times.begin(), times.end()) << std::endl;
+		};
+		std::cout << frame << " frames of " << width << "x" << height << " in " << totalSeconds << " s" << std::endl;
+		summary("CPU", cpuTimes);
+		summary("GPU", gpuTimes);
+		if (rasterizer) {
+			summary("Raster", rasterTimes);
+			std::cout << "Raster worst frame: " << 100.0 * rasterWorstPixels / ((size_t) width * height) << "% pixels off GL" << std::endl;
+		}
+		const FrameRingStats& ring = frameRing.stats();
+		std::cout << "Frame data: peak " << ring.peakFrameBytes << " bytes per frame, " << ring.waits << " fence waits ("
+			<< ring.waitMs << " ms), " << ring.grows << " grows" << std::endl;
 
-		computeMatricesFromInputs(window);
-		glm::mat4 ProjectionMatrix = getProjectionMatrix();
-		glm::mat4 ViewMatrix = getViewMatrix();
-		glm::mat4 ModelMatrix = glm::mat4(1.0);
-		glm::mat3 ModelView3x3Matrix = glm::mat3(ViewMatrix * ModelMatrix); // Take the upper-left part of ModelViewMatrix
-		glm::mat4 mvp = ProjectionMatrix * ViewMatrix * ModelMatrix;
-
-
-		glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &mvp[0][0]);
-		glUniformMatrix4fv(ModelMatrixID, 1, GL_FALSE, &ModelMatrix[0][0]);
-		glUniformMatrix4fv(ViewMatrixID, 1, GL_FALSE, &ViewMatrix[0][0]);
-		glUniformMatrix3fv(ModelView3x3MatrixID, 1, GL_FALSE, &ModelView3x3Matrix[0][0]);
-		glUniform3f(LightPositionID, light.position.x, light.position.y, light.position.z);
-		glUniform3f(LightColorID, light.color.r, light.color.g, light.color.b);
-		glUniform1f(LightIntensityID, light.intensity);
-
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-		glDisableVertexAttribArray(2);
-
-		
-		// Swap buffers
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		glDeleteQueries(2 * FrameRing::FRAMES, &timerQueries[0][0]);
+		offscreen.reset();
+		headlessContext.reset();
+	}
+	else {
+		glfwDestroyWindow(window);
+		glfwTerminate();
 	}
-	glfwDestroyWindow(window);
-	glfwTerminate();
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,100 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path)
+{
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		file = nullptr;
+		throw std::runtime_error("Cannot open file: " + path);
+	}
+
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	length = (size_t) fileSize.QuadPart;
+
+	// Empty files cannot be mapped, they simply have no data
+	if (length == 0)
+	{
+		return;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping)
+	{
+		bytes = (const char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+
+	if (!bytes)
+	{
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		throw std::runtime_error("Cannot map file: " + path);
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (bytes) UnmapViewOfFile(bytes);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Cannot open file: " + path);
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("Cannot stat file: " + path);
+	}
+	length = (size_t) info.st_size;
+
+	// Empty files cannot be mapped, they simply have no data
+	if (length > 0)
+	{
+		void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view == MAP_FAILED)
+		{
+			close(fd);
+			throw std::runtime_error("Cannot map file: " + path);
+		}
+		bytes = (const char*) view;
+
+		// The whole file is going to be read, start paging it in now
+		madvise(view, length, MADV_WILLNEED);
+	}
+
+	// The mapping stays valid once the descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (bytes) munmap((void*) bytes, length);
+}
+
+#endif
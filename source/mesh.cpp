@@ -0,0 +1,135 @@
+#include "mesh.h"
+#include "profiler.h"
+#include "obj.h"
+#include "stl.h"
+#include "tangents.h"
+#include "mesh_optimizer.h"
+#include "meshlets.h"
+#include "simplify.h"
+#include "../vbo_indexer.h"
+
+#include <stdexcept>
+#include <string>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+
+namespace
+{
+	bool isStl(const char * path)
+	{
+		const size_t length = strlen(path);
+		return length >= 4 && path[length - 4] == '.' && tolower(path[length - 3]) == 's' &&
+			tolower(path[length - 2]) == 't' && tolower(path[length - 1]) == 'l';
+	}
+
+	// STL facets carry no UVs and one normal each, with enough noise that no
+	// two facets match: vertices get the average normal of the facets around
+	// them within the crease angle instead, so flat and smooth areas weld
+	void loadSTL(const char * path, std::vector<glm::vec3> & out_vertices, std::vector<glm::vec2> & out_uvs, std::vector<glm::vec3> & out_normals, ThreadPool & pool)
+	{
+		const float CREASE_COS = std::cos(30.0f * 3.14159265f / 180.0f);
+
+		const std::vector<Triangle> triangles = ReadStl(path, nullptr, pool);
+		const size_t cornerCount = triangles.size() * 3;
+
+		out_vertices.resize(cornerCount);
+		for (size_t t = 0; t < triangles.size(); ++t)
+		{
+			out_vertices[t * 3 + 0] = triangles[t].p0;
+			out_vertices[t * 3 + 1] = triangles[t].p1;
+			out_vertices[t * 3 + 2] = triangles[t].p2;
+		}
+		out_uvs.assign(cornerCount, glm::vec2(0.0f));
+		out_normals.assign(cornerCount, glm::vec3(0.0f));
+
+		// Corners sharing a position
+		std::vector<unsigned int> corners;
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec2> uvs;
+		std::vector<glm::vec3> normals;
+		indexVBO(out_vertices, out_uvs, out_normals, corners, positions, uvs, normals);
+
+		std::vector<uint32_t> first(positions.size() + 1, 0);
+		for (unsigned int p : corners) ++first[p + 1];
+		for (size_t p = 0; p < positions.size(); ++p) first[p + 1] += first[p];
+		std::vector<uint32_t> faces(cornerCount);
+		{
+			std::vector<uint32_t> cursor(first.begin(), first.end() - 1);
+			for (size_t c = 0; c < cornerCount; ++c) faces[cursor[corners[c]]++] = (uint32_t)(c / 3);
+		}
+
+		std::vector<glm::vec3> faceNormals(triangles.size());
+		for (size_t t = 0; t < triangles.size(); ++t)
+		{
+			faceNormals[t] = glm::cross(triangles[t].p1 - triangles[t].p0, triangles[t].p2 - triangles[t].p0);
+		}
+
+		pool.parallelFor(cornerCount, [&](size_t c) {
+			const glm::vec3 & own = faceNormals[c / 3];
+			const float ownLength = glm::length(own);
+			glm::vec3 sum(0.0f);
+
+			// Same faces in the same order for every corner of a smoothing group, so their normals are bitwise equal
+			const unsigned int p = corners[c];
+			for (uint32_t i = first[p]; i < first[p + 1]; ++i)
+			{
+				const glm::vec3 & other = faceNormals[faces[i]];
+				if (glm::dot(own, other) >= CREASE_COS * ownLength * glm::length(other))
+				{
+					sum += other;
+				}
+			}
+
+			const float length = glm::length(sum);
+			out_normals[c] = length > 0.0f ? sum / length : glm::vec3(0.0f, 0.0f, 1.0f);
+		});
+	}
+}
+
+Mesh BuildMesh(const char * path, const MeshOptions & options, ThreadPool & pool)
+{
+	PROFILE_SCOPE("BuildMesh");
+	std::vector<glm::vec3> in_vertices;
+	std::vector<glm::vec2> in_uvs;
+	std::vector<glm::vec3> in_normals;
+
+	if (isStl(path))
+	{
+		loadSTL(path, in_vertices, in_uvs, in_normals, pool);
+	}
+	else if (!loadOBJ(path, in_vertices, in_uvs, in_normals, pool))
+	{
+		throw std::runtime_error(std::string("Cannot load mesh: ") + path);
+	}
+
+	for (auto & vertex : in_vertices)
+	{
+		vertex += options.offset;
+	}
+
+	Mesh mesh;
+	if (options.tangents)
+	{
+		// Normal mapped meshes also merge vertices within 0.01, then the
+		// tangents are accumulated on the welded vertices
+		indexVBO_near(in_vertices, in_uvs, in_normals, mesh.indices, mesh.vertices, mesh.uvs, mesh.normals);
+		ComputeTangents(mesh, pool);
+	}
+	else
+	{
+		indexVBO(in_vertices, in_uvs, in_normals, mesh.indices, mesh.vertices, mesh.uvs, mesh.normals);
+	}
+
+	if (options.optimize)
+	{
+		OptimizeMesh(mesh);
+	}
+
+	// Built last, as they are runs of the final triangle order
+	mesh.meshlets = BuildMeshlets(mesh.vertices, mesh.indices, MeshletLimits(), pool);
+
+	BuildLods(mesh, options.lodRatios, pool);
+
+	return mesh;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "thread_pool.h"
+
+// Read-only view of the vertex streams of a mesh, wherever they are stored.
+// tangents and bitangents are null when the mesh has none.
+struct MeshStreams
+{
+	const glm::vec3 * positions = nullptr;
+	const glm::vec2 * uvs = nullptr;
+	const glm::vec3 * normals = nullptr;
+	const glm::vec3 * tangents = nullptr;
+	const glm::vec3 * bitangents = nullptr;
+	size_t vertexCount = 0;
+};
+
+// Run of at most a few dozen triangles of the index buffer, with the bounds
+// used to cull it as a whole
+struct Meshlet
+{
+	glm::vec3 center; // bounding sphere
+	float radius;
+	glm::vec3 coneAxis; // average facing direction
+	float coneCutoff; // sine of the cone half angle, 1 when the cone can't cull
+	uint32_t firstTriangle;
+	uint32_t triangleCount;
+	uint32_t vertexCount;
+	uint32_t padding;
+};
+
+// Level of detail: a range of the index buffer, and how far its surface may
+// stray from the full resolution one
+struct MeshLod
+{
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	float error; // quadric error estimate, in mesh units
+	uint32_t padding;
+};
+
+// Indexed mesh, ready to be uploaded: one entry per welded vertex in each stream
+struct Mesh
+{
+	std::vector<glm::vec3> vertices;
+	std::vector<glm::vec2> uvs;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec3> tangents; // empty unless built with tangents
+	std::vector<glm::vec3> bitangents;
+	std::vector<unsigned int> indices; // every LOD, finest first
+	std::vector<MeshLod> lods; // at least the full resolution one
+	std::vector<Meshlet> meshlets; // cover the first LOD in order
+
+	MeshStreams streams() const
+	{
+		MeshStreams view;
+		view.positions = vertices.data();
+		view.uvs = uvs.data();
+		view.normals = normals.data();
+		view.tangents = tangents.empty() ? nullptr : tangents.data();
+		view.bitangents = bitangents.empty() ? nullptr : bitangents.data();
+		view.vertexCount = vertices.size();
+		return view;
+	}
+};
+
+// How BuildMesh turns an OBJ file into a Mesh
+struct MeshOptions
+{
+	bool tangents = false; // compute a tangent basis for normal mapping
+	glm::vec3 offset = glm::vec3(0.0f); // added to every position
+	bool optimize = true; // reorder triangles and vertices for the GPU caches
+	std::vector<float> lodRatios; // triangle ratio of each simplified LOD, decreasing
+};
+
+// Loads, welds and optionally computes tangents for an OBJ or STL file, then
+// reorders it for the vertex caches unless options.optimize is false, splits
+// it in meshlets and appends its LODs. Its parallel loops run on pool.
+// Throws std::runtime_error if the file can't be loaded.
+Mesh BuildMesh(const char * path, const MeshOptions & options, ThreadPool & pool = ThreadPool::global());
+
@@ -0,0 +1,347 @@
+#include "mesh_cache.h"
+#include "profiler.h"
+#include "hash.h"
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+namespace
+{
+	const char MAGIC[8] = {'G', 'G', 'L', 'M', 'E', 'S', 'H', '\0'};
+
+	// Bump when the layout or the processing done by BuildMesh or
+	// InterleaveVertices changes
+	const uint32_t VERSION = 7;
+
+	const size_t ALIGNMENT = 16;
+
+	struct StreamEntry
+	{
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t indexSize; // 2 or 4 bytes
+		uint64_t sourceHash;
+		uint64_t optionsHash;
+		uint64_t layoutHash;
+		uint64_t vertexCount;
+		uint64_t vertexStride;
+		uint64_t indexCount;
+		uint64_t meshletCount;
+		uint64_t lodCount;
+		StreamEntry streams[MeshCache::STREAM_COUNT];
+	};
+
+	size_t alignUp(size_t value)
+	{
+		return (value + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	}
+
+	const Header & headerOf(const char * bytes)
+	{
+		return *(const Header *) bytes;
+	}
+}
+
+MeshCache::MeshCache(const std::string & path)
+	: file(new MappedFile(path))
+{
+	bytes = file->data();
+	length = file->size();
+	validate(path);
+}
+
+MeshCache::MeshCache(std::vector<char> data)
+	: memory(std::move(data))
+{
+	bytes = memory.data();
+	length = memory.size();
+	validate("mesh in memory");
+}
+
+void MeshCache::validate(const std::string & name)
+{
+	if (length < sizeof(Header) || memcmp(headerOf(bytes).magic, MAGIC, sizeof(MAGIC)) != 0)
+	{
+		throw std::runtime_error("Not a mesh cache: " + name);
+	}
+
+	const Header & header = headerOf(bytes);
+	if (header.version != VERSION)
+	{
+		throw std::runtime_error("Outdated mesh cache: " + name);
+	}
+
+	const uint64_t expected[STREAM_COUNT] = {
+		header.vertexCount * sizeof(glm::vec3),
+		header.vertexCount * sizeof(glm::vec2),
+		header.vertexCount * sizeof(glm::vec3),
+		header.vertexCount * sizeof(glm::vec3),
+		header.vertexCount * sizeof(glm::vec3),
+		header.indexCount * header.indexSize,
+		header.meshletCount * sizeof(Meshlet),
+		header.lodCount * sizeof(MeshLod),
+		header.vertexCount * header.vertexStride,
+	};
+
+	for (int i = 0; i < STREAM_COUNT; ++i)
+	{
+		const StreamEntry & stream = header.streams[i];
+		const bool optional = i == TANGENTS || i == BITANGENTS;
+		if ((stream.size != expected[i] && !(optional && stream.size == 0)) ||
+			stream.offset % ALIGNMENT != 0 || stream.offset > length || stream.size > length - stream.offset)
+		{
+			throw std::runtime_error("Corrupted mesh cache: " + name);
+		}
+	}
+}
+
+uint64_t MeshCache::sourceHash() const { return headerOf(bytes).sourceHash; }
+uint64_t MeshCache::optionsHash() const { return headerOf(bytes).optionsHash; }
+uint64_t MeshCache::layoutHash() const { return headerOf(bytes).layoutHash; }
+size_t MeshCache::vertexCount() const { return (size_t) headerOf(bytes).vertexCount; }
+size_t MeshCache::vertexStride() const { return (size_t) headerOf(bytes).vertexStride; }
+size_t MeshCache::indexCount() const { return (size_t) headerOf(bytes).indexCount; }
+size_t MeshCache::meshletCount() const { return (size_t) headerOf(bytes).meshletCount; }
+size_t MeshCache::lodCount() const { return (size_t) headerOf(bytes).lodCount; }
+
+GLenum MeshCache::indexType() const
+{
+	return headerOf(bytes).indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+const void * MeshCache::data(Stream stream) const
+{
+	return bytes + headerOf(bytes).streams[stream].offset;
+}
+
+size_t MeshCache::size(Stream stream) const
+{
+	return (size_t) headerOf(bytes).streams[stream].size;
+}
+
+MeshStreams MeshCache::streams() const
+{
+	MeshStreams view;
+	view.positions = (const glm::vec3 *) data(POSITIONS);
+	view.uvs = (const glm::vec2 *) data(UVS);
+	view.normals = (const glm::vec3 *) data(NORMALS);
+	view.tangents = has(TANGENTS) ? (const glm::vec3 *) data(TANGENTS) : nullptr;
+	view.bitangents = has(BITANGENTS) ? (const glm::vec3 *) data(BITANGENTS) : nullptr;
+	view.vertexCount = vertexCount();
+	return view;
+}
+
+Mesh MeshCache::toMesh() const
+{
+	auto copy = [this](Stream stream, auto & out) {
+		out.resize(size(stream) / sizeof(out[0]));
+		memcpy(out.data(), data(stream), size(stream));
+	};
+
+	Mesh mesh;
+	copy(POSITIONS, mesh.vertices);
+	copy(UVS, mesh.uvs);
+	copy(NORMALS, mesh.normals);
+	copy(TANGENTS, mesh.tangents);
+	copy(BITANGENTS, mesh.bitangents);
+	copy(MESHLETS, mesh.meshlets);
+	copy(LODS, mesh.lods);
+
+	if (indexType() == GL_UNSIGNED_SHORT)
+	{
+		const unsigned short * indices = (const unsigned short *) data(INDICES);
+		mesh.indices.assign(indices, indices + indexCount());
+	}
+	else
+	{
+		copy(INDICES, mesh.indices);
+	}
+	return mesh;
+}
+
+std::vector<unsigned int> MeshCache::lodIndices(size_t lod) const
+{
+	const MeshLod & level = lods()[lod];
+	if (indexType() == GL_UNSIGNED_SHORT)
+	{
+		const unsigned short * indices = (const unsigned short *) data(INDICES) + level.firstIndex;
+		return std::vector<unsigned int>(indices, indices + level.indexCount);
+	}
+
+	const unsigned int * indices = (const unsigned int *) data(INDICES) + level.firstIndex;
+	return std::vector<unsigned int>(indices, indices + level.indexCount);
+}
+
+std::vector<char> SerializeMesh(const Mesh & mesh, const VertexLayout & layout, uint64_t sourceHash, uint64_t optionsHash, ThreadPool & pool)
+{
+	const bool narrow = mesh.vertices.size() <= 0xFFFF;
+	const VertexFormat format = MakeVertexFormat(layout);
+	const std::vector<unsigned char> vertices = InterleaveVertices(mesh.streams(), format, pool);
+
+	Header header = {};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.indexSize = narrow ? 2 : 4;
+	header.sourceHash = sourceHash;
+	header.optionsHash = optionsHash;
+	header.layoutHash = HashVertexLayout(layout);
+	header.vertexCount = mesh.vertices.size();
+	header.vertexStride = format.stride;
+	header.indexCount = mesh.indices.size();
+	header.meshletCount = mesh.meshlets.size();
+	header.lodCount = mesh.lods.size();
+
+	const size_t sizes[MeshCache::STREAM_COUNT] = {
+		mesh.vertices.size() * sizeof(glm::vec3),
+		mesh.uvs.size() * sizeof(glm::vec2),
+		mesh.normals.size() * sizeof(glm::vec3),
+		mesh.tangents.size() * sizeof(glm::vec3),
+		mesh.bitangents.size() * sizeof(glm::vec3),
+		mesh.indices.size() * header.indexSize,
+		mesh.meshlets.size() * sizeof(Meshlet),
+		mesh.lods.size() * sizeof(MeshLod),
+		vertices.size(),
+	};
+
+	size_t offset = alignUp(sizeof(Header));
+	for (int i = 0; i < MeshCache::STREAM_COUNT; ++i)
+	{
+		header.streams[i].offset = offset;
+		header.streams[i].size = sizes[i];
+		offset = alignUp(offset + sizes[i]);
+	}
+
+	std::vector<char> bytes(offset, 0);
+	memcpy(bytes.data(), &header, sizeof(Header));
+
+	const void * sources[MeshCache::STREAM_COUNT] = {
+		mesh.vertices.data(), mesh.uvs.data(), mesh.normals.data(),
+		mesh.tangents.data(), mesh.bitangents.data(), mesh.indices.data(),
+		mesh.meshlets.data(), mesh.lods.data(), vertices.data(),
+	};
+	for (int i = 0; i < MeshCache::STREAM_COUNT; ++i)
+	{
+		// Indices are written below, narrowed if needed
+		if (i != MeshCache::INDICES && sizes[i]) memcpy(bytes.data() + header.streams[i].offset, sources[i], sizes[i]);
+	}
+
+	char * indices = bytes.data() + header.streams[MeshCache::INDICES].offset;
+	if (narrow)
+	{
+		for (size_t i = 0; i < mesh.indices.size(); ++i)
+		{
+			const unsigned short index = (unsigned short) mesh.indices[i];
+			memcpy(indices + i * 2, &index, 2);
+		}
+	}
+	else if (sizes[MeshCache::INDICES])
+	{
+		memcpy(indices, mesh.indices.data(), sizes[MeshCache::INDICES]);
+	}
+
+	return bytes;
+}
+
+void SaveMeshCache(const std::string & path, const Mesh & mesh, const VertexLayout & layout, uint64_t sourceHash, uint64_t optionsHash, ThreadPool & pool)
+{
+	PROFILE_SCOPE("SaveMeshCache");
+	const std::vector<char> bytes = SerializeMesh(mesh, layout, sourceHash, optionsHash, pool);
+
+	// Write next to the target then rename, so a crash never leaves half a cache behind
+	const std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write(bytes.data(), bytes.size());
+		if (!out.good())
+		{
+			throw std::runtime_error("Cannot write mesh cache: " + path);
+		}
+	}
+
+	std::remove(path.c_str());
+	if (std::rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		std::remove(temporary.c_str());
+		throw std::runtime_error("Cannot write mesh cache: " + path);
+	}
+}
+
+uint64_t HashMeshOptions(const MeshOptions & options)
+{
+	const float values[5] = {options.tangents ? 1.0f : 0.0f, options.offset.x, options.offset.y, options.offset.z, options.optimize ? 1.0f : 0.0f};
+	return HashBytes(options.lodRatios.data(), options.lodRatios.size() * sizeof(float), HashBytes(values, sizeof(values), VERSION));
+}
+
+uint64_t HashVertexLayout(const VertexLayout & layout)
+{
+	const uint32_t values[4] = {layout.uvs ? 1u : 0u, layout.halfUVs ? 1u : 0u, (uint32_t) layout.normals, layout.tangents ? 1u : 0u};
+	return HashBytes(values, sizeof(values), VERSION);
+}
+
+std::string MeshCachePath(const char * objPath, const MeshOptions & options, const VertexLayout & layout)
+{
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".%08x.%08x.meshcache", (unsigned) HashMeshOptions(options), (unsigned) HashVertexLayout(layout));
+	return objPath + std::string(suffix);
+}
+
+MeshCache LoadMeshCached(const char * objPath, const MeshOptions & options, const VertexLayout & layout, ThreadPool & pool)
+{
+	PROFILE_SCOPE("LoadMeshCached");
+	const std::string cachePath = MeshCachePath(objPath, options, layout);
+	const uint64_t optionsHash = HashMeshOptions(options);
+	const uint64_t layoutHash = HashVertexLayout(layout);
+
+	uint64_t sourceHash = 0;
+	bool haveSource = true;
+	try
+	{
+		sourceHash = HashFile(objPath, pool);
+	}
+	catch (const std::exception &)
+	{
+		// Caches can be shipped without their source
+		haveSource = false;
+	}
+
+	try
+	{
+		MeshCache cache(cachePath);
+		if ((!haveSource || cache.sourceHash() == sourceHash) && cache.optionsHash() == optionsHash && cache.layoutHash() == layoutHash)
+		{
+			return cache;
+		}
+	}
+	catch (const std::exception &)
+	{
+		// Missing, outdated or corrupted: rebuilt below
+	}
+
+	if (!haveSource)
+	{
+		throw std::runtime_error(std::string("Cannot load mesh: ") + objPath);
+	}
+
+	std::cout << "Building mesh cache " << cachePath << std::endl;
+	const Mesh mesh = BuildMesh(objPath, options, pool);
+
+	try
+	{
+		SaveMeshCache(cachePath, mesh, layout, sourceHash, optionsHash, pool);
+		return MeshCache(cachePath);
+	}
+	catch (const std::exception & e)
+	{
+		std::cerr << e.what() << std::endl;
+		return MeshCache(SerializeMesh(mesh, layout, sourceHash, optionsHash, pool));
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "mesh.h"
+#include "mapped_file.h"
+#include "vertex_format.h"
+
+// Preprocessed mesh: the final streams of a Mesh, 16-byte aligned so they
+// can be given to glBufferData straight from the mapped file. VERTICES is
+// the interleaved vertex buffer of one VertexLayout, the float streams are
+// kept for the CPU side.
+class MeshCache
+{
+public:
+	enum Stream { POSITIONS, UVS, NORMALS, TANGENTS, BITANGENTS, INDICES, MESHLETS, LODS, VERTICES, STREAM_COUNT };
+
+	// Maps a cache file, throws std::runtime_error if it is missing or not valid
+	explicit MeshCache(const std::string & path);
+
+	// Reads a cache held in memory
+	explicit MeshCache(std::vector<char> bytes);
+
+	uint64_t sourceHash() const;
+	uint64_t optionsHash() const;
+	uint64_t layoutHash() const;
+
+	size_t vertexCount() const;
+	size_t vertexStride() const; // of VERTICES
+	size_t indexCount() const;
+	GLenum indexType() const;
+
+	size_t meshletCount() const;
+	const Meshlet * meshlets() const { return (const Meshlet *) data(MESHLETS); }
+
+	size_t lodCount() const;
+	const MeshLod * lods() const { return (const MeshLod *) data(LODS); }
+
+	// Copies the indices of a LOD, widened to 32 bits
+	std::vector<unsigned int> lodIndices(size_t lod) const;
+
+	const void * data(Stream stream) const;
+	size_t size(Stream stream) const;
+	bool has(Stream stream) const { return size(stream) > 0; }
+
+	// Points at the vertex streams without copying them
+	MeshStreams streams() const;
+
+	// Copies the streams back into a Mesh
+	Mesh toMesh() const;
+
+private:
+	void validate(const std::string & name);
+
+	std::unique_ptr<MappedFile> file;
+	std::vector<char> memory;
+	const char * bytes = nullptr;
+	size_t length = 0;
+};
+
+// Serializes mesh with its vertices interleaved in layout, narrowing the
+// indices to 16 bits when they fit
+std::vector<char> SerializeMesh(const Mesh & mesh, const VertexLayout & layout, uint64_t sourceHash, uint64_t optionsHash,
+	ThreadPool & pool = ThreadPool::global());
+
+// Writes the serialized mesh to path, throws std::runtime_error on failure
+void SaveMeshCache(const std::string & path, const Mesh & mesh, const VertexLayout & layout, uint64_t sourceHash, uint64_t optionsHash,
+	ThreadPool & pool = ThreadPool::global());
+
+uint64_t HashMeshOptions(const MeshOptions & options);
+uint64_t HashVertexLayout(const VertexLayout & layout);
+
+// Cache file of an OBJ file built with options for layout:
+// "<objPath>.<options hash>.<layout hash>.meshcache"
+std::string MeshCachePath(const char * objPath, const MeshOptions & options, const VertexLayout & layout);
+
+// Returns the cached mesh of objPath, and rebuilds the cache file first if the
+// OBJ file, the options or the layout changed since it was written, with
+// the parallel loops on pool.
+// Throws std::runtime_error if neither the cache nor the OBJ file can be read.
+MeshCache LoadMeshCached(const char * objPath, const MeshOptions & options, const VertexLayout & layout,
+	ThreadPool & pool = ThreadPool::global());
@@ -0,0 +1,288 @@
+#include "mesh_optimizer.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdint>
+
+VertexCacheStats AnalyzeVertexCache(const std::vector<unsigned int> & indices, size_t vertexCount, unsigned cacheSize)
+{
+	// A vertex is in the FIFO while fewer than cacheSize misses happened since it was inserted
+	std::vector<size_t> insertedAt(vertexCount, 0);
+	std::vector<bool> cached(vertexCount, false);
+
+	VertexCacheStats stats;
+	for (unsigned int index : indices)
+	{
+		if (!cached[index] || stats.transformed - insertedAt[index] >= cacheSize)
+		{
+			cached[index] = true;
+			insertedAt[index] = stats.transformed;
+			++stats.transformed;
+		}
+	}
+
+	const size_t triangles = indices.size() / 3;
+	stats.acmr = triangles ? (float) stats.transformed / triangles : 0.0f;
+	stats.atvr = vertexCount ? (float) stats.transformed / vertexCount : 0.0f;
+	return stats;
+}
+
+void OptimizeVertexCache(std::vector<unsigned int> & indices, size_t vertexCount, unsigned cacheSize, std::vector<size_t> * clusters)
+{
+	const size_t triangleCount = indices.size() / 3;
+	if (clusters)
+	{
+		clusters->clear();
+	}
+	if (triangleCount == 0)
+	{
+		return;
+	}
+
+	// Vertex to triangles adjacency, in CSR form
+	std::vector<uint32_t> live(vertexCount, 0);
+	for (unsigned int index : indices)
+	{
+		++live[index];
+	}
+
+	std::vector<size_t> firstTriangle(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		firstTriangle[v + 1] = firstTriangle[v] + live[v];
+	}
+
+	std::vector<uint32_t> adjacency(indices.size());
+	std::vector<size_t> cursor(firstTriangle.begin(), firstTriangle.end() - 1);
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		adjacency[cursor[indices[i]]++] = (uint32_t)(i / 3);
+	}
+
+	std::vector<size_t> cacheTime(vertexCount, 0);
+	std::vector<bool> emitted(triangleCount, false);
+	std::vector<unsigned int> deadEnds;
+	std::vector<unsigned int> candidates;
+	std::vector<unsigned int> output;
+	output.reserve(indices.size());
+
+	size_t time = cacheSize + 1;
+	size_t nextVertex = 0; // scan position for dead ends
+	size_t fanning = indices[0];
+
+	if (clusters)
+	{
+		clusters->push_back(0);
+	}
+
+	while (true)
+	{
+		// Emit every remaining triangle around the fanning vertex
+		candidates.clear();
+		for (size_t a = firstTriangle[fanning]; a < firstTriangle[fanning + 1]; ++a)
+		{
+			const uint32_t triangle = adjacency[a];
+			if (emitted[triangle])
+			{
+				continue;
+			}
+
+			for (int k = 0; k < 3; ++k)
+			{
+				const unsigned int v = indices[triangle * 3 + k];
+				output.push_back(v);
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				--live[v];
+				if (time - cacheTime[v] > cacheSize)
+				{
+					cacheTime[v] = time++;
+				}
+			}
+			emitted[triangle] = true;
+		}
+
+		// Prefer the candidate still in cache whose fan is the oldest
+		long best = -1;
+		long bestPriority = -1;
+		for (unsigned int v : candidates)
+		{
+			if (live[v] == 0)
+			{
+				continue;
+			}
+
+			long priority = 0;
+			if (time - cacheTime[v] + 2 * live[v] <= cacheSize)
+			{
+				priority = (long)(time - cacheTime[v]);
+			}
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				best = v;
+			}
+		}
+
+		if (best < 0)
+		{
+			// Dead end: go back to a recently used vertex, or scan for any live one
+			while (!deadEnds.empty() && best < 0)
+			{
+				const unsigned int v = deadEnds.back();
+				deadEnds.pop_back();
+				if (live[v] > 0)
+				{
+					best = v;
+				}
+			}
+			while (best < 0 && nextVertex < vertexCount)
+			{
+				if (live[nextVertex] > 0)
+				{
+					best = (long) nextVertex;
+				}
+				++nextVertex;
+			}
+			if (best < 0)
+			{
+				break;
+			}
+
+			if (clusters && output.size() / 3 > clusters->back())
+			{
+				clusters->push_back(output.size() / 3);
+			}
+		}
+
+		fanning = (size_t) best;
+	}
+
+	indices.swap(output);
+}
+
+void OptimizeOverdraw(std::vector<unsigned int> & indices, const std::vector<glm::vec3> & positions, const std::vector<size_t> & clusters)
+{
+	const size_t triangleCount = indices.size() / 3;
+	if (clusters.size() < 2)
+	{
+		return;
+	}
+
+	struct Cluster
+	{
+		size_t begin, end;
+		glm::vec3 centroid;
+		glm::vec3 normal;
+		float score;
+	};
+
+	std::vector<Cluster> sorted(clusters.size());
+	glm::vec3 meshCentroid(0.0f);
+	float meshArea = 0.0f;
+
+	for (size_t c = 0; c < clusters.size(); ++c)
+	{
+		Cluster & cluster = sorted[c];
+		cluster.begin = clusters[c];
+		cluster.end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+		cluster.centroid = glm::vec3(0.0f);
+		cluster.normal = glm::vec3(0.0f);
+
+		// Area weighted centroid and normal
+		float area = 0.0f;
+		for (size_t t = cluster.begin; t < cluster.end; ++t)
+		{
+			const glm::vec3 & p0 = positions[indices[t * 3 + 0]];
+			const glm::vec3 & p1 = positions[indices[t * 3 + 1]];
+			const glm::vec3 & p2 = positions[indices[t * 3 + 2]];
+			const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+			const float a = glm::length(n);
+			cluster.centroid += (p0 + p1 + p2) * (a / 3.0f);
+			cluster.normal += n;
+			area += a;
+		}
+
+		meshCentroid += cluster.centroid;
+		meshArea += area;
+		if (area > 0.0f)
+		{
+			cluster.centroid /= area;
+		}
+	}
+
+	if (meshArea > 0.0f)
+	{
+		meshCentroid /= meshArea;
+	}
+
+	for (auto & cluster : sorted)
+	{
+		const float length = glm::length(cluster.normal);
+		cluster.score = length > 0.0f ? glm::dot(cluster.centroid - meshCentroid, cluster.normal / length) : 0.0f;
+	}
+
+	std::stable_sort(sorted.begin(), sorted.end(), [](const Cluster & a, const Cluster & b) {
+		return a.score > b.score;
+	});
+
+	std::vector<unsigned int> output;
+	output.reserve(indices.size());
+	for (const auto & cluster : sorted)
+	{
+		output.insert(output.end(), indices.begin() + cluster.begin * 3, indices.begin() + cluster.end * 3);
+	}
+	indices.swap(output);
+}
+
+void OptimizeVertexFetch(Mesh & mesh)
+{
+	const size_t vertexCount = mesh.vertices.size();
+	const unsigned int UNUSED = 0xFFFFFFFF;
+
+	std::vector<unsigned int> remap(vertexCount, UNUSED);
+	unsigned int next = 0;
+	for (auto & index : mesh.indices)
+	{
+		if (remap[index] == UNUSED)
+		{
+			remap[index] = next++;
+		}
+		index = remap[index];
+	}
+	for (auto & target : remap)
+	{
+		if (target == UNUSED)
+		{
+			target = next++;
+		}
+	}
+
+	auto reorder = [&remap](auto & stream) {
+		if (stream.empty())
+		{
+			return;
+		}
+		std::remove_reference_t<decltype(stream)> sorted(stream.size());
+		for (size_t v = 0; v < stream.size(); ++v)
+		{
+			sorted[remap[v]] = stream[v];
+		}
+		stream.swap(sorted);
+	};
+
+	reorder(mesh.vertices);
+	reorder(mesh.uvs);
+	reorder(mesh.normals);
+	reorder(mesh.tangents);
+	reorder(mesh.bitangents);
+}
+
+void OptimizeMesh(Mesh & mesh, unsigned cacheSize)
+{
+	PROFILE_SCOPE("OptimizeMesh");
+	std::vector<size_t> clusters;
+	OptimizeVertexCache(mesh.indices, mesh.vertices.size(), cacheSize, &clusters);
+	OptimizeOverdraw(mesh.indices, mesh.vertices, clusters);
+	OptimizeVertexFetch(mesh);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+
+// Post-transform vertex cache behaviour of an index buffer, simulated with a FIFO cache
+struct VertexCacheStats
+{
+	size_t transformed = 0; // vertex shader invocations
+	float acmr = 0.0f; // average cache miss ratio: transformed vertices per triangle, 0.5 at best
+	float atvr = 0.0f; // average transformed to vertex ratio: 1 at best
+};
+
+VertexCacheStats AnalyzeVertexCache(const std::vector<unsigned int> & indices, size_t vertexCount, unsigned cacheSize = 16);
+
+// Reorders the triangles for post-transform cache locality (Tipsify, Sander et al. 2007).
+// When clusters is given, it receives the first triangle of every run that
+// starts after a dead end, which OptimizeOverdraw can then reorder freely.
+void OptimizeVertexCache(std::vector<unsigned int> & indices, size_t vertexCount, unsigned cacheSize = 16, std::vector<size_t> * clusters = nullptr);
+
+// Sorts the clusters of OptimizeVertexCache so the ones facing outwards are
+// drawn first, which lets the depth test reject more of the hidden fragments
+void OptimizeOverdraw(std::vector<unsigned int> & indices, const std::vector<glm::vec3> & positions, const std::vector<size_t> & clusters);
+
+// Renumbers the vertices in the order the indices first reference them, so
+// vertex fetches walk memory forward. Unreferenced vertices move to the end.
+void OptimizeVertexFetch(Mesh & mesh);
+
+// Runs the three passes above
+void OptimizeMesh(Mesh & mesh, unsigned cacheSize = 16);
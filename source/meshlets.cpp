@@ -0,0 +1,199 @@
+#include "meshlets.h"
+#include "profiler.h"
+#include "frustum.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	void computeBounds(Meshlet & meshlet, const std::vector<glm::vec3> & positions, const std::vector<unsigned int> & indices)
+	{
+		const size_t begin = (size_t) meshlet.firstTriangle * 3;
+		const size_t end = begin + (size_t) meshlet.triangleCount * 3;
+
+		// Sphere around the box center, tight enough for meshlets
+		glm::vec3 low(positions[indices[begin]]);
+		glm::vec3 high(low);
+		for (size_t i = begin; i < end; ++i)
+		{
+			low = glm::min(low, positions[indices[i]]);
+			high = glm::max(high, positions[indices[i]]);
+		}
+
+		meshlet.center = (low + high) * 0.5f;
+		float radius2 = 0.0f;
+		for (size_t i = begin; i < end; ++i)
+		{
+			const glm::vec3 d = positions[indices[i]] - meshlet.center;
+			radius2 = std::max(radius2, glm::dot(d, d));
+		}
+		meshlet.radius = std::sqrt(radius2);
+
+		// The cone holds the normal of every triangle
+		std::vector<glm::vec3> normals;
+		normals.reserve(meshlet.triangleCount);
+		glm::vec3 axis(0.0f);
+		for (size_t i = begin; i < end; i += 3)
+		{
+			const glm::vec3 & p0 = positions[indices[i]];
+			const glm::vec3 n = glm::cross(positions[indices[i + 1]] - p0, positions[indices[i + 2]] - p0);
+			const float length = glm::length(n);
+			if (length > 0.0f)
+			{
+				normals.push_back(n / length);
+				axis += n / length;
+			}
+		}
+
+		meshlet.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+		meshlet.coneCutoff = 1.0f;
+
+		const float axisLength = glm::length(axis);
+		if (axisLength == 0.0f)
+		{
+			return;
+		}
+		axis /= axisLength;
+		meshlet.coneAxis = axis;
+
+		float minDot = 1.0f;
+		for (const auto & n : normals)
+		{
+			minDot = std::min(minDot, glm::dot(n, axis));
+		}
+
+		// Wider than about 84 degrees, the cone culls too rarely to be worth testing
+		if (minDot > 0.1f)
+		{
+			meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+		}
+	}
+}
+
+std::vector<Meshlet> BuildMeshlets(const std::vector<glm::vec3> & positions, const std::vector<unsigned int> & indices,
+	const MeshletLimits & limits, ThreadPool & pool)
+{
+	PROFILE_SCOPE("BuildMeshlets");
+	const size_t triangleCount = indices.size() / 3;
+	const uint32_t NONE = 0xFFFFFFFF;
+
+	std::vector<Meshlet> meshlets;
+	std::vector<uint32_t> owner(positions.size(), NONE); // last meshlet that used each vertex
+
+	Meshlet current = {};
+	glm::vec3 normalSum(0.0f);
+
+	auto close = [&]() {
+		if (current.triangleCount > 0)
+		{
+			meshlets.push_back(current);
+		}
+		current = {};
+		current.firstTriangle = (uint32_t)(meshlets.size() ? meshlets.back().firstTriangle + meshlets.back().triangleCount : 0);
+		normalSum = glm::vec3(0.0f);
+	};
+
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		const unsigned int * triangle = &indices[t * 3];
+		const uint32_t id = (uint32_t) meshlets.size();
+
+		size_t newVertices = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			// A repeated index in a degenerate triangle is counted twice, which only closes a meshlet early
+			newVertices += owner[triangle[k]] != id;
+		}
+
+		const glm::vec3 & p0 = positions[triangle[0]];
+		glm::vec3 normal = glm::cross(positions[triangle[1]] - p0, positions[triangle[2]] - p0);
+		const float length = glm::length(normal);
+		normal = length > 0.0f ? normal / length : glm::vec3(0.0f);
+
+		const float sumLength = glm::length(normalSum);
+		const bool divergent = current.triangleCount >= limits.minTrianglesToSplit && length > 0.0f && sumLength > 0.0f &&
+			glm::dot(normal, normalSum / sumLength) < limits.minNormalDot;
+
+		if (current.triangleCount > 0 &&
+			(current.vertexCount + newVertices > limits.maxVertices || current.triangleCount + 1 > limits.maxTriangles || divergent))
+		{
+			close();
+		}
+
+		const uint32_t meshlet = (uint32_t) meshlets.size();
+		for (int k = 0; k < 3; ++k)
+		{
+			if (owner[triangle[k]] != meshlet)
+			{
+				owner[triangle[k]] = meshlet;
+				++current.vertexCount;
+			}
+		}
+		++current.triangleCount;
+		normalSum += normal;
+	}
+	close();
+
+	pool.parallelFor(meshlets.size(), [&](size_t i) {
+		computeBounds(meshlets[i], positions, indices);
+	});
+
+	return meshlets;
+}
+
+void MeshletCullStats::add(const MeshletCullStats & other)
+{
+	meshlets += other.meshlets;
+	visibleMeshlets += other.visibleMeshlets;
+	triangles += other.triangles;
+	backfaceTriangles += other.backfaceTriangles;
+	frustumTriangles += other.frustumTriangles;
+}
+
+void CullMeshlets(const Meshlet * meshlets, size_t count, const glm::mat4 & modelViewProjection, const glm::vec3 & cameraPosition,
+	bool coneCulling, std::vector<TriangleRange> & visible, MeshletCullStats * stats)
+{
+	const Frustum frustum = ExtractFrustum(modelViewProjection);
+
+	MeshletCullStats local;
+	local.meshlets = count;
+
+	// Ranges already in visible may come from another object, they are left alone
+	const size_t firstRange = visible.size();
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Meshlet & meshlet = meshlets[i];
+		local.triangles += meshlet.triangleCount;
+
+		// Every triangle faces away when the eye is behind the cone, sphere included
+		const glm::vec3 toCenter = meshlet.center - cameraPosition;
+		if (coneCulling && glm::dot(toCenter, meshlet.coneAxis) >= meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius)
+		{
+			local.backfaceTriangles += meshlet.triangleCount;
+			continue;
+		}
+
+		if (!SphereInFrustum(frustum, meshlet.center, meshlet.radius))
+		{
+			local.frustumTriangles += meshlet.triangleCount;
+			continue;
+		}
+
+		++local.visibleMeshlets;
+		if (visible.size() > firstRange && visible.back().firstTriangle + visible.back().triangleCount == meshlet.firstTriangle)
+		{
+			visible.back().triangleCount += meshlet.triangleCount;
+		}
+		else
+		{
+			visible.push_back({meshlet.firstTriangle, meshlet.triangleCount});
+		}
+	}
+
+	if (stats)
+	{
+		stats->add(local);
+	}
+}
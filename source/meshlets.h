@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "thread_pool.h"
+
+struct MeshletLimits
+{
+	size_t maxVertices = 64;
+	size_t maxTriangles = 124;
+	// A meshlet of at least minTrianglesToSplit triangles is closed early when a
+	// triangle faces further than minNormalDot (cosine) from its average
+	// normal, which would make its cone useless
+	float minNormalDot = 0.0f;
+	size_t minTrianglesToSplit = 8;
+};
+
+// Splits the triangles in runs of consecutive triangles within limits, and
+// computes the bounding sphere and normal cone of each in parallel.
+// Works best on an index buffer already ordered for the vertex cache.
+std::vector<Meshlet> BuildMeshlets(const std::vector<glm::vec3> & positions, const std::vector<unsigned int> & indices,
+	const MeshletLimits & limits = MeshletLimits(), ThreadPool & pool = ThreadPool::global());
+
+// Triangles [firstTriangle, firstTriangle + triangleCount) of the index buffer
+struct TriangleRange
+{
+	uint32_t firstTriangle;
+	uint32_t triangleCount;
+};
+
+struct MeshletCullStats
+{
+	size_t meshlets = 0;
+	size_t visibleMeshlets = 0;
+	size_t triangles = 0;
+	size_t backfaceTriangles = 0; // rejected by the normal cone
+	size_t frustumTriangles = 0; // rejected by the bounding sphere
+
+	size_t rejectedTriangles() const { return backfaceTriangles + frustumTriangles; }
+	void add(const MeshletCullStats & other);
+};
+
+// Appends the triangle ranges of the meshlets that may be visible to visible,
+// merging neighbours found by this call. cameraPosition is in model space, modelViewProjection
+// takes model space to clip space. The normal cone test only holds when back
+// faces are culled too, coneCulling should follow GL_CULL_FACE.
+void CullMeshlets(const Meshlet * meshlets, size_t count, const glm::mat4 & modelViewProjection, const glm::vec3 & cameraPosition,
+	bool coneCulling, std::vector<TriangleRange> & visible, MeshletCullStats * stats = nullptr);
@@ -0,0 +1,314 @@
+#include "obj.h"
+#include "profiler.h"
+#include "mapped_file.h"
+#include "parse_utils.h"
+
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <climits>
+#include <algorithm>
+
+namespace
+{
+	const int32_t NO_INDEX = INT32_MIN;
+
+	// One triangle corner. Indices are 0-based, and those flagged relative
+	// still need the number of attributes declared in the previous chunks.
+	struct Corner
+	{
+		int32_t index[3]; // position, uv, normal
+		uint8_t relative;
+	};
+
+	// Everything declared between two line aligned offsets of the file
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec2> uvs;
+		std::vector<glm::vec3> normals;
+		std::vector<Corner> corners; // three per triangle
+
+		size_t offset[3] = {0, 0, 0}; // attributes declared before this chunk
+		std::string error;
+	};
+
+	// Turns a 1-based or negative OBJ index into a 0-based one
+	bool toCornerIndex(int32_t raw, size_t declared, int attribute, Corner& corner)
+	{
+		if (raw > 0)
+		{
+			corner.index[attribute] = raw - 1;
+		}
+		else if (raw < 0)
+		{
+			corner.index[attribute] = (int32_t) declared + raw;
+			corner.relative |= 1 << attribute;
+		}
+		else
+		{
+			return false;
+		}
+		return true;
+	}
+
+	// Parses "v", "v/t", "v//n" or "v/t/n"
+	bool parseCorner(const char*& p, const char* end, const Chunk& chunk, Corner& corner)
+	{
+		corner.index[0] = corner.index[1] = corner.index[2] = NO_INDEX;
+		corner.relative = 0;
+
+		int32_t raw;
+		if (!parseInt(p, end, raw) || !toCornerIndex(raw, chunk.positions.size(), 0, corner))
+		{
+			return false;
+		}
+
+		for (int attribute = 1; attribute < 3 && p < end && *p == '/'; ++attribute)
+		{
+			++p;
+			if (p < end && *p == '/')
+			{
+				continue; // v//n
+			}
+
+			const size_t declared = attribute == 1 ? chunk.uvs.size() : chunk.normals.size();
+			if (!parseInt(p, end, raw) || !toCornerIndex(raw, declared, attribute, corner))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void parseChunk(Chunk& chunk)
+	{
+		std::vector<Corner> polygon;
+
+		const char* line = chunk.begin;
+		while (line < chunk.end && chunk.error.empty())
+		{
+			const char* eol = (const char*) memchr(line, '\n', chunk.end - line);
+			if (!eol)
+			{
+				eol = chunk.end;
+			}
+
+			const char* p = skipSpaces(line, eol);
+			if (eol - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				glm::vec3 vertex;
+				p += 1;
+				if (!parseFloat(p, eol, vertex.x) || !parseFloat(p, eol, vertex.y) || !parseFloat(p, eol, vertex.z))
+				{
+					chunk.error = "bad vertex";
+				}
+				chunk.positions.push_back(vertex);
+			}
+			else if (eol - p >= 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+			{
+				glm::vec2 uv;
+				p += 2;
+				if (!parseFloat(p, eol, uv.x) || !parseFloat(p, eol, uv.y))
+				{
+					chunk.error = "bad texture coordinate";
+				}
+				chunk.uvs.push_back(uv);
+			}
+			else if (eol - p >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+			{
+				glm::vec3 normal;
+				p += 2;
+				if (!parseFloat(p, eol, normal.x) || !parseFloat(p, eol, normal.y) || !parseFloat(p, eol, normal.z))
+				{
+					chunk.error = "bad normal";
+				}
+				chunk.normals.push_back(normal);
+			}
+			else if (eol - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				polygon.clear();
+				p = skipSpaces(p + 1, eol);
+				while (p < eol)
+				{
+					Corner corner;
+					if (!parseCorner(p, eol, chunk, corner))
+					{
+						chunk.error = "bad face";
+						break;
+					}
+					polygon.push_back(corner);
+					p = skipSpaces(p, eol);
+				}
+
+				if (chunk.error.empty() && polygon.size() < 3)
+				{
+					chunk.error = "face with less than three corners";
+				}
+
+				// Fan the polygon around its first corner
+				for (size_t i = 2; chunk.error.empty() && i < polygon.size(); ++i)
+				{
+					chunk.corners.push_back(polygon[0]);
+					chunk.corners.push_back(polygon[i - 1]);
+					chunk.corners.push_back(polygon[i]);
+				}
+			}
+			// Anything else (comments, groups, materials...) is ignored
+
+			line = eol + 1;
+		}
+	}
+}
+
+bool loadOBJ(
+	const char* path,
+	std::vector<glm::vec3>& out_vertices,
+	std::vector<glm::vec2>& out_uvs,
+	std::vector<glm::vec3>& out_normals,
+	ThreadPool& pool
+) {
+	PROFILE_SCOPE("loadOBJ");
+	try
+	{
+		const MappedFile file(path);
+		const char* data = file.data();
+		const size_t size = file.size();
+
+		// Cut the file in a few chunks per thread, each ending right after a new line
+		const size_t minChunkSize = 1 << 16;
+		const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(pool.size() * 4, size / minChunkSize));
+
+		std::vector<Chunk> chunks(chunkCount);
+		const char* cursor = data;
+		for (size_t i = 0; i < chunkCount; ++i)
+		{
+			const char* end = data + size;
+			if (i + 1 < chunkCount)
+			{
+				end = std::max(cursor, data + size * (i + 1) / chunkCount);
+				const char* eol = (const char*) memchr(end, '\n', data + size - end);
+				end = eol ? eol + 1 : data + size;
+			}
+			chunks[i].begin = cursor;
+			chunks[i].end = end;
+			cursor = end;
+		}
+
+		pool.parallelFor(chunkCount, [&](size_t i) {
+			parseChunk(chunks[i]);
+		});
+
+		// Attributes are numbered in file order, so each chunk starts where the previous ones stopped
+		size_t totals[3] = {0, 0, 0};
+		size_t cornerCount = 0;
+		for (auto& chunk : chunks)
+		{
+			if (!chunk.error.empty())
+			{
+				printf("Can't read %s : %s\n", path, chunk.error.c_str());
+				return false;
+			}
+			chunk.offset[0] = totals[0];
+			chunk.offset[1] = totals[1];
+			chunk.offset[2] = totals[2];
+			totals[0] += chunk.positions.size();
+			totals[1] += chunk.uvs.size();
+			totals[2] += chunk.normals.size();
+			cornerCount += chunk.corners.size();
+		}
+
+		std::vector<glm::vec3> positions(totals[0]);
+		std::vector<glm::vec2> uvs(totals[1]);
+		std::vector<glm::vec3> normals(totals[2]);
+
+		pool.parallelFor(chunkCount, [&](size_t i) {
+			const Chunk& chunk = chunks[i];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + chunk.offset[0]);
+			std::copy(chunk.uvs.begin(), chunk.uvs.end(), uvs.begin() + chunk.offset[1]);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + chunk.offset[2]);
+		});
+
+		const size_t base = out_vertices.size();
+		out_vertices.resize(base + cornerCount);
+		out_uvs.resize(base + cornerCount);
+		out_normals.resize(base + cornerCount);
+
+		// Expand the triangles, every chunk writing its own range of the output
+		std::vector<size_t> firstCorner(chunkCount, base);
+		for (size_t i = 1; i < chunkCount; ++i)
+		{
+			firstCorner[i] = firstCorner[i - 1] + chunks[i - 1].corners.size();
+		}
+
+		std::vector<char> invalid(chunkCount, 0);
+		pool.parallelFor(chunkCount, [&](size_t i) {
+			const Chunk& chunk = chunks[i];
+
+			for (size_t c = 0; c < chunk.corners.size(); c += 3)
+			{
+				int64_t resolved[3][3];
+				for (int k = 0; k < 3; ++k)
+				{
+					const Corner& corner = chunk.corners[c + k];
+					for (int attribute = 0; attribute < 3; ++attribute)
+					{
+						int64_t index = corner.index[attribute];
+						if (index != NO_INDEX && (corner.relative & (1 << attribute)))
+						{
+							index += chunk.offset[attribute];
+						}
+						if (index != NO_INDEX && (index < 0 || index >= (int64_t) totals[attribute]))
+						{
+							invalid[i] = 1;
+							return;
+						}
+						resolved[k][attribute] = index;
+					}
+				}
+
+				const size_t out = firstCorner[i] + c;
+				for (int k = 0; k < 3; ++k)
+				{
+					out_vertices[out + k] = positions[resolved[k][0]];
+					out_uvs[out + k] = resolved[k][1] != NO_INDEX ? uvs[resolved[k][1]] : glm::vec2(0.0f);
+				}
+
+				if (resolved[0][2] != NO_INDEX && resolved[1][2] != NO_INDEX && resolved[2][2] != NO_INDEX)
+				{
+					for (int k = 0; k < 3; ++k)
+					{
+						out_normals[out + k] = normals[resolved[k][2]];
+					}
+				}
+				else
+				{
+					glm::vec3 faceNormal = glm::cross(out_vertices[out + 1] - out_vertices[out], out_vertices[out + 2] - out_vertices[out]);
+					const float length = glm::length(faceNormal);
+					faceNormal = length > 0.0f ? faceNormal / length : glm::vec3(0, 1, 0);
+					out_normals[out] = out_normals[out + 1] = out_normals[out + 2] = faceNormal;
+				}
+			}
+		});
+
+		if (std::find(invalid.begin(), invalid.end(), 1) != invalid.end())
+		{
+			printf("Can't read %s : face index out of range\n", path);
+			out_vertices.resize(base);
+			out_uvs.resize(base);
+			out_normals.resize(base);
+			return false;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("Impossible to open the file ! %s\n", e.what());
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "thread_pool.h"
+
+// Loads a Wavefront OBJ as a triangle soup, three output vertices per triangle.
+// Faces may be v, v/t, v//n or v/t/n, use negative indices and have any number
+// of corners (polygons are fanned). Missing UVs are zero and missing normals
+// are replaced by the face normal.
+// The file is memory mapped and parsed in parallel, in chunks of whole lines.
+// Appends to the output vectors and returns false if the file can't be read.
+bool loadOBJ(
+	const char* path,
+	std::vector<glm::vec3>& out_vertices,
+	std::vector<glm::vec2>& out_uvs,
+	std::vector<glm::vec3>& out_normals,
+	ThreadPool& pool = ThreadPool::global()
+);
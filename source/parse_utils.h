@@ -0,0 +1,57 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+
+// Small helpers shared by the text mesh parsers.
+// They work on [p, end) ranges of a mapped file, which is not null terminated.
+
+// Skips spaces and tabs, and the \r of Windows line endings
+inline const char* skipSpaces(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+	{
+		++p;
+	}
+	return p;
+}
+
+// Same as skipSpaces, across line ends too
+inline const char* skipWhitespace(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	{
+		++p;
+	}
+	return p;
+}
+
+// Parses a float after optional blanks, and moves p past it
+inline bool parseFloat(const char*& p, const char* end, float& value)
+{
+	p = skipWhitespace(p, end);
+	if (p < end && *p == '+')
+	{
+		++p;
+	}
+
+	const auto result = std::from_chars(p, end, value);
+	if (result.ec != std::errc())
+	{
+		return false;
+	}
+	p = result.ptr;
+	return true;
+}
+
+// Parses an integer right at p, and moves p past it
+inline bool parseInt(const char*& p, const char* end, int32_t& value)
+{
+	const auto result = std::from_chars(p, end, value);
+	if (result.ec != std::errc())
+	{
+		return false;
+	}
+	p = result.ptr;
+	return true;
+}
@@ -0,0 +1,339 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+
+namespace
+{
+	const size_t DROPPED = SIZE_MAX;
+	const uint32_t GPU_THREAD = 1000;
+
+	int64_t nowNs()
+	{
+		static const auto epoch = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	// Nearest rank on sorted values
+	double percentile(const std::vector<double> & sorted, double p)
+	{
+		const size_t rank = (size_t) std::ceil(p * sorted.size());
+		return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+	}
+
+	void writeEscaped(FILE * file, const char * text)
+	{
+		for (; *text; ++text)
+		{
+			if (*text == '"' || *text == '\\') fputc('\\', file);
+			if ((unsigned char) *text >= 0x20) fputc(*text, file);
+		}
+	}
+}
+
+Profiler & Profiler::global()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+void Profiler::setEnabled(bool enabled)
+{
+	nowNs(); // starts the clock
+	isEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+Profiler::ThreadEvents & Profiler::threadEvents()
+{
+	// Each thread registers once, its buffer lives as long as the profiler
+	thread_local Profiler * owner = nullptr;
+	thread_local ThreadEvents * events = nullptr;
+	if (owner != this)
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		threads.emplace_back(new ThreadEvents());
+		events = threads.back().get();
+		events->thread = (uint32_t) threads.size() - 1;
+		owner = this;
+	}
+	return *events;
+}
+
+void Profiler::beginScope(const char * name)
+{
+	ThreadEvents & local = threadEvents();
+	std::lock_guard<std::mutex> lock(local.mutex);
+	if (eventCount.fetch_add(1, std::memory_order_relaxed) >= maxEvents)
+	{
+		droppedEvents.fetch_add(1, std::memory_order_relaxed);
+		local.open.push_back(DROPPED);
+		return;
+	}
+	local.open.push_back(local.events.size());
+	local.events.push_back({name, nowNs(), 0, (uint32_t) local.open.size() - 1});
+}
+
+void Profiler::endScope()
+{
+	const int64_t end = nowNs();
+	ThreadEvents & local = threadEvents();
+	std::lock_guard<std::mutex> lock(local.mutex);
+	if (local.open.empty())
+	{
+		return; // cleared while the scope was open
+	}
+	const size_t index = local.open.back();
+	local.open.pop_back();
+	if (index != DROPPED)
+	{
+		local.events[index].endNs = end;
+	}
+}
+
+GLuint Profiler::allocateQuery()
+{
+	if (freeQueries.empty())
+	{
+		freeQueries.resize(64);
+		glGenQueries((GLsizei) freeQueries.size(), freeQueries.data());
+	}
+	const GLuint query = freeQueries.back();
+	freeQueries.pop_back();
+	return query;
+}
+
+void Profiler::beginGpuScope(const char * name)
+{
+	if (!gpuClockKnown)
+	{
+		// Both clocks read back to back, good to a few microseconds
+		GLint64 gpuNow = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+		gpuToCpuNs = nowNs() - gpuNow;
+		gpuClockKnown = true;
+	}
+
+	const GLuint query = allocateQuery();
+	glQueryCounter(query, GL_TIMESTAMP);
+	openGpu.push_back(pendingGpu.size());
+	pendingGpu.push_back({name, query, 0, (uint32_t) openGpu.size() - 1});
+}
+
+void Profiler::endGpuScope()
+{
+	if (openGpu.empty())
+	{
+		return;
+	}
+	const GLuint query = allocateQuery();
+	glQueryCounter(query, GL_TIMESTAMP);
+	pendingGpu[openGpu.back()].end = query;
+	openGpu.pop_back();
+}
+
+void Profiler::resolveGpu(bool wait)
+{
+	// Scopes still open hold indices in pendingGpu, leave it alone until they close
+	if (!openGpu.empty())
+	{
+		return;
+	}
+
+	size_t resolved = 0;
+	for (; resolved < pendingGpu.size(); ++resolved)
+	{
+		const GpuScope & scope = pendingGpu[resolved];
+		if (!wait)
+		{
+			GLint available = 0;
+			glGetQueryObjectiv(scope.end, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+			{
+				break;
+			}
+		}
+
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(scope.begin, GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(scope.end, GL_QUERY_RESULT, &end);
+		freeQueries.push_back(scope.begin);
+		freeQueries.push_back(scope.end);
+
+		if (eventCount.fetch_add(1, std::memory_order_relaxed) >= maxEvents)
+		{
+			droppedEvents.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		gpuEvents.push_back({scope.name, (int64_t) begin + gpuToCpuNs, (int64_t) end + gpuToCpuNs, scope.depth});
+	}
+	pendingGpu.erase(pendingGpu.begin(), pendingGpu.begin() + resolved);
+}
+
+void Profiler::endFrame()
+{
+	if (enabled() || !pendingGpu.empty())
+	{
+		resolveGpu(false);
+	}
+}
+
+void Profiler::flushGpu()
+{
+	resolveGpu(true);
+}
+
+void Profiler::shutdown()
+{
+	for (const GpuScope & scope : pendingGpu)
+	{
+		freeQueries.push_back(scope.begin);
+		if (scope.end) freeQueries.push_back(scope.end);
+	}
+	if (!freeQueries.empty())
+	{
+		glDeleteQueries((GLsizei) freeQueries.size(), freeQueries.data());
+	}
+	freeQueries.clear();
+	pendingGpu.clear();
+	openGpu.clear();
+	gpuClockKnown = false; // another context has another clock
+}
+
+std::vector<Profiler::ScopeStats> Profiler::stats() const
+{
+	// Durations per scope name, GPU scopes apart
+	std::map<std::pair<std::string, bool>, std::vector<double>> durations;
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		for (const auto & thread : threads)
+		{
+			std::lock_guard<std::mutex> threadLock(thread->mutex);
+			for (const Event & event : thread->events)
+			{
+				if (event.endNs)
+				{
+					durations[{event.name, false}].push_back((event.endNs - event.startNs) / 1e6);
+				}
+			}
+		}
+	}
+	for (const Event & event : gpuEvents)
+	{
+		durations[{event.name, true}].push_back((event.endNs - event.startNs) / 1e6);
+	}
+
+	std::vector<ScopeStats> result;
+	for (auto & entry : durations)
+	{
+		std::vector<double> & values = entry.second;
+		std::sort(values.begin(), values.end());
+		ScopeStats stats;
+		stats.name = entry.first.first;
+		stats.gpu = entry.first.second;
+		stats.count = values.size();
+		stats.totalMs = 0.0;
+		for (double value : values)
+		{
+			stats.totalMs += value;
+		}
+		stats.meanMs = stats.totalMs / values.size();
+		stats.p50Ms = percentile(values, 0.50);
+		stats.p95Ms = percentile(values, 0.95);
+		stats.p99Ms = percentile(values, 0.99);
+		stats.maxMs = values.back();
+		result.push_back(stats);
+	}
+	std::sort(result.begin(), result.end(), [](const ScopeStats & a, const ScopeStats & b) { return a.totalMs > b.totalMs; });
+	return result;
+}
+
+void Profiler::printStats(std::ostream & out) const
+{
+	char line[256];
+	snprintf(line, sizeof(line), "%-32s %8s %10s %9s %9s %9s %9s %9s", "scope (ms)", "calls", "total", "mean", "p50", "p95", "p99", "max");
+	out << line << std::endl;
+	for (const ScopeStats & stats : this->stats())
+	{
+		const std::string name = stats.gpu ? stats.name + " [GPU]" : stats.name;
+		snprintf(line, sizeof(line), "%-32s %8zu %10.3f %9.3f %9.3f %9.3f %9.3f %9.3f", name.c_str(), stats.count,
+			stats.totalMs, stats.meanMs, stats.p50Ms, stats.p95Ms, stats.p99Ms, stats.maxMs);
+		out << line << std::endl;
+	}
+	if (droppedEvents)
+	{
+		out << droppedEvents << " events dropped past " << maxEvents << std::endl;
+	}
+}
+
+void Profiler::writeChromeTrace(const char * path) const
+{
+	FILE * file = fopen(path, "w");
+	if (!file)
+	{
+		throw std::runtime_error(std::string("Cannot write ") + path);
+	}
+
+	// Complete events ("X"), times in microseconds
+	bool first = true;
+	auto writeEvent = [&](const Event & event, uint32_t thread) {
+		fprintf(file, "%s\n{\"name\":\"", first ? "" : ",");
+		writeEscaped(file, event.name);
+		fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			thread, event.startNs / 1e3, (event.endNs - event.startNs) / 1e3);
+		first = false;
+	};
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		for (const auto & thread : threads)
+		{
+			std::lock_guard<std::mutex> threadLock(thread->mutex);
+			fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"Thread %u\"}}",
+				first ? "" : ",", thread->thread, thread->thread);
+			first = false;
+			for (const Event & event : thread->events)
+			{
+				if (event.endNs)
+				{
+					writeEvent(event, thread->thread);
+				}
+			}
+		}
+	}
+	if (!gpuEvents.empty())
+	{
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", first ? "" : ",", GPU_THREAD);
+		first = false;
+		for (const Event & event : gpuEvents)
+		{
+			writeEvent(event, GPU_THREAD);
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	const bool failed = ferror(file) != 0;
+	fclose(file);
+	if (failed)
+	{
+		throw std::runtime_error(std::string("Cannot write ") + path);
+	}
+}
+
+void Profiler::clear()
+{
+	std::lock_guard<std::mutex> lock(threadsMutex);
+	for (const auto & thread : threads)
+	{
+		std::lock_guard<std::mutex> threadLock(thread->mutex);
+		thread->events.clear();
+		thread->open.clear();
+	}
+	gpuEvents.clear();
+	eventCount = 0;
+	droppedEvents = 0;
+}
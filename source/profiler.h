@@ -0,0 +1,158 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// Named scope markers on the CPU, from any thread, and GPU timestamp query
+// pairs on the GL thread. Events are kept for Chrome trace export and
+// summarized per scope name. When disabled, a scope costs one relaxed load
+// and a branch; defining GAMAGORA_NO_PROFILER compiles the markers out.
+class Profiler
+{
+public:
+	struct ScopeStats
+	{
+		std::string name;
+		bool gpu;
+		size_t count;
+		double totalMs, meanMs, p50Ms, p95Ms, p99Ms, maxMs;
+	};
+
+	static Profiler & global();
+
+	void setEnabled(bool enabled);
+	bool enabled() const { return isEnabled.load(std::memory_order_relaxed); }
+
+	// Names must outlive the profiler, string literals in practice
+	void beginScope(const char * name);
+	void endScope();
+
+	// GL thread only. Results are read a few frames later, without stalling.
+	void beginGpuScope(const char * name);
+	void endGpuScope();
+
+	// Frame boundaries, on the GL thread: collects the GPU results that are ready
+	void endFrame();
+
+	// Waits for every pending GPU result, before stats() or a trace export
+	void flushGpu();
+
+	// GL thread, before the context goes away: deletes the timestamp queries,
+	// results not read yet are lost
+	void shutdown();
+
+	// Per scope name, sorted by total time
+	std::vector<ScopeStats> stats() const;
+	void printStats(std::ostream & out) const;
+
+	// Chrome trace-event JSON, for chrome://tracing or ui.perfetto.dev
+	void writeChromeTrace(const char * path) const;
+
+	void clear();
+
+	// Events past this many are dropped, and counted
+	size_t maxEvents = 4000000;
+
+private:
+	struct Event
+	{
+		const char * name;
+		int64_t startNs;
+		int64_t endNs;
+		uint32_t depth;
+	};
+
+	struct ThreadEvents
+	{
+		std::mutex mutex;
+		std::vector<Event> events;
+		std::vector<size_t> open;
+		uint32_t thread;
+	};
+
+	struct GpuScope
+	{
+		const char * name;
+		GLuint begin, end;
+		uint32_t depth;
+	};
+
+	ThreadEvents & threadEvents();
+	GLuint allocateQuery();
+	void resolveGpu(bool wait);
+
+	std::atomic<bool> isEnabled{false};
+	std::atomic<size_t> eventCount{0};
+	std::atomic<size_t> droppedEvents{0};
+
+	mutable std::mutex threadsMutex;
+	std::vector<std::unique_ptr<ThreadEvents>> threads;
+
+	// GPU side, touched by the GL thread only
+	std::vector<GLuint> freeQueries;
+	std::vector<GpuScope> pendingGpu; // ended, results not read yet
+	std::vector<size_t> openGpu; // indices in pendingGpu
+	std::vector<Event> gpuEvents;
+	int64_t gpuToCpuNs = 0; // GL_TIMESTAMP to the CPU clock
+	bool gpuClockKnown = false;
+};
+
+// Profiles the enclosing block
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char * name)
+		: active(Profiler::global().enabled())
+	{
+		if (active) Profiler::global().beginScope(name);
+	}
+	~ProfileScope()
+	{
+		if (active) Profiler::global().endScope();
+	}
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+	bool active;
+};
+
+// Profiles the GL commands of the enclosing block
+class GpuProfileScope
+{
+public:
+	explicit GpuProfileScope(const char * name)
+		: active(Profiler::global().enabled())
+	{
+		if (active) Profiler::global().beginGpuScope(name);
+	}
+	~GpuProfileScope()
+	{
+		if (active) Profiler::global().endGpuScope();
+	}
+
+	GpuProfileScope(const GpuProfileScope&) = delete;
+	GpuProfileScope& operator=(const GpuProfileScope&) = delete;
+
+private:
+	bool active;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+#ifdef GAMAGORA_NO_PROFILER
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#else
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
+#endif
@@ -0,0 +1,966 @@
+#include "rasterizer.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RASTER_SSE 1
+#endif
+
+namespace
+{
+	// Vertices are snapped to 1/16 of a pixel
+	const int SUBPIXEL_BITS = 4;
+	const int SUBPIXEL = 1 << SUBPIXEL_BITS;
+
+	// Triangles are only clipped against the sides this far off screen. With
+	// 4 sub pixel bits, every edge function stays within 32 bits over a tile.
+	const float GUARD_BAND = 8192.0f;
+	const int MAX_SIZE = 8192;
+
+	// Triangles per front end task, at least
+	const size_t MIN_CHUNK = 256;
+
+	// Shaded vertices remembered by a front end task, direct mapped
+	const size_t VERTEX_CACHE_SIZE = 64;
+
+	// Outputs of shader.vert read by shader.frag, interpolated with perspective
+	struct Varyings
+	{
+		glm::vec2 uv;
+		glm::vec3 baseColor;
+		glm::vec3 positionWorld;
+		glm::vec3 normalCamera;
+		glm::vec3 lightDirectionCamera;
+		glm::vec3 eyeDirectionCamera;
+		glm::vec3 lightDirectionTangent;
+		glm::vec3 eyeDirectionTangent;
+		glm::vec3 vertexNormalCamera;
+		glm::vec3 tangentCamera;
+		glm::vec3 bitangentCamera;
+	};
+
+	Varyings mix(const Varyings & a, const Varyings & b, float t)
+	{
+		Varyings v;
+		v.uv = a.uv + (b.uv - a.uv) * t;
+		v.baseColor = a.baseColor + (b.baseColor - a.baseColor) * t;
+		v.positionWorld = a.positionWorld + (b.positionWorld - a.positionWorld) * t;
+		v.normalCamera = a.normalCamera + (b.normalCamera - a.normalCamera) * t;
+		v.lightDirectionCamera = a.lightDirectionCamera + (b.lightDirectionCamera - a.lightDirectionCamera) * t;
+		v.eyeDirectionCamera = a.eyeDirectionCamera + (b.eyeDirectionCamera - a.eyeDirectionCamera) * t;
+		v.lightDirectionTangent = a.lightDirectionTangent + (b.lightDirectionTangent - a.lightDirectionTangent) * t;
+		v.eyeDirectionTangent = a.eyeDirectionTangent + (b.eyeDirectionTangent - a.eyeDirectionTangent) * t;
+		v.vertexNormalCamera = a.vertexNormalCamera + (b.vertexNormalCamera - a.vertexNormalCamera) * t;
+		v.tangentCamera = a.tangentCamera + (b.tangentCamera - a.tangentCamera) * t;
+		v.bitangentCamera = a.bitangentCamera + (b.bitangentCamera - a.bitangentCamera) * t;
+		return v;
+	}
+
+	Varyings subtract(const Varyings & a, const Varyings & b)
+	{
+		Varyings v;
+		v.uv = a.uv - b.uv;
+		v.baseColor = a.baseColor - b.baseColor;
+		v.positionWorld = a.positionWorld - b.positionWorld;
+		v.normalCamera = a.normalCamera - b.normalCamera;
+		v.lightDirectionCamera = a.lightDirectionCamera - b.lightDirectionCamera;
+		v.eyeDirectionCamera = a.eyeDirectionCamera - b.eyeDirectionCamera;
+		v.lightDirectionTangent = a.lightDirectionTangent - b.lightDirectionTangent;
+		v.eyeDirectionTangent = a.eyeDirectionTangent - b.eyeDirectionTangent;
+		v.vertexNormalCamera = a.vertexNormalCamera - b.vertexNormalCamera;
+		v.tangentCamera = a.tangentCamera - b.tangentCamera;
+		v.bitangentCamera = a.bitangentCamera - b.bitangentCamera;
+		return v;
+	}
+
+	// v0 + d1 * b1 + d2 * b2
+	Varyings interpolate(const Varyings & v0, const Varyings & d1, const Varyings & d2, float b1, float b2)
+	{
+		Varyings v;
+		v.uv = v0.uv + d1.uv * b1 + d2.uv * b2;
+		v.baseColor = v0.baseColor + d1.baseColor * b1 + d2.baseColor * b2;
+		v.positionWorld = v0.positionWorld + d1.positionWorld * b1 + d2.positionWorld * b2;
+		v.normalCamera = v0.normalCamera + d1.normalCamera * b1 + d2.normalCamera * b2;
+		v.lightDirectionCamera = v0.lightDirectionCamera + d1.lightDirectionCamera * b1 + d2.lightDirectionCamera * b2;
+		v.eyeDirectionCamera = v0.eyeDirectionCamera + d1.eyeDirectionCamera * b1 + d2.eyeDirectionCamera * b2;
+		v.lightDirectionTangent = v0.lightDirectionTangent + d1.lightDirectionTangent * b1 + d2.lightDirectionTangent * b2;
+		v.eyeDirectionTangent = v0.eyeDirectionTangent + d1.eyeDirectionTangent * b1 + d2.eyeDirectionTangent * b2;
+		v.vertexNormalCamera = v0.vertexNormalCamera + d1.vertexNormalCamera * b1 + d2.vertexNormalCamera * b2;
+		v.tangentCamera = v0.tangentCamera + d1.tangentCamera * b1 + d2.tangentCamera * b2;
+		v.bitangentCamera = v0.bitangentCamera + d1.bitangentCamera * b1 + d2.bitangentCamera * b2;
+		return v;
+	}
+
+	struct ShadedVertex
+	{
+		glm::vec4 clip;
+		Varyings varyings;
+	};
+
+	// Attributes of a draw's vertex format, by shader location, null when disabled
+	struct VertexFetch
+	{
+		const VertexFormat::Attribute * position = nullptr;
+		const VertexFormat::Attribute * uv = nullptr;
+		const VertexFormat::Attribute * normal = nullptr;
+		const VertexFormat::Attribute * tangent = nullptr;
+		size_t stride = 0;
+		bool octahedral = false;
+	};
+
+	VertexFetch makeVertexFetch(const VertexFormat & format)
+	{
+		VertexFetch fetch;
+		for (const VertexFormat::Attribute & attribute : format.attributes)
+		{
+			switch (attribute.location)
+			{
+			case ATTRIBUTE_POSITION: fetch.position = &attribute; break;
+			case ATTRIBUTE_UV: fetch.uv = &attribute; break;
+			case ATTRIBUTE_NORMAL: fetch.normal = &attribute; break;
+			case ATTRIBUTE_TANGENT: fetch.tangent = &attribute; break;
+			}
+		}
+		if (!fetch.position)
+		{
+			throw std::runtime_error("Rasterizer: vertex format without position");
+		}
+		fetch.stride = format.stride;
+		fetch.octahedral = format.layout.normals == NormalEncoding::Octahedral;
+		return fetch;
+	}
+
+	// Converts like glVertexAttribPointer, missing components default to (0, 0, 0, 1)
+	glm::vec4 fetchAttribute(const unsigned char * vertex, const VertexFormat::Attribute * attribute)
+	{
+		glm::vec4 value(0.0f, 0.0f, 0.0f, 1.0f);
+		if (!attribute)
+		{
+			return value;
+		}
+
+		const unsigned char * data = vertex + attribute->offset;
+		switch (attribute->type)
+		{
+		case GL_FLOAT:
+			memcpy(&value[0], data, attribute->size * sizeof(float));
+			break;
+		case GL_HALF_FLOAT:
+			for (GLint i = 0; i < attribute->size; ++i)
+			{
+				uint16_t half;
+				memcpy(&half, data + i * 2, 2);
+				value[i] = HalfToFloat(half);
+			}
+			break;
+		case GL_SHORT:
+			for (GLint i = 0; i < attribute->size; ++i)
+			{
+				int16_t component;
+				memcpy(&component, data + i * 2, 2);
+				value[i] = attribute->normalized ? Snorm16ToFloat(component) : (float) component;
+			}
+			break;
+		case GL_INT_2_10_10_10_REV:
+		{
+			uint32_t packed;
+			memcpy(&packed, data, 4);
+			value = UnpackSnorm1010102(packed);
+			break;
+		}
+		default:
+			throw std::runtime_error("Rasterizer: unsupported vertex attribute type");
+		}
+		return value;
+	}
+
+	// What shader.vert derives from the instance, once per instance
+	struct InstanceTransforms
+	{
+		glm::mat4 model;
+		glm::mat4 viewModel;
+		glm::mat4 viewProjectionModel;
+		glm::mat3 modelView3x3;
+		glm::vec3 color;
+	};
+
+	InstanceTransforms makeInstanceTransforms(const InstanceData & instance, const RasterUniforms & uniforms)
+	{
+		InstanceTransforms transforms;
+		transforms.model = instance.model;
+		transforms.viewModel = uniforms.view * instance.model;
+		transforms.viewProjectionModel = uniforms.viewProjection * instance.model;
+		transforms.modelView3x3 = glm::mat3(transforms.viewModel);
+		transforms.color = glm::vec3(instance.color);
+		return transforms;
+	}
+
+	// gl_Position of shader.vert, with instanced set
+	glm::vec4 clipPosition(const unsigned char * vertex, const VertexFetch & fetch, const InstanceTransforms & instance)
+	{
+		glm::vec3 position;
+		if (fetch.position->type == GL_FLOAT)
+		{
+			memcpy(&position, vertex + fetch.position->offset, sizeof(position));
+		}
+		else
+		{
+			position = glm::vec3(fetchAttribute(vertex, fetch.position));
+		}
+		return instance.viewProjectionModel * glm::vec4(position, 1.0f);
+	}
+
+	// The other outputs of shader.vert, only computed for the triangles that cover pixels
+	Varyings shadeVertex(const unsigned char * vertex, const VertexFetch & fetch, const InstanceTransforms & instance, const glm::vec3 & lightPositionCamera)
+	{
+		const glm::vec3 position = glm::vec3(fetchAttribute(vertex, fetch.position));
+		const glm::vec4 normalAttribute = fetchAttribute(vertex, fetch.normal);
+		const glm::vec3 normal = fetch.octahedral ? OctahedralDecode(glm::vec2(normalAttribute)) : glm::vec3(normalAttribute);
+		const glm::vec4 tangent = fetchAttribute(vertex, fetch.tangent);
+
+		Varyings v;
+		v.eyeDirectionCamera = -glm::vec3(instance.viewModel * glm::vec4(position, 1.0f));
+		v.lightDirectionCamera = lightPositionCamera + v.eyeDirectionCamera;
+		v.positionWorld = glm::vec3(instance.model * glm::vec4(position, 1.0f));
+		v.normalCamera = glm::vec3(instance.viewModel * glm::vec4(normal, 0.0f));
+
+		// The shader leaves them unset without tangent, zero skips normal mapping in the fragment
+		glm::vec3 normalCamera(0.0f), tangentCamera(0.0f), bitangentCamera(0.0f);
+		if (glm::length(glm::vec3(tangent)) > 0.0f)
+		{
+			const glm::vec3 bitangent = glm::cross(normal, glm::vec3(tangent)) * tangent.w;
+			normalCamera = instance.modelView3x3 * glm::normalize(normal);
+			tangentCamera = instance.modelView3x3 * glm::normalize(glm::vec3(tangent));
+			bitangentCamera = instance.modelView3x3 * glm::normalize(bitangent);
+		}
+
+		v.uv = glm::vec2(fetchAttribute(vertex, fetch.uv));
+		v.baseColor = instance.color;
+
+		const glm::mat3 tbn = glm::transpose(glm::mat3(tangentCamera, bitangentCamera, normalCamera));
+		v.lightDirectionTangent = tbn * v.lightDirectionCamera;
+		v.eyeDirectionTangent = tbn * v.eyeDirectionCamera;
+		v.vertexNormalCamera = normalCamera;
+		v.tangentCamera = tangentCamera;
+		v.bitangentCamera = bitangentCamera;
+		return v;
+	}
+
+	// shader.frag, at window position fragCoord of a width x height viewport
+	glm::vec3 shadeFragment(const Varyings & v, const glm::vec2 & fragCoord, int width, int height, const glm::vec2 & uvDx, const glm::vec2 & uvDy,
+		const RasterTexture * colorTexture, const RasterTexture * normalTexture, const RasterUniforms & uniforms)
+	{
+		glm::vec3 n = glm::normalize(v.normalCamera);
+		glm::vec3 nCamera = n;
+		glm::vec3 l = glm::normalize(v.lightDirectionCamera);
+		const glm::vec3 E = glm::normalize(v.eyeDirectionCamera);
+
+		if (glm::length(v.eyeDirectionTangent) > 0.0f)
+		{
+			const glm::vec3 textureNormal = normalTexture ? normalTexture->sample(v.uv, uvDx, uvDy) : glm::vec3(0.0f);
+			const glm::vec2 xy = glm::vec2(textureNormal) * 2.0f - 1.0f;
+			n = glm::normalize(glm::vec3(xy, std::sqrt(std::max(0.0f, 1.0f - glm::dot(xy, xy)))));
+			nCamera = glm::normalize(glm::mat3(v.tangentCamera, v.bitangentCamera, v.vertexNormalCamera) * n);
+			l = glm::normalize(v.lightDirectionTangent);
+		}
+		const glm::vec3 R = glm::reflect(-l, n);
+
+		const glm::vec3 diffuse = (colorTexture ? colorTexture->sample(v.uv, uvDx, uvDy) : glm::vec3(0.0f)) + v.baseColor;
+		const glm::vec3 ambient = glm::vec3(0.15f) * diffuse;
+		const glm::vec3 specular = glm::vec3(0.3f);
+
+		const glm::vec3 toLight = v.positionWorld - uniforms.lightPosition;
+		const float distanceSquared = glm::dot(toLight, toLight);
+		const float cosTheta = glm::clamp(glm::dot(n, l), 0.0f, 1.0f);
+		const float cosAlpha = glm::clamp(glm::dot(E, R), 0.0f, 1.0f);
+		const float cosAlpha2 = cosAlpha * cosAlpha;
+		const glm::vec3 light = uniforms.lightColor * uniforms.lightIntensity / distanceSquared;
+
+		glm::vec3 result = ambient + diffuse * light * cosTheta + specular * light * (cosAlpha2 * cosAlpha2 * cosAlpha);
+
+		// clustered_lights.glsl
+		if (uniforms.clusters)
+		{
+			const LightClusters & clusters = *uniforms.clusters;
+			const glm::vec3 position = -v.eyeDirectionCamera;
+			const ClusterRange range = clusters.clusters()[clusters.clusterAt(fragCoord, width, height, -position.z)];
+			glm::vec3 pointLights(0.0f);
+			for (uint32_t i = 0; i < range.count; i++)
+			{
+				const ClusterLight & pointLight = clusters.lights()[clusters.lightIndices()[range.offset + i]];
+				pointLights += ShadePointLight(pointLight, position, nCamera, E, diffuse, specular);
+			}
+			result += pointLights;
+		}
+		return result;
+	}
+
+	// Unorm conversion of the color attachment
+	uint32_t packColor(const glm::vec3 & color)
+	{
+		const glm::vec3 c = glm::clamp(color, 0.0f, 1.0f) * 255.0f + 0.5f;
+		return (uint32_t) c.r | (uint32_t) c.g << 8 | (uint32_t) c.b << 16 | 0xFF000000u;
+	}
+
+	// Sutherland-Hodgman against dot(plane, clip) >= 0, returns the output vertex count
+	size_t clipPolygon(const ShadedVertex * in, size_t count, const glm::vec4 & plane, ShadedVertex * out)
+	{
+		size_t outCount = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const ShadedVertex & a = in[i];
+			const ShadedVertex & b = in[(i + 1) % count];
+			const float da = glm::dot(plane, a.clip), db = glm::dot(plane, b.clip);
+			if (da >= 0.0f)
+			{
+				out[outCount++] = a;
+			}
+			if ((da >= 0.0f) != (db >= 0.0f))
+			{
+				const float t = da / (da - db);
+				out[outCount].clip = a.clip + (b.clip - a.clip) * t;
+				out[outCount].varyings = mix(a.varyings, b.varyings, t);
+				outCount++;
+			}
+		}
+		return outCount;
+	}
+
+	int64_t floorDivide(int64_t value, int64_t divisor)
+	{
+		const int64_t quotient = value / divisor;
+		return quotient * divisor > value ? quotient - 1 : quotient;
+	}
+
+	// a * x + b * y + c >= 0 for every pixel of [x0, x1] x [y0, y1]: 1, for none: -1, else 0
+	int classifyEdge(int64_t a, int64_t b, int64_t c, int x0, int y0, int x1, int y1)
+	{
+		const int64_t origin = a * x0 + b * y0 + c;
+		const int64_t dx = a * (x1 - x0), dy = b * (y1 - y0);
+		const int64_t low = origin + std::min<int64_t>(dx, 0) + std::min<int64_t>(dy, 0);
+		const int64_t high = origin + std::max<int64_t>(dx, 0) + std::max<int64_t>(dy, 0);
+		return low >= 0 ? 1 : high < 0 ? -1 : 0;
+	}
+}
+
+RasterTexture::RasterTexture(std::vector<Image> levels)
+	: levels(std::move(levels))
+{
+	if (this->levels.empty())
+	{
+		throw std::runtime_error("RasterTexture: no level");
+	}
+}
+
+glm::vec3 RasterTexture::bilinear(const Image & level, const glm::vec2 & uv) const
+{
+	const float u = uv.x * level.width - 0.5f, v = uv.y * level.height - 0.5f;
+	const float fu = std::floor(u), fv = std::floor(v);
+	const float tu = u - fu, tv = v - fv;
+
+	// GL_REPEAT
+	auto wrap = [](int i, int size) { i %= size; return i < 0 ? i + size : i; };
+	const int x0 = wrap((int) fu, level.width), x1 = wrap((int) fu + 1, level.width);
+	const int y0 = wrap((int) fv, level.height), y1 = wrap((int) fv + 1, level.height);
+
+	auto texel = [&](int x, int y) {
+		const unsigned char * t = &level.data[((size_t) y * level.width + x) * 3];
+		return glm::vec3(t[0], t[1], t[2]);
+	};
+	const glm::vec3 bottom = glm::mix(texel(x0, y0), texel(x1, y0), tu);
+	const glm::vec3 top = glm::mix(texel(x0, y1), texel(x1, y1), tu);
+	return glm::mix(bottom, top, tv) * (1.0f / 255.0f);
+}
+
+glm::vec3 RasterTexture::sample(const glm::vec2 & uv, const glm::vec2 & uvDx, const glm::vec2 & uvDy) const
+{
+	const glm::vec2 size(levels[0].width, levels[0].height);
+	const float rho = std::max(glm::length(uvDx * size), glm::length(uvDy * size));
+
+	// Magnified: GL_LINEAR on the base level
+	if (!(rho > 1.0f))
+	{
+		return bilinear(levels[0], uv);
+	}
+
+	const float lod = std::min(std::log2(rho), (float) (levels.size() - 1));
+	const size_t level = (size_t) lod;
+	if (level + 1 >= levels.size())
+	{
+		return bilinear(levels[level], uv);
+	}
+	return glm::mix(bilinear(levels[level], uv), bilinear(levels[level + 1], uv), lod - level);
+}
+
+// Screen space planes are p.x * x + p.y * y + p.z, with x and y in pixels
+// from (minX, minY). Barycentrics b1, b2 follow perspective: b1 = lambda1 / q
+// with q = 1 / w, both interpolated linearly on screen.
+struct Rasterizer::Triangle
+{
+	int minX, minY, maxX, maxY; // bounds of the covered pixels, inclusive
+	int64_t a[3], b[3], c[3]; // edge k is opposite vertex k, a * x + b * y + c >= 0 inside at pixel x, y
+	glm::vec3 depthPlane; // window z
+	glm::vec3 qPlane;
+	glm::vec3 lambda1Plane, lambda2Plane;
+	Varyings v0, d1, d2; // v0 + d1 * b1 + d2 * b2
+	const RasterTexture * colorTexture;
+	const RasterTexture * normalTexture;
+};
+
+struct Rasterizer::Chunk
+{
+	struct Binned
+	{
+		uint32_t tile;
+		uint32_t triangle;
+	};
+
+	std::vector<Triangle> triangles;
+	std::vector<Binned> binned;
+	std::vector<uint32_t> tileStart; // triangles of tile t are tileTriangles[tileStart[t], tileStart[t + 1])
+	std::vector<uint32_t> tileTriangles;
+};
+
+namespace
+{
+	// Snaps the vertices and sets up the edge functions and planes, false when nothing
+	// is covered. The varyings are left to the caller, in the counter clockwise order.
+	template <typename Triangle>
+	bool setupTriangle(const glm::vec4 * const clips[3], int width, int height, Triangle & triangle, int order[3])
+	{
+		int64_t x[3], y[3];
+		float z[3], q[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			const glm::vec4 & clip = *clips[i];
+			q[i] = 1.0f / clip.w;
+			x[i] = (int64_t) std::floor((clip.x * q[i] * 0.5f + 0.5f) * width * SUBPIXEL + 0.5f);
+			y[i] = (int64_t) std::floor((clip.y * q[i] * 0.5f + 0.5f) * height * SUBPIXEL + 0.5f);
+			z[i] = clip.z * q[i] * 0.5f + 0.5f;
+		}
+
+		int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (area == 0)
+		{
+			return false;
+		}
+
+		// Counter clockwise order, no face is culled
+		order[0] = 0;
+		order[1] = 1;
+		order[2] = 2;
+		if (area < 0)
+		{
+			std::swap(order[1], order[2]);
+			area = -area;
+		}
+		const int i0 = order[0], i1 = order[1], i2 = order[2];
+
+		// Pixel x is covered when its center x * SUBPIXEL + SUBPIXEL / 2 is
+		const int64_t minFx = std::min({x[0], x[1], x[2]}), maxFx = std::max({x[0], x[1], x[2]});
+		const int64_t minFy = std::min({y[0], y[1], y[2]}), maxFy = std::max({y[0], y[1], y[2]});
+		triangle.minX = (int) std::max<int64_t>(0, (minFx - SUBPIXEL / 2 + SUBPIXEL - 1) >> SUBPIXEL_BITS);
+		triangle.minY = (int) std::max<int64_t>(0, (minFy - SUBPIXEL / 2 + SUBPIXEL - 1) >> SUBPIXEL_BITS);
+		triangle.maxX = (int) std::min<int64_t>(width - 1, (maxFx - SUBPIXEL / 2) >> SUBPIXEL_BITS);
+		triangle.maxY = (int) std::min<int64_t>(height - 1, (maxFy - SUBPIXEL / 2) >> SUBPIXEL_BITS);
+		if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+		{
+			return false;
+		}
+
+		// Edge from va to vb: E(X, Y) = a * X + b * Y + c in sub pixels, positive inside.
+		// At pixel centers E = SUBPIXEL * (a * x + b * y) + K, so the test E + bias >= 0
+		// becomes a * x + b * y + floor((K + bias) / SUBPIXEL) >= 0, exactly. Like the
+		// planes, edges are then made relative to (minX, minY).
+		const int edges[3][2] = {{i1, i2}, {i2, i0}, {i0, i1}};
+		const double inverseArea = 1.0 / (double) area;
+		double lambda[3][3]; // plane of each edge function divided by the area
+		for (int k = 0; k < 3; ++k)
+		{
+			const int va = edges[k][0], vb = edges[k][1];
+			const int64_t a = y[va] - y[vb];
+			const int64_t b = x[vb] - x[va];
+			const int64_t c = -(a * x[va] + b * y[va]);
+			const int64_t k0 = c + (a + b) * (SUBPIXEL / 2);
+
+			// Top-left rule, pixels on a shared edge belong to one triangle
+			const bool topLeft = a > 0 || (a == 0 && b < 0);
+			triangle.a[k] = a;
+			triangle.b[k] = b;
+			triangle.c[k] = floorDivide(k0 + (topLeft ? 0 : -1), SUBPIXEL) + a * triangle.minX + b * triangle.minY;
+
+			lambda[k][0] = (double) (a * SUBPIXEL) * inverseArea;
+			lambda[k][1] = (double) (b * SUBPIXEL) * inverseArea;
+			lambda[k][2] = (double) (k0 + SUBPIXEL * (a * triangle.minX + b * triangle.minY)) * inverseArea;
+		}
+		auto plane = [&](double f0, double f1, double f2) {
+			return glm::vec3(
+				(float) (f0 * lambda[0][0] + f1 * lambda[1][0] + f2 * lambda[2][0]),
+				(float) (f0 * lambda[0][1] + f1 * lambda[1][1] + f2 * lambda[2][1]),
+				(float) (f0 * lambda[0][2] + f1 * lambda[1][2] + f2 * lambda[2][2]));
+		};
+		triangle.depthPlane = plane(z[i0], z[i1], z[i2]);
+		triangle.qPlane = plane(q[i0], q[i1], q[i2]);
+		triangle.lambda1Plane = plane(0.0, q[i1], 0.0);
+		triangle.lambda2Plane = plane(0.0, 0.0, q[i2]);
+		return true;
+	}
+}
+
+Rasterizer::Rasterizer(int width, int height)
+	: width(width), height(height),
+	tilesX((width + TILE_SIZE - 1) / TILE_SIZE), tilesY((height + TILE_SIZE - 1) / TILE_SIZE)
+{
+	if (width <= 0 || height <= 0 || width > MAX_SIZE || height > MAX_SIZE)
+	{
+		throw std::runtime_error("Rasterizer: size must be within 1 to 8192 pixels");
+	}
+
+	// Rows padded to 4 pixels, so SIMD groups never leave their tile
+	stride = (width + 3) & ~3;
+	color.resize((size_t) stride * height);
+	depth.resize((size_t) stride * height);
+	clear(glm::vec3(0.0f));
+}
+
+Rasterizer::~Rasterizer() = default;
+
+void Rasterizer::clear(const glm::vec3 & clearColor)
+{
+	std::fill(color.begin(), color.end(), packColor(clearColor));
+	std::fill(depth.begin(), depth.end(), 1.0f);
+}
+
+void Rasterizer::draw(const RasterDraw & draw)
+{
+	draws.push_back(draw);
+}
+
+void Rasterizer::render(const RasterUniforms & uniforms, ThreadPool & pool)
+{
+	PROFILE_SCOPE("Rasterizer::render");
+	lastStats = RasterStats();
+	const auto frontStart = std::chrono::steady_clock::now();
+
+	// Every instance of every command, numbered by their first triangle
+	struct Span
+	{
+		uint32_t draw;
+		uint32_t command;
+		uint32_t instance;
+	};
+	std::vector<Span> spans;
+	std::vector<size_t> spanStart(1, 0);
+	std::vector<VertexFetch> fetches;
+	for (uint32_t d = 0; d < draws.size(); ++d)
+	{
+		fetches.push_back(makeVertexFetch(*draws[d].format));
+		for (uint32_t c = 0; c < draws[d].commandCount; ++c)
+		{
+			const DrawElementsIndirectCommand & command = draws[d].commands[c];
+			if (command.count < 3)
+			{
+				continue;
+			}
+			for (uint32_t i = 0; i < command.instanceCount; ++i)
+			{
+				spans.push_back({d, c, command.baseInstance + i});
+				spanStart.push_back(spanStart.back() + command.count / 3);
+			}
+		}
+	}
+	const size_t triangleCount = spanStart.back();
+	lastStats.triangles = triangleCount;
+
+	const size_t tileCount = (size_t) tilesX * tilesY;
+	const size_t chunkSize = std::max(MIN_CHUNK, (triangleCount + pool.size() * 4 - 1) / (pool.size() * 4));
+	const size_t chunkCount = (triangleCount + chunkSize - 1) / chunkSize;
+	if (chunks.size() < chunkCount)
+	{
+		chunks.resize(chunkCount);
+	}
+
+	const glm::vec3 lightPositionCamera = glm::vec3(uniforms.view * glm::vec4(uniforms.lightPosition, 1.0f));
+
+	// Side planes at the guard band, the near and far planes of the frustum
+	const float guardX = 2.0f * GUARD_BAND / width + 1.0f, guardY = 2.0f * GUARD_BAND / height + 1.0f;
+	const glm::vec4 clipPlanes[6] = {
+		glm::vec4(0.0f, 0.0f, 1.0f, 1.0f), glm::vec4(0.0f, 0.0f, -1.0f, 1.0f),
+		glm::vec4(1.0f, 0.0f, 0.0f, guardX), glm::vec4(-1.0f, 0.0f, 0.0f, guardX),
+		glm::vec4(0.0f, 1.0f, 0.0f, guardY), glm::vec4(0.0f, -1.0f, 0.0f, guardY),
+	};
+
+	// Front end: shade, clip, set up and bin each chunk of triangles
+	pool.parallelFor(chunkCount, [&](size_t c) {
+		PROFILE_SCOPE("Rasterizer front end");
+		Chunk & chunk = chunks[c];
+		chunk.triangles.clear();
+		chunk.binned.clear();
+
+		// Clip positions first, the varyings once a triangle covers pixels
+		struct CachedVertex
+		{
+			size_t span;
+			uint32_t index;
+			bool shaded;
+			glm::vec4 clip;
+			Varyings varyings;
+		};
+		CachedVertex cache[VERTEX_CACHE_SIZE];
+		for (CachedVertex & entry : cache)
+		{
+			entry.span = spans.size();
+		}
+
+		const size_t begin = c * chunkSize, end = std::min(begin + chunkSize, triangleCount);
+		size_t s = std::upper_bound(spanStart.begin(), spanStart.end(), begin) - spanStart.begin() - 1;
+		size_t currentSpan = spans.size();
+		InstanceTransforms instance;
+
+		for (size_t t = begin; t < end; ++t)
+		{
+			while (t >= spanStart[s + 1])
+			{
+				++s;
+			}
+			const Span & span = spans[s];
+			const RasterDraw & draw = draws[span.draw];
+			const VertexFetch & fetch = fetches[span.draw];
+			const DrawElementsIndirectCommand & command = draw.commands[span.command];
+			if (s != currentSpan)
+			{
+				instance = makeInstanceTransforms(draw.instances[span.instance], uniforms);
+				currentSpan = s;
+			}
+
+			auto lookup = [&](uint32_t index) -> CachedVertex & {
+				CachedVertex & entry = cache[index % VERTEX_CACHE_SIZE];
+				if (entry.span != s || entry.index != index)
+				{
+					entry.span = s;
+					entry.index = index;
+					entry.shaded = false;
+					entry.clip = clipPosition(draw.vertices + (size_t) index * fetch.stride, fetch, instance);
+				}
+				return entry;
+			};
+			// Copied out, the corners may share a cache entry
+			auto varyings = [&](uint32_t index) {
+				CachedVertex & entry = lookup(index);
+				if (!entry.shaded)
+				{
+					entry.varyings = shadeVertex(draw.vertices + (size_t) index * fetch.stride, fetch, instance, lightPositionCamera);
+					entry.shaded = true;
+				}
+				return entry.varyings;
+			};
+
+			uint32_t indices[3];
+			glm::vec4 clips[3];
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				const size_t element = command.firstIndex + (t - spanStart[s]) * 3 + corner;
+				indices[corner] = (draw.indexType == GL_UNSIGNED_SHORT
+					? ((const uint16_t *) draw.indices)[element]
+					: ((const uint32_t *) draw.indices)[element]) + command.baseVertex;
+				clips[corner] = lookup(indices[corner]).clip;
+			}
+
+			// Trivially rejected outside one plane, clipped only when crossing one
+			bool rejected = false, crossing = false;
+			for (const glm::vec4 & plane : clipPlanes)
+			{
+				const float d0 = glm::dot(plane, clips[0]), d1 = glm::dot(plane, clips[1]), d2 = glm::dot(plane, clips[2]);
+				rejected |= d0 < 0.0f && d1 < 0.0f && d2 < 0.0f;
+				crossing |= d0 < 0.0f || d1 < 0.0f || d2 < 0.0f;
+			}
+			if (rejected)
+			{
+				continue;
+			}
+
+			// Sets up and bins one triangle, the unclipped one shades its corners only when binned
+			auto emit = [&](const glm::vec4 * const corners[3], const Varyings * const clippedVaryings[3]) {
+				Triangle triangle;
+				int order[3];
+				if (!setupTriangle(corners, width, height, triangle, order))
+				{
+					return;
+				}
+
+				const uint32_t triangleIndex = (uint32_t) chunk.triangles.size();
+				const size_t binnedBefore = chunk.binned.size();
+				const int tx0 = triangle.minX / TILE_SIZE, tx1 = triangle.maxX / TILE_SIZE;
+				const int ty0 = triangle.minY / TILE_SIZE, ty1 = triangle.maxY / TILE_SIZE;
+				for (int ty = ty0; ty <= ty1; ++ty)
+				{
+					for (int tx = tx0; tx <= tx1; ++tx)
+					{
+						// Skip the tiles of the bounds the triangle misses
+						if (tx0 != tx1 || ty0 != ty1)
+						{
+							const int x0 = std::max(tx * TILE_SIZE, triangle.minX) - triangle.minX, x1 = std::min(tx * TILE_SIZE + TILE_SIZE - 1, triangle.maxX) - triangle.minX;
+							const int y0 = std::max(ty * TILE_SIZE, triangle.minY) - triangle.minY, y1 = std::min(ty * TILE_SIZE + TILE_SIZE - 1, triangle.maxY) - triangle.minY;
+							bool outside = false;
+							for (int k = 0; k < 3 && !outside; ++k)
+							{
+								outside = classifyEdge(triangle.a[k], triangle.b[k], triangle.c[k], x0, y0, x1, y1) < 0;
+							}
+							if (outside)
+							{
+								continue;
+							}
+						}
+						chunk.binned.push_back({(uint32_t) (ty * tilesX + tx), triangleIndex});
+					}
+				}
+				if (chunk.binned.size() == binnedBefore)
+				{
+					return;
+				}
+
+				Varyings cornerVaryings[3];
+				for (int corner = 0; corner < 3; ++corner)
+				{
+					cornerVaryings[corner] = clippedVaryings ? *clippedVaryings[order[corner]] : varyings(indices[order[corner]]);
+				}
+				triangle.v0 = cornerVaryings[0];
+				triangle.d1 = subtract(cornerVaryings[1], triangle.v0);
+				triangle.d2 = subtract(cornerVaryings[2], triangle.v0);
+				triangle.colorTexture = draw.colorTexture;
+				triangle.normalTexture = draw.normalTexture;
+				chunk.triangles.push_back(triangle);
+			};
+
+			if (!crossing)
+			{
+				const glm::vec4 * const corners[3] = {&clips[0], &clips[1], &clips[2]};
+				emit(corners, nullptr);
+				continue;
+			}
+
+			ShadedVertex polygon[2][9];
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				polygon[0][corner].clip = clips[corner];
+				polygon[0][corner].varyings = varyings(indices[corner]);
+			}
+			size_t vertexCount = 3;
+			int current = 0;
+			for (const glm::vec4 & plane : clipPlanes)
+			{
+				bool planeCrossing = false;
+				for (size_t i = 0; i < vertexCount; ++i)
+				{
+					planeCrossing |= glm::dot(plane, polygon[current][i].clip) < 0.0f;
+				}
+				if (planeCrossing)
+				{
+					vertexCount = clipPolygon(polygon[current], vertexCount, plane, polygon[1 - current]);
+					current = 1 - current;
+				}
+			}
+
+			// Fan of the clipped polygon
+			for (size_t i = 1; i + 1 < vertexCount; ++i)
+			{
+				const ShadedVertex * fan[3] = {&polygon[current][0], &polygon[current][i], &polygon[current][i + 1]};
+				const glm::vec4 * const corners[3] = {&fan[0]->clip, &fan[1]->clip, &fan[2]->clip};
+				const Varyings * const cornerVaryings[3] = {&fan[0]->varyings, &fan[1]->varyings, &fan[2]->varyings};
+				emit(corners, cornerVaryings);
+			}
+		}
+
+		// Counting sort by tile, keeping the submission order in each tile
+		chunk.tileStart.assign(tileCount + 1, 0);
+		for (const Chunk::Binned & entry : chunk.binned)
+		{
+			chunk.tileStart[entry.tile + 1]++;
+		}
+		for (size_t tile = 0; tile < tileCount; ++tile)
+		{
+			chunk.tileStart[tile + 1] += chunk.tileStart[tile];
+		}
+		chunk.tileTriangles.resize(chunk.binned.size());
+		std::vector<uint32_t> cursor(chunk.tileStart.begin(), chunk.tileStart.end() - 1);
+		for (const Chunk::Binned & entry : chunk.binned)
+		{
+			chunk.tileTriangles[cursor[entry.tile]++] = entry.triangle;
+		}
+	});
+
+	for (size_t c = 0; c < chunkCount; ++c)
+	{
+		lastStats.setupTriangles += chunks[c].triangles.size();
+		lastStats.binnedTriangles += chunks[c].binned.size();
+	}
+	const auto backStart = std::chrono::steady_clock::now();
+	lastStats.frontEndMs = std::chrono::duration<double, std::milli>(backStart - frontStart).count();
+
+	// Back end: each tile walks the chunks in order
+	activeChunks = chunkCount;
+	std::vector<size_t> tileFragments(tileCount, 0);
+	pool.parallelFor(tileCount, [&](size_t tile) {
+		rasterizeTile(tile, uniforms, tileFragments[tile]);
+	});
+	for (size_t fragments : tileFragments)
+	{
+		lastStats.fragments += fragments;
+	}
+	lastStats.backEndMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - backStart).count();
+
+	draws.clear();
+}
+
+void Rasterizer::rasterizeTile(size_t tile, const RasterUniforms & uniforms, size_t & fragments)
+{
+	const int tileX0 = (int) (tile % tilesX) * TILE_SIZE, tileY0 = (int) (tile / tilesX) * TILE_SIZE;
+	const int tileX1 = std::min(tileX0 + TILE_SIZE, stride) - 1, tileY1 = std::min(tileY0 + TILE_SIZE, height) - 1;
+
+	for (size_t c = 0; c < activeChunks; ++c)
+	{
+		const Chunk & chunk = chunks[c];
+		for (uint32_t i = chunk.tileStart[tile]; i < chunk.tileStart[tile + 1]; ++i)
+		{
+			const Triangle & triangle = chunk.triangles[chunk.tileTriangles[i]];
+
+			// Groups of 4 pixels aligned to 4, within the tile, relative to (minX, minY)
+			const int x0 = (std::max(triangle.minX, tileX0) & ~3) - triangle.minX;
+			const int x1 = (std::min(triangle.maxX, tileX1) | 3) - triangle.minX;
+			const int y0 = std::max(triangle.minY, tileY0) - triangle.minY;
+			const int y1 = std::min(triangle.maxY, tileY1) - triangle.minY;
+
+			// Edges the whole block is inside of are dropped, the others fit in 32 bits
+			int32_t a[3], b[3], e[3];
+			bool outside = false;
+			for (int k = 0; k < 3; ++k)
+			{
+				const int coverage = classifyEdge(triangle.a[k], triangle.b[k], triangle.c[k], x0, y0, x1, y1);
+				outside |= coverage < 0;
+				a[k] = coverage > 0 ? 0 : (int32_t) triangle.a[k];
+				b[k] = coverage > 0 ? 0 : (int32_t) triangle.b[k];
+				e[k] = coverage > 0 ? 0 : (int32_t) (triangle.a[k] * x0 + triangle.b[k] * y0 + triangle.c[k]);
+			}
+			if (outside)
+			{
+				continue;
+			}
+
+			const glm::vec3 & zp = triangle.depthPlane;
+			for (int y = y0; y <= y1; ++y)
+			{
+				const size_t row = (size_t) (y + triangle.minY) * stride + triangle.minX;
+				int32_t rowEdge[3];
+				for (int k = 0; k < 3; ++k)
+				{
+					rowEdge[k] = e[k] + b[k] * (y - y0);
+				}
+				const float rowDepth = zp.y * y + zp.z;
+
+#ifdef RASTER_SSE
+				__m128i edge[3], edgeStep[3];
+				for (int k = 0; k < 3; ++k)
+				{
+					edge[k] = _mm_add_epi32(_mm_set1_epi32(rowEdge[k]), _mm_set_epi32(a[k] * 3, a[k] * 2, a[k], 0));
+					edgeStep[k] = _mm_set1_epi32(a[k] * 4);
+				}
+				__m128 z = _mm_add_ps(_mm_set1_ps(rowDepth + zp.x * x0), _mm_set_ps(zp.x * 3, zp.x * 2, zp.x, 0.0f));
+				const __m128 zStep = _mm_set1_ps(zp.x * 4);
+#endif
+
+				for (int x = x0; x <= x1; x += 4)
+				{
+					float * depthGroup = &depth[row + x];
+					int mask;
+#ifdef RASTER_SSE
+					// Covered when no edge function is negative, then depth tested
+					const __m128i sign = _mm_or_si128(_mm_or_si128(edge[0], edge[1]), edge[2]);
+					const int covered = ~_mm_movemask_ps(_mm_castsi128_ps(sign)) & 0xF;
+					if (covered)
+					{
+						const __m128 stored = _mm_loadu_ps(depthGroup);
+						const __m128 pass = _mm_and_ps(_mm_cmplt_ps(z, stored), _mm_castsi128_ps(_mm_cmpgt_epi32(sign, _mm_set1_epi32(-1))));
+						mask = _mm_movemask_ps(pass);
+						_mm_storeu_ps(depthGroup, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, stored)));
+					}
+					else
+					{
+						mask = 0;
+					}
+					for (int k = 0; k < 3; ++k)
+					{
+						edge[k] = _mm_add_epi32(edge[k], edgeStep[k]);
+					}
+					z = _mm_add_ps(z, zStep);
+#else
+					mask = 0;
+					for (int lane = 0; lane < 4; ++lane)
+					{
+						const int px = x + lane;
+						const int32_t dx = px - x0;
+						const bool inside = rowEdge[0] + a[0] * dx >= 0 && rowEdge[1] + a[1] * dx >= 0 && rowEdge[2] + a[2] * dx >= 0;
+						const float z = rowDepth + zp.x * px;
+						if (inside && z < depthGroup[lane])
+						{
+							depthGroup[lane] = z;
+							mask |= 1 << lane;
+						}
+					}
+#endif
+
+					// Shade the fragments that passed
+					while (mask)
+					{
+						const int lane = mask & 1 ? 0 : mask & 2 ? 1 : mask & 4 ? 2 : 3;
+						mask &= mask - 1;
+						const float px = (float) (x + lane), py = (float) y;
+
+						const glm::vec3 & qp = triangle.qPlane;
+						const glm::vec3 & l1 = triangle.lambda1Plane;
+						const glm::vec3 & l2 = triangle.lambda2Plane;
+						const float q = qp.x * px + qp.y * py + qp.z;
+						const float inverseQ = 1.0f / q;
+						const float b1 = (l1.x * px + l1.y * py + l1.z) * inverseQ;
+						const float b2 = (l2.x * px + l2.y * py + l2.z) * inverseQ;
+						const Varyings v = interpolate(triangle.v0, triangle.d1, triangle.d2, b1, b2);
+
+						// Exact screen derivatives of the texture coordinates, for the mip level
+						const glm::vec2 uvDx = triangle.d1.uv * ((l1.x - b1 * qp.x) * inverseQ) + triangle.d2.uv * ((l2.x - b2 * qp.x) * inverseQ);
+						const glm::vec2 uvDy = triangle.d1.uv * ((l1.y - b1 * qp.y) * inverseQ) + triangle.d2.uv * ((l2.y - b2 * qp.y) * inverseQ);
+
+						// Pixel centers in window coordinates, like gl_FragCoord
+						const glm::vec2 fragCoord(triangle.minX + px + 0.5f, triangle.minY + py + 0.5f);
+						color[row + x + lane] = packColor(shadeFragment(v, fragCoord, width, height, uvDx, uvDy, triangle.colorTexture, triangle.normalTexture, uniforms));
+						fragments++;
+					}
+				}
+			}
+		}
+	}
+}
+
+Image Rasterizer::readPixels() const
+{
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.data.resize((size_t) width * height * 3);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			const uint32_t pixel = color[(size_t) y * stride + x];
+			unsigned char * out = &image.data[((size_t) y * width + x) * 3];
+			out[0] = (unsigned char) pixel;
+			out[1] = (unsigned char) (pixel >> 8);
+			out[2] = (unsigned char) (pixel >> 16);
+		}
+	}
+	return image;
+}
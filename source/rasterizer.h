@@ -0,0 +1,117 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "texture.h"
+#include "vertex_format.h"
+#include "batching.h"
+#include "thread_pool.h"
+#include "clustered_lighting.h"
+
+// RGB8 texture sampled like a GL_REPEAT, GL_LINEAR_MIPMAP_LINEAR one
+class RasterTexture
+{
+public:
+	// Levels from BuildMipChain, the same CreateTexture uploads
+	explicit RasterTexture(std::vector<Image> levels);
+
+	// Trilinear sample, the level chosen from the screen derivatives of uv
+	glm::vec3 sample(const glm::vec2 & uv, const glm::vec2 & uvDx, const glm::vec2 & uvDy) const;
+
+	size_t levelCount() const { return levels.size(); }
+
+private:
+	glm::vec3 bilinear(const Image & level, const glm::vec2 & uv) const;
+
+	std::vector<Image> levels;
+};
+
+// Uniforms of shader.vert and shader.frag shared by every draw of a frame
+struct RasterUniforms
+{
+	glm::mat4 view;
+	glm::mat4 viewProjection;
+	glm::vec3 lightPosition;
+	glm::vec3 lightColor;
+	float lightIntensity;
+	const LightClusters * clusters = nullptr; // point lights of the frame, built for the same view
+};
+
+// One glMultiDrawElementsIndirect call of the instanced path, reading the
+// same interleaved vertices, index buffer, commands and instance data.
+// Nothing is copied: the buffers must outlive Rasterizer::render.
+struct RasterDraw
+{
+	const unsigned char * vertices;
+	const VertexFormat * format;
+	const void * indices;
+	GLenum indexType; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	const DrawElementsIndirectCommand * commands;
+	size_t commandCount;
+	const InstanceData * instances; // indexed by baseInstance + instance
+	const RasterTexture * colorTexture = nullptr; // unbound units read black, like GL
+	const RasterTexture * normalTexture = nullptr;
+};
+
+struct RasterStats
+{
+	size_t triangles = 0; // submitted
+	size_t setupTriangles = 0; // after clipping and removing the degenerate and off screen ones
+	size_t binnedTriangles = 0; // triangle and tile pairs
+	size_t fragments = 0; // shaded, after the depth test
+	double frontEndMs = 0.0; // vertex shading, clipping, setup and binning
+	double backEndMs = 0.0; // tile rasterization and shading
+};
+
+// Software renderer reproducing shader.vert and shader.frag with depth
+// testing (GL_LESS), as a reference for the GL path and a fallback without GPU.
+// Triangles are shaded, clipped and binned to 64x64 tiles in parallel chunks,
+// then the tiles are rasterized in parallel with 4-wide SIMD edge functions,
+// each one walking the chunks in order so results do not depend on threading.
+class Rasterizer
+{
+public:
+	static const int TILE_SIZE = 64;
+
+	Rasterizer(int width, int height);
+	~Rasterizer();
+
+	Rasterizer(const Rasterizer&) = delete;
+	Rasterizer& operator=(const Rasterizer&) = delete;
+
+	void clear(const glm::vec3 & color);
+
+	// Queued until render
+	void draw(const RasterDraw & draw);
+
+	// Runs the queued draws into the color and depth buffers, then empties the queue
+	void render(const RasterUniforms & uniforms, ThreadPool & pool = ThreadPool::global());
+
+	// Color buffer as RGB rows, bottom row first like OffscreenTarget::readPixels
+	Image readPixels() const;
+
+	const RasterStats & stats() const { return lastStats; }
+
+	const int width, height;
+
+private:
+	struct Triangle;
+	struct Chunk;
+
+	void rasterizeTile(size_t tile, const RasterUniforms & uniforms, size_t & fragments);
+
+	const int tilesX, tilesY;
+	int stride; // pixels per row, a multiple of 4
+	std::vector<uint32_t> color; // 0xAABBGGRR
+	std::vector<float> depth; // window z, cleared to 1
+
+	std::vector<RasterDraw> draws;
+	std::vector<Chunk> chunks; // kept between frames for their storage
+	size_t activeChunks = 0;
+	RasterStats lastStats;
+};
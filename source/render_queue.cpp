@@ -0,0 +1,355 @@
+#include "render_queue.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace
+{
+	const int PASS_BITS = 4;
+	const int PROGRAM_BITS = 8;
+	const int MATERIAL_BITS = 12;
+	const int MESH_BITS = 16;
+	const int DEPTH_BITS = 24;
+
+	uint64_t field(uint32_t value, int bits)
+	{
+		return value & ((1u << bits) - 1);
+	}
+}
+
+uint64_t RenderSortKey(RenderPass pass, uint32_t program, uint32_t material, uint32_t mesh, float depth)
+{
+	const float clamped = std::min(std::max(depth, 0.0f), 1.0f);
+	const uint32_t quantized = (uint32_t) (clamped * ((1u << DEPTH_BITS) - 1) + 0.5f);
+	const uint64_t state = (field(program, PROGRAM_BITS) << (MATERIAL_BITS + MESH_BITS))
+		| (field(material, MATERIAL_BITS) << MESH_BITS) | field(mesh, MESH_BITS);
+
+	uint64_t key = field(pass, PASS_BITS) << (64 - PASS_BITS);
+	if (pass == RENDER_PASS_TRANSPARENT)
+	{
+		// Far first, then state among draws at the same depth
+		key |= field(~quantized, DEPTH_BITS) << (PROGRAM_BITS + MATERIAL_BITS + MESH_BITS);
+		key |= state;
+	}
+	else
+	{
+		key |= state << DEPTH_BITS;
+		key |= quantized;
+	}
+	return key;
+}
+
+void RenderStateStats::add(const RenderStateStats & other)
+{
+	draws += other.draws;
+	programs += other.programs;
+	textures += other.textures;
+	vertexInputs += other.vertexInputs;
+	attributeToggles += other.attributeToggles;
+	buffers += other.buffers;
+	uniforms += other.uniforms;
+	skipped += other.skipped;
+}
+
+const GLuint RenderState::UNKNOWN;
+
+RenderState::RenderState(bool submit)
+	: submit(submit)
+{
+	reset();
+}
+
+void RenderState::reset()
+{
+	program = UNKNOWN;
+	std::fill(textures, textures + RenderDraw::TEXTURE_UNITS, UNKNOWN);
+	vertexBuffer = UNKNOWN;
+	elementBuffer = UNKNOWN;
+	instanceBuffer = UNKNOWN;
+	instanceOffset = 0;
+	indirectBuffer = UNKNOWN;
+	format = nullptr;
+	uniformValues.clear();
+	counters = RenderStateStats();
+}
+
+void RenderState::useProgram(GLuint name)
+{
+	if (name == program)
+	{
+		counters.skipped++;
+		return;
+	}
+	program = name;
+	counters.programs++;
+	if (submit)
+	{
+		glUseProgram(name);
+	}
+}
+
+void RenderState::bindTexture(GLuint unit, GLuint texture)
+{
+	if (textures[unit] == texture)
+	{
+		counters.skipped++;
+		return;
+	}
+	textures[unit] = texture;
+	counters.textures++;
+	if (submit)
+	{
+		glBindTextureUnit(unit, texture);
+	}
+}
+
+void RenderState::setUniform(const RenderUniform & uniform)
+{
+	if (uniform.location < 0)
+	{
+		return;
+	}
+
+	// A handful of values per program, a linear search is enough
+	auto found = std::find_if(uniformValues.begin(), uniformValues.end(), [&](const UniformValue & known) {
+		return known.program == program && known.location == uniform.location;
+	});
+	if (found != uniformValues.end() && found->value == uniform.value)
+	{
+		counters.skipped++;
+		return;
+	}
+	if (found == uniformValues.end())
+	{
+		uniformValues.push_back({program, uniform.location, uniform.value});
+	}
+	else
+	{
+		found->value = uniform.value;
+	}
+	counters.uniforms++;
+	if (submit)
+	{
+		glProgramUniform1i(program, uniform.location, uniform.value);
+	}
+}
+
+void RenderState::bindVertexInput(GLuint buffer, const VertexFormat * vertexFormat, GLuint instances, size_t instancesOffset)
+{
+	if (buffer != vertexBuffer || vertexFormat != format)
+	{
+		// Only the arrays switching on or off are toggled
+		uint32_t mask = 0;
+		for (const VertexFormat::Attribute & attribute : vertexFormat->attributes)
+		{
+			mask |= 1u << attribute.location;
+		}
+		for (uint32_t changed = mask ^ enabledAttributes; changed; changed &= changed - 1)
+		{
+			GLuint location = 0;
+			while (!(changed >> location & 1))
+			{
+				location++;
+			}
+			counters.attributeToggles++;
+			if (submit)
+			{
+				if (mask >> location & 1)
+				{
+					glEnableVertexAttribArray(location);
+				}
+				else
+				{
+					glDisableVertexAttribArray(location);
+				}
+			}
+		}
+		enabledAttributes = mask;
+
+		vertexBuffer = buffer;
+		format = vertexFormat;
+		counters.vertexInputs++;
+		if (submit)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			for (const VertexFormat::Attribute & attribute : vertexFormat->attributes)
+			{
+				glVertexAttribPointer(attribute.location, attribute.size, attribute.type, attribute.normalized,
+					(GLsizei) vertexFormat->stride, (void *) attribute.offset);
+			}
+		}
+	}
+	else
+	{
+		counters.skipped++;
+	}
+
+	if (instances != instanceBuffer || (instances && instancesOffset != instanceOffset))
+	{
+		counters.buffers++;
+		if (submit)
+		{
+			if (instances)
+			{
+				glBindBuffer(GL_ARRAY_BUFFER, instances);
+				BindInstanceFormat(instancesOffset);
+			}
+			else if (instanceBuffer != UNKNOWN)
+			{
+				UnbindInstanceFormat();
+			}
+		}
+		instanceBuffer = instances;
+		instanceOffset = instancesOffset;
+	}
+	else
+	{
+		counters.skipped++;
+	}
+}
+
+void RenderState::bindElementBuffer(GLuint buffer)
+{
+	if (buffer == elementBuffer)
+	{
+		counters.skipped++;
+		return;
+	}
+	elementBuffer = buffer;
+	counters.buffers++;
+	if (submit)
+	{
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+	}
+}
+
+void RenderState::bindIndirectBuffer(GLuint buffer)
+{
+	if (buffer == indirectBuffer)
+	{
+		counters.skipped++;
+		return;
+	}
+	indirectBuffer = buffer;
+	counters.buffers++;
+	if (submit)
+	{
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+	}
+}
+
+void RenderState::drawIndirect(GLenum indexType, size_t indirectOffset, uint32_t firstCommand, uint32_t commandCount)
+{
+	counters.draws++;
+	if (submit)
+	{
+		glMultiDrawElementsIndirect(GL_TRIANGLES, indexType, (void *) (indirectOffset + firstCommand * sizeof(DrawElementsIndirectCommand)), commandCount, 0);
+	}
+}
+
+void RenderState::finish()
+{
+	if (submit)
+	{
+		for (GLuint location = 0; location < 32; location++)
+		{
+			if (enabledAttributes >> location & 1)
+			{
+				glDisableVertexAttribArray(location);
+			}
+		}
+		if (instanceBuffer != 0 && instanceBuffer != UNKNOWN)
+		{
+			UnbindInstanceFormat();
+		}
+	}
+	enabledAttributes = 0;
+	vertexBuffer = UNKNOWN;
+	format = nullptr;
+	instanceBuffer = 0;
+}
+
+void RenderQueue::clear()
+{
+	draws.clear();
+	keys.clear();
+	order.clear();
+}
+
+void RenderQueue::push(uint64_t key, const RenderDraw & draw)
+{
+	order.push_back((uint32_t) draws.size());
+	draws.push_back(draw);
+	keys.push_back(key);
+}
+
+void RenderQueue::sort()
+{
+	PROFILE_SCOPE("RenderQueue::sort");
+
+	// Every byte histogram in one pass over the keys
+	const size_t count = keys.size();
+	uint32_t histograms[8][256] = {};
+	for (const uint64_t key : keys)
+	{
+		for (int byte = 0; byte < 8; byte++)
+		{
+			histograms[byte][key >> (byte * 8) & 0xFF]++;
+		}
+	}
+
+	// Only keys and 32-bit draw indices move, the draws stay where they were pushed
+	scratchKeys.resize(count);
+	scratchOrder.resize(count);
+	for (int byte = 0; byte < 8; byte++)
+	{
+		// A byte all the keys share leaves the order as it is
+		uint32_t * histogram = histograms[byte];
+		const int shift = byte * 8;
+		if (count == 0 || histogram[keys[0] >> shift & 0xFF] == count)
+		{
+			continue;
+		}
+
+		uint32_t offset = 0;
+		for (int digit = 0; digit < 256; digit++)
+		{
+			const uint32_t size = histogram[digit];
+			histogram[digit] = offset;
+			offset += size;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			const uint32_t slot = histogram[keys[i] >> shift & 0xFF]++;
+			scratchKeys[slot] = keys[i];
+			scratchOrder[slot] = order[i];
+		}
+		keys.swap(scratchKeys);
+		order.swap(scratchOrder);
+	}
+}
+
+void RenderQueue::execute(RenderState & state) const
+{
+	PROFILE_SCOPE("RenderQueue::execute");
+
+	for (const uint32_t index : order)
+	{
+		const RenderDraw & draw = draws[index];
+		state.useProgram(draw.program);
+		for (int unit = 0; unit < RenderDraw::TEXTURE_UNITS; unit++)
+		{
+			state.bindTexture(unit, draw.textures[unit]);
+		}
+		for (const RenderUniform & uniform : draw.uniforms)
+		{
+			state.setUniform(uniform);
+		}
+		state.bindVertexInput(draw.vertexBuffer, draw.format, draw.instanceBuffer, draw.instanceOffset);
+		state.bindElementBuffer(draw.elementBuffer);
+		state.bindIndirectBuffer(draw.indirectBuffer);
+		state.drawIndirect(draw.indexType, draw.indirectOffset, draw.firstCommand, draw.commandCount);
+	}
+	state.finish();
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <cstdint>
+
+#include "vertex_format.h"
+#include "batching.h"
+
+// Passes run in order. Opaque draws are sorted by state then front to back,
+// transparent ones back to front first.
+enum RenderPass
+{
+	RENDER_PASS_OPAQUE = 0,
+	RENDER_PASS_TRANSPARENT = 1,
+};
+
+// Key bits, from the most significant: pass 4, then program 8, material 12,
+// mesh 16 and depth 24 for opaque draws, or depth 24 (reversed), program 8,
+// material 12 and mesh 16 for transparent ones. Larger ids are truncated to
+// their field, depth is clamped to [0, 1].
+uint64_t RenderSortKey(RenderPass pass, uint32_t program, uint32_t material, uint32_t mesh, float depth);
+
+// A glUniform1i the draw needs, skipped while the program already has the value
+struct RenderUniform
+{
+	GLint location; // -1 is ignored, like GL does
+	GLint value;
+};
+
+// Everything a queued glMultiDrawElementsIndirect binds, by GL name.
+// Textures go to units 0 and up, unused units are 0.
+struct RenderDraw
+{
+	static const int TEXTURE_UNITS = 2;
+	static const int UNIFORMS = 2;
+
+	GLuint program;
+	GLuint vertexBuffer;
+	const VertexFormat * format;
+	GLuint instanceBuffer; // read through BindInstanceFormat, 0 for none
+	size_t instanceOffset; // of instance 0
+	GLuint elementBuffer;
+	GLenum indexType;
+	GLuint textures[TEXTURE_UNITS];
+	RenderUniform uniforms[UNIFORMS];
+	GLuint indirectBuffer;
+	size_t indirectOffset; // of command 0
+	uint32_t firstCommand;
+	uint32_t commandCount;
+};
+
+struct RenderStateStats
+{
+	size_t draws = 0;
+	size_t programs = 0; // glUseProgram
+	size_t textures = 0; // glBindTextureUnit
+	size_t vertexInputs = 0; // vertex buffer and format changes
+	size_t attributeToggles = 0; // glEnable/DisableVertexAttribArray
+	size_t buffers = 0; // element, instance and indirect buffer binds
+	size_t uniforms = 0; // glUniform1i
+	size_t skipped = 0; // calls the state already matched
+
+	size_t changes() const { return programs + textures + vertexInputs + attributeToggles + buffers + uniforms; }
+	void add(const RenderStateStats & other);
+};
+
+// GL state as the last draws left it, so each draw only issues the calls
+// that change something. Bindings are forgotten by reset(), since code
+// outside the queue binds buffers and textures too. Without submit, nothing
+// is called and only the statistics are kept, which needs no GL context.
+class RenderState
+{
+public:
+	explicit RenderState(bool submit = true);
+
+	// Bindings unknown, program uniforms forgotten, statistics cleared.
+	// Attribute arrays are still assumed disabled, see finish().
+	void reset();
+
+	void useProgram(GLuint program);
+	void bindTexture(GLuint unit, GLuint texture);
+	void setUniform(const RenderUniform & uniform);
+	void bindVertexInput(GLuint buffer, const VertexFormat * format, GLuint instanceBuffer, size_t instanceOffset);
+	void bindElementBuffer(GLuint buffer);
+	void bindIndirectBuffer(GLuint buffer);
+	void drawIndirect(GLenum indexType, size_t indirectOffset, uint32_t firstCommand, uint32_t commandCount);
+
+	// Disables the attribute arrays the draws enabled, so the next frame
+	// starts from none
+	void finish();
+
+	const RenderStateStats & stats() const { return counters; }
+
+private:
+	static const GLuint UNKNOWN = ~0u;
+
+	const bool submit;
+	GLuint program;
+	GLuint textures[RenderDraw::TEXTURE_UNITS];
+	GLuint vertexBuffer, elementBuffer, instanceBuffer, indirectBuffer;
+	size_t instanceOffset;
+	const VertexFormat * format;
+	uint32_t enabledAttributes = 0; // of the vertex formats, bit per location
+	struct UniformValue
+	{
+		GLuint program;
+		GLint location;
+		GLint value;
+	};
+	std::vector<UniformValue> uniformValues;
+	RenderStateStats counters;
+};
+
+// Draws of a frame, sorted by key with a stable LSD radix sort on the bytes
+// that differ, then replayed through a RenderState. The sort moves keys and
+// draw indices, never the draws themselves.
+class RenderQueue
+{
+public:
+	void clear();
+	void push(uint64_t key, const RenderDraw & draw);
+
+	// Orders the draws by key
+	void sort();
+
+	// The draws in order through state, then state.finish()
+	void execute(RenderState & state) const;
+
+	size_t size() const { return draws.size(); }
+	uint64_t key(size_t i) const { return keys[i]; }
+	const RenderDraw & draw(size_t i) const { return draws[order[i]]; }
+
+private:
+	std::vector<RenderDraw> draws; // in push order
+	std::vector<uint64_t> keys, scratchKeys;
+	std::vector<uint32_t> order, scratchOrder; // draws index of each key
+};
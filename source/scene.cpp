@@ -0,0 +1,192 @@
+#include "scene.h"
+#include "frustum.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCENE_SSE 1
+#endif
+
+namespace
+{
+	// Objects per culling task, a multiple of 4
+	const size_t CULL_BLOCK = 4096;
+
+	// Writes the ids of the objects of [begin, end) touching the frustum to out, returns how many
+	size_t cullBlock(const Frustum & frustum, size_t begin, size_t end,
+		const float * cx, const float * cy, const float * cz,
+		const float * ex, const float * ey, const float * ez, uint32_t * out)
+	{
+		size_t count = 0;
+		size_t i = begin;
+
+#ifdef SCENE_SSE
+		// A box is outside when center distance + projected extent < 0 for one plane
+		__m128 nx[6], ny[6], nz[6], nw[6], ax[6], ay[6], az[6];
+		for (int p = 0; p < 6; ++p)
+		{
+			const glm::vec4 & plane = frustum.planes[p];
+			nx[p] = _mm_set1_ps(plane.x);
+			ny[p] = _mm_set1_ps(plane.y);
+			nz[p] = _mm_set1_ps(plane.z);
+			nw[p] = _mm_set1_ps(plane.w);
+			ax[p] = _mm_set1_ps(std::fabs(plane.x));
+			ay[p] = _mm_set1_ps(std::fabs(plane.y));
+			az[p] = _mm_set1_ps(std::fabs(plane.z));
+		}
+
+		const __m128 zero = _mm_setzero_ps();
+		for (; i + 4 <= end; i += 4)
+		{
+			const __m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+			const __m128 hx = _mm_loadu_ps(ex + i), hy = _mm_loadu_ps(ey + i), hz = _mm_loadu_ps(ez + i);
+
+			__m128 outside = _mm_setzero_ps();
+			for (int p = 0; p < 6; ++p)
+			{
+				const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], x), _mm_mul_ps(ny[p], y)), _mm_add_ps(_mm_mul_ps(nz[p], z), nw[p]));
+				const __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[p], hx), _mm_mul_ps(ay[p], hy)), _mm_mul_ps(az[p], hz));
+				outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+			}
+
+			int inside = ~_mm_movemask_ps(outside) & 0xF;
+			while (inside)
+			{
+				const int lane = inside & 1 ? 0 : inside & 2 ? 1 : inside & 4 ? 2 : 3;
+				out[count++] = (uint32_t) (i + lane);
+				inside &= inside - 1;
+			}
+		}
+#endif
+
+		for (; i < end; ++i)
+		{
+			bool inside = true;
+			for (const auto & plane : frustum.planes)
+			{
+				const float distance = plane.x * cx[i] + plane.y * cy[i] + plane.z * cz[i] + plane.w;
+				const float radius = std::fabs(plane.x) * ex[i] + std::fabs(plane.y) * ey[i] + std::fabs(plane.z) * ez[i];
+				if (distance + radius < 0.0f)
+				{
+					inside = false;
+					break;
+				}
+			}
+			if (inside)
+			{
+				out[count++] = (uint32_t) i;
+			}
+		}
+		return count;
+	}
+}
+
+Aabb ComputeBounds(const glm::vec3 * positions, size_t count)
+{
+	Aabb bounds{glm::vec3(1e30f), glm::vec3(-1e30f)};
+	for (size_t i = 0; i < count; ++i)
+	{
+		bounds.min = glm::min(bounds.min, positions[i]);
+		bounds.max = glm::max(bounds.max, positions[i]);
+	}
+	return bounds;
+}
+
+Aabb TransformBounds(const Aabb & bounds, const glm::mat4 & transform)
+{
+	// Each column moves the box along one axis by its min or max, whichever is lower (Arvo)
+	Aabb result{glm::vec3(transform[3]), glm::vec3(transform[3])};
+	for (int column = 0; column < 3; ++column)
+	{
+		const glm::vec3 axis(transform[column]);
+		const glm::vec3 a = axis * bounds.min[column];
+		const glm::vec3 b = axis * bounds.max[column];
+		result.min += glm::min(a, b);
+		result.max += glm::max(a, b);
+	}
+	return result;
+}
+
+Scene::ObjectId Scene::add(uint32_t mesh, const Aabb & bounds, const glm::mat4 & transform, uint32_t material)
+{
+	const ObjectId object = (ObjectId) meshes.size();
+	meshes.push_back(mesh);
+	materials.push_back(material);
+	transforms.push_back(transform);
+	localBounds.push_back(bounds);
+	for (auto * array : {&centerX, &centerY, &centerZ, &extentX, &extentY, &extentZ})
+	{
+		array->push_back(0.0f);
+	}
+	updateBounds(object);
+	return object;
+}
+
+void Scene::setTransform(ObjectId object, const glm::mat4 & transform)
+{
+	transforms[object] = transform;
+	updateBounds(object);
+}
+
+void Scene::setBounds(ObjectId object, const Aabb & bounds)
+{
+	localBounds[object] = bounds;
+	updateBounds(object);
+}
+
+Aabb Scene::worldBounds(ObjectId object) const
+{
+	const glm::vec3 center(centerX[object], centerY[object], centerZ[object]);
+	const glm::vec3 extent(extentX[object], extentY[object], extentZ[object]);
+	return {center - extent, center + extent};
+}
+
+void Scene::updateBounds(ObjectId object)
+{
+	const Aabb world = TransformBounds(localBounds[object], transforms[object]);
+	const glm::vec3 center = (world.min + world.max) * 0.5f;
+	const glm::vec3 extent = (world.max - world.min) * 0.5f;
+	centerX[object] = center.x;
+	centerY[object] = center.y;
+	centerZ[object] = center.z;
+	extentX[object] = extent.x;
+	extentY[object] = extent.y;
+	extentZ[object] = extent.z;
+}
+
+void Scene::cull(const glm::mat4 & viewProjection, std::vector<ObjectId> & visible, SceneCullStats * stats, ThreadPool & pool) const
+{
+	const Frustum frustum = ExtractFrustum(viewProjection);
+	const size_t count = size();
+	const size_t blocks = (count + CULL_BLOCK - 1) / CULL_BLOCK;
+
+	// Each block writes its survivors at its own offset, then they are packed in order
+	visible.resize(count);
+	std::vector<size_t> blockCounts(blocks);
+	pool.parallelFor(blocks, [&](size_t block) {
+		const size_t begin = block * CULL_BLOCK;
+		const size_t end = std::min(count, begin + CULL_BLOCK);
+		blockCounts[block] = cullBlock(frustum, begin, end, centerX.data(), centerY.data(), centerZ.data(),
+			extentX.data(), extentY.data(), extentZ.data(), visible.data() + begin);
+	});
+
+	size_t total = 0;
+	for (size_t block = 0; block < blocks; ++block)
+	{
+		if (total != block * CULL_BLOCK)
+		{
+			std::memmove(visible.data() + total, visible.data() + block * CULL_BLOCK, blockCounts[block] * sizeof(ObjectId));
+		}
+		total += blockCounts[block];
+	}
+	visible.resize(total);
+
+	if (stats)
+	{
+		stats->objects += count;
+		stats->visibleObjects += total;
+	}
+}
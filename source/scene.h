@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "thread_pool.h"
+
+struct Aabb
+{
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+// Box around count positions, empty (min > max) when count is 0
+Aabb ComputeBounds(const glm::vec3 * positions, size_t count);
+
+// Box around the transformed corners of bounds
+Aabb TransformBounds(const Aabb & bounds, const glm::mat4 & transform);
+
+struct SceneCullStats
+{
+	size_t objects = 0;
+	size_t visibleObjects = 0;
+};
+
+// Objects stored as structure of arrays: each object has mesh and material
+// ids chosen by the caller, a transform and local bounds. World boxes are kept as separate
+// center and extent arrays so culling tests four objects at a time.
+class Scene
+{
+public:
+	typedef uint32_t ObjectId;
+
+	ObjectId add(uint32_t mesh, const Aabb & localBounds, const glm::mat4 & transform = glm::mat4(1.0f), uint32_t material = 0);
+	void setTransform(ObjectId object, const glm::mat4 & transform);
+	void setBounds(ObjectId object, const Aabb & localBounds);
+
+	size_t size() const { return meshes.size(); }
+	uint32_t mesh(ObjectId object) const { return meshes[object]; }
+	uint32_t material(ObjectId object) const { return materials[object]; }
+	const glm::mat4 & transform(ObjectId object) const { return transforms[object]; }
+	Aabb worldBounds(ObjectId object) const;
+
+	// Replaces visible with the objects whose world box touches the frustum
+	// of viewProjection, in increasing order. Blocks of objects are tested on
+	// the pool.
+	void cull(const glm::mat4 & viewProjection, std::vector<ObjectId> & visible,
+		SceneCullStats * stats = nullptr, ThreadPool & pool = ThreadPool::global()) const;
+
+private:
+	void updateBounds(ObjectId object);
+
+	std::vector<uint32_t> meshes;
+	std::vector<uint32_t> materials;
+	std::vector<glm::mat4> transforms;
+	std::vector<Aabb> localBounds;
+
+	std::vector<float> centerX, centerY, centerZ;
+	std::vector<float> extentX, extentY, extentZ;
+};
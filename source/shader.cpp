@@ -1,31 +1,260 @@
-#include <glad/glad.h>
+#include "shader.h"
 
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
 
-GLuint MakeShader(GLuint t, std::string path)
+#include "profiler.h"
+#include "hash.h"
+
+// ARB_parallel_shader_compile, missing from the glad loader
+#ifndef GL_COMPLETION_STATUS_ARB
+#define GL_COMPLETION_STATUS_ARB 0x91B1
+#endif
+
+namespace
 {
-	std::cout << path << std::endl;
-	std::ifstream file(path.c_str(), std::ios::in);
+	const char MAGIC[8] = {'G', 'G', 'L', 'P', 'R', 'O', 'G', '\0'};
+
+	// Bump when the header or the key change
+	const uint32_t VERSION = 1;
+
+	const int MAX_INCLUDE_DEPTH = 16;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t binaryFormat;
+		uint64_t key; // sources and driver
+		uint64_t size; // of the binary following the header
+	};
+
+	std::string readFile(const std::string & path)
+	{
+		std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+		if (!file.good())
+		{
+			throw std::runtime_error("File not found: " + path);
+		}
+
+		std::ostringstream contents;
+		contents << file.rdbuf();
+		return contents.str();
+	}
+
+	std::string directoryOf(const std::string & path)
+	{
+		const size_t slash = path.find_last_of("/\\");
+		return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+	}
+
+	bool isDirective(const std::string & line, size_t first, const char * directive)
+	{
+		return first != std::string::npos && line.compare(first, strlen(directive), directive) == 0;
+	}
+
+	// Appends path to source, its includes expanded in place. Only the stage
+	// file gets the defines, after its #version line.
+	void expand(const std::string & path, ShaderSource & source, const ShaderDefines * defines, int depth)
+	{
+		if (depth > MAX_INCLUDE_DEPTH)
+		{
+			throw std::runtime_error("Shader includes nested too deep: " + path);
+		}
+
+		const std::string number = std::to_string(source.files.size());
+		source.files.push_back(path);
+
+		std::string definitions;
+		if (defines)
+		{
+			for (const std::string & define : *defines)
+			{
+				definitions += "#define " + define + "\n";
+			}
+		}
+		bool defined = definitions.empty();
+
+		std::istringstream lines(readFile(path));
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(lines, line))
+		{
+			lineNumber++;
+			const size_t first = line.find_first_not_of(" \t");
+			if (isDirective(line, first, "#include"))
+			{
+				const size_t open = line.find('"', first);
+				const size_t close = open == std::string::npos ? std::string::npos : line.find('"', open + 1);
+				if (close == std::string::npos)
+				{
+					throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": malformed #include");
+				}
+
+				const std::string included = directoryOf(path) + line.substr(open + 1, close - open - 1);
+				if (std::find(source.files.begin(), source.files.end(), included) == source.files.end())
+				{
+					source.text += "#line 1 " + std::to_string(source.files.size()) + "\n";
+					expand(included, source, nullptr, depth + 1);
+					source.text += "#line " + std::to_string(lineNumber + 1) + " " + number + "\n";
+				}
+				else
+				{
+					// Already in, an empty line keeps the numbering
+					source.text += "\n";
+				}
+				continue;
+			}
 
-	if(!file.good())
+			source.text += line + "\n";
+			if (!defined && isDirective(line, first, "#version"))
+			{
+				source.text += definitions + "#line " + std::to_string(lineNumber + 1) + " " + number + "\n";
+				defined = true;
+			}
+		}
+
+		if (!defined)
+		{
+			source.text = definitions + "#line 1 " + number + "\n" + source.text;
+		}
+	}
+
+	// Errors are reported as source:line, name the sources
+	std::string compileLog(GLuint shader, const ShaderSource & source)
+	{
+		GLint length = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		std::string infoLog(std::max(length, 1), '\0');
+		glGetShaderInfoLog(shader, (GLsizei) infoLog.size(), nullptr, &infoLog[0]);
+
+		std::string message = infoLog.c_str();
+		for (size_t i = 0; i < source.files.size(); i++)
+		{
+			message += "source " + std::to_string(i) + ": " + source.files[i] + "\n";
+		}
+		return message;
+	}
+
+	bool hasParallelCompile()
 	{
-		throw std::runtime_error("File not found: " + path);
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (GLint i = 0; i < count; i++)
+		{
+			const char * extension = (const char *) glGetStringi(GL_EXTENSIONS, i);
+			if (extension && (strcmp(extension, "GL_ARB_parallel_shader_compile") == 0 || strcmp(extension, "GL_KHR_parallel_shader_compile") == 0))
+			{
+				return true;
+			}
+		}
+		return false;
 	}
 
-	std::ostringstream contents;
-	contents << file.rdbuf();
-	file.close();
+	// 0 when the file is missing, stale or refused by the driver
+	GLuint loadBinary(const std::string & path, uint64_t key)
+	{
+		PROFILE_SCOPE("Load program binary");
+		std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+		if (!file.good())
+		{
+			return 0;
+		}
+		std::ostringstream contents;
+		contents << file.rdbuf();
+		const std::string bytes = contents.str();
+
+		Header header;
+		if (bytes.size() < sizeof(Header))
+		{
+			return 0;
+		}
+		memcpy(&header, bytes.data(), sizeof(Header));
+		if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.key != key
+			|| header.size != bytes.size() - sizeof(Header))
+		{
+			return 0;
+		}
 
-	const auto content = contents.str();
-	std::cout << content << std::endl;
+		const GLuint program = glCreateProgram();
+		glProgramBinary(program, header.binaryFormat, bytes.data() + sizeof(Header), (GLsizei) header.size);
 
-	const auto s = glCreateShader(t);
+		GLint success;
+		glGetProgramiv(program, GL_LINK_STATUS, &success);
+		if (!success)
+		{
+			glDeleteProgram(program);
+			return 0;
+		}
+		return program;
+	}
+
+	void saveBinary(const std::string & path, uint64_t key, GLuint program)
+	{
+		PROFILE_SCOPE("Save program binary");
+		GLint length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+		{
+			return;
+		}
+
+		std::vector<char> bytes(sizeof(Header) + length);
+		GLsizei written = 0;
+		GLenum binaryFormat = 0;
+		glGetProgramBinary(program, length, &written, &binaryFormat, bytes.data() + sizeof(Header));
+
+		Header header = {};
+		memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.version = VERSION;
+		header.binaryFormat = binaryFormat;
+		header.key = key;
+		header.size = (uint64_t) written;
+		memcpy(bytes.data(), &header, sizeof(Header));
+		bytes.resize(sizeof(Header) + written);
+
+		// Write next to the target then rename, so a crash never leaves half a binary behind
+		const std::string temporary = path + ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			out.write(bytes.data(), bytes.size());
+			if (!out.good())
+			{
+				throw std::runtime_error("Cannot write program binary: " + path);
+			}
+		}
+
+		std::remove(path.c_str());
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			std::remove(temporary.c_str());
+			throw std::runtime_error("Cannot write program binary: " + path);
+		}
+	}
+}
+
+ShaderSource PreprocessShader(const std::string & path, const ShaderDefines & defines)
+{
+	PROFILE_SCOPE("PreprocessShader");
+	ShaderSource source;
+	expand(path, source, &defines, 0);
+	return source;
+}
+
+GLuint MakeShader(GLenum type, const ShaderSource & source)
+{
+	PROFILE_SCOPE("MakeShader");
+	const auto s = glCreateShader(type);
 
-	GLint sizes[] = {(GLint) content.size()};
-	const auto data = content.data();
+	GLint sizes[] = {(GLint) source.text.size()};
+	const auto data = source.text.data();
 
 	glShaderSource(s, 1, &data, sizes);
 	glCompileShader(s);
@@ -34,24 +263,32 @@ GLuint MakeShader(GLuint t, std::string path)
 	glGetShaderiv(s, GL_COMPILE_STATUS, &success);
 	if(!success)
 	{
-		GLchar infoLog[512];
-		GLsizei l;
-		glGetShaderInfoLog(s, 512, &l, infoLog);
-
-		throw std::runtime_error(infoLog);
+		const std::string message = compileLog(s, source);
+		glDeleteShader(s);
+		throw std::runtime_error(message);
 	}
 
 	return s;
 }
 
-GLuint AttachAndLink(std::vector<GLuint> shaders)
+GLuint MakeShader(GLuint t, std::string path)
+{
+	return MakeShader(t, PreprocessShader(path));
+}
+
+GLuint AttachAndLink(std::vector<GLuint> shaders, bool retrievable)
 {
+	PROFILE_SCOPE("AttachAndLink");
 	const auto prg = glCreateProgram();
 	for(const auto s : shaders)
 	{
 		glAttachShader(prg, s);
 	}
 
+	if(retrievable)
+	{
+		glProgramParameteri(prg, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 	glLinkProgram(prg);
 
 	GLint success;
@@ -67,3 +304,150 @@ GLuint AttachAndLink(std::vector<GLuint> shaders)
 
 	return prg;
 }
+
+ProgramBuild StartProgram(const std::vector<ShaderStage> & stages, const ShaderDefines & defines)
+{
+	PROFILE_SCOPE("StartProgram");
+	ProgramBuild build;
+	build.start = std::chrono::steady_clock::now();
+	if (stages.empty())
+	{
+		throw std::runtime_error("StartProgram: no stage");
+	}
+
+	// The file name only depends on the permutation, so a stale binary is
+	// overwritten instead of piling up next to the new one
+	uint64_t key = HashBytes(&VERSION, sizeof(VERSION));
+	uint64_t name = key;
+	for (const ShaderStage & stage : stages)
+	{
+		build.sources.push_back(PreprocessShader(stage.path, defines));
+		const ShaderSource & source = build.sources.back();
+		build.info.files.insert(build.info.files.end(), source.files.begin(), source.files.end());
+		key = HashBytes(&stage.type, sizeof(stage.type), key);
+		key = HashBytes(source.text.data(), source.text.size(), key);
+		name = HashBytes(stage.path.c_str(), stage.path.size() + 1, HashBytes(&stage.type, sizeof(stage.type), name));
+	}
+	for (const std::string & define : defines)
+	{
+		name = HashBytes(define.c_str(), define.size() + 1, name);
+	}
+
+	// Binaries are only valid for the driver that produced them
+	const std::string driver = std::string((const char *) glGetString(GL_VENDOR)) + "\n"
+		+ (const char *) glGetString(GL_RENDERER) + "\n" + (const char *) glGetString(GL_VERSION);
+	build.key = HashBytes(driver.data(), driver.size(), key);
+
+	GLint binaryFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+	if (binaryFormats > 0)
+	{
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%08x.progbin", (unsigned) name);
+		build.info.cachePath = stages[0].path + suffix;
+
+		build.program = loadBinary(build.info.cachePath, build.key);
+		if (build.program)
+		{
+			build.info.cached = true;
+			return build;
+		}
+	}
+
+	// Only issued here: the driver may compile and link on its own threads,
+	// the statuses are read by FinishProgram
+	build.parallel = hasParallelCompile();
+	build.program = glCreateProgram();
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		const GLuint s = glCreateShader(stages[i].type);
+		const GLint size = (GLint) build.sources[i].text.size();
+		const auto data = build.sources[i].text.data();
+		glShaderSource(s, 1, &data, &size);
+		glCompileShader(s);
+		glAttachShader(build.program, s);
+		glDeleteShader(s);
+		build.shaders.push_back(s);
+	}
+	if (binaryFormats > 0)
+	{
+		glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	glLinkProgram(build.program);
+	return build;
+}
+
+bool FinishProgram(ProgramBuild & build, bool wait)
+{
+	if (!build.info.cached && !build.shaders.empty())
+	{
+		if (!wait && build.parallel)
+		{
+			GLint complete = GL_FALSE;
+			glGetProgramiv(build.program, GL_COMPLETION_STATUS_ARB, &complete);
+			if (!complete)
+			{
+				return false;
+			}
+		}
+
+		PROFILE_SCOPE("FinishProgram");
+		GLint success;
+		for (size_t i = 0; i < build.shaders.size(); i++)
+		{
+			glGetShaderiv(build.shaders[i], GL_COMPILE_STATUS, &success);
+			if (!success)
+			{
+				const std::string message = compileLog(build.shaders[i], build.sources[i]);
+				glDeleteProgram(build.program);
+				build.program = 0;
+				throw std::runtime_error(message);
+			}
+		}
+
+		glGetProgramiv(build.program, GL_LINK_STATUS, &success);
+		if (!success)
+		{
+			GLchar infoLog[512];
+			GLsizei l;
+			glGetProgramInfoLog(build.program, 512, &l, infoLog);
+			glDeleteProgram(build.program);
+			build.program = 0;
+			throw std::runtime_error(infoLog);
+		}
+
+		// Detaching deletes the shaders, they were flagged for it
+		for (const GLuint s : build.shaders)
+		{
+			glDetachShader(build.program, s);
+		}
+		build.shaders.clear();
+
+		if (!build.info.cachePath.empty())
+		{
+			try
+			{
+				saveBinary(build.info.cachePath, build.key, build.program);
+			}
+			catch (const std::exception & e)
+			{
+				std::cerr << e.what() << std::endl;
+			}
+		}
+	}
+
+	build.info.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - build.start).count();
+	return true;
+}
+
+GLuint LoadProgram(const std::vector<ShaderStage> & stages, const ShaderDefines & defines, ProgramInfo * info)
+{
+	PROFILE_SCOPE("LoadProgram");
+	ProgramBuild build = StartProgram(stages, defines);
+	FinishProgram(build, true);
+	if (info)
+	{
+		*info = std::move(build.info);
+	}
+	return build.program;
+}
@@ -1,7 +1,72 @@
+#pragma once
+
 #include <glad/glad.h>
 
 #include <vector>
 #include <string>
+#include <chrono>
+#include <cstdint>
+
+// Injected right after #version, each as "NAME" or "NAME VALUE"
+typedef std::vector<std::string> ShaderDefines;
+
+struct ShaderStage
+{
+	GLenum type;
+	std::string path;
+};
+
+// Source of a stage after #include expansion. Each file is a GLSL source
+// string number in #line directives, so compile errors point at it.
+struct ShaderSource
+{
+	std::string text;
+	std::vector<std::string> files; // the stage file first, then its includes
+};
+
+// Expands #include "file" (relative to the including file, each file once
+// per stage) and adds the defines. Throws std::runtime_error if a file is
+// missing.
+ShaderSource PreprocessShader(const std::string & path, const ShaderDefines & defines = {});
 
+GLuint MakeShader(GLenum type, const ShaderSource & source);
 GLuint MakeShader(GLuint t, std::string path);
-GLuint AttachAndLink(std::vector<GLuint> shaders);
+GLuint AttachAndLink(std::vector<GLuint> shaders, bool retrievable = false);
+
+struct ProgramInfo
+{
+	double ms = 0.0; // preprocessing, compile and link, or binary load
+	bool cached = false; // loaded from the program binary cache
+	std::string cachePath; // empty when the driver has no binary format
+	std::vector<std::string> files; // every source file of every stage
+};
+
+// Program being compiled and linked, by the driver's own threads when it has
+// ARB_parallel_shader_compile, so a relink does not stall the frames
+struct ProgramBuild
+{
+	GLuint program = 0;
+	std::vector<ShaderSource> sources;
+	std::vector<GLuint> shaders; // flagged for deletion, alive while attached
+	uint64_t key = 0;
+	bool parallel = false;
+	ProgramInfo info;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Loads the cached binary, or preprocesses the stages and issues their
+// compile and link. Throws std::runtime_error if a file is missing. An
+// abandoned build is freed with glDeleteProgram.
+ProgramBuild StartProgram(const std::vector<ShaderStage> & stages, const ShaderDefines & defines = {});
+
+// True once build.program is linked, with build.info filled and the binary
+// cached. Blocks until then with wait, or when the driver cannot tell.
+// Throws std::runtime_error with the compile or link log, after deleting
+// the program.
+bool FinishProgram(ProgramBuild & build, bool wait = false);
+
+// Links the stages with the defines, through a glProgramBinary cache next to
+// the first stage: "<path>.<stages and defines hash>.progbin". The binary is
+// keyed by the preprocessed sources and the driver, and rebuilt when either
+// changes.
+GLuint LoadProgram(const std::vector<ShaderStage> & stages, const ShaderDefines & defines = {}, ProgramInfo * info = nullptr);
@@ -0,0 +1,456 @@
+#include "simplify.h"
+#include "profiler.h"
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace
+{
+	// Sum of squared distances to a set of weighted planes
+	struct Quadric
+	{
+		double xx = 0, xy = 0, xz = 0, yy = 0, yz = 0, zz = 0;
+		double x = 0, y = 0, z = 0, c = 0;
+		double weight = 0;
+
+		void addPlane(const glm::vec3 & n, const glm::vec3 & point, double w)
+		{
+			const double a = n.x, b = n.y, cc = n.z;
+			const double d = -(a * point.x + b * point.y + cc * point.z);
+			xx += w * a * a; xy += w * a * b; xz += w * a * cc;
+			yy += w * b * b; yz += w * b * cc; zz += w * cc * cc;
+			x += w * a * d; y += w * b * d; z += w * cc * d;
+			c += w * d * d;
+			weight += w;
+		}
+
+		void add(const Quadric & q)
+		{
+			xx += q.xx; xy += q.xy; xz += q.xz; yy += q.yy; yz += q.yz; zz += q.zz;
+			x += q.x; y += q.y; z += q.z; c += q.c;
+			weight += q.weight;
+		}
+
+		// Weighted mean squared distance of p to the planes
+		double error(const glm::vec3 & p) const
+		{
+			const double px = p.x, py = p.y, pz = p.z;
+			const double e = px * px * xx + py * py * yy + pz * pz * zz
+				+ 2.0 * (px * py * xy + px * pz * xz + py * pz * yz)
+				+ 2.0 * (px * x + py * y + pz * z) + c;
+			return weight > 0.0 ? std::max(e, 0.0) / weight : 0.0;
+		}
+	};
+
+	enum Kind : uint8_t
+	{
+		MANIFOLD, // moves freely
+		FEATURE, // on a border or a seam, moves along it only
+		LOCKED, // corner, or too complex to move safely
+	};
+
+	const uint32_t NONE = 0xFFFFFFFF;
+
+	uint64_t edgeKey(uint32_t a, uint32_t b)
+	{
+		return (uint64_t) a << 32 | b;
+	}
+
+	struct Collapse
+	{
+		uint32_t from, to; // positions
+		double cost;
+	};
+}
+
+std::vector<unsigned int> SimplifyMesh(const std::vector<glm::vec3> & positions, const std::vector<unsigned int> & indices,
+	size_t targetIndexCount, float maxError, float * resultError, ThreadPool & pool)
+{
+	const size_t vertexCount = positions.size();
+	std::vector<unsigned int> result(indices.begin(), indices.end() - indices.size() % 3);
+	if (resultError)
+	{
+		*resultError = 0.0f;
+	}
+	if (result.size() <= targetIndexCount)
+	{
+		return result;
+	}
+
+	// Vertices with bitwise equal positions share a position id, the smallest vertex index among them
+	std::vector<uint32_t> position(vertexCount);
+	{
+		std::vector<uint32_t> order(vertexCount);
+		for (uint32_t v = 0; v < vertexCount; ++v) order[v] = v;
+		auto less = [&positions](uint32_t a, uint32_t b) {
+			const int c = memcmp(&positions[a], &positions[b], sizeof(glm::vec3));
+			return c != 0 ? c < 0 : a < b;
+		};
+		std::sort(order.begin(), order.end(), less);
+		for (size_t i = 0; i < vertexCount; ++i)
+		{
+			const bool same = i > 0 && memcmp(&positions[order[i]], &positions[order[i - 1]], sizeof(glm::vec3)) == 0;
+			position[order[i]] = same ? position[order[i - 1]] : order[i];
+		}
+	}
+
+	// Wedges: the vertices of each position, in a circular list
+	std::vector<uint32_t> nextWedge(vertexCount);
+	for (uint32_t v = 0; v < vertexCount; ++v)
+	{
+		const uint32_t p = position[v];
+		if (p == v)
+		{
+			nextWedge[v] = v;
+		}
+		else
+		{
+			nextWedge[v] = nextWedge[p];
+			nextWedge[p] = v;
+		}
+	}
+
+	// Half edges leaving each vertex. One without its opposite is open: on a
+	// border when the positions have no opposite either, on a seam when only
+	// the attributes differ.
+	std::vector<uint32_t> firstOut(vertexCount + 1, 0);
+	for (unsigned int index : result) ++firstOut[index + 1];
+	for (size_t v = 0; v < vertexCount; ++v) firstOut[v + 1] += firstOut[v];
+	std::vector<uint32_t> outTargets(result.size());
+	{
+		std::vector<uint32_t> cursor(firstOut.begin(), firstOut.end() - 1);
+		for (size_t i = 0; i < result.size(); ++i)
+		{
+			const size_t next = i % 3 == 2 ? i - 2 : i + 1;
+			outTargets[cursor[result[i]]++] = result[next];
+		}
+	}
+	auto hasEdge = [&](uint32_t a, uint32_t b) {
+		return std::find(outTargets.begin() + firstOut[a], outTargets.begin() + firstOut[a + 1], b) != outTargets.begin() + firstOut[a + 1];
+	};
+
+	// Feature vertices may only slide towards the two positions their border or seam leads to
+	std::vector<Kind> kind(vertexCount, MANIFOLD);
+	std::vector<uint32_t> feature(vertexCount * 2, NONE);
+	std::vector<Quadric> quadrics(vertexCount);
+
+	auto addFeature = [&](uint32_t p, uint32_t q) {
+		if (kind[p] == LOCKED || feature[p * 2] == q || feature[p * 2 + 1] == q) return;
+		if (feature[p * 2] == NONE) feature[p * 2] = q;
+		else if (feature[p * 2 + 1] == NONE) feature[p * 2 + 1] = q;
+		else kind[p] = LOCKED; // more than one border or seam goes through p
+	};
+
+	for (size_t i = 0; i < result.size(); i += 3)
+	{
+		const uint32_t p[3] = {position[result[i]], position[result[i + 1]], position[result[i + 2]]};
+		const glm::vec3 & p0 = positions[p[0]];
+		glm::vec3 normal = glm::cross(positions[p[1]] - p0, positions[p[2]] - p0);
+		const float area = glm::length(normal);
+		if (area == 0.0f)
+		{
+			continue;
+		}
+		normal /= area;
+
+		for (int k = 0; k < 3; ++k)
+		{
+			quadrics[p[k]].addPlane(normal, p0, area);
+		}
+
+		for (int k = 0; k < 3; ++k)
+		{
+			const uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+			if (hasEdge(b, a))
+			{
+				continue;
+			}
+
+			const uint32_t pa = position[a], pb = position[b];
+			addFeature(pa, pb);
+			addFeature(pb, pa);
+
+			// Keep the surface from pulling away from its border: a heavy plane through the edge, normal to the triangle
+			const glm::vec3 edge = positions[pb] - positions[pa];
+			const float length = glm::length(edge);
+			if (length > 0.0f)
+			{
+				const glm::vec3 side = glm::normalize(glm::cross(edge, normal));
+				quadrics[pa].addPlane(side, positions[pa], length * length * 10.0f);
+				quadrics[pb].addPlane(side, positions[pa], length * length * 10.0f);
+			}
+		}
+	}
+
+	for (uint32_t v = 0; v < vertexCount; ++v)
+	{
+		if (position[v] != v || kind[v] == LOCKED)
+		{
+			continue;
+		}
+
+		if (feature[v * 2] != NONE)
+		{
+			// A border or seam that ends here, or that comes back to itself, is a corner
+			kind[v] = feature[v * 2 + 1] != NONE ? FEATURE : LOCKED;
+		}
+		else if (nextWedge[v] != v)
+		{
+			// Several wedges but no open edge: separate sheets touching at one point
+			kind[v] = LOCKED;
+		}
+	}
+
+	// Collapses are applied in passes of independent collapses, cheapest first
+	std::vector<uint32_t> firstTriangle(vertexCount + 1);
+	std::vector<uint32_t> triangles;
+	std::vector<uint32_t> remap(vertexCount);
+	std::vector<bool> touched(vertexCount);
+	std::vector<Collapse> collapses;
+	std::vector<uint64_t> edges;
+	double worstError = 0.0;
+	const double maxError2 = (double) maxError * maxError;
+
+	while (result.size() > targetIndexCount)
+	{
+		const size_t triangleCount = result.size() / 3;
+
+		// Triangles around each position
+		std::fill(firstTriangle.begin(), firstTriangle.end(), 0);
+		for (unsigned int index : result) ++firstTriangle[position[index] + 1];
+		for (size_t v = 0; v < vertexCount; ++v) firstTriangle[v + 1] += firstTriangle[v];
+		triangles.resize(result.size());
+		{
+			std::vector<uint32_t> cursor(firstTriangle.begin(), firstTriangle.end() - 1);
+			for (size_t i = 0; i < result.size(); ++i) triangles[cursor[position[result[i]]]++] = (uint32_t)(i / 3);
+		}
+
+		// Unique edges between positions, both directions evaluated
+		edges.clear();
+		for (size_t i = 0; i < result.size(); i += 3)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				const uint32_t a = position[result[i + k]], b = position[result[i + (k + 1) % 3]];
+				edges.push_back(edgeKey(std::min(a, b), std::max(a, b)));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+		auto allowed = [&](uint32_t from, uint32_t to) {
+			return kind[from] == MANIFOLD || (kind[from] == FEATURE && (feature[from * 2] == to || feature[from * 2 + 1] == to));
+		};
+
+		collapses.resize(edges.size());
+		pool.parallelRanges(edges.size(), 4096, [&](size_t begin, size_t end) {
+			for (size_t e = begin; e < end; ++e)
+			{
+				const uint32_t a = (uint32_t)(edges[e] >> 32), b = (uint32_t) edges[e];
+				Quadric q = quadrics[a];
+				q.add(quadrics[b]);
+
+				Collapse best = {NONE, NONE, 0.0};
+				if (allowed(a, b)) best = {a, b, q.error(positions[b])};
+				if (allowed(b, a))
+				{
+					const double cost = q.error(positions[a]);
+					if (best.from == NONE || cost < best.cost) best = {b, a, cost};
+				}
+				collapses[e] = best;
+			}
+		});
+		collapses.erase(std::remove_if(collapses.begin(), collapses.end(), [](const Collapse & c) { return c.from == NONE; }), collapses.end());
+
+		// Each collapse removes about two triangles. Only the cheapest few need
+		// sorting, as conflicts rarely reject more than half of them.
+		const size_t wanted = (triangleCount - targetIndexCount / 3) / 2 + 1;
+		auto cheaper = [](const Collapse & x, const Collapse & y) { return x.cost < y.cost; };
+		if (collapses.size() > wanted * 8)
+		{
+			std::nth_element(collapses.begin(), collapses.begin() + wanted * 8, collapses.end(), cheaper);
+			collapses.resize(wanted * 8);
+		}
+		std::sort(collapses.begin(), collapses.end(), cheaper);
+		size_t applied = 0;
+
+		for (uint32_t v = 0; v < vertexCount; ++v) remap[v] = v;
+		std::fill(touched.begin(), touched.end(), false);
+
+		for (const Collapse & collapse : collapses)
+		{
+			if (applied >= wanted || collapse.cost > maxError2)
+			{
+				break;
+			}
+
+			const uint32_t from = collapse.from, to = collapse.to;
+			if (touched[from] || touched[to])
+			{
+				continue;
+			}
+
+			// Every wedge of from needs a wedge of to sharing a triangle with it, so attributes follow the collapse
+			bool matched = true;
+			uint32_t w = from;
+			do
+			{
+				uint32_t partner = NONE;
+				for (uint32_t t = firstTriangle[from]; t < firstTriangle[from + 1] && partner == NONE; ++t)
+				{
+					const unsigned int * triangle = &result[triangles[t] * 3];
+					if (triangle[0] != w && triangle[1] != w && triangle[2] != w) continue;
+					for (int k = 0; k < 3; ++k)
+					{
+						if (position[triangle[k]] == to) partner = triangle[k];
+					}
+				}
+				if (partner == NONE)
+				{
+					matched = false;
+					break;
+				}
+				remap[w] = partner;
+				w = nextWedge[w];
+			} while (w != from);
+
+			// Reject collapses that flip or fold a remaining triangle
+			bool flips = false;
+			for (uint32_t t = firstTriangle[from]; matched && t < firstTriangle[from + 1] && !flips; ++t)
+			{
+				const unsigned int * triangle = &result[triangles[t] * 3];
+				glm::vec3 before[3], after[3];
+				bool degenerate = false;
+				for (int k = 0; k < 3; ++k)
+				{
+					const uint32_t p = position[triangle[k]];
+					degenerate |= p == to;
+					before[k] = positions[p];
+					after[k] = p == from ? positions[to] : positions[p];
+				}
+				if (degenerate) continue;
+
+				const glm::vec3 n0 = glm::cross(before[1] - before[0], before[2] - before[0]);
+				const glm::vec3 n1 = glm::cross(after[1] - after[0], after[2] - after[0]);
+				flips = glm::dot(n0, n1) < 0.25f * glm::length(n0) * glm::length(n1);
+			}
+
+			if (!matched || flips)
+			{
+				w = from;
+				do
+				{
+					remap[w] = w;
+					w = nextWedge[w];
+				} while (w != from);
+				continue;
+			}
+
+			// Positions of the triangles around from can't move until the next pass, so the flip test above stays true
+			for (uint32_t t = firstTriangle[from]; t < firstTriangle[from + 1]; ++t)
+			{
+				const unsigned int * triangle = &result[triangles[t] * 3];
+				for (int k = 0; k < 3; ++k) touched[position[triangle[k]]] = true;
+			}
+			touched[to] = true;
+
+			quadrics[to].add(quadrics[from]);
+			worstError = std::max(worstError, collapse.cost);
+
+			// The border or seam now runs from the far neighbour of from straight to to
+			if (kind[from] == FEATURE)
+			{
+				const uint32_t other = feature[from * 2] == to ? feature[from * 2 + 1] : feature[from * 2];
+				for (int k = 0; k < 2; ++k)
+				{
+					if (feature[other * 2 + k] == from) feature[other * 2 + k] = to;
+					if (feature[to * 2 + k] == from) feature[to * 2 + k] = other;
+				}
+			}
+			++applied;
+		}
+
+		if (applied == 0)
+		{
+			break;
+		}
+
+		// Retarget the indices and drop the triangles that lost their area
+		size_t write = 0;
+		for (size_t i = 0; i < result.size(); i += 3)
+		{
+			const uint32_t a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+			const uint32_t pa = position[a], pb = position[b], pc = position[c];
+			if (pa == pb || pb == pc || pa == pc) continue;
+			result[write++] = a;
+			result[write++] = b;
+			result[write++] = c;
+		}
+		result.resize(write);
+	}
+
+	if (resultError)
+	{
+		*resultError = (float) std::sqrt(worstError);
+	}
+	return result;
+}
+
+void BuildLods(Mesh & mesh, const std::vector<float> & ratios, ThreadPool & pool)
+{
+	PROFILE_SCOPE("BuildLods");
+	if (!mesh.lods.empty())
+	{
+		mesh.indices.resize(mesh.lods[0].indexCount);
+	}
+
+	const size_t fullCount = mesh.indices.size();
+	mesh.lods.assign(1, MeshLod{0, (uint32_t) fullCount, 0.0f, 0});
+
+	std::vector<unsigned int> previous = mesh.indices;
+	float error = 0.0f;
+
+	for (float ratio : ratios)
+	{
+		const size_t target = (size_t)(fullCount / 3 * ratio) * 3;
+		if (target >= previous.size())
+		{
+			continue;
+		}
+
+		float levelError = 0.0f;
+		std::vector<unsigned int> level = SimplifyMesh(mesh.vertices, previous, target, 1e30f, &levelError, pool);
+
+		// Not worth a level if locked seams kept it close to the previous one
+		if (level.size() * 10 > previous.size() * 9)
+		{
+			break;
+		}
+
+		OptimizeVertexCache(level, mesh.vertices.size());
+
+		// Errors of successive levels add up at most
+		error += levelError;
+		mesh.lods.push_back(MeshLod{(uint32_t) mesh.indices.size(), (uint32_t) level.size(), error, 0});
+		mesh.indices.insert(mesh.indices.end(), level.begin(), level.end());
+		previous.swap(level);
+	}
+}
+
+size_t SelectLod(const MeshLod * lods, size_t count, float distance, float projectionScale, float maxPixels)
+{
+	size_t selected = 0;
+	for (size_t i = 1; i < count; ++i)
+	{
+		// Errors grow along the chain, so the first level over budget ends the search
+		if (lods[i].error * projectionScale > maxPixels * std::max(distance, 1e-6f))
+		{
+			break;
+		}
+		selected = i;
+	}
+	return selected;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "thread_pool.h"
+
+// Reduces indices to about targetIndexCount with edge collapses ordered by
+// quadric error (Garland and Heckbert 1997). Vertices are never moved or
+// created, collapses only retarget indices, so every attribute stays valid.
+// Vertices that share a position but not their attributes form a seam: seams
+// and open borders only collapse along themselves, and their corners are kept.
+// Stops early when the next collapse would move the surface further than
+// maxError. resultError receives the largest error reached, in mesh units.
+std::vector<unsigned int> SimplifyMesh(const std::vector<glm::vec3> & positions, const std::vector<unsigned int> & indices,
+	size_t targetIndexCount, float maxError = 1e30f, float * resultError = nullptr, ThreadPool & pool = ThreadPool::global());
+
+// Appends a simplified copy of the first LOD of mesh.indices for each ratio
+// of its triangle count, every level built from the previous one. The chain
+// stops early when a level can't get meaningfully smaller.
+void BuildLods(Mesh & mesh, const std::vector<float> & ratios, ThreadPool & pool = ThreadPool::global());
+
+// Index of the coarsest LOD whose error, seen from distance, covers at most
+// maxPixels. projectionScale is viewport height / 2 * projection[1][1].
+size_t SelectLod(const MeshLod * lods, size_t count, float distance, float projectionScale, float maxPixels = 1.0f);
@@ -1,43 +1,236 @@
 #include "stl.h"
+#include "profiler.h"
+#include "mapped_file.h"
+#include "parse_utils.h"
 
-#include <fstream>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <algorithm>
 
-std::vector<Triangle> ReadStl(const char * filename)
+namespace
 {
-	std::ifstream file(filename, std::ios::in | std::ios::binary);
-	if (file.is_open())
+	const size_t HEADER_SIZE = 84; // 80 bytes of text, then the triangle count
+	const size_t RECORD_SIZE = 50; // normal, three vertices, attribute word
+
+	bool isBinaryStl(const char * data, size_t size)
 	{
-		// skip header
-		file.seekg(80);
+		if (size < HEADER_SIZE)
+		{
+			return false;
+		}
 
-		unsigned triCount;
-		file.read((char*) &triCount, 4);
+		uint32_t triCount;
+		memcpy(&triCount, data + 80, 4);
+		return HEADER_SIZE + (uint64_t) triCount * RECORD_SIZE == size;
+	}
 
+	void decodeBinary(const char * data, size_t size, std::vector<Triangle> & tris, StlFacets * facets, ThreadPool & pool)
+	{
+		const size_t triCount = (size - HEADER_SIZE) / RECORD_SIZE;
+
+		tris.resize(triCount);
+		if (facets)
+		{
+			facets->normals.resize(triCount);
+			facets->attributes.resize(triCount);
+		}
+
+		const char * records = data + HEADER_SIZE;
+		pool.parallelRanges(triCount, 1 << 14, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+			{
+				// Records are 50 bytes long, so the floats are not aligned
+				const char * record = records + i * RECORD_SIZE;
+				memcpy(&tris[i], record + 12, sizeof(Triangle));
+
+				if (facets)
+				{
+					memcpy(&facets->normals[i], record, sizeof(glm::vec3));
+					memcpy(&facets->attributes[i], record + 48, 2);
+				}
+			}
+		});
+	}
+
+	// Facets found between two offsets of an ASCII file
+	struct AsciiChunk
+	{
+		const char * begin;
+		const char * end;
 		std::vector<Triangle> tris;
-		tris.reserve(triCount);
+		std::vector<glm::vec3> normals;
+		bool valid = true;
+	};
+
+	bool isWord(const char * p, const char * end, const char * word, size_t length)
+	{
+		return (size_t)(end - p) >= length && memcmp(p, word, length) == 0 &&
+			(p + length == end || (unsigned char) p[length] <= ' ');
+	}
+
+	const char * skipLine(const char * p, const char * end)
+	{
+		const char * eol = (const char *) memchr(p, '\n', end - p);
+		return eol ? eol + 1 : end;
+	}
 
-		for(unsigned i = 0; i < triCount; ++i)
+	// facet normal nx ny nz / outer loop / vertex x y z (x3) / endloop / endfacet
+	void parseAsciiChunk(AsciiChunk & chunk)
+	{
+		const char * p = chunk.begin;
+		const char * end = chunk.end;
+
+		glm::vec3 normal(0.0f);
+		glm::vec3 corners[3];
+		int cornerCount = 0;
+
+		while ((p = skipWhitespace(p, end)) < end)
 		{
-			glm::vec3 p0, p1, p2;
+			if (isWord(p, end, "vertex", 6))
+			{
+				p += 6;
+				glm::vec3 v;
+				if (cornerCount == 3 || !parseFloat(p, end, v.x) || !parseFloat(p, end, v.y) || !parseFloat(p, end, v.z))
+				{
+					chunk.valid = false;
+					return;
+				}
+				corners[cornerCount++] = v;
+			}
+			else if (isWord(p, end, "facet", 5))
+			{
+				p = skipWhitespace(p + 5, end);
+				if (!isWord(p, end, "normal", 6))
+				{
+					chunk.valid = false;
+					return;
+				}
+				p += 6;
+				if (!parseFloat(p, end, normal.x) || !parseFloat(p, end, normal.y) || !parseFloat(p, end, normal.z))
+				{
+					chunk.valid = false;
+					return;
+				}
+				cornerCount = 0;
+			}
+			else if (isWord(p, end, "endfacet", 8))
+			{
+				p += 8;
+				if (cornerCount != 3)
+				{
+					chunk.valid = false;
+					return;
+				}
+				chunk.tris.push_back({corners[0], corners[1], corners[2]});
+				chunk.normals.push_back(normal);
+				cornerCount = 0;
+			}
+			else if (isWord(p, end, "solid", 5) || isWord(p, end, "endsolid", 8))
+			{
+				// The solid name runs until the end of the line
+				p = skipLine(p, end);
+			}
+			else
+			{
+				// outer loop, endloop
+				while (p < end && (unsigned char) *p > ' ')
+				{
+					++p;
+				}
+			}
+		}
+	}
 
-			// skip normal
-			file.seekg(3 * 4, std::ios_base::cur);
+	void decodeAscii(const char * data, size_t size, std::vector<Triangle> & tris, StlFacets * facets, ThreadPool & pool)
+	{
+		const std::string_view text(data, size);
 
-			file.read((char*) &p0, sizeof(glm::vec3));
-			file.read((char*) &p1, sizeof(glm::vec3));
-			file.read((char*) &p2, sizeof(glm::vec3));
+		// Chunks end right after an "endfacet", so each one holds whole facets
+		const size_t minChunkSize = 1 << 16;
+		const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(pool.size() * 4, size / minChunkSize));
 
-			// skip attribute
-			file.seekg(2, std::ios_base::cur);
+		std::vector<AsciiChunk> chunks(chunkCount);
+		size_t cursor = 0;
+		for (size_t i = 0; i < chunkCount; ++i)
+		{
+			size_t end = size;
+			if (i + 1 < chunkCount)
+			{
+				const size_t found = text.find("endfacet", std::max(cursor, size * (i + 1) / chunkCount));
+				end = found == std::string_view::npos ? size : found + 8;
+			}
+			chunks[i].begin = data + cursor;
+			chunks[i].end = data + end;
+			cursor = end;
+		}
 
-			tris.push_back({p0, p1, p2});
+		pool.parallelFor(chunkCount, [&](size_t i) {
+			parseAsciiChunk(chunks[i]);
+		});
+
+		size_t triCount = 0;
+		for (const auto & chunk : chunks)
+		{
+			if (!chunk.valid)
+			{
+				throw std::runtime_error("Malformed ASCII STL facet");
+			}
+			triCount += chunk.tris.size();
 		}
 
-		return tris;
+		tris.reserve(triCount);
+		for (const auto & chunk : chunks)
+		{
+			tris.insert(tris.end(), chunk.tris.begin(), chunk.tris.end());
+		}
+
+		if (facets)
+		{
+			facets->normals.reserve(triCount);
+			for (const auto & chunk : chunks)
+			{
+				facets->normals.insert(facets->normals.end(), chunk.normals.begin(), chunk.normals.end());
+			}
+			facets->attributes.assign(triCount, 0);
+		}
+	}
+}
+
+std::vector<Triangle> ReadStl(const char * filename, StlFacets * facets, ThreadPool & pool)
+{
+	PROFILE_SCOPE("ReadStl");
+	static_assert(sizeof(Triangle) == 36, "Triangle must match the STL vertex layout");
+
+	const MappedFile file(filename);
+	const char * data = file.data();
+	const size_t size = file.size();
+
+	std::vector<Triangle> tris;
+	if (facets)
+	{
+		facets->normals.clear();
+		facets->attributes.clear();
+	}
+
+	// Binary files may also start with "solid", so trust the size first
+	if (isBinaryStl(data, size))
+	{
+		decodeBinary(data, size, tris, facets, pool);
+	}
+	else if (isWord(skipWhitespace(data, data + size), data + size, "solid", 5))
+	{
+		decodeAscii(data, size, tris, facets, pool);
+	}
+	else if (size >= HEADER_SIZE)
+	{
+		throw std::runtime_error(std::string("Triangle count does not match the file size: ") + filename);
 	}
 	else
 	{
-		throw std::runtime_error(std::string("Cannot open file: ") + filename);
-		return {};
+		throw std::runtime_error(std::string("Not an STL file: ") + filename);
 	}
+
+	return tris;
 }
@@ -3,10 +3,23 @@
 #include <glm/vec3.hpp>
 
 #include <vector>
+#include <cstdint>
+
+#include "thread_pool.h"
 
 struct Triangle
 {
 	glm::vec3 p0, p1, p2;
 };
 
-std::vector<Triangle> ReadStl(const char * filename);
+// Per facet data ReadStl can return on request
+struct StlFacets
+{
+	std::vector<glm::vec3> normals;
+	std::vector<uint16_t> attributes; // always 0 for ASCII files
+};
+
+// Reads a binary or ASCII STL file.
+// The file is memory mapped and its facets are decoded in parallel.
+// Throws std::runtime_error if the file can't be opened or is malformed.
+std::vector<Triangle> ReadStl(const char * filename, StlFacets * facets = nullptr, ThreadPool & pool = ThreadPool::global());
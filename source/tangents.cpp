@@ -0,0 +1,203 @@
+#include "tangents.h"
+#include "profiler.h"
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TANGENTS_SSE 1
+#endif
+
+namespace
+{
+	// Below this, the UV mapping of a triangle is considered flat
+	const float MIN_UV_AREA = 1e-20f;
+
+	// Area weighted tangent and bitangent of triangle f, or zero if it is degenerate
+	void faceFrame(const Mesh & mesh, size_t f, glm::vec3 & tangent, glm::vec3 & bitangent)
+	{
+		const unsigned int i0 = mesh.indices[f * 3 + 0];
+		const unsigned int i1 = mesh.indices[f * 3 + 1];
+		const unsigned int i2 = mesh.indices[f * 3 + 2];
+
+		const glm::vec3 deltaPos1 = mesh.vertices[i1] - mesh.vertices[i0];
+		const glm::vec3 deltaPos2 = mesh.vertices[i2] - mesh.vertices[i0];
+		const glm::vec2 deltaUV1 = mesh.uvs[i1] - mesh.uvs[i0];
+		const glm::vec2 deltaUV2 = mesh.uvs[i2] - mesh.uvs[i0];
+
+		const float det = deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x;
+		const float area = glm::length(glm::cross(deltaPos1, deltaPos2));
+
+		// Only the sign of 1/det matters once the frame is normalized
+		const float s = det < 0.0f ? -1.0f : 1.0f;
+		const glm::vec3 t = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * s;
+		const glm::vec3 b = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * s;
+
+		const float lt = glm::length(t);
+		const float lb = glm::length(b);
+		if (std::fabs(det) <= MIN_UV_AREA || lt <= 0.0f || lb <= 0.0f)
+		{
+			tangent = bitangent = glm::vec3(0.0f);
+			return;
+		}
+
+		tangent = t * (area / lt);
+		bitangent = b * (area / lb);
+	}
+
+#ifdef TANGENTS_SSE
+	// Same as faceFrame for the four triangles starting at f
+	void faceFrame4(const Mesh & mesh, size_t f, glm::vec3 * tangents, glm::vec3 * bitangents)
+	{
+		alignas(16) float p[3][3][4]; // corner, axis, triangle
+		alignas(16) float uv[3][2][4];
+		for (int k = 0; k < 4; ++k)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				const unsigned int i = mesh.indices[(f + k) * 3 + c];
+				p[c][0][k] = mesh.vertices[i].x;
+				p[c][1][k] = mesh.vertices[i].y;
+				p[c][2][k] = mesh.vertices[i].z;
+				uv[c][0][k] = mesh.uvs[i].x;
+				uv[c][1][k] = mesh.uvs[i].y;
+			}
+		}
+
+		__m128 e1[3], e2[3];
+		for (int a = 0; a < 3; ++a)
+		{
+			const __m128 p0 = _mm_load_ps(p[0][a]);
+			e1[a] = _mm_sub_ps(_mm_load_ps(p[1][a]), p0);
+			e2[a] = _mm_sub_ps(_mm_load_ps(p[2][a]), p0);
+		}
+
+		const __m128 du1 = _mm_sub_ps(_mm_load_ps(uv[1][0]), _mm_load_ps(uv[0][0]));
+		const __m128 dv1 = _mm_sub_ps(_mm_load_ps(uv[1][1]), _mm_load_ps(uv[0][1]));
+		const __m128 du2 = _mm_sub_ps(_mm_load_ps(uv[2][0]), _mm_load_ps(uv[0][0]));
+		const __m128 dv2 = _mm_sub_ps(_mm_load_ps(uv[2][1]), _mm_load_ps(uv[0][1]));
+
+		const __m128 det = _mm_sub_ps(_mm_mul_ps(du1, dv2), _mm_mul_ps(dv1, du2));
+		const __m128 signBit = _mm_and_ps(det, _mm_set1_ps(-0.0f));
+		const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+
+		const __m128 cx = _mm_sub_ps(_mm_mul_ps(e1[1], e2[2]), _mm_mul_ps(e1[2], e2[1]));
+		const __m128 cy = _mm_sub_ps(_mm_mul_ps(e1[2], e2[0]), _mm_mul_ps(e1[0], e2[2]));
+		const __m128 cz = _mm_sub_ps(_mm_mul_ps(e1[0], e2[1]), _mm_mul_ps(e1[1], e2[0]));
+		const __m128 area = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz)));
+
+		__m128 t[3], b[3];
+		for (int a = 0; a < 3; ++a)
+		{
+			// Flipping the sign bit multiplies by the sign of det
+			t[a] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(e1[a], dv2), _mm_mul_ps(e2[a], dv1)), signBit);
+			b[a] = _mm_xor_ps(_mm_sub_ps(_mm_mul_ps(e2[a], du1), _mm_mul_ps(e1[a], du2)), signBit);
+		}
+
+		const __m128 lt = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(t[0], t[0]), _mm_mul_ps(t[1], t[1])), _mm_mul_ps(t[2], t[2])));
+		const __m128 lb = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(b[0], b[0]), _mm_mul_ps(b[1], b[1])), _mm_mul_ps(b[2], b[2])));
+
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 valid = _mm_and_ps(_mm_cmpgt_ps(absDet, _mm_set1_ps(MIN_UV_AREA)),
+			_mm_and_ps(_mm_cmpgt_ps(lt, zero), _mm_cmpgt_ps(lb, zero)));
+
+		// Degenerate lanes divide by one and are masked to zero
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 st = _mm_and_ps(valid, _mm_div_ps(area, _mm_or_ps(_mm_and_ps(valid, lt), _mm_andnot_ps(valid, one))));
+		const __m128 sb = _mm_and_ps(valid, _mm_div_ps(area, _mm_or_ps(_mm_and_ps(valid, lb), _mm_andnot_ps(valid, one))));
+
+		alignas(16) float out[6][4];
+		for (int a = 0; a < 3; ++a)
+		{
+			_mm_store_ps(out[a], _mm_mul_ps(t[a], st));
+			_mm_store_ps(out[a + 3], _mm_mul_ps(b[a], sb));
+		}
+
+		for (int k = 0; k < 4; ++k)
+		{
+			tangents[k] = glm::vec3(out[0][k], out[1][k], out[2][k]);
+			bitangents[k] = glm::vec3(out[3][k], out[4][k], out[5][k]);
+		}
+	}
+#endif
+
+	// Any unit vector perpendicular to n
+	glm::vec3 perpendicular(const glm::vec3 & n)
+	{
+		const glm::vec3 axis = std::fabs(n.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+		return glm::normalize(glm::cross(n, axis));
+	}
+}
+
+void ComputeTangents(Mesh & mesh, ThreadPool & pool)
+{
+	PROFILE_SCOPE("ComputeTangents");
+	const size_t vertexCount = mesh.vertices.size();
+	const size_t faceCount = mesh.indices.size() / 3;
+
+	// Per triangle frames
+	std::vector<glm::vec3> faceTangents(faceCount);
+	std::vector<glm::vec3> faceBitangents(faceCount);
+
+	pool.parallelRanges(faceCount, 4096, [&](size_t begin, size_t end) {
+		size_t f = begin;
+#ifdef TANGENTS_SSE
+		for (; f + 4 <= end; f += 4)
+		{
+			faceFrame4(mesh, f, &faceTangents[f], &faceBitangents[f]);
+		}
+#endif
+		for (; f < end; ++f)
+		{
+			faceFrame(mesh, f, faceTangents[f], faceBitangents[f]);
+		}
+	});
+
+	// Triangles around each vertex, in triangle order so the sums are deterministic
+	std::vector<uint32_t> firstFace(vertexCount + 1, 0);
+	for (unsigned int index : mesh.indices)
+	{
+		++firstFace[index + 1];
+	}
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		firstFace[v + 1] += firstFace[v];
+	}
+
+	std::vector<uint32_t> vertexFaces(mesh.indices.size());
+	std::vector<uint32_t> cursor(firstFace.begin(), firstFace.end() - 1);
+	for (size_t i = 0; i < mesh.indices.size(); ++i)
+	{
+		vertexFaces[cursor[mesh.indices[i]]++] = (uint32_t)(i / 3);
+	}
+
+	mesh.tangents.resize(vertexCount);
+	mesh.bitangents.resize(vertexCount);
+
+	pool.parallelRanges(vertexCount, 4096, [&](size_t begin, size_t end) {
+		for (size_t v = begin; v < end; ++v)
+		{
+			glm::vec3 t(0.0f), b(0.0f);
+			for (uint32_t i = firstFace[v]; i < firstFace[v + 1]; ++i)
+			{
+				t += faceTangents[vertexFaces[i]];
+				b += faceBitangents[vertexFaces[i]];
+			}
+
+			const float ln = glm::length(mesh.normals[v]);
+			const glm::vec3 n = ln > 0.0f ? mesh.normals[v] / ln : glm::vec3(0, 0, 1);
+
+			// Gram-Schmidt
+			t -= n * glm::dot(n, t);
+			const float lt = glm::length(t);
+			t = lt > 1e-12f ? t / lt : perpendicular(n);
+
+			const glm::vec3 nt = glm::cross(n, t);
+			const float handedness = glm::dot(nt, b) < 0.0f ? -1.0f : 1.0f;
+
+			mesh.tangents[v] = t;
+			mesh.bitangents[v] = nt * handedness;
+		}
+	});
+}
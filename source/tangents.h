@@ -0,0 +1,11 @@
+#pragma once
+
+#include "mesh.h"
+#include "thread_pool.h"
+
+// Fills mesh.tangents and mesh.bitangents from its indexed positions, UVs and normals.
+// Each vertex sums the area weighted tangent frames of its triangles, then the
+// tangent is orthonormalized against the normal and the bitangent rebuilt from
+// the handedness. Triangles with degenerate UVs or positions are ignored, and
+// vertices left without a tangent get an arbitrary one perpendicular to the normal.
+void ComputeTangents(Mesh & mesh, ThreadPool & pool = ThreadPool::global());
@@ -1,17 +1,494 @@
 #include <CImg.h>
 
 #include "texture.h"
+#include "mapped_file.h"
+#include "profiler.h"
 
-Image LoadImage(const char *filename)
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEXTURE_SSE 1
+#endif
+
+namespace
+{
+	uint16_t read16(const unsigned char *bytes)
+	{
+		return (uint16_t) (bytes[0] | bytes[1] << 8);
+	}
+
+	uint32_t read32(const unsigned char *bytes)
+	{
+		return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+	}
+
+	// Rows of source texels per parallel band, about 64 KB of work each
+	size_t rowGrain(int width)
+	{
+		return std::max<size_t>(1, 65536 / ((size_t) width * 3));
+	}
+
+	// Output rows [begin, end) of a 2x2 box filter, the last row and column
+	// repeated when the source size is odd
+	void downsampleRows(const Image &source, Image &level, size_t begin, size_t end)
+	{
+		const int channels = source.channels;
+		const size_t sourceStride = (size_t) source.width * channels;
+		const size_t stride = (size_t) level.width * channels;
+		for (size_t y = begin; y < end; y++)
+		{
+			const unsigned char *row0 = &source.data[std::min<size_t>(y * 2, source.height - 1) * sourceStride];
+			const unsigned char *row1 = &source.data[std::min<size_t>(y * 2 + 1, source.height - 1) * sourceStride];
+			unsigned char *out = &level.data[y * stride];
+			int x = 0;
+
+#ifdef TEXTURE_SSE
+			// Two output texels from 12 source bytes of each row, while the
+			// 16 byte loads and 8 byte stores stay inside the rows
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i rounding = _mm_set1_epi16(2);
+			for (; channels == 3 && (size_t) x * 6 + 16 <= sourceStride && (size_t) x * 3 + 8 <= stride; x += 2)
+			{
+				const __m128i a = _mm_loadu_si128((const __m128i *) (row0 + x * 6));
+				const __m128i b = _mm_loadu_si128((const __m128i *) (row1 + x * 6));
+				const __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)); // bytes 0-7
+				const __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)); // bytes 8-15
+
+				// Left and right texel of each pair added, first pair in bytes 0-5, second in 6-11
+				const __m128i second = _mm_or_si128(_mm_srli_si128(low, 12), _mm_slli_si128(high, 4));
+				const __m128i sum0 = _mm_add_epi16(low, _mm_srli_si128(low, 6));
+				const __m128i sum1 = _mm_add_epi16(second, _mm_srli_si128(second, 6));
+				__m128i sums = _mm_or_si128(_mm_and_si128(sum0, _mm_set_epi32(0, 0, 0xFFFF, -1)), _mm_slli_si128(sum1, 6));
+				sums = _mm_srli_epi16(_mm_add_epi16(sums, rounding), 2);
+				_mm_storel_epi64((__m128i *) (out + x * 3), _mm_packus_epi16(sums, zero));
+			}
+#endif
+
+			for (; x < level.width; x++)
+			{
+				const int x0 = std::min(x * 2, source.width - 1) * channels, x1 = std::min(x * 2 + 1, source.width - 1) * channels;
+				for (int channel = 0; channel < channels; channel++)
+				{
+					const int sum = row0[x0 + channel] + row0[x1 + channel] + row1[x0 + channel] + row1[x1 + channel];
+					out[x * channels + channel] = (unsigned char) ((sum + 2) / 4);
+				}
+			}
+		}
+	}
+
+	// Averaged normals are shorter than 1, bring them back to unit length
+	void renormalizeRows(Image &level, size_t begin, size_t end)
+	{
+		const size_t stride = (size_t) level.width * level.channels;
+		for (size_t i = begin * stride; i < end * stride; i += level.channels)
+		{
+			float n[3];
+			for (int channel = 0; channel < 3; channel++)
+			{
+				n[channel] = level.data[i + channel] * (2.0f / 255.0f) - 1.0f;
+			}
+			const float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			if (length > 0.0f)
+			{
+				for (int channel = 0; channel < 3; channel++)
+				{
+					level.data[i + channel] = (unsigned char) std::lround((n[channel] / length * 0.5f + 0.5f) * 255.0f);
+				}
+			}
+		}
+	}
+
+	// Output rows [begin, end) of InterleavePlanes
+	void interleaveRows(const unsigned char *const planes[4], int width, int height, int channels, unsigned char *image,
+		size_t begin, size_t end)
+	{
+		const size_t stride = (size_t) width * channels;
+		for (size_t y = begin; y < end; y++)
+		{
+			const size_t row = (size_t) (height - 1 - y) * width;
+			const unsigned char *r = planes[0] + row, *g = planes[1] + row, *b = planes[2] + row;
+			const unsigned char *a = planes[3] ? planes[3] + row : nullptr;
+			unsigned char *out = image + y * stride;
+			int x = 0;
+
+#ifdef TEXTURE_SSE
+			// 16 texels at a time, unpacked to RGBA. For RGB each 64-bit lane
+			// packs its two texels in 6 bytes, then both lanes are joined in 12
+			// bytes: the 16 byte stores overlap and need 4 bytes past the texels.
+			const __m128i opaque = _mm_set1_epi8((char) 0xFF);
+			const __m128i firstTexel = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+			const __m128i secondTexel = _mm_set_epi32(0x00FFFFFF, 0, 0x00FFFFFF, 0);
+			const __m128i firstLane = _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+			for (; (size_t) (x + 16) * channels + (channels == 3 ? 4 : 0) <= stride; x += 16)
+			{
+				const __m128i vr = _mm_loadu_si128((const __m128i *) (r + x));
+				const __m128i vg = _mm_loadu_si128((const __m128i *) (g + x));
+				const __m128i vb = _mm_loadu_si128((const __m128i *) (b + x));
+				const __m128i va = a ? _mm_loadu_si128((const __m128i *) (a + x)) : opaque;
+				const __m128i rgLow = _mm_unpacklo_epi8(vr, vg), rgHigh = _mm_unpackhi_epi8(vr, vg);
+				const __m128i baLow = _mm_unpacklo_epi8(vb, va), baHigh = _mm_unpackhi_epi8(vb, va);
+				const __m128i texels[4] = {
+					_mm_unpacklo_epi16(rgLow, baLow), _mm_unpackhi_epi16(rgLow, baLow),
+					_mm_unpacklo_epi16(rgHigh, baHigh), _mm_unpackhi_epi16(rgHigh, baHigh),
+				};
+				for (int i = 0; i < 4; i++)
+				{
+					if (channels == 4)
+					{
+						_mm_storeu_si128((__m128i *) (out + (x + i * 4) * 4), texels[i]);
+						continue;
+					}
+					const __m128i pairs = _mm_or_si128(_mm_and_si128(texels[i], firstTexel),
+						_mm_srli_epi64(_mm_and_si128(texels[i], secondTexel), 8));
+					const __m128i packed = _mm_or_si128(_mm_and_si128(pairs, firstLane),
+						_mm_srli_si128(_mm_andnot_si128(firstLane, pairs), 2));
+					_mm_storeu_si128((__m128i *) (out + (x + i * 4) * 3), packed);
+				}
+			}
+#endif
+
+			for (; x < width; x++)
+			{
+				out[x * channels + 0] = r[x];
+				out[x * channels + 1] = g[x];
+				out[x * channels + 2] = b[x];
+				if (channels == 4)
+				{
+					out[x * 4 + 3] = a ? a[x] : 255;
+				}
+			}
+		}
+	}
+
+	// CImg keeps each channel in its own plane: gray images use the first
+	// one for red, green and blue, and alpha follows the color planes
+	cimg_library::CImg<unsigned char> decodePlanes(const char *filename, int channels, const unsigned char *planes[4])
+	{
+		if (channels != 3 && channels != 4)
+		{
+			throw std::runtime_error(std::string(filename) + ": images load as 3 or 4 channels");
+		}
+		cimg_library::CImg<unsigned char> decoded(filename);
+		const size_t planeSize = (size_t) decoded.width() * decoded.height();
+		const int spectrum = decoded.spectrum();
+		const bool gray = spectrum < 3;
+		for (int channel = 0; channel < 3; channel++)
+		{
+			planes[channel] = decoded.data() + (gray ? 0 : channel) * planeSize;
+		}
+		const int alpha = gray ? 1 : 3;
+		planes[3] = spectrum > alpha ? decoded.data() + alpha * planeSize : nullptr;
+		return decoded;
+	}
+}
+
+std::vector<unsigned char> ImageBufferPool::acquire(size_t size)
+{
+	std::vector<unsigned char> buffer;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto best = buffers.end();
+		for (auto candidate = buffers.begin(); candidate != buffers.end(); ++candidate)
+		{
+			if (candidate->capacity() >= size && (best == buffers.end() || candidate->capacity() < best->capacity()))
+			{
+				best = candidate;
+			}
+		}
+		if (best != buffers.end())
+		{
+			buffer = std::move(*best);
+			buffers.erase(best);
+		}
+	}
+
+	// Released buffers keep their size, so a reused one is rarely cleared again
+	buffer.resize(size);
+	return buffer;
+}
+
+void ImageBufferPool::release(std::vector<unsigned char> buffer)
+{
+	if (buffer.capacity() > 0)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers.push_back(std::move(buffer));
+	}
+}
+
+void InterleavePlanes(const unsigned char *const planes[4], int width, int height, int channels, unsigned char *out,
+	ThreadPool &pool)
+{
+	if (channels != 3 && channels != 4)
+	{
+		throw std::runtime_error("InterleavePlanes: channels must be 3 or 4");
+	}
+	pool.parallelRanges(height, rowGrain(width), [&](size_t begin, size_t end) {
+		interleaveRows(planes, width, height, channels, out, begin, end);
+	});
+}
+
+Image LoadImage(const char *filename, int channels, ImageBufferPool *buffers, ThreadPool &pool)
+{
+	PROFILE_SCOPE("LoadImage");
+	const unsigned char *planes[4];
+	const cimg_library::CImg<unsigned char> decoded = decodePlanes(filename, channels, planes);
+
+	Image image;
+	image.width = decoded.width();
+	image.height = decoded.height();
+	image.channels = channels;
+	const size_t size = (size_t) image.width * image.height * channels;
+	image.data = buffers ? buffers->acquire(size) : std::vector<unsigned char>(size);
+	InterleavePlanes(planes, image.width, image.height, channels, image.data.data(), pool);
+	return image;
+}
+
+size_t LoadImage(const char *filename, int channels, unsigned char *destination, size_t capacity,
+	int *width, int *height, ThreadPool &pool)
+{
+	PROFILE_SCOPE("LoadImage");
+	const unsigned char *planes[4];
+	const cimg_library::CImg<unsigned char> decoded = decodePlanes(filename, channels, planes);
+
+	const size_t size = (size_t) decoded.width() * decoded.height() * channels;
+	if (size > capacity)
+	{
+		throw std::runtime_error(std::string(filename) + ": " + std::to_string(size) + " bytes do not fit in "
+			+ std::to_string(capacity));
+	}
+	InterleavePlanes(planes, decoded.width(), decoded.height(), channels, destination, pool);
+	*width = decoded.width();
+	*height = decoded.height();
+	return size;
+}
+
+Image LoadBMP(const char *filename, ThreadPool &pool)
 {
-	cimg_library::CImg<unsigned char> im(filename);
+	PROFILE_SCOPE("LoadBMP");
+	const MappedFile file(filename);
+	const unsigned char *bytes = (const unsigned char *) file.data();
+	auto invalid = [filename](const char *reason) {
+		return std::runtime_error(std::string(filename) + ": " + reason);
+	};
+
+	// BITMAPFILEHEADER then at least a BITMAPINFOHEADER
+	if (file.size() < 54 || bytes[0] != 'B' || bytes[1] != 'M')
+	{
+		throw invalid("not a BMP file");
+	}
+	const uint32_t dataOffset = read32(bytes + 0x0A);
+	const uint32_t headerSize = read32(bytes + 0x0E);
+	const int32_t width = (int32_t) read32(bytes + 0x12);
+	const int32_t signedHeight = (int32_t) read32(bytes + 0x16);
+	const uint16_t planes = read16(bytes + 0x1A);
+	const uint16_t bitsPerPixel = read16(bytes + 0x1C);
+	const uint32_t compression = read32(bytes + 0x1E);
+
+	if (headerSize < 40 || 14 + (size_t) headerSize > file.size())
+	{
+		throw invalid("unsupported BMP header");
+	}
+	if (planes != 1 || (bitsPerPixel != 24 && bitsPerPixel != 32))
+	{
+		throw invalid("only 24 and 32-bit BMP files are supported");
+	}
+
+	// BI_RGB, or BI_BITFIELDS with the usual BGRA masks
+	const bool standardMasks = file.size() >= 0x42
+		&& read32(bytes + 0x36) == 0x00FF0000u && read32(bytes + 0x3A) == 0x0000FF00u && read32(bytes + 0x3E) == 0x000000FFu;
+	if (compression != 0 && !(compression == 3 && bitsPerPixel == 32 && standardMasks))
+	{
+		throw invalid("compressed or palette BMP files are not supported");
+	}
+
+	// A negative height means rows are stored top row first
+	const bool topDown = signedHeight < 0;
+	const int32_t height = topDown ? -signedHeight : signedHeight;
+	if (width <= 0 || height <= 0 || width > 65536 || height > 65536)
+	{
+		throw invalid("bad BMP size");
+	}
+
+	// Rows are padded to 4 bytes
+	const size_t pixelSize = bitsPerPixel / 8;
+	const size_t rowSize = ((size_t) width * bitsPerPixel + 31) / 32 * 4;
+	if (dataOffset < 14 + headerSize || dataOffset > file.size() || (file.size() - dataOffset) / rowSize < (size_t) height)
+	{
+		throw invalid("truncated BMP file");
+	}
+
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.data.resize((size_t) width * height * 3);
+
+	pool.parallelRanges(height, rowGrain(width), [&](size_t begin, size_t end) {
+		for (size_t y = begin; y < end; y++)
+		{
+			const unsigned char *source = bytes + dataOffset + (topDown ? height - 1 - y : y) * rowSize;
+			unsigned char *out = &image.data[y * width * 3];
+			for (int32_t x = 0; x < width; x++, source += pixelSize, out += 3)
+			{
+				out[0] = source[2];
+				out[1] = source[1];
+				out[2] = source[0];
+			}
+		}
+	});
+
+	return image;
+}
+
+std::vector<Image> BuildMipChain(Image base, MipFilter filter, ThreadPool &pool)
+{
+	PROFILE_SCOPE("BuildMipChain");
+	if (base.width <= 0 || base.height <= 0 || (base.channels != 3 && base.channels != 4)
+		|| base.data.size() != (size_t) base.width * base.height * base.channels)
+	{
+		throw std::runtime_error("BuildMipChain: image is not RGB or RGBA");
+	}
+
+	std::vector<Image> levels;
+	levels.push_back(std::move(base));
+	if (filter == MipFilter::NormalMap)
+	{
+		// Unit length from the base level, so x and y alone describe a normal
+		Image &level = levels.back();
+		pool.parallelRanges(level.height, rowGrain(level.width), [&](size_t begin, size_t end) {
+			renormalizeRows(level, begin, end);
+		});
+	}
+	while (levels.back().width > 1 || levels.back().height > 1)
+	{
+		const Image &source = levels.back();
+		Image level;
+		level.width = std::max(source.width / 2, 1);
+		level.height = std::max(source.height / 2, 1);
+		level.channels = source.channels;
+		level.data.resize((size_t) level.width * level.height * level.channels);
+
+		pool.parallelRanges(level.height, rowGrain(level.width), [&](size_t begin, size_t end) {
+			downsampleRows(source, level, begin, end);
+			if (filter == MipFilter::NormalMap)
+			{
+				renormalizeRows(level, begin, end);
+			}
+		});
+		levels.push_back(std::move(level));
+	}
+	return levels;
+}
+
+GLuint CreateTexture(const std::vector<Image> &levels)
+{
+	PROFILE_SCOPE("CreateTexture");
+	if (levels.empty())
+	{
+		throw std::runtime_error("CreateTexture: no level");
+	}
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	// Storage for the whole chain at once, then each level as is
+	const bool alpha = levels[0].channels == 4;
+	glTexStorage2D(GL_TEXTURE_2D, (GLsizei) levels.size(), alpha ? GL_RGBA8 : GL_RGB8, levels[0].width, levels[0].height);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (size_t level = 0; level < levels.size(); level++)
+	{
+		const Image &image = levels[level];
+		glTexSubImage2D(GL_TEXTURE_2D, (GLint) level, 0, 0, image.width, image.height, alpha ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE,
+			image.data.data());
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	return texture;
+}
+
+void SaveBMP(const char *filename, const Image &image)
+{
+	// Rows are stored bottom-up in BGR order, padded to 4 bytes
+	const uint32_t rowSize = (image.width * 3 + 3) & ~3u;
+	const uint32_t dataSize = rowSize * image.height;
+
+	unsigned char header[54] = {'B', 'M'};
+	auto put32 = [&](size_t offset, uint32_t value) {
+		for (int i = 0; i < 4; i++) header[offset + i] = (unsigned char) (value >> (8 * i));
+	};
+	put32(0x02, 54 + dataSize);
+	put32(0x0A, 54);
+	put32(0x0E, 40);
+	put32(0x12, image.width);
+	put32(0x16, image.height);
+	header[0x1A] = 1; // planes
+	header[0x1C] = 24; // bits per pixel
+	put32(0x22, dataSize);
+
+	FILE *file = fopen(filename, "wb");
+	if (!file)
+	{
+		throw std::runtime_error(std::string("Cannot write ") + filename);
+	}
+
+	std::vector<unsigned char> row(rowSize, 0);
+	bool written = fwrite(header, 1, 54, file) == 54;
+	for (int y = 0; y < image.height && written; y++)
+	{
+		const unsigned char *source = image.data.data() + (size_t) y * image.width * 3;
+		for (int x = 0; x < image.width; x++)
+		{
+			row[x * 3 + 0] = source[x * 3 + 2];
+			row[x * 3 + 1] = source[x * 3 + 1];
+			row[x * 3 + 2] = source[x * 3 + 0];
+		}
+		written = fwrite(row.data(), 1, rowSize, file) == rowSize;
+	}
+	fclose(file);
+
+	if (!written)
+	{
+		throw std::runtime_error(std::string("Cannot write ") + filename);
+	}
+}
+
+ImageDifference CompareImages(const Image &a, const Image &b, int threshold)
+{
+	if (a.width != b.width || a.height != b.height || a.channels != b.channels || a.data.size() != b.data.size())
+	{
+		throw std::runtime_error("CompareImages: sizes differ");
+	}
 
-	std::vector<unsigned char> picture;
-	cimg_forXY(im, x, y) {
-		picture.push_back(im(x, im.height() - y - 1, 0, 0));
-		picture.push_back(im(x, im.height() - y - 1, 0, 1));
-		picture.push_back(im(x, im.height() - y - 1, 0, 2));
+	ImageDifference difference = {0.0, 0, 0, 0.0};
+	uint64_t sum = 0, squares = 0;
+	for (size_t pixel = 0; pixel + a.channels <= a.data.size(); pixel += a.channels)
+	{
+		int pixelError = 0;
+		for (int channel = 0; channel < a.channels; channel++)
+		{
+			const int error = std::abs((int) a.data[pixel + channel] - (int) b.data[pixel + channel]);
+			sum += error;
+			squares += error * error;
+			pixelError = std::max(pixelError, error);
+		}
+		difference.maxError = std::max(difference.maxError, pixelError);
+		difference.differingPixels += pixelError > threshold;
 	}
+	difference.meanError = a.data.empty() ? 0.0 : (double) sum / a.data.size();
 
-	return {picture, im.width(), im.height()};
+	// Identical images are reported at 99 dB rather than infinity
+	const double meanSquare = a.data.empty() ? 0.0 : (double) squares / a.data.size();
+	difference.psnr = meanSquare > 0.0 ? std::min(99.0, 10.0 * std::log10(255.0 * 255.0 / meanSquare)) : 99.0;
+	return difference;
 }
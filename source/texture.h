@@ -1,11 +1,82 @@
 #pragma once
 #include <vector>
 #include <tuple>
+#include <cstddef>
+#include <mutex>
+
+#include <glad/glad.h>
+
+#include "thread_pool.h"
 
 struct Image
 {
 	std::vector<unsigned char> data;
 	int width, height;
+	int channels = 3; // 3 for RGB rows, 4 for RGBA
+};
+
+// Recycles pixel buffers between loads, so streaming textures does not
+// allocate and fault in fresh memory for every image. Thread safe.
+class ImageBufferPool
+{
+public:
+	// size bytes, from the smallest released buffer large enough when there is one
+	std::vector<unsigned char> acquire(size_t size);
+
+	void release(std::vector<unsigned char> buffer);
+
+private:
+	std::mutex mutex;
+	std::vector<std::vector<unsigned char>> buffers;
+};
+
+// Planar channels as CImg stores them, top row first, to interleaved rows,
+// bottom row first. planes[3] may be null for opaque images; channels is 3
+// (alpha dropped) or 4. out holds width * height * channels bytes.
+void InterleavePlanes(const unsigned char *const planes[4], int width, int height, int channels, unsigned char *out,
+	ThreadPool &pool = ThreadPool::global());
+
+// Decodes any format CImg reads into RGB (channels 3) or RGBA (channels 4)
+// rows, bottom row first. Gray images are expanded and a missing alpha is
+// opaque. The pixels go in a buffer of the pool when one is given.
+Image LoadImage(const char *filename, int channels = 3, ImageBufferPool *buffers = nullptr,
+	ThreadPool &pool = ThreadPool::global());
+
+// Same, straight into caller memory such as a mapped pixel unpack buffer.
+// Returns the bytes written; throws std::runtime_error, leaving destination
+// untouched, when the image needs more than capacity.
+size_t LoadImage(const char *filename, int channels, unsigned char *destination, size_t capacity,
+	int *width, int *height, ThreadPool &pool = ThreadPool::global());
+
+// Decodes an uncompressed 24 or 32-bit BMP, bottom-up or top-down, from the
+// mapped file straight into RGB rows, bottom row first. Throws
+// std::runtime_error when the header does not describe such a file.
+Image LoadBMP(const char *filename, ThreadPool &pool = ThreadPool::global());
+
+enum class MipFilter
+{
+	Color, // 2x2 box
+	NormalMap, // 2x2 box, then each texel of every level, the base included, decoded, renormalized and encoded again
+};
+
+// Level 0 followed by every smaller level down to 1x1, as glGenerateMipmap
+// would make them. Levels are built one after the other, each in parallel
+// row bands.
+std::vector<Image> BuildMipChain(Image base, MipFilter filter, ThreadPool &pool = ThreadPool::global());
+
+// Immutable GL_RGB8 or GL_RGBA8 texture holding the levels, with trilinear filtering
+GLuint CreateTexture(const std::vector<Image> &levels);
+
+// Writes RGB rows, bottom row first, as a 24-bit BMP
+void SaveBMP(const char *filename, const Image &image);
+
+// Channel differences between two images of the same size and channels
+struct ImageDifference
+{
+	double meanError; // per channel, in 0-255 units
+	int maxError;
+	size_t differingPixels; // with a channel off by more than the threshold
+	double psnr; // in dB, over every channel
 };
 
-Image LoadImage(const char *filename);
+ImageDifference CompareImages(const Image &a, const Image &b, int threshold);
@@ -0,0 +1,286 @@
+#include "texture_cache.h"
+#include "profiler.h"
+#include "hash.h"
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+namespace
+{
+	const char MAGIC[8] = {'G', 'G', 'L', 'T', 'E', 'X', 'C', '\0'};
+
+	// Bump when the layout, the encoder or the mip filters change
+	const uint32_t VERSION = 1;
+
+	const size_t ALIGNMENT = 16;
+
+	// Enough for 65536x65536
+	const size_t MAX_LEVELS = 17;
+
+	struct LevelEntry
+	{
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t format; // BlockFormat
+		uint32_t width; // of level 0
+		uint32_t height;
+		uint32_t levelCount;
+		uint32_t padding;
+		uint64_t sourceHash;
+		LevelEntry levels[MAX_LEVELS];
+	};
+
+	size_t alignUp(size_t value)
+	{
+		return (value + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	}
+
+	const Header & headerOf(const char * bytes)
+	{
+		return *(const Header *) bytes;
+	}
+
+	const char * formatName(BlockFormat format)
+	{
+		switch (format)
+		{
+		case BlockFormat::BC1: return "bc1";
+		case BlockFormat::BC3: return "bc3";
+		default: return "bc5";
+		}
+	}
+
+	// BMP files go through the mapped decoder, the rest through CImg
+	Image loadSource(const char * imagePath, BlockFormat format, ThreadPool & pool)
+	{
+		const std::string path = imagePath;
+		const bool bmp = path.size() > 4 && path.compare(path.size() - 4, 4, ".bmp") == 0;
+		if (format == BlockFormat::BC3)
+		{
+			return LoadImage(imagePath, 4, nullptr, pool);
+		}
+		return bmp ? LoadBMP(imagePath, pool) : LoadImage(imagePath, 3, nullptr, pool);
+	}
+}
+
+TextureCache::TextureCache(const std::string & path)
+	: file(new MappedFile(path))
+{
+	bytes = file->data();
+	length = file->size();
+	validate(path);
+}
+
+TextureCache::TextureCache(std::vector<char> data)
+	: memory(std::move(data))
+{
+	bytes = memory.data();
+	length = memory.size();
+	validate("texture in memory");
+}
+
+void TextureCache::validate(const std::string & name)
+{
+	if (length < sizeof(Header) || memcmp(headerOf(bytes).magic, MAGIC, sizeof(MAGIC)) != 0)
+	{
+		throw std::runtime_error("Not a texture cache: " + name);
+	}
+
+	const Header & header = headerOf(bytes);
+	if (header.version != VERSION)
+	{
+		throw std::runtime_error("Outdated texture cache: " + name);
+	}
+
+	if (header.format > (uint32_t) BlockFormat::BC5 || header.width == 0 || header.height == 0
+		|| header.levelCount == 0 || header.levelCount > MAX_LEVELS)
+	{
+		throw std::runtime_error("Corrupted texture cache: " + name);
+	}
+
+	for (size_t level = 0; level < header.levelCount; ++level)
+	{
+		const LevelEntry & entry = header.levels[level];
+		if (entry.size != CompressedSize(format(), width(level), height(level)) ||
+			entry.offset % ALIGNMENT != 0 || entry.offset > length || entry.size > length - entry.offset)
+		{
+			throw std::runtime_error("Corrupted texture cache: " + name);
+		}
+	}
+}
+
+uint64_t TextureCache::sourceHash() const { return headerOf(bytes).sourceHash; }
+BlockFormat TextureCache::format() const { return (BlockFormat) headerOf(bytes).format; }
+size_t TextureCache::levelCount() const { return headerOf(bytes).levelCount; }
+int TextureCache::width(size_t level) const { return std::max(1, (int) (headerOf(bytes).width >> level)); }
+int TextureCache::height(size_t level) const { return std::max(1, (int) (headerOf(bytes).height >> level)); }
+
+const unsigned char * TextureCache::data(size_t level) const
+{
+	return (const unsigned char *) bytes + headerOf(bytes).levels[level].offset;
+}
+
+size_t TextureCache::size(size_t level) const
+{
+	return (size_t) headerOf(bytes).levels[level].size;
+}
+
+std::vector<Image> TextureCache::decode() const
+{
+	std::vector<Image> levels;
+	for (size_t level = 0; level < levelCount(); ++level)
+	{
+		levels.push_back(DecompressImage(data(level), format(), width(level), height(level)));
+	}
+	return levels;
+}
+
+std::vector<char> SerializeTexture(const std::vector<Image> & levels, BlockFormat format, uint64_t sourceHash, ThreadPool & pool)
+{
+	PROFILE_SCOPE("SerializeTexture");
+	if (levels.empty() || levels.size() > MAX_LEVELS)
+	{
+		throw std::runtime_error("SerializeTexture: bad level count");
+	}
+
+	Header header = {};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.format = (uint32_t) format;
+	header.width = levels[0].width;
+	header.height = levels[0].height;
+	header.levelCount = (uint32_t) levels.size();
+	header.sourceHash = sourceHash;
+
+	std::vector<std::vector<unsigned char>> blocks;
+	size_t offset = alignUp(sizeof(Header));
+	for (size_t level = 0; level < levels.size(); ++level)
+	{
+		if (levels[level].width != std::max(1, levels[0].width >> level) || levels[level].height != std::max(1, levels[0].height >> level))
+		{
+			throw std::runtime_error("SerializeTexture: levels are not a mip chain");
+		}
+		blocks.push_back(CompressImage(levels[level], format, pool));
+		header.levels[level].offset = offset;
+		header.levels[level].size = blocks.back().size();
+		offset = alignUp(offset + blocks.back().size());
+	}
+
+	std::vector<char> bytes(offset, 0);
+	memcpy(bytes.data(), &header, sizeof(Header));
+	for (size_t level = 0; level < levels.size(); ++level)
+	{
+		memcpy(bytes.data() + header.levels[level].offset, blocks[level].data(), blocks[level].size());
+	}
+	return bytes;
+}
+
+void SaveTextureCache(const std::string & path, const std::vector<char> & bytes)
+{
+	PROFILE_SCOPE("SaveTextureCache");
+
+	// Write next to the target then rename, so a crash never leaves half a cache behind
+	const std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write(bytes.data(), bytes.size());
+		if (!out.good())
+		{
+			throw std::runtime_error("Cannot write texture cache: " + path);
+		}
+	}
+
+	std::remove(path.c_str());
+	if (std::rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		std::remove(temporary.c_str());
+		throw std::runtime_error("Cannot write texture cache: " + path);
+	}
+}
+
+std::string TextureCachePath(const char * imagePath, BlockFormat format)
+{
+	return imagePath + std::string(".") + formatName(format) + ".texcache";
+}
+
+TextureCache LoadTextureCached(const char * imagePath, BlockFormat format, ThreadPool & pool)
+{
+	PROFILE_SCOPE("LoadTextureCached");
+	const std::string cachePath = TextureCachePath(imagePath, format);
+
+	uint64_t sourceHash = 0;
+	bool haveSource = true;
+	try
+	{
+		sourceHash = HashFile(imagePath, pool);
+	}
+	catch (const std::exception &)
+	{
+		// Caches can be shipped without their source
+		haveSource = false;
+	}
+
+	try
+	{
+		TextureCache cache(cachePath);
+		if ((!haveSource || cache.sourceHash() == sourceHash) && cache.format() == format)
+		{
+			return cache;
+		}
+	}
+	catch (const std::exception &)
+	{
+		// Missing, outdated or corrupted: rebuilt below
+	}
+
+	if (!haveSource)
+	{
+		throw std::runtime_error(std::string("Cannot load texture: ") + imagePath);
+	}
+
+	std::cout << "Building texture cache " << cachePath << std::endl;
+	const MipFilter filter = format == BlockFormat::BC5 ? MipFilter::NormalMap : MipFilter::Color;
+	const std::vector<Image> levels = BuildMipChain(loadSource(imagePath, format, pool), filter, pool);
+	std::vector<char> bytes = SerializeTexture(levels, format, sourceHash, pool);
+
+	try
+	{
+		SaveTextureCache(cachePath, bytes);
+		return TextureCache(cachePath);
+	}
+	catch (const std::exception & e)
+	{
+		std::cerr << e.what() << std::endl;
+		return TextureCache(std::move(bytes));
+	}
+}
+
+GLuint CreateCompressedTexture(const TextureCache & cache)
+{
+	PROFILE_SCOPE("CreateCompressedTexture");
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	// Storage for the whole chain at once, then each level straight from the cache
+	glTexStorage2D(GL_TEXTURE_2D, (GLsizei) cache.levelCount(), BlockGLFormat(cache.format()), cache.width(0), cache.height(0));
+	for (size_t level = 0; level < cache.levelCount(); level++)
+	{
+		glCompressedTexSubImage2D(GL_TEXTURE_2D, (GLint) level, 0, 0, cache.width(level), cache.height(level),
+			BlockGLFormat(cache.format()), (GLsizei) cache.size(level), cache.data(level));
+	}
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	return texture;
+}
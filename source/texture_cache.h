@@ -0,0 +1,64 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "block_compression.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+// Block compressed mip chain, laid out like a DDS or KTX file: a header
+// with the format and size, a table of levels, then each level 16-byte
+// aligned so it can be given to glCompressedTexImage2D from the mapped file.
+class TextureCache
+{
+public:
+	// Maps a cache file, throws std::runtime_error if it is missing or not valid
+	explicit TextureCache(const std::string & path);
+
+	// Reads a cache held in memory
+	explicit TextureCache(std::vector<char> bytes);
+
+	uint64_t sourceHash() const;
+	BlockFormat format() const;
+
+	size_t levelCount() const;
+	int width(size_t level) const;
+	int height(size_t level) const;
+	const unsigned char * data(size_t level) const;
+	size_t size(size_t level) const;
+
+	// Every level decoded, for the CPU side users of the texture
+	std::vector<Image> decode() const;
+
+private:
+	void validate(const std::string & name);
+
+	std::unique_ptr<MappedFile> file;
+	std::vector<char> memory;
+	const char * bytes = nullptr;
+	size_t length = 0;
+};
+
+// Compresses every level, all of the same format, from the largest one down
+std::vector<char> SerializeTexture(const std::vector<Image> & levels, BlockFormat format, uint64_t sourceHash,
+	ThreadPool & pool = ThreadPool::global());
+
+// Writes the serialized texture to path, throws std::runtime_error on failure
+void SaveTextureCache(const std::string & path, const std::vector<char> & bytes);
+
+// Cache file of an image: "<imagePath>.<bc1|bc3|bc5>.texcache"
+std::string TextureCachePath(const char * imagePath, BlockFormat format);
+
+// Returns the compressed mip chain of imagePath, and rebuilds the cache file
+// first if the image changed since it was written. BC5 builds normal map
+// mips, the others color ones. Throws std::runtime_error if neither the cache
+// nor the image can be read.
+TextureCache LoadTextureCached(const char * imagePath, BlockFormat format, ThreadPool & pool = ThreadPool::global());
+
+// Immutable texture holding every level, with trilinear filtering
+GLuint CreateCompressedTexture(const TextureCache & cache);
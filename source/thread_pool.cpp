@@ -0,0 +1,172 @@
+#include "thread_pool.h"
+#include "profiler.h"
+
+#include <algorithm>
+
+static thread_local bool insidePool = false;
+
+namespace
+{
+	// Marks the caller as inside a loop, until it returns or throws
+	struct InsidePool
+	{
+		bool previous;
+		InsidePool() : previous(insidePool) { insidePool = true; }
+		~InsidePool() { insidePool = previous; }
+	};
+}
+
+ThreadPool::ThreadPool(unsigned threadCount)
+	: nextTask(0)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	for (unsigned i = 1; i < threadCount; ++i)
+	{
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::runTasks()
+{
+	try
+	{
+		for (size_t i = nextTask++; i < taskCount; i = nextTask++)
+		{
+			(*task)(i);
+		}
+	}
+	catch (...)
+	{
+		// The other threads stop at their next task
+		nextTask = taskCount;
+		std::lock_guard<std::mutex> lock(stateMutex);
+		if (!error)
+		{
+			error = std::current_exception();
+		}
+	}
+}
+
+void ThreadPool::workerLoop()
+{
+	insidePool = true;
+	unsigned seen = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(stateMutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+			{
+				return;
+			}
+			seen = generation;
+		}
+
+		{
+			PROFILE_SCOPE("Worker tasks");
+			runTasks();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(stateMutex);
+			++finishedWorkers;
+		}
+		done.notify_one();
+	}
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& body)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	if (workers.empty() || count == 1 || insidePool)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			body(i);
+		}
+		return;
+	}
+
+	std::lock_guard<std::mutex> loop(loopMutex);
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		task = &body;
+		taskCount = count;
+		nextTask = 0;
+		finishedWorkers = 0;
+		error = nullptr;
+		++generation;
+	}
+	wake.notify_all();
+
+	{
+		InsidePool inside;
+		runTasks();
+	}
+
+	// Every worker checks in, so none is left reading this loop once we return
+	std::exception_ptr thrown;
+	{
+		std::unique_lock<std::mutex> lock(stateMutex);
+		done.wait(lock, [&] { return finishedWorkers == workers.size(); });
+		task = nullptr;
+		taskCount = 0;
+		std::swap(thrown, error);
+	}
+	if (thrown)
+	{
+		std::rethrow_exception(thrown);
+	}
+}
+
+void ThreadPool::parallelRanges(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+	grain = std::max<size_t>(grain, 1);
+
+	// A few ranges per thread keeps the load balanced without tiny tasks
+	const size_t ranges = std::min((count + grain - 1) / grain, (size_t) size() * 4);
+	if (ranges == 0)
+	{
+		return;
+	}
+
+	const size_t step = (count + ranges - 1) / ranges;
+	parallelFor(ranges, [&](size_t r) {
+		const size_t begin = r * step;
+		const size_t end = std::min(count, begin + step);
+		if (begin < end)
+		{
+			body(begin, end);
+		}
+	});
+}
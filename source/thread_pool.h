@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <exception>
+
+// Fixed set of worker threads running data parallel loops.
+// The calling thread takes part in the loop, and a loop started from
+// inside a worker runs inline instead of waiting on itself.
+class ThreadPool
+{
+public:
+	// 0 means one thread per core
+	explicit ThreadPool(unsigned threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Number of threads working on a loop, the caller included
+	unsigned size() const { return (unsigned) workers.size() + 1; }
+
+	// Runs task(i) for every i in [0, count) and returns once all are done.
+	// If a task throws, the tasks not started yet are skipped and the first
+	// exception is rethrown on the caller once every thread left the loop.
+	void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+	// Splits [0, count) in ranges of at least grain items and runs task(begin, end) on each
+	void parallelRanges(size_t count, size_t grain, const std::function<void(size_t, size_t)>& task);
+
+	// Pool of the per-frame passes, and of the loaders called without one
+	static ThreadPool& global();
+
+private:
+	void workerLoop();
+	void runTasks();
+
+	std::vector<std::thread> workers;
+
+	std::mutex loopMutex; // one loop at a time
+	std::mutex stateMutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	const std::function<void(size_t)>* task = nullptr;
+	size_t taskCount = 0;
+	std::atomic<size_t> nextTask;
+	size_t finishedWorkers = 0;
+	std::exception_ptr error; // first thrown by a task of the loop
+	unsigned generation = 0;
+	bool stopping = false;
+};
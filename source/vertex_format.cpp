@@ -0,0 +1,300 @@
+#include "vertex_format.h"
+#include "profiler.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+uint16_t FloatToHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
+
+	const uint32_t sign = (bits >> 16) & 0x8000u;
+	const int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+	uint32_t mantissa = bits & 0x7FFFFFu;
+
+	if (((bits >> 23) & 0xFF) == 0xFF)
+	{
+		// Inf or NaN
+		return (uint16_t)(sign | 0x7C00u | (mantissa ? 0x200u : 0u));
+	}
+	if (exponent >= 31)
+	{
+		return (uint16_t)(sign | 0x7C00u);
+	}
+	if (exponent <= 0)
+	{
+		// Denormal or zero
+		if (exponent < -10)
+		{
+			return (uint16_t) sign;
+		}
+		mantissa |= 0x800000u;
+		const uint32_t shift = (uint32_t)(14 - exponent);
+		uint32_t half = mantissa >> shift;
+		// Round to nearest even
+		const uint32_t rest = mantissa & ((1u << shift) - 1);
+		const uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+		{
+			++half;
+		}
+		return (uint16_t)(sign | half);
+	}
+
+	uint32_t half = sign | ((uint32_t) exponent << 10) | (mantissa >> 13);
+	const uint32_t rest = mantissa & 0x1FFFu;
+	if (rest > 0x1000u || (rest == 0x1000u && (half & 1)))
+	{
+		++half; // may carry into the exponent, which is still correct
+	}
+	return (uint16_t) half;
+}
+
+float HalfToFloat(uint16_t half)
+{
+	const uint32_t sign = (uint32_t)(half & 0x8000u) << 16;
+	uint32_t exponent = (half >> 10) & 0x1F;
+	uint32_t mantissa = half & 0x3FFu;
+
+	uint32_t bits;
+	if (exponent == 0x1F)
+	{
+		bits = sign | 0x7F800000u | (mantissa << 13);
+	}
+	else if (exponent == 0)
+	{
+		if (mantissa == 0)
+		{
+			bits = sign;
+		}
+		else
+		{
+			// Normalize the denormal
+			exponent = 127 - 15 + 1;
+			while ((mantissa & 0x400u) == 0)
+			{
+				mantissa <<= 1;
+				--exponent;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3FFu) << 13);
+		}
+	}
+	else
+	{
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+
+	float value;
+	memcpy(&value, &bits, 4);
+	return value;
+}
+
+glm::vec2 OctahedralEncode(const glm::vec3 & n)
+{
+	const float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+	glm::vec2 e = l1 > 0.0f ? glm::vec2(n.x / l1, n.y / l1) : glm::vec2(0.0f);
+	if (n.z < 0.0f)
+	{
+		// Fold the lower hemisphere over the diagonals
+		e = glm::vec2(
+			(1.0f - std::fabs(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f),
+			(1.0f - std::fabs(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f));
+	}
+	return e;
+}
+
+glm::vec3 OctahedralDecode(const glm::vec2 & e)
+{
+	glm::vec3 n(e.x, e.y, 1.0f - std::fabs(e.x) - std::fabs(e.y));
+	const float t = std::max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return glm::normalize(n);
+}
+
+int16_t FloatToSnorm16(float value)
+{
+	return (int16_t) std::lround(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f);
+}
+
+float Snorm16ToFloat(int16_t value)
+{
+	return std::max(value / 32767.0f, -1.0f);
+}
+
+uint32_t PackSnorm1010102(const glm::vec4 & v)
+{
+	auto quantize = [](float f, float scale, uint32_t mask) {
+		const int32_t q = (int32_t) std::lround(std::min(std::max(f, -1.0f), 1.0f) * scale);
+		return (uint32_t) q & mask;
+	};
+
+	return quantize(v.x, 511.0f, 0x3FFu)
+		| quantize(v.y, 511.0f, 0x3FFu) << 10
+		| quantize(v.z, 511.0f, 0x3FFu) << 20
+		| quantize(v.w, 1.0f, 0x3u) << 30;
+}
+
+glm::vec4 UnpackSnorm1010102(uint32_t packed)
+{
+	// Sign extend each field by shifting it to the top of an int32
+	auto field = [packed](int shift, int bits, float scale) {
+		const int32_t value = (int32_t)(packed << (32 - shift - bits)) >> (32 - bits);
+		return std::max(value / scale, -1.0f);
+	};
+
+	return glm::vec4(field(0, 10, 511.0f), field(10, 10, 511.0f), field(20, 10, 511.0f), field(30, 2, 1.0f));
+}
+
+VertexFormat MakeVertexFormat(const VertexLayout & layout)
+{
+	VertexFormat format;
+	format.layout = layout;
+
+	auto add = [&format](GLuint location, GLint size, GLenum type, GLboolean normalized, size_t bytes) {
+		format.attributes.push_back({location, size, type, normalized, format.stride});
+		format.stride += bytes;
+	};
+
+	add(ATTRIBUTE_POSITION, 3, GL_FLOAT, GL_FALSE, 12);
+
+	if (layout.uvs)
+	{
+		if (layout.halfUVs) add(ATTRIBUTE_UV, 2, GL_HALF_FLOAT, GL_FALSE, 4);
+		else add(ATTRIBUTE_UV, 2, GL_FLOAT, GL_FALSE, 8);
+	}
+
+	switch (layout.normals)
+	{
+	case NormalEncoding::Float: add(ATTRIBUTE_NORMAL, 3, GL_FLOAT, GL_FALSE, 12); break;
+	case NormalEncoding::Octahedral: add(ATTRIBUTE_NORMAL, 2, GL_SHORT, GL_TRUE, 4); break;
+	case NormalEncoding::Packed1010102: add(ATTRIBUTE_NORMAL, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 4); break;
+	}
+
+	if (layout.tangents)
+	{
+		if (layout.normals == NormalEncoding::Float) add(ATTRIBUTE_TANGENT, 4, GL_FLOAT, GL_FALSE, 16);
+		else add(ATTRIBUTE_TANGENT, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 4);
+	}
+
+	return format;
+}
+
+std::vector<unsigned char> InterleaveVertices(const MeshStreams & mesh, const VertexFormat & format, ThreadPool & pool)
+{
+	PROFILE_SCOPE("InterleaveVertices");
+	const VertexLayout & layout = format.layout;
+	std::vector<unsigned char> data(mesh.vertexCount * format.stride);
+
+	pool.parallelRanges(mesh.vertexCount, 8192, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			unsigned char * out = &data[i * format.stride];
+			auto put = [&out](const void * value, size_t size) {
+				memcpy(out, value, size);
+				out += size;
+			};
+
+			put(&mesh.positions[i], 12);
+
+			if (layout.uvs)
+			{
+				const glm::vec2 uv = mesh.uvs ? mesh.uvs[i] : glm::vec2(0.0f);
+				if (layout.halfUVs)
+				{
+					const uint16_t half[2] = {FloatToHalf(uv.x), FloatToHalf(uv.y)};
+					put(half, 4);
+				}
+				else
+				{
+					put(&uv, 8);
+				}
+			}
+
+			// Degenerate OBJ normals and zero area STL facets give no direction
+			const float length = glm::length(mesh.normals[i]);
+			const glm::vec3 normal = length > 0.0f ? mesh.normals[i] / length : glm::vec3(0.0f, 0.0f, 1.0f);
+			if (layout.normals == NormalEncoding::Float)
+			{
+				put(&normal, 12);
+			}
+			else if (layout.normals == NormalEncoding::Octahedral)
+			{
+				const glm::vec2 e = OctahedralEncode(normal);
+				const int16_t packed[2] = {FloatToSnorm16(e.x), FloatToSnorm16(e.y)};
+				put(packed, 4);
+			}
+			else
+			{
+				const uint32_t packed = PackSnorm1010102(glm::vec4(normal, 0.0f));
+				put(&packed, 4);
+			}
+
+			if (layout.tangents)
+			{
+				glm::vec4 tangent(0.0f, 0.0f, 0.0f, 1.0f);
+				if (mesh.tangents)
+				{
+					const float handedness = glm::dot(glm::cross(normal, mesh.tangents[i]), mesh.bitangents[i]) < 0.0f ? -1.0f : 1.0f;
+					tangent = glm::vec4(mesh.tangents[i], handedness);
+				}
+
+				if (layout.normals == NormalEncoding::Float)
+				{
+					put(&tangent, 16);
+				}
+				else
+				{
+					const uint32_t packed = PackSnorm1010102(tangent);
+					put(&packed, 4);
+				}
+			}
+		}
+	});
+
+	return data;
+}
+
+void BindVertexFormat(const VertexFormat & format)
+{
+	for (const auto & attribute : format.attributes)
+	{
+		glEnableVertexAttribArray(attribute.location);
+		glVertexAttribPointer(attribute.location, attribute.size, attribute.type, attribute.normalized, (GLsizei) format.stride, (void *) attribute.offset);
+	}
+}
+
+void UnbindVertexFormat(const VertexFormat & format)
+{
+	for (const auto & attribute : format.attributes)
+	{
+		glDisableVertexAttribArray(attribute.location);
+	}
+}
+
+void BindInstanceFormat(size_t offset)
+{
+	// The matrix goes column by column
+	for (GLuint column = 0; column < 4; ++column)
+	{
+		const GLuint location = ATTRIBUTE_INSTANCE_MODEL + column;
+		glEnableVertexAttribArray(location);
+		glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void *) (offset + offsetof(InstanceData, model) + column * sizeof(glm::vec4)));
+		glVertexAttribDivisor(location, 1);
+	}
+	glEnableVertexAttribArray(ATTRIBUTE_INSTANCE_COLOR);
+	glVertexAttribPointer(ATTRIBUTE_INSTANCE_COLOR, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void *) (offset + offsetof(InstanceData, color)));
+	glVertexAttribDivisor(ATTRIBUTE_INSTANCE_COLOR, 1);
+}
+
+void UnbindInstanceFormat()
+{
+	for (GLuint location = ATTRIBUTE_INSTANCE_MODEL; location <= ATTRIBUTE_INSTANCE_COLOR; ++location)
+	{
+		glVertexAttribDivisor(location, 0);
+		glDisableVertexAttribArray(location);
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "thread_pool.h"
+
+// How normals (and tangents) are stored in the interleaved vertex
+enum class NormalEncoding
+{
+	Float, // 3 floats, tangent as 4 floats
+	Octahedral, // 2 snorm16 octahedral coordinates, tangent as 10-10-10-2
+	Packed1010102, // 10-10-10-2 snorm, tangent too
+};
+
+// Which attributes go in the interleaved vertex, and how they are quantized.
+// The tangent always carries the bitangent handedness in w, the shader rebuilds
+// the bitangent as cross(normal, tangent) * w.
+struct VertexLayout
+{
+	bool uvs = true;
+	bool halfUVs = true; // 2 half floats instead of 2 floats
+	NormalEncoding normals = NormalEncoding::Packed1010102;
+	bool tangents = false;
+};
+
+// Shader attribute locations, as declared in shader.vert
+enum VertexAttribute
+{
+	ATTRIBUTE_POSITION = 0,
+	ATTRIBUTE_UV = 1,
+	ATTRIBUTE_NORMAL = 2,
+	ATTRIBUTE_TANGENT = 4,
+	ATTRIBUTE_INSTANCE_MODEL = 6, // a mat4 takes locations 6 to 9
+	ATTRIBUTE_INSTANCE_COLOR = 10,
+};
+
+// Resolved layout: stride and glVertexAttribPointer arguments of each attribute
+struct VertexFormat
+{
+	struct Attribute
+	{
+		GLuint location;
+		GLint size;
+		GLenum type;
+		GLboolean normalized;
+		size_t offset;
+	};
+
+	VertexLayout layout;
+	size_t stride = 0;
+	std::vector<Attribute> attributes;
+};
+
+VertexFormat MakeVertexFormat(const VertexLayout & layout);
+
+// Packs the streams of a mesh in one interleaved buffer, in parallel
+std::vector<unsigned char> InterleaveVertices(const MeshStreams & mesh, const VertexFormat & format, ThreadPool & pool = ThreadPool::global());
+
+// Enables and points the attributes of format at the bound GL_ARRAY_BUFFER
+void BindVertexFormat(const VertexFormat & format);
+void UnbindVertexFormat(const VertexFormat & format);
+
+// Per instance attributes of batched draws, advanced once per instance
+struct InstanceData
+{
+	glm::mat4 model;
+	glm::vec4 color;
+};
+
+// Enables and points the instance attributes at the bound GL_ARRAY_BUFFER of
+// InstanceData, starting offset bytes in
+void BindInstanceFormat(size_t offset = 0);
+void UnbindInstanceFormat();
+
+// Quantization helpers, exposed so their error can be measured on the CPU
+uint16_t FloatToHalf(float value);
+float HalfToFloat(uint16_t half);
+
+glm::vec2 OctahedralEncode(const glm::vec3 & n); // unit vector to [-1, 1]^2
+glm::vec3 OctahedralDecode(const glm::vec2 & e);
+
+int16_t FloatToSnorm16(float value);
+float Snorm16ToFloat(int16_t value);
+
+// x, y, z on 10 bits and w on 2 bits, as GL_INT_2_10_10_10_REV normalized
+uint32_t PackSnorm1010102(const glm::vec4 & v);
+glm::vec4 UnpackSnorm1010102(uint32_t packed);
@@ -0,0 +1,1683 @@
+// Command line front end for the CPU side mesh pipeline.
+// Runs without a GL context, so it can be used on machines with no GPU.
+
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "../vbo_indexer.h"
+#include "obj.h"
+#include "stl.h"
+#include "mesh_cache.h"
+#include "hash.h"
+#include "thread_pool.h"
+#include "vertex_format.h"
+#include "mesh_optimizer.h"
+#include "meshlets.h"
+#include "simplify.h"
+#include "bvh.h"
+#include "scene.h"
+#include "batching.h"
+#include "profiler.h"
+#include "rasterizer.h"
+#include "texture.h"
+#include "texture_cache.h"
+#include "mesh.h"
+#include "clustered_lighting.h"
+#include "render_queue.h"
+
+using namespace std;
+
+static double elapsedMs(chrono::steady_clock::time_point start) {
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+#pragma region convert
+
+// Builds the .meshcache file the application would otherwise build at startup
+static int convert(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "convert needs an OBJ file" << endl;
+		return 1;
+	}
+
+	const char* objPath = argv[0];
+	string outPath;
+	MeshOptions options;
+	VertexLayout layout;
+
+	for (int i = 1; i < argc; i++) {
+		const string arg = argv[i];
+		if (arg == "--tangents") {
+			options.tangents = true;
+			layout.tangents = true;
+		} else if (arg == "--no-uvs") {
+			layout.uvs = false;
+		} else if (arg == "--no-optimize") {
+			options.optimize = false;
+		} else if (arg == "--offset" && i + 3 < argc) {
+			options.offset = glm::vec3(stof(argv[i + 1]), stof(argv[i + 2]), stof(argv[i + 3]));
+			i += 3;
+		} else if (arg == "-o" && i + 1 < argc) {
+			outPath = argv[++i];
+		} else {
+			cerr << "Unknown option " << arg << endl;
+			return 1;
+		}
+	}
+
+	if (outPath.empty()) {
+		outPath = MeshCachePath(objPath, options, layout);
+	}
+
+	auto start = chrono::steady_clock::now();
+	const Mesh mesh = BuildMesh(objPath, options);
+	const double buildMs = elapsedMs(start);
+
+	SaveMeshCache(outPath, mesh, layout, HashFile(objPath), HashMeshOptions(options));
+
+	start = chrono::steady_clock::now();
+	const MeshCache cache(outPath);
+	const double mapMs = elapsedMs(start);
+
+	cout << outPath << ": " << cache.vertexCount() << " vertices, " << cache.indexCount() / 3 << " triangles, " << cache.meshletCount() << " meshlets, "
+		<< (cache.indexType() == GL_UNSIGNED_SHORT ? 16 : 32) << "-bit indices" << endl
+		<< "parse + weld " << buildMs << " ms, cache map " << mapMs << " ms" << endl;
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region bench-weld
+
+// The linear search indexVBO_TBN used before the welding grid, kept as the reference
+static void indexVBO_TBN_linear(
+	const std::vector<glm::vec3>& in_vertices,
+	const std::vector<glm::vec2>& in_uvs,
+	const std::vector<glm::vec3>& in_normals,
+	const std::vector<glm::vec3>& in_tangents,
+	const std::vector<glm::vec3>& in_bitangents,
+
+	std::vector<unsigned int>& out_indices,
+	std::vector<glm::vec3>& out_vertices,
+	std::vector<glm::vec2>& out_uvs,
+	std::vector<glm::vec3>& out_normals,
+	std::vector<glm::vec3>& out_tangents,
+	std::vector<glm::vec3>& out_bitangents
+) {
+	auto is_near = [](float v1, float v2) { return fabs(v1 - v2) < 0.01f; };
+
+	for (size_t i = 0; i < in_vertices.size(); i++) {
+		size_t index = 0;
+		for (; index < out_vertices.size(); index++) {
+			if (
+				is_near(in_vertices[i].x, out_vertices[index].x) &&
+				is_near(in_vertices[i].y, out_vertices[index].y) &&
+				is_near(in_vertices[i].z, out_vertices[index].z) &&
+				is_near(in_uvs[i].x, out_uvs[index].x) &&
+				is_near(in_uvs[i].y, out_uvs[index].y) &&
+				is_near(in_normals[i].x, out_normals[index].x) &&
+				is_near(in_normals[i].y, out_normals[index].y) &&
+				is_near(in_normals[i].z, out_normals[index].z)
+				) {
+				break;
+			}
+		}
+
+		if (index < out_vertices.size()) {
+			out_tangents[index] += in_tangents[i];
+			out_bitangents[index] += in_bitangents[i];
+		} else {
+			out_vertices.push_back(in_vertices[i]);
+			out_uvs.push_back(in_uvs[i]);
+			out_normals.push_back(in_normals[i]);
+			out_tangents.push_back(in_tangents[i]);
+			out_bitangents.push_back(in_bitangents[i]);
+		}
+		out_indices.push_back((unsigned int)index);
+	}
+}
+
+// Unindexed grid of side x side quads, slightly jittered so welding needs the tolerance
+static void makeJitteredGrid(
+	int side,
+	std::vector<glm::vec3>& vertices,
+	std::vector<glm::vec2>& uvs,
+	std::vector<glm::vec3>& normals,
+	std::vector<glm::vec3>& tangents,
+	std::vector<glm::vec3>& bitangents
+) {
+	mt19937 rng(side);
+	uniform_real_distribution<float> jitter(-0.002f, 0.002f);
+
+	const int corners[6][2] = { {0, 0}, {1, 0}, {1, 1}, {0, 0}, {1, 1}, {0, 1} };
+	for (int y = 0; y < side; y++) {
+		for (int x = 0; x < side; x++) {
+			for (const auto& c : corners) {
+				const glm::vec2 uv((x + c[0]) / (float)side, (y + c[1]) / (float)side);
+				vertices.push_back(glm::vec3(uv.x * side * 0.1f + jitter(rng), jitter(rng), uv.y * side * 0.1f));
+				uvs.push_back(uv);
+				normals.push_back(glm::vec3(0, 1, 0));
+				tangents.push_back(glm::vec3(1, 0, 0));
+				bitangents.push_back(glm::vec3(0, 0, 1));
+			}
+		}
+	}
+}
+
+// Compares the welding grid of indexVBO_TBN with the former linear search
+static int benchWeld(int argc, char** argv) {
+	const size_t maxLinearTriangles = argc > 0 ? stoul(argv[0]) : 32768;
+
+	cout << "triangles  vertices  grid(ms)  linear(ms)  speedup" << endl;
+	for (int side = 16; side <= 1024; side *= 2) {
+		std::vector<glm::vec3> vertices, normals, tangents, bitangents;
+		std::vector<glm::vec2> uvs;
+		makeJitteredGrid(side, vertices, uvs, normals, tangents, bitangents);
+
+		std::vector<unsigned int> indices;
+		std::vector<glm::vec3> out_vertices, out_normals, out_tangents, out_bitangents;
+		std::vector<glm::vec2> out_uvs;
+
+		auto start = chrono::steady_clock::now();
+		indexVBO_TBN(vertices, uvs, normals, tangents, bitangents, indices, out_vertices, out_uvs, out_normals, out_tangents, out_bitangents);
+		const double gridMs = elapsedMs(start);
+
+		const size_t triangles = vertices.size() / 3;
+		cout << triangles << "  " << out_vertices.size() << "  " << gridMs;
+
+		if (triangles <= maxLinearTriangles) {
+			std::vector<unsigned int> ref_indices;
+			std::vector<glm::vec3> ref_vertices, ref_normals, ref_tangents, ref_bitangents;
+			std::vector<glm::vec2> ref_uvs;
+
+			start = chrono::steady_clock::now();
+			indexVBO_TBN_linear(vertices, uvs, normals, tangents, bitangents, ref_indices, ref_vertices, ref_uvs, ref_normals, ref_tangents, ref_bitangents);
+			const double linearMs = elapsedMs(start);
+
+			cout << "  " << linearMs << "  " << linearMs / gridMs << "x";
+			if (ref_indices != indices || ref_vertices.size() != out_vertices.size()) {
+				cout << endl << "Mismatch with the linear search!" << endl;
+				return 1;
+			}
+		} else {
+			cout << "  -  -";
+		}
+		cout << endl;
+	}
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region bench-obj
+
+// Times loadOBJ on the same file with a growing number of threads
+static int benchObj(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "bench-obj needs an OBJ file" << endl;
+		return 1;
+	}
+
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+
+	cout << "threads  triangles  load(ms)" << endl;
+	for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		ThreadPool pool(threads);
+
+		std::vector<glm::vec3> vertices, normals;
+		std::vector<glm::vec2> uvs;
+
+		const auto start = chrono::steady_clock::now();
+		if (!loadOBJ(argv[0], vertices, uvs, normals, pool)) {
+			return 1;
+		}
+		cout << threads << "  " << vertices.size() / 3 << "  " << elapsedMs(start) << endl;
+
+		if (threads == maxThreads) break;
+	}
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region bench-stl
+
+// Times ReadStl and reports the decode bandwidth
+static int benchStl(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "bench-stl needs an STL file" << endl;
+		return 1;
+	}
+
+	// The first read also brings the file in the page cache
+	ReadStl(argv[0]);
+
+	const int runs = 5;
+	double bestMs = 1e30;
+	size_t triangles = 0;
+	for (int i = 0; i < runs; i++) {
+		StlFacets facets;
+		const auto start = chrono::steady_clock::now();
+		triangles = ReadStl(argv[0], &facets).size();
+		bestMs = min(bestMs, elapsedMs(start));
+	}
+
+	ifstream file(argv[0], ios::binary | ios::ate);
+	const double megabytes = (double)file.tellg() / (1024.0 * 1024.0);
+
+	cout << triangles << " triangles, " << megabytes << " MB in " << bestMs << " ms ("
+		<< megabytes / (bestMs / 1000.0) << " MB/s, " << ThreadPool::global().size() << " threads)" << endl;
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region optimize
+
+static void printCacheStats(const char* label, const VertexCacheStats& stats) {
+	cout << "  " << label << ": ACMR " << stats.acmr << ", ATVR " << stats.atvr << " (" << stats.transformed << " transformed)" << endl;
+}
+
+// Runs the vertex cache, overdraw and vertex fetch passes on an OBJ or STL file and reports their gains
+static int optimize(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "optimize needs an OBJ or STL file" << endl;
+		return 1;
+	}
+
+	unsigned cacheSize = 16;
+	bool overdraw = true;
+	string outPath;
+	for (int i = 1; i < argc; i++) {
+		const string arg = argv[i];
+		if (arg == "--cache" && i + 1 < argc) {
+			cacheSize = (unsigned)stoul(argv[++i]);
+		} else if (arg == "--no-overdraw") {
+			overdraw = false;
+		} else if (arg == "-o" && i + 1 < argc) {
+			outPath = argv[++i];
+		} else {
+			cerr << "Unknown option " << arg << endl;
+			return 1;
+		}
+	}
+
+	MeshOptions options;
+	options.optimize = false;
+	Mesh mesh = BuildMesh(argv[0], options);
+	const size_t vertexCount = mesh.vertices.size();
+
+	cout << argv[0] << ": " << vertexCount << " vertices, " << mesh.indices.size() / 3 << " triangles, "
+		<< cacheSize << " entry FIFO" << endl;
+	printCacheStats("file order", AnalyzeVertexCache(mesh.indices, vertexCount, cacheSize));
+
+	auto start = chrono::steady_clock::now();
+	vector<size_t> clusters;
+	OptimizeVertexCache(mesh.indices, vertexCount, cacheSize, &clusters);
+	const double cacheMs = elapsedMs(start);
+	printCacheStats("vertex cache", AnalyzeVertexCache(mesh.indices, vertexCount, cacheSize));
+
+	double overdrawMs = 0.0;
+	if (overdraw) {
+		start = chrono::steady_clock::now();
+		OptimizeOverdraw(mesh.indices, mesh.vertices, clusters);
+		overdrawMs = elapsedMs(start);
+		printCacheStats("overdraw", AnalyzeVertexCache(mesh.indices, vertexCount, cacheSize));
+	}
+
+	start = chrono::steady_clock::now();
+	OptimizeVertexFetch(mesh);
+	const double fetchMs = elapsedMs(start);
+
+	cout << "  " << clusters.size() << " clusters; vertex cache " << cacheMs << " ms, overdraw " << overdrawMs
+		<< " ms, vertex fetch " << fetchMs << " ms" << endl;
+
+	if (!outPath.empty()) {
+		options.optimize = true;
+		SaveMeshCache(outPath, mesh, VertexLayout(), HashFile(argv[0]), HashMeshOptions(options));
+		cout << "Wrote " << outPath << endl;
+	}
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region meshlets
+
+// Splits an OBJ or STL file in meshlets and measures how much CPU culling rejects from views orbiting it
+static int meshlets(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "meshlets needs an OBJ or STL file" << endl;
+		return 1;
+	}
+
+	MeshletLimits limits;
+	int views = 64;
+	for (int i = 1; i < argc; i++) {
+		const string arg = argv[i];
+		if (arg == "--max-vertices" && i + 1 < argc) {
+			limits.maxVertices = stoul(argv[++i]);
+		} else if (arg == "--max-triangles" && i + 1 < argc) {
+			limits.maxTriangles = stoul(argv[++i]);
+		} else if (arg == "--views" && i + 1 < argc) {
+			views = stoi(argv[++i]);
+		} else {
+			cerr << "Unknown option " << arg << endl;
+			return 1;
+		}
+	}
+
+	Mesh mesh = BuildMesh(argv[0], MeshOptions());
+
+	auto start = chrono::steady_clock::now();
+	const vector<Meshlet> built = BuildMeshlets(mesh.vertices, mesh.indices, limits);
+	const double buildMs = elapsedMs(start);
+
+	size_t vertices = 0, withCone = 0;
+	for (const auto& meshlet : built) {
+		vertices += meshlet.vertexCount;
+		withCone += meshlet.coneCutoff < 1.0f;
+	}
+	const size_t triangles = mesh.indices.size() / 3;
+	cout << argv[0] << ": " << built.size() << " meshlets in " << buildMs << " ms, "
+		<< (double)vertices / max<size_t>(built.size(), 1) << " vertices and " << (double)triangles / max<size_t>(built.size(), 1)
+		<< " triangles on average (limits " << limits.maxVertices << "/" << limits.maxTriangles << "), "
+		<< withCone << " with a usable normal cone" << endl;
+
+	// Mesh bounds, to place the cameras
+	glm::vec3 low = mesh.vertices.empty() ? glm::vec3(0.0f) : mesh.vertices[0], high = low;
+	for (const auto& p : mesh.vertices) {
+		low = glm::min(low, p);
+		high = glm::max(high, p);
+	}
+	const glm::vec3 center = (low + high) * 0.5f;
+	const float radius = max(glm::length(high - low) * 0.5f, 1e-6f);
+	const glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, radius * 0.01f, radius * 10.0f);
+
+	// Cameras on a sphere around the mesh, close enough that part of it is off screen
+	MeshletCullStats stats;
+	vector<TriangleRange> visible;
+	double cullMs = 0.0;
+	const float golden = 3.14159265f * (3.0f - sqrt(5.0f));
+	for (int v = 0; v < views; v++) {
+		const float y = 1.0f - 2.0f * (v + 0.5f) / views;
+		const float ring = sqrt(1.0f - y * y);
+		const glm::vec3 direction(cos(golden * v) * ring, y, sin(golden * v) * ring);
+		const glm::vec3 eye = center + direction * radius * 1.8f;
+		const glm::vec3 up = fabs(y) > 0.99f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+		const glm::mat4 viewProjection = projection * glm::lookAt(eye, center, up);
+
+		visible.clear();
+		start = chrono::steady_clock::now();
+		CullMeshlets(built.data(), built.size(), viewProjection, eye, true, visible, &stats);
+		cullMs += elapsedMs(start);
+	}
+
+	const double perView = 1.0 / max(views, 1);
+	cout << "Over " << views << " views: " << stats.visibleMeshlets * perView << " meshlets drawn, "
+		<< 100.0 * stats.rejectedTriangles() / max<size_t>(stats.triangles, 1) << "% of the triangles rejected ("
+		<< 100.0 * stats.backfaceTriangles / max<size_t>(stats.triangles, 1) << "% back facing, "
+		<< 100.0 * stats.frustumTriangles / max<size_t>(stats.triangles, 1) << "% off screen), "
+		<< cullMs * 1000.0 * perView << " us per view" << endl;
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region lod
+
+// Closest point of triangle abc to p (Ericson, Real-Time Collision Detection 5.1.5)
+static glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+	const glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+	const float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+	const glm::vec3 bp = p - b;
+	const float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3) return b;
+
+	const float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+	const glm::vec3 cp = p - c;
+	const float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6) return c;
+
+	const float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+	const float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+	const float denominator = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+// Largest distance from a sample of the original vertices to the simplified surface, by brute force
+static double measureError(const vector<glm::vec3>& positions, const unsigned int* indices, size_t indexCount, const vector<unsigned int>& used) {
+	const size_t budget = 100000000; // point to triangle tests
+	const size_t samples = min(used.size(), max<size_t>(budget / max<size_t>(indexCount / 3, 1), 64));
+	vector<double> distances(samples, 0.0);
+
+	ThreadPool::global().parallelFor(samples, [&](size_t s) {
+		const glm::vec3& p = positions[used[s * used.size() / samples]];
+		float best = 1e30f;
+		for (size_t i = 0; i < indexCount; i += 3) {
+			const glm::vec3 d = p - closestPointOnTriangle(p, positions[indices[i]], positions[indices[i + 1]], positions[indices[i + 2]]);
+			best = min(best, glm::dot(d, d));
+		}
+		distances[s] = sqrt(best);
+	});
+	return distances.empty() ? 0.0 : *max_element(distances.begin(), distances.end());
+}
+
+// Builds a LOD chain and reports its triangle counts, quadric and measured errors, and build time
+static int lod(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "lod needs an OBJ or STL file" << endl;
+		return 1;
+	}
+
+	vector<float> ratios = {0.5f, 0.25f, 0.125f, 0.0625f};
+	for (int i = 1; i < argc; i++) {
+		const string arg = argv[i];
+		if (arg == "--ratios" && i + 1 < argc) {
+			ratios.clear();
+			stringstream list(argv[++i]);
+			string ratio;
+			while (getline(list, ratio, ',')) ratios.push_back(stof(ratio));
+		} else {
+			cerr << "Unknown option " << arg << endl;
+			return 1;
+		}
+	}
+
+	Mesh mesh = BuildMesh(argv[0], MeshOptions());
+
+	const auto start = chrono::steady_clock::now();
+	BuildLods(mesh, ratios);
+	const double buildMs = elapsedMs(start);
+
+	glm::vec3 low = mesh.vertices.empty() ? glm::vec3(0.0f) : mesh.vertices[0], high = low;
+	for (const auto& p : mesh.vertices) {
+		low = glm::min(low, p);
+		high = glm::max(high, p);
+	}
+	const double radius = max(glm::length(high - low) * 0.5, 1e-12);
+
+	// Every vertex the full resolution mesh draws
+	vector<unsigned int> used(mesh.indices.begin(), mesh.indices.begin() + mesh.lods[0].indexCount);
+	sort(used.begin(), used.end());
+	used.erase(unique(used.begin(), used.end()), used.end());
+
+	cout << argv[0] << ": " << mesh.lods.size() << " LODs built in " << buildMs << " ms, bounding radius " << radius << endl;
+	for (size_t i = 0; i < mesh.lods.size(); i++) {
+		const MeshLod& level = mesh.lods[i];
+		const double measured = measureError(mesh.vertices, &mesh.indices[level.firstIndex], level.indexCount, used);
+		cout << "  LOD " << i << ": " << level.indexCount / 3 << " triangles ("
+			<< 100.0 * level.indexCount / mesh.lods[0].indexCount << "%), quadric error " << level.error
+			<< " (" << 100.0 * level.error / radius << "% of the radius), measured " << measured << endl;
+	}
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region bench-bvh
+
+// Reference for the BVH: every triangle against the ray
+static RayHit intersectAll(const vector<Triangle>& triangles, const Ray& ray) {
+	RayHit hit;
+	hit.t = ray.tMax;
+	for (size_t i = 0; i < triangles.size(); i++) {
+		const Triangle& tri = triangles[i];
+		const glm::vec3 e1 = tri.p1 - tri.p0, e2 = tri.p2 - tri.p0;
+		const glm::vec3 p = glm::cross(ray.direction, e2);
+		const float det = glm::dot(e1, p);
+		if (det == 0.0f) continue;
+		const glm::vec3 s = ray.origin - tri.p0;
+		const float u = glm::dot(s, p) / det;
+		const glm::vec3 q = glm::cross(s, e1);
+		const float v = glm::dot(ray.direction, q) / det;
+		const float t = glm::dot(e2, q) / det;
+		if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f && t < hit.t) {
+			hit.t = t;
+			hit.triangle = (uint32_t)i;
+		}
+	}
+	return hit;
+}
+
+// Builds a BVH over an OBJ or STL file with 1 to all cores, checks it against
+// brute force, and measures single and multi-threaded ray throughput
+static int benchBvh(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "bench-bvh needs an OBJ or STL file" << endl;
+		return 1;
+	}
+	const size_t rayCount = argc > 1 ? stoul(argv[1]) : 1000000;
+
+	MeshOptions options;
+	options.optimize = false;
+	const Mesh mesh = BuildMesh(argv[0], options);
+	vector<Triangle> triangles(mesh.indices.size() / 3);
+	for (size_t t = 0; t < triangles.size(); t++) {
+		triangles[t] = {mesh.vertices[mesh.indices[t * 3]], mesh.vertices[mesh.indices[t * 3 + 1]], mesh.vertices[mesh.indices[t * 3 + 2]]};
+	}
+
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+	cout << triangles.size() << " triangles" << endl << "threads  build(ms)" << endl;
+	for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		ThreadPool pool(threads);
+		const auto start = chrono::steady_clock::now();
+		const Bvh bvh(triangles, pool);
+		cout << threads << "  " << elapsedMs(start) << endl;
+		if (threads == maxThreads) break;
+	}
+
+	const Bvh bvh(triangles);
+	cout << bvh.nodeCount() << " nodes, depth " << bvh.depth() << ", SAH cost " << bvh.sahCost() << endl;
+
+	// Rays from a sphere around the mesh towards random points of its box, most of them hit
+	const BvhNode& root = bvh.root();
+	const glm::vec3 center = (root.boundsMin + root.boundsMax) * 0.5f;
+	const float radius = glm::length(root.boundsMax - root.boundsMin) * 0.5f;
+	mt19937 random(42);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	vector<Ray> rays(rayCount);
+	for (auto& ray : rays) {
+		const float z = 2.0f * unit(random) - 1.0f, angle = 6.2831853f * unit(random);
+		const float ring = sqrt(1.0f - z * z);
+		ray.origin = center + glm::vec3(ring * cos(angle), ring * sin(angle), z) * radius * 2.0f;
+		const glm::vec3 target = root.boundsMin + (root.boundsMax - root.boundsMin) * glm::vec3(unit(random), unit(random), unit(random));
+		ray.direction = glm::normalize(target - ray.origin);
+	}
+
+	// The closest hit distance must match, the triangle may differ where two share an edge
+	const size_t checked = min<size_t>(rays.size(), max<size_t>(100, 200000000 / max<size_t>(triangles.size(), 1)));
+	atomic<size_t> mismatches(0);
+	ThreadPool::global().parallelFor(checked, [&](size_t r) {
+		const RayHit expected = intersectAll(triangles, rays[r]);
+		const RayHit found = bvh.intersect(rays[r]);
+		if (expected.hit() != found.hit() || (found.hit() && fabs(expected.t - found.t) > 1e-4f * max(1.0f, expected.t))) mismatches++;
+	});
+	cout << "Checked " << checked << " rays against brute force: " << mismatches << " mismatches" << endl;
+
+	size_t hits = 0;
+	auto start = chrono::steady_clock::now();
+	for (const auto& ray : rays) hits += bvh.intersect(ray).hit();
+	const double singleMs = elapsedMs(start);
+
+	atomic<size_t> parallelHits(0);
+	start = chrono::steady_clock::now();
+	ThreadPool::global().parallelRanges(rays.size(), 4096, [&](size_t begin, size_t end) {
+		size_t local = 0;
+		for (size_t r = begin; r < end; r++) local += bvh.intersect(rays[r]).hit();
+		parallelHits += local;
+	});
+	const double parallelMs = elapsedMs(start);
+
+	cout << rays.size() << " rays, " << 100.0 * hits / max<size_t>(rays.size(), 1) << "% hit" << endl
+		<< "1 thread: " << rays.size() / (singleMs / 1000.0) / 1e6 << " Mrays/s, " << singleMs * 1000.0 / rays.size() << " us per ray" << endl
+		<< ThreadPool::global().size() << " threads: " << rays.size() / (parallelMs / 1000.0) / 1e6 << " Mrays/s" << endl;
+	return mismatches == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-cull
+
+// Reference for the culling: every corner of the world box against every plane
+static bool boxInFrustum(const glm::mat4& viewProjection, const Aabb& box) {
+	const glm::mat4& m = viewProjection;
+	for (int row = 0; row < 3; row++) {
+		for (float side : {1.0f, -1.0f}) {
+			const glm::vec4 plane = glm::vec4(m[0][3], m[1][3], m[2][3], m[3][3]) + side * glm::vec4(m[0][row], m[1][row], m[2][row], m[3][row]);
+			bool outside = true;
+			for (int corner = 0; corner < 8 && outside; corner++) {
+				const glm::vec3 p(corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y, corner & 4 ? box.max.z : box.min.z);
+				outside = glm::dot(glm::vec3(plane), p) + plane.w < 0.0f;
+			}
+			if (outside) return false;
+		}
+	}
+	return true;
+}
+
+// Culls a random scene of unit cubes from a camera turning around its center,
+// checks the result against a per-corner test and times it per thread count
+static int benchCull(int argc, char** argv) {
+	const size_t objectCount = argc > 0 ? stoul(argv[0]) : 100000;
+	const int frames = argc > 1 ? stoi(argv[1]) : 200;
+
+	mt19937 random(42);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const Aabb cube{glm::vec3(-0.5f), glm::vec3(0.5f)};
+	const float worldSize = 2000.0f;
+
+	auto start = chrono::steady_clock::now();
+	Scene scene;
+	for (size_t i = 0; i < objectCount; i++) {
+		const glm::vec3 position = (glm::vec3(unit(random), unit(random), unit(random)) - 0.5f) * worldSize;
+		const glm::vec3 axis = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + 0.01f);
+		glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+		transform = glm::rotate(transform, unit(random) * 6.2831853f, axis);
+		transform = glm::scale(transform, glm::vec3(1.0f + unit(random) * 9.0f));
+		scene.add(0, cube, transform);
+	}
+	cout << objectCount << " objects added in " << elapsedMs(start) << " ms" << endl;
+
+	const glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 1000.0f);
+	auto viewProjection = [&](int frame) {
+		const float angle = frame * 6.2831853f / frames;
+		const glm::vec3 direction(cos(angle), sin(angle * 0.5f) * 0.3f, sin(angle));
+		return projection * glm::lookAt(glm::vec3(0.0f), direction, glm::vec3(0, 1, 0));
+	};
+
+	// Same visible list as the reference on a few frames
+	vector<Scene::ObjectId> visible;
+	size_t mismatches = 0;
+	for (int frame = 0; frame < frames; frame += max(1, frames / 8)) {
+		const glm::mat4 vp = viewProjection(frame);
+		scene.cull(vp, visible);
+		vector<Scene::ObjectId> expected;
+		for (size_t i = 0; i < scene.size(); i++) {
+			if (boxInFrustum(vp, scene.worldBounds((Scene::ObjectId)i))) expected.push_back((Scene::ObjectId)i);
+		}
+		if (visible != expected) mismatches++;
+	}
+	cout << "Reference check: " << mismatches << " mismatching frames" << endl;
+
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+	cout << "threads  cull(ms)  Mobjects/s  visible" << endl;
+	for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		ThreadPool pool(threads);
+		SceneCullStats stats;
+		start = chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; frame++) {
+			scene.cull(viewProjection(frame), visible, &stats, pool);
+		}
+		const double ms = elapsedMs(start) / frames;
+		cout << threads << "  " << ms << "  " << objectCount / ms / 1000.0 << "  "
+			<< 100.0 * stats.visibleObjects / max<size_t>(stats.objects, 1) << "%" << endl;
+		if (threads == maxThreads) break;
+	}
+	return mismatches == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-batch
+
+// Checks the output of a DrawBatcher against the items it was given: every
+// item drawn once per range (or once), with its transform, color, mesh and
+// range, and batches that cover the commands with one buffer and state each.
+// Objects are recognized by their translation, which holds their id.
+static size_t checkBatches(const DrawBatcher& batcher, const vector<BatchMesh>& meshes, const vector<BatchMaterial>& materials,
+	const vector<DrawItem>& items, const vector<TriangleRange>& ranges, size_t objectCount) {
+	size_t errors = 0;
+	vector<int> itemOfObject(objectCount, -1);
+	for (size_t i = 0; i < items.size(); i++) itemOfObject[items[i].object] = (int)i;
+
+	const auto& commands = batcher.commands();
+	const auto& instances = batcher.instances();
+	vector<size_t> draws(items.size(), 0);
+	for (const auto& command : commands) {
+		if (command.baseInstance + command.instanceCount > instances.size()) {
+			errors++;
+			continue;
+		}
+		for (uint32_t s = command.baseInstance; s < command.baseInstance + command.instanceCount; s++) {
+			const size_t object = (size_t)instances[s].model[3].x;
+			const int i = object < objectCount ? itemOfObject[object] : -1;
+			if (i < 0) {
+				errors++;
+				continue;
+			}
+			const DrawItem& item = items[i];
+			const BatchMesh& mesh = meshes[item.mesh];
+			bool valid = instances[s].color == materials[item.material].color;
+			if (item.rangeCount == 0) {
+				valid = valid && command.firstIndex == mesh.firstIndex && command.count == mesh.indexCount;
+			}
+			else {
+				bool found = false;
+				for (uint32_t r = item.firstRange; r < item.firstRange + item.rangeCount; r++) {
+					found = found || (command.firstIndex == mesh.firstIndex + ranges[r].firstTriangle * 3 && command.count == ranges[r].triangleCount * 3);
+				}
+				valid = valid && found && command.instanceCount == 1;
+			}
+			if (!valid) errors++;
+			draws[i]++;
+		}
+	}
+	for (size_t i = 0; i < items.size(); i++) {
+		if (draws[i] != max<size_t>(items[i].rangeCount, 1)) errors++;
+	}
+
+	// Batches: in order, no gap, and each command of a batch matching its buffer and state
+	uint32_t next = 0;
+	for (const auto& batch : batcher.batches()) {
+		if (batch.firstCommand != next || batch.commandCount == 0) errors++;
+		for (uint32_t c = batch.firstCommand; c < batch.firstCommand + batch.commandCount && c < commands.size(); c++) {
+			const size_t object = (size_t)instances[commands[c].baseInstance].model[3].x;
+			const DrawItem& item = items[itemOfObject[object]];
+			if (meshes[item.mesh].buffer != batch.buffer || materials[item.material].state != batch.state) errors++;
+		}
+		next = batch.firstCommand + batch.commandCount;
+	}
+	if (next != commands.size()) errors++;
+	return errors;
+}
+
+// Feeds a DrawBatcher random draws of many meshes and materials, checks the
+// commands it emits and times it per thread count
+static int benchBatch(int argc, char** argv) {
+	const size_t objectCount = argc > 0 ? stoul(argv[0]) : 100000;
+	const size_t meshCount = argc > 1 ? stoul(argv[1]) : 64;
+	const size_t materialCount = argc > 2 ? stoul(argv[2]) : 32;
+	const int frames = 100;
+
+	mt19937 random(42);
+	vector<BatchMesh> meshes(meshCount);
+	for (size_t m = 0; m < meshCount; m++) {
+		meshes[m] = {(uint32_t)(m * 30000), 3 * (1000 + (uint32_t)(random() % 9000)), 0, (uint32_t)(m % 4)};
+	}
+	vector<BatchMaterial> materials(materialCount);
+	for (size_t m = 0; m < materialCount; m++) {
+		materials[m] = {glm::vec4((float)m, 0.0f, 0.0f, 1.0f), (uint32_t)(m % 3)};
+	}
+
+	// Object ids in the translation, for checkBatches
+	Scene scene;
+	const Aabb box{glm::vec3(-1.0f), glm::vec3(1.0f)};
+	for (size_t i = 0; i < objectCount; i++) {
+		scene.add((uint32_t)(random() % meshCount), box, glm::translate(glm::mat4(1.0f), glm::vec3((float)i, 0.0f, 0.0f)), (uint32_t)(random() % materialCount));
+	}
+
+	// One in 20 objects is drawn by meshlet ranges
+	vector<DrawItem> items(objectCount);
+	vector<TriangleRange> ranges;
+	for (size_t i = 0; i < objectCount; i++) {
+		DrawItem& item = items[i];
+		item = {(Scene::ObjectId)i, scene.mesh((Scene::ObjectId)i), scene.material((Scene::ObjectId)i), 0, 0};
+		if (random() % 20 == 0) {
+			item.firstRange = (uint32_t)ranges.size();
+			item.rangeCount = 1 + random() % 8;
+			for (uint32_t r = 0; r < item.rangeCount; r++) {
+				ranges.push_back({r * 100, 1 + (uint32_t)(random() % 99)});
+			}
+		}
+	}
+
+	DrawBatcher batcher;
+	batcher.build(scene, meshes, materials, items.data(), items.size(), ranges.data());
+	const BatchStats stats = batcher.stats();
+	const size_t errors = checkBatches(batcher, meshes, materials, items, ranges, objectCount);
+	cout << objectCount << " objects, " << meshCount << " meshes, " << materialCount << " materials: "
+		<< stats.commands << " commands in " << stats.batches << " draw calls, " << errors << " errors" << endl;
+
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+	cout << "threads  build(ms)  Mitems/s" << endl;
+	for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		ThreadPool pool(threads);
+		const auto start = chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; frame++) {
+			batcher.build(scene, meshes, materials, items.data(), items.size(), ranges.data(), pool);
+		}
+		const double ms = elapsedMs(start) / frames;
+		cout << threads << "  " << ms << "  " << objectCount / ms / 1000.0 << endl;
+		if (threads == maxThreads) break;
+	}
+	return errors == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-raster
+
+// Renders a grid of instances of a mesh with the software rasterizer, with no GL context
+static int benchRaster(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "bench-raster needs an OBJ or STL file" << endl;
+		return 1;
+	}
+	int width = 1024, height = 768, grid = 10, frames = 20;
+	string output;
+	for (int i = 1; i < argc; i++) {
+		const string argument = argv[i];
+		if (argument == "--size" && i + 1 < argc) sscanf(argv[++i], "%dx%d", &width, &height);
+		else if (argument == "--grid" && i + 1 < argc) grid = max(1, stoi(argv[++i]));
+		else if (argument == "--frames" && i + 1 < argc) frames = max(1, stoi(argv[++i]));
+		else if (argument == "-o" && i + 1 < argc) output = argv[++i];
+	}
+
+	const Mesh mesh = BuildMesh(argv[0], MeshOptions());
+	const VertexFormat format = MakeVertexFormat(VertexLayout());
+	const vector<unsigned char> vertices = InterleaveVertices(mesh.streams(), format);
+
+	// A grid of instances on the XZ plane, colored in turn
+	const Aabb bounds = ComputeBounds(mesh.vertices.data(), mesh.vertices.size());
+	const glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+	const float spacing = glm::length(bounds.max - bounds.min) * 1.2f;
+	const glm::vec4 colors[4] = {{0.7f, 0.5f, 0.1f, 1.0f}, {0.6f, 0.1f, 0.1f, 1.0f}, {0.1f, 0.3f, 0.6f, 1.0f}, {0.2f, 0.5f, 0.2f, 1.0f}};
+	vector<InstanceData> instances;
+	for (int row = 0; row < grid; row++) {
+		for (int column = 0; column < grid; column++) {
+			const glm::vec3 offset((column - (grid - 1) * 0.5f) * spacing, 0.0f, (row - (grid - 1) * 0.5f) * spacing);
+			instances.push_back({glm::translate(glm::mat4(1.0f), offset - center), colors[(row + column) % 4]});
+		}
+	}
+	const DrawElementsIndirectCommand command = {mesh.lods[0].indexCount, (uint32_t)instances.size(), 0, 0, 0};
+
+	RasterDraw draw;
+	draw.vertices = vertices.data();
+	draw.format = &format;
+	draw.indices = mesh.indices.data();
+	draw.indexType = GL_UNSIGNED_INT;
+	draw.commands = &command;
+	draw.commandCount = 1;
+	draw.instances = instances.data();
+
+	// Orbit over the grid
+	const float radius = spacing * grid * 0.6f;
+	const glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)width / height, radius * 0.01f, radius * 4.0f);
+	auto uniforms = [&](int frame) {
+		const float angle = frame * 6.2831853f / frames;
+		const glm::vec3 eye(cos(angle) * radius, radius * 0.5f, sin(angle) * radius);
+		const glm::mat4 view = glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0, 1, 0));
+		return RasterUniforms{view, projection * view, glm::vec3(0.0f, radius * 0.5f, 0.0f), glm::vec3(0.9f, 0.9f, 0.8f), radius * radius * 0.5f};
+	};
+
+	Rasterizer rasterizer(width, height);
+	auto render = [&](int frame, ThreadPool& pool) {
+		rasterizer.clear(glm::vec3(0.2f, 0.2f, 0.3f));
+		rasterizer.draw(draw);
+		rasterizer.render(uniforms(frame), pool);
+	};
+
+	// Binning keeps the submission order in each tile, so the image may not depend on the thread count
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+	Image reference;
+	{
+		ThreadPool pool(1);
+		render(0, pool);
+		reference = rasterizer.readPixels();
+	}
+	ThreadPool checkPool(max(4u, maxThreads));
+	render(0, checkPool);
+	const ImageDifference difference = CompareImages(reference, rasterizer.readPixels(), 0);
+	cout << mesh.indices.size() / 3 * instances.size() << " triangles, " << width << "x" << height << endl
+		<< rasterizer.stats().setupTriangles << " set up, " << rasterizer.stats().binnedTriangles << " binned to tiles" << endl
+		<< "Threading check: " << difference.differingPixels << " pixels differ between 1 and " << checkPool.size() << " threads" << endl;
+
+	cout << "threads  frame(ms)  front(ms)  back(ms)  Mtriangles/s  fragments" << endl;
+	for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		ThreadPool pool(threads);
+		double front = 0.0, back = 0.0;
+		size_t fragments = 0;
+		const auto start = chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; frame++) {
+			render(frame, pool);
+			front += rasterizer.stats().frontEndMs;
+			back += rasterizer.stats().backEndMs;
+			fragments += rasterizer.stats().fragments;
+		}
+		const double ms = elapsedMs(start) / frames;
+		cout << threads << "  " << ms << "  " << front / frames << "  " << back / frames << "  "
+			<< rasterizer.stats().triangles / ms / 1000.0 << "  " << fragments / frames << endl;
+		if (threads == maxThreads) break;
+	}
+
+	if (!output.empty()) {
+		SaveBMP(output.c_str(), rasterizer.readPixels());
+		cout << "Last frame written to " << output << endl;
+	}
+	return difference.differingPixels == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-lights
+
+// Bins random point lights in a box around a turning camera. Checks on random
+// points of the frustum that every light reaching a point is listed in its
+// cluster, that the lists do not depend on the thread count, and times the
+// binning per thread count.
+static int benchLights(int argc, char** argv) {
+	const size_t lightCount = argc > 0 ? stoul(argv[0]) : 10000;
+	const int frames = argc > 1 ? stoi(argv[1]) : 100;
+	const int width = 1280, height = 720;
+
+	mt19937 random(42);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const float worldSize = 200.0f;
+	vector<PointLight> lights(lightCount);
+	for (PointLight& light : lights) {
+		light.position = (glm::vec3(unit(random), unit(random), unit(random)) - 0.5f) * worldSize;
+		light.radius = 1.0f + unit(random) * 4.0f;
+		light.color = glm::vec3(1.0f);
+		light.intensity = 1.0f;
+	}
+
+	const glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)width / height, 0.1f, worldSize);
+	auto view = [&](int frame) {
+		const float angle = frame * 6.2831853f / frames;
+		const glm::vec3 direction(cos(angle), sin(angle * 0.5f) * 0.3f, sin(angle));
+		return glm::lookAt(glm::vec3(0.0f), direction, glm::vec3(0, 1, 0));
+	};
+
+	LightClusters clusters;
+	cout << lightCount << " lights, " << clusters.tilesX << "x" << clusters.tilesY << "x" << clusters.slices << " clusters for " << width << "x" << height << endl;
+
+	// Brute force over every light at random pixels and depths
+	const size_t samples = 20000;
+	const float nearPlane = 0.1f, farPlane = worldSize;
+	size_t missed = 0, threadMismatches = 0;
+	ThreadPool singlePool(1);
+	ThreadPool checkPool(max(4u, thread::hardware_concurrency()));
+	for (int frame = 0; frame < frames; frame += max(1, frames / 4)) {
+		const glm::mat4 v = view(frame);
+		clusters.build(lights, v, projection, singlePool);
+		const vector<uint32_t> singleIndices = clusters.lightIndices();
+		clusters.build(lights, v, projection, checkPool);
+		if (clusters.lightIndices() != singleIndices) threadMismatches++;
+
+		for (size_t s = 0; s < samples; s++) {
+			const glm::vec2 fragCoord(unit(random) * width, unit(random) * height);
+			const float depth = nearPlane * pow(farPlane / nearPlane, unit(random));
+			const glm::vec3 position((fragCoord.x / width * 2.0f - 1.0f) / projection[0][0] * depth, (fragCoord.y / height * 2.0f - 1.0f) / projection[1][1] * depth, -depth);
+
+			const ClusterRange range = clusters.clusters()[clusters.clusterAt(fragCoord, width, height, depth)];
+			const uint32_t* listed = clusters.lightIndices().data() + range.offset;
+			for (uint32_t i = 0; i < (uint32_t)lightCount; i++) {
+				const glm::vec4& light = clusters.lights()[i].positionRadius;
+				const glm::vec3 d = glm::vec3(light) - position;
+				if (glm::dot(d, d) < light.w * light.w && !binary_search(listed, listed + range.count, i)) missed++;
+			}
+		}
+	}
+	cout << "Reference check: " << missed << " lights missing from their cluster, " << threadMismatches << " frames differing between 1 and "
+		<< checkPool.size() << " threads" << endl;
+
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+	cout << "threads  build(ms)  Mlights/s  visible  references  occupied  max/cluster" << endl;
+	for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		ThreadPool pool(threads);
+		LightClusterStats total;
+		const auto start = chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; frame++) {
+			clusters.build(lights, view(frame), projection, pool);
+			total.visibleLights += clusters.stats().visibleLights;
+			total.references += clusters.stats().references;
+			total.occupiedClusters += clusters.stats().occupiedClusters;
+			total.maxClusterLights = max(total.maxClusterLights, clusters.stats().maxClusterLights);
+		}
+		const double ms = elapsedMs(start) / frames;
+		cout << threads << "  " << ms << "  " << lightCount / ms / 1000.0 << "  " << total.visibleLights / frames << "  "
+			<< total.references / frames << "  " << total.occupiedClusters / frames << "/" << clusters.clusterCount() << "  " << total.maxClusterLights << endl;
+		if (threads == maxThreads) break;
+	}
+	return missed == 0 && threadMismatches == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-queue
+
+// Queues random draws over a few programs, materials and meshes, checks the
+// radix sort against std::stable_sort, and replays the queue through a
+// RenderState that only counts, in submission and in key order
+static int benchQueue(int argc, char** argv) {
+	const size_t drawCount = argc > 0 ? stoul(argv[0]) : 100000;
+	const int runs = argc > 1 ? stoi(argv[1]) : 20;
+	const uint32_t programs = 4, materials = 64, meshes = 256;
+
+	mt19937 random(42);
+	vector<VertexFormat> formats;
+	for (bool tangents : {false, true}) {
+		for (bool uvs : {false, true}) {
+			VertexLayout layout;
+			layout.tangents = tangents;
+			layout.uvs = uvs;
+			formats.push_back(MakeVertexFormat(layout));
+		}
+	}
+
+	// GL names are only compared, they need no context
+	vector<uint64_t> keys(drawCount);
+	vector<RenderDraw> draws(drawCount);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (size_t i = 0; i < drawCount; i++) {
+		const uint32_t program = random() % programs, material = random() % materials, mesh = random() % meshes;
+		RenderDraw& draw = draws[i];
+		draw.program = 1 + program;
+		draw.vertexBuffer = 1 + mesh;
+		draw.format = &formats[mesh % formats.size()];
+		draw.instanceBuffer = 1000;
+		draw.instanceOffset = 0;
+		draw.elementBuffer = 1 + mesh;
+		draw.indexType = GL_UNSIGNED_INT;
+		draw.textures[0] = 1 + material;
+		draw.textures[1] = 1 + material % 8;
+		draw.uniforms[0] = {0, 0};
+		draw.uniforms[1] = {1, 1};
+		draw.indirectBuffer = 2000;
+		draw.indirectOffset = 0;
+		draw.firstCommand = (uint32_t)i;
+		draw.commandCount = 1;
+		keys[i] = RenderSortKey(i % 10 == 0 ? RENDER_PASS_TRANSPARENT : RENDER_PASS_OPAQUE, program, material, mesh, unit(random));
+	}
+
+	RenderQueue queue;
+	auto fill = [&]() {
+		queue.clear();
+		for (size_t i = 0; i < drawCount; i++) queue.push(keys[i], draws[i]);
+	};
+
+	// Same order as a stable comparison sort of the keys
+	fill();
+	queue.sort();
+	vector<uint32_t> expected(drawCount);
+	for (size_t i = 0; i < drawCount; i++) expected[i] = (uint32_t)i;
+	stable_sort(expected.begin(), expected.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+	size_t mismatches = 0;
+	for (size_t i = 0; i < drawCount; i++) {
+		if (queue.key(i) != keys[expected[i]] || queue.draw(i).firstCommand != expected[i]) mismatches++;
+	}
+	cout << drawCount << " draws, " << programs << " programs, " << materials << " materials, " << meshes << " meshes, 10% transparent" << endl
+		<< "Sort check: " << mismatches << " draws out of std::stable_sort order" << endl;
+
+	double fillMs = 0.0, sortMs = 0.0, stdSortMs = 0.0;
+	for (int run = 0; run < runs; run++) {
+		auto start = chrono::steady_clock::now();
+		fill();
+		fillMs += elapsedMs(start);
+		start = chrono::steady_clock::now();
+		queue.sort();
+		sortMs += elapsedMs(start);
+
+		vector<pair<uint64_t, uint32_t>> pairs(drawCount);
+		for (size_t i = 0; i < drawCount; i++) pairs[i] = {keys[i], (uint32_t)i};
+		start = chrono::steady_clock::now();
+		sort(pairs.begin(), pairs.end());
+		stdSortMs += elapsedMs(start);
+	}
+	cout << "push " << fillMs / runs << " ms, radix sort " << sortMs / runs << " ms, std::sort " << stdSortMs / runs << " ms" << endl;
+
+	cout << "order  execute(ms)  changes  programs  textures  vertex inputs  uniforms  skipped" << endl;
+	for (bool sorted : {false, true}) {
+		fill();
+		if (sorted) queue.sort();
+		RenderState state(false);
+		double executeMs = 0.0;
+		for (int run = 0; run < runs; run++) {
+			state.reset();
+			const auto start = chrono::steady_clock::now();
+			queue.execute(state);
+			executeMs += elapsedMs(start);
+		}
+		const RenderStateStats& stats = state.stats();
+		cout << (sorted ? "key" : "submission") << "  " << executeMs / runs << "  " << stats.changes() << "  " << stats.programs << "  "
+			<< stats.textures << "  " << stats.vertexInputs << "  " << stats.uniforms << "  " << stats.skipped << endl;
+	}
+	return mismatches == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-texture
+
+// 32-bit top-down BMP, a layout SaveBMP does not write
+static void saveBMP32TopDown(const string& path, const Image& image) {
+	vector<unsigned char> file(54 + (size_t)image.width * image.height * 4, 0);
+	auto put32 = [&](size_t offset, uint32_t value) {
+		for (int i = 0; i < 4; i++) file[offset + i] = (unsigned char)(value >> (8 * i));
+	};
+	file[0] = 'B';
+	file[1] = 'M';
+	put32(0x02, (uint32_t)file.size());
+	put32(0x0A, 54);
+	put32(0x0E, 40);
+	put32(0x12, image.width);
+	put32(0x16, (uint32_t)-image.height);
+	file[0x1A] = 1;
+	file[0x1C] = 32;
+	for (int y = 0; y < image.height; y++) {
+		const unsigned char* source = &image.data[(size_t)(image.height - 1 - y) * image.width * 3];
+		unsigned char* out = &file[54 + (size_t)y * image.width * 4];
+		for (int x = 0; x < image.width; x++) {
+			out[x * 4 + 0] = source[x * 3 + 2];
+			out[x * 4 + 1] = source[x * 3 + 1];
+			out[x * 4 + 2] = source[x * 3 + 0];
+			out[x * 4 + 3] = 255;
+		}
+	}
+	ofstream(path, ios::binary).write((const char*)file.data(), file.size());
+}
+
+static int benchTexture(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "bench-texture needs a BMP file" << endl;
+		return 1;
+	}
+	const int runs = argc > 1 ? stoi(argv[1]) : 10;
+
+	auto start = chrono::steady_clock::now();
+	const Image image = LoadBMP(argv[0]);
+	cout << image.width << "x" << image.height << " loaded in " << elapsedMs(start) << " ms" << endl;
+
+	// Padded rows and the 32-bit top-down layout decode to the same texels
+	size_t errors = 0;
+	Image odd;
+	odd.width = max(1, image.width - 1);
+	odd.height = image.height;
+	for (int y = 0; y < odd.height; y++) {
+		const unsigned char* row = &image.data[(size_t)y * image.width * 3];
+		odd.data.insert(odd.data.end(), row, row + odd.width * 3);
+	}
+	const string oddPath = string(argv[0]) + ".odd.bmp", topDownPath = string(argv[0]) + ".topdown.bmp";
+	SaveBMP(oddPath.c_str(), odd);
+	saveBMP32TopDown(topDownPath, image);
+	errors += LoadBMP(oddPath.c_str()).data != odd.data;
+	errors += LoadBMP(topDownPath.c_str()).data != image.data;
+	remove(oddPath.c_str());
+	remove(topDownPath.c_str());
+
+	// Scalar 2x2 box filter as the reference of every level
+	vector<Image> levels = BuildMipChain(odd, MipFilter::Color);
+	for (size_t level = 1; level < levels.size(); level++) {
+		const Image& source = levels[level - 1];
+		const Image& mip = levels[level];
+		for (int y = 0; y < mip.height; y++) {
+			for (int x = 0; x < mip.width; x++) {
+				const int x0 = min(x * 2, source.width - 1), x1 = min(x * 2 + 1, source.width - 1);
+				const int y0 = min(y * 2, source.height - 1), y1 = min(y * 2 + 1, source.height - 1);
+				for (int c = 0; c < 3; c++) {
+					auto texel = [&](int tx, int ty) { return (int)source.data[((size_t)ty * source.width + tx) * 3 + c]; };
+					const int expected = (texel(x0, y0) + texel(x1, y0) + texel(x0, y1) + texel(x1, y1) + 2) / 4;
+					errors += mip.data[((size_t)y * mip.width + x) * 3 + c] != expected;
+				}
+			}
+		}
+	}
+
+	// Renormalized levels stay unit length, within the 8-bit quantization
+	const vector<Image> normalLevels = BuildMipChain(image, MipFilter::NormalMap);
+	double worstLength = 0.0;
+	for (size_t level = 1; level < normalLevels.size(); level++) {
+		const vector<unsigned char>& data = normalLevels[level].data;
+		for (size_t i = 0; i < data.size(); i += 3) {
+			const glm::vec3 n = glm::vec3(data[i], data[i + 1], data[i + 2]) * (2.0f / 255.0f) - 1.0f;
+			const double length = glm::length(n);
+			if (length > 0.1) worstLength = max(worstLength, fabs(length - 1.0));
+		}
+	}
+	cout << levels.size() << " levels, " << errors << " errors, normal map levels within " << worstLength << " of unit length" << endl;
+
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+	cout << "threads  load(ms)  mips(ms)  normal mips(ms)" << endl;
+	for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		ThreadPool pool(threads);
+		double load = 0.0, mips = 0.0, normalMips = 0.0;
+		for (int run = 0; run < runs; run++) {
+			start = chrono::steady_clock::now();
+			Image base = LoadBMP(argv[0], pool);
+			load += elapsedMs(start);
+			start = chrono::steady_clock::now();
+			BuildMipChain(base, MipFilter::Color, pool);
+			mips += elapsedMs(start);
+			start = chrono::steady_clock::now();
+			BuildMipChain(move(base), MipFilter::NormalMap, pool);
+			normalMips += elapsedMs(start);
+		}
+		cout << threads << "  " << load / runs << "  " << mips / runs << "  " << normalMips / runs << endl;
+		if (threads == maxThreads) break;
+	}
+	return errors == 0 && worstLength < 0.02 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-image
+
+// What LoadImage did: CImg's accessor and three push_back per texel
+static vector<unsigned char> pushBackInterleave(const unsigned char* const planes[4], int width, int height) {
+	vector<unsigned char> picture;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			for (int c = 0; c < 3; c++) picture.push_back(planes[c][(size_t)(height - y - 1) * width + x]);
+		}
+	}
+	return picture;
+}
+
+static int benchImage(int argc, char** argv) {
+	const int size = argc > 0 ? stoi(argv[0]) : 4096;
+	const int runs = argc > 1 ? stoi(argv[1]) : 5;
+
+	// Odd width so rows end off the 16 texel SIMD blocks
+	const int width = size + 3, height = size;
+	const size_t planeSize = (size_t)width * height;
+	vector<unsigned char> planeData(planeSize * 4);
+	mt19937 random(7);
+	for (unsigned char& value : planeData) value = (unsigned char)random();
+	const unsigned char* planes[4] = { &planeData[0], &planeData[planeSize], &planeData[planeSize * 2], &planeData[planeSize * 3] };
+
+	// Conversion alone, checked against the scalar layout
+	size_t errors = 0;
+	double pushBack = 0.0, rgb = 0.0, rgba = 0.0;
+	vector<unsigned char> rgbPixels(planeSize * 3), rgbaPixels(planeSize * 4);
+	vector<unsigned char> reference;
+	for (int run = 0; run < runs; run++) {
+		auto start = chrono::steady_clock::now();
+		reference = pushBackInterleave(planes, width, height);
+		pushBack += elapsedMs(start);
+		start = chrono::steady_clock::now();
+		InterleavePlanes(planes, width, height, 3, rgbPixels.data());
+		rgb += elapsedMs(start);
+		start = chrono::steady_clock::now();
+		InterleavePlanes(planes, width, height, 4, rgbaPixels.data());
+		rgba += elapsedMs(start);
+	}
+	errors += rgbPixels != reference;
+	for (size_t texel = 0; texel < planeSize; texel++) {
+		errors += memcmp(&rgbaPixels[texel * 4], &reference[texel * 3], 3) != 0;
+		errors += rgbaPixels[texel * 4 + 3] != planes[3][(height - 1 - texel / width) * (size_t)width + texel % width];
+	}
+	cout << width << "x" << height << " planes to rows: push_back " << pushBack / runs << " ms, RGB " << rgb / runs
+		<< " ms, RGBA " << rgba / runs << " ms" << endl;
+
+	// Whole loads of a BMP through CImg
+	Image image;
+	image.width = width;
+	image.height = height;
+	image.data = reference;
+	const string path = "bench-image.bmp";
+	SaveBMP(path.c_str(), image);
+	ImageBufferPool buffers;
+	vector<unsigned char> destination(planeSize * 4);
+	double fresh = 0.0, pooled = 0.0, caller = 0.0, bmp = 0.0;
+	for (int run = 0; run < runs; run++) {
+		auto start = chrono::steady_clock::now();
+		Image loaded = LoadImage(path.c_str());
+		fresh += elapsedMs(start);
+		errors += loaded.data != reference;
+
+		start = chrono::steady_clock::now();
+		loaded = LoadImage(path.c_str(), 4, &buffers);
+		pooled += elapsedMs(start);
+		buffers.release(move(loaded.data));
+
+		int loadedWidth = 0, loadedHeight = 0;
+		start = chrono::steady_clock::now();
+		const size_t written = LoadImage(path.c_str(), 3, destination.data(), destination.size(), &loadedWidth, &loadedHeight);
+		caller += elapsedMs(start);
+		errors += written != reference.size() || memcmp(destination.data(), reference.data(), written) != 0;
+
+		start = chrono::steady_clock::now();
+		errors += LoadBMP(path.c_str()).data != reference;
+		bmp += elapsedMs(start);
+	}
+	remove(path.c_str());
+	cout << "LoadImage: new buffer " << fresh / runs << " ms, pooled RGBA " << pooled / runs << " ms, caller buffer "
+		<< caller / runs << " ms (LoadBMP " << bmp / runs << " ms)" << endl;
+	cout << errors << " errors" << endl;
+	return errors == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-bc
+
+static int benchBc(int argc, char** argv) {
+	if (argc < 1) {
+		cerr << "bench-bc needs an image" << endl;
+		return 1;
+	}
+	const int runs = argc > 1 ? stoi(argv[1]) : 3;
+	const unsigned maxThreads = max(1u, thread::hardware_concurrency());
+
+	size_t errors = 0;
+	const BlockFormat formats[3] = { BlockFormat::BC1, BlockFormat::BC3, BlockFormat::BC5 };
+	const char* names[3] = { "BC1", "BC3", "BC5" };
+	for (int f = 0; f < 3; f++) {
+		const BlockFormat format = formats[f];
+
+		const string path = argv[0];
+		Image source = path.size() > 4 && path.compare(path.size() - 4, 4, ".bmp") == 0 ? LoadBMP(argv[0]) : LoadImage(argv[0]);
+		if (format == BlockFormat::BC3) {
+			// Luminance as alpha, to exercise the alpha blocks
+			Image rgba;
+			rgba.width = source.width;
+			rgba.height = source.height;
+			rgba.channels = 4;
+			for (size_t i = 0; i < source.data.size(); i += 3) {
+				rgba.data.insert(rgba.data.end(), &source.data[i], &source.data[i] + 3);
+				rgba.data.push_back((unsigned char)((source.data[i] * 77 + source.data[i + 1] * 150 + source.data[i + 2] * 29) >> 8));
+			}
+			source = move(rgba);
+		}
+		if (format == BlockFormat::BC5) {
+			// The renormalized base level, as the texture cache builds it
+			source = move(BuildMipChain(move(source), MipFilter::NormalMap)[0]);
+		}
+		const double texels = (double)source.width * source.height;
+
+		const vector<unsigned char> blocks = CompressImage(source, format);
+		const Image decoded = DecompressImage(blocks.data(), format, source.width, source.height);
+		cout << names[f] << ": " << source.width << "x" << source.height << ", " << blocks.size() / 1024 << " KB for "
+			<< source.data.size() / 1024 << " KB";
+
+		if (format == BlockFormat::BC5) {
+			// Only x and y are stored, z is rebuilt from them
+			double squares = 0.0, angle = 0.0;
+			for (size_t i = 0; i < source.data.size(); i += 3) {
+				for (int c = 0; c < 2; c++) squares += pow(source.data[i + c] - decoded.data[i + c], 2);
+				auto normal = [](const unsigned char* texel) {
+					return glm::normalize(glm::vec3(texel[0], texel[1], texel[2]) * (2.0f / 255.0f) - 1.0f);
+				};
+				const float cosine = glm::dot(normal(&source.data[i]), normal(&decoded.data[i]));
+				angle += acos(glm::clamp(cosine, -1.0f, 1.0f)) * 180.0 / 3.14159265358979;
+			}
+			cout << ", PSNR of x and y " << 10.0 * log10(255.0 * 255.0 * texels * 2.0 / max(squares, 1e-9))
+				<< " dB, mean normal error " << angle / texels << " degrees" << endl;
+		}
+		else {
+			const ImageDifference difference = CompareImages(source, decoded, 8);
+			cout << ", PSNR " << difference.psnr << " dB, max error " << difference.maxError << endl;
+		}
+
+		// Same blocks whatever the threads, and through the cache container
+		const vector<char> cache = SerializeTexture({ source }, format, 42);
+		const TextureCache loaded(cache);
+		errors += loaded.levelCount() != 1 || loaded.size(0) != blocks.size() || memcmp(loaded.data(0), blocks.data(), blocks.size()) != 0;
+		errors += loaded.decode()[0].data != decoded.data;
+
+		for (unsigned threads = 1; ; threads = min(threads * 2, maxThreads)) {
+			ThreadPool pool(threads);
+			double total = 0.0;
+			for (int run = 0; run < runs; run++) {
+				const auto start = chrono::steady_clock::now();
+				errors += CompressImage(source, format, pool) != blocks;
+				total += elapsedMs(start);
+			}
+			cout << "  " << threads << " threads: " << total / runs << " ms, " << texels / (total / runs) / 1000.0 << " Mtexel/s" << endl;
+			if (threads == maxThreads) break;
+		}
+	}
+
+	cout << errors << " errors" << endl;
+	return errors == 0 ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region bench-profiler
+
+// Cost of a PROFILE_SCOPE with the profiler off and on
+static int benchProfiler(int argc, char** argv) {
+	const size_t scopes = argc > 0 ? stoul(argv[0]) : 1000000;
+	Profiler& profiler = Profiler::global();
+
+	auto run = [&]() {
+		const auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < scopes; i++) {
+			PROFILE_SCOPE("bench-profiler");
+		}
+		return elapsedMs(start) * 1e6 / scopes;
+	};
+
+	profiler.setEnabled(false);
+	run();
+	const double disabledNs = run();
+
+	profiler.setEnabled(true);
+	const double enabledNs = run();
+	profiler.setEnabled(false);
+
+	const auto stats = profiler.stats();
+	const size_t recorded = stats.empty() ? 0 : stats.front().count;
+	profiler.clear();
+
+	cout << scopes << " scopes: " << disabledNs << " ns each disabled, " << enabledNs << " ns each enabled, "
+		<< recorded << " recorded" << endl;
+	return recorded == scopes ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region quantization-error
+
+struct ErrorStats {
+	double maxError = 0.0;
+	double sumError = 0.0;
+	size_t count = 0;
+
+	void add(double error) {
+		maxError = max(maxError, error);
+		sumError += error;
+		count++;
+	}
+};
+
+// Prints the stats of one encoding and says whether they stay within bound
+static bool report(const char* name, const ErrorStats& stats, double bound, const char* unit) {
+	const bool pass = stats.maxError <= bound;
+	cout << "  " << name << ": max " << stats.maxError << unit << ", mean " << stats.sumError / max<size_t>(stats.count, 1) << unit
+		<< " (bound " << bound << unit << ") " << (pass ? "ok" : "FAILED") << endl;
+	return pass;
+}
+
+// Angle between a and b, in double precision: acos of a float dot product can't resolve hundredths of a degree
+static double angleDegrees(const glm::vec3& a, const glm::vec3& b) {
+	const double ax = a.x, ay = a.y, az = a.z, bx = b.x, by = b.y, bz = b.z;
+	const double cx = ay * bz - az * by, cy = az * bx - ax * bz, cz = ax * by - ay * bx;
+	return atan2(sqrt(cx * cx + cy * cy + cz * cz), ax * bx + ay * by + az * bz) * 180.0 / 3.14159265358979323846;
+}
+
+// Largest half float rounding error for a value of magnitude x: half an ulp
+static double halfBound(float x) {
+	return max((double)fabs(x) / 2048.0, 1.0 / (1 << 25));
+}
+
+// Decodes the interleaved vertices of mesh with format and measures the error of every attribute
+static bool checkInterleaved(const Mesh& mesh, const VertexLayout& layout, const char* name) {
+	const VertexFormat format = MakeVertexFormat(layout);
+	const vector<unsigned char> data = InterleaveVertices(mesh.streams(), format);
+
+	ErrorStats position, uv, normal, tangent;
+	size_t wrongSigns = 0;
+	for (size_t i = 0; i < mesh.vertices.size(); i++) {
+		const unsigned char* vertex = &data[i * format.stride];
+		glm::vec3 decodedNormal;
+		for (const auto& attribute : format.attributes) {
+			const unsigned char* p = vertex + attribute.offset;
+			if (attribute.location == ATTRIBUTE_POSITION) {
+				glm::vec3 v;
+				memcpy(&v, p, 12);
+				position.add(glm::length(v - mesh.vertices[i]));
+			} else if (attribute.location == ATTRIBUTE_UV) {
+				glm::vec2 v;
+				if (attribute.type == GL_HALF_FLOAT) {
+					uint16_t h[2];
+					memcpy(h, p, 4);
+					v = glm::vec2(HalfToFloat(h[0]), HalfToFloat(h[1]));
+				} else {
+					memcpy(&v, p, 8);
+				}
+				uv.add(max(fabs(v.x - mesh.uvs[i].x), fabs(v.y - mesh.uvs[i].y)));
+			} else if (attribute.location == ATTRIBUTE_NORMAL) {
+				if (attribute.type == GL_FLOAT) {
+					memcpy(&decodedNormal, p, 12);
+				} else if (attribute.type == GL_SHORT) {
+					int16_t e[2];
+					memcpy(e, p, 4);
+					decodedNormal = OctahedralDecode(glm::vec2(Snorm16ToFloat(e[0]), Snorm16ToFloat(e[1])));
+				} else {
+					uint32_t packed;
+					memcpy(&packed, p, 4);
+					decodedNormal = glm::vec3(UnpackSnorm1010102(packed));
+				}
+				normal.add(angleDegrees(decodedNormal, mesh.normals[i]));
+			} else if (attribute.location == ATTRIBUTE_TANGENT) {
+				glm::vec4 t;
+				if (attribute.type == GL_FLOAT) {
+					memcpy(&t, p, 16);
+				} else {
+					uint32_t packed;
+					memcpy(&packed, p, 4);
+					t = UnpackSnorm1010102(packed);
+				}
+				tangent.add(angleDegrees(glm::vec3(t), mesh.tangents[i]));
+				// Rebuild the bitangent the way shader.vert does
+				const glm::vec3 bitangent = glm::cross(decodedNormal, glm::vec3(t)) * t.w;
+				if (glm::dot(bitangent, mesh.bitangents[i]) <= 0.0f) wrongSigns++;
+			}
+		}
+	}
+
+	cout << name << " (" << format.stride << " bytes per vertex, " << mesh.vertices.size() << " vertices)" << endl;
+	bool pass = report("position", position, 0.0, "");
+	if (layout.uvs) pass &= report("uv", uv, layout.halfUVs ? 0.002 : 0.0, "");
+	const double normalBound = layout.normals == NormalEncoding::Float ? 0.01 : layout.normals == NormalEncoding::Octahedral ? 0.01 : 0.2;
+	pass &= report("normal", normal, normalBound, " deg");
+	if (layout.tangents) {
+		pass &= report("tangent", tangent, layout.normals == NormalEncoding::Float ? 0.01 : 0.2, " deg");
+		cout << "  bitangent sign: " << wrongSigns << " flipped " << (wrongSigns == 0 ? "ok" : "FAILED") << endl;
+		pass &= wrongSigns == 0;
+	}
+	return pass;
+}
+
+// Measures the encode/decode error of the vertex quantization on random samples
+// and, when given a mesh, on its interleaved vertices. Returns 1 if any bound is exceeded.
+static int quantizationError(int argc, char** argv) {
+	const size_t samples = argc > 1 ? stoul(argv[1]) : 1000000;
+	mt19937 random(1234);
+	uniform_real_distribution<float> coordinate(-1.0f, 1.0f);
+	uniform_real_distribution<float> texcoord(-8.0f, 8.0f);
+
+	auto randomUnit = [&]() {
+		glm::vec3 v;
+		do {
+			v = glm::vec3(coordinate(random), coordinate(random), coordinate(random));
+		} while (glm::length(v) < 0.01f || glm::length(v) > 1.0f);
+		return glm::normalize(v);
+	};
+
+	ErrorStats half, halfRelative, octahedral, packed;
+	size_t wrongSigns = 0;
+	for (size_t i = 0; i < samples; i++) {
+		const float x = texcoord(random);
+		const double error = fabs(HalfToFloat(FloatToHalf(x)) - x);
+		half.add(error);
+		halfRelative.add(error / halfBound(x));
+
+		const glm::vec3 n = randomUnit();
+		const glm::vec2 e = OctahedralEncode(n);
+		octahedral.add(angleDegrees(OctahedralDecode(glm::vec2(Snorm16ToFloat(FloatToSnorm16(e.x)), Snorm16ToFloat(FloatToSnorm16(e.y)))), n));
+
+		const float sign = (i & 1) ? 1.0f : -1.0f;
+		const glm::vec4 unpacked = UnpackSnorm1010102(PackSnorm1010102(glm::vec4(n, sign)));
+		packed.add(angleDegrees(glm::vec3(unpacked), n));
+		if (unpacked.w != sign) wrongSigns++;
+	}
+
+	cout << "Random samples (" << samples << ")" << endl;
+	bool pass = report("half uv in [-8, 8]", half, 8.0 / 2048.0, "");
+	pass &= report("half uv, in half ulps", halfRelative, 1.0, "");
+	pass &= report("octahedral snorm16 normal", octahedral, 0.01, " deg");
+	pass &= report("10-10-10-2 normal", packed, 0.2, " deg");
+	cout << "  10-10-10-2 sign: " << wrongSigns << " flipped " << (wrongSigns == 0 ? "ok" : "FAILED") << endl;
+	pass &= wrongSigns == 0;
+
+	if (argc > 0 && string(argv[0]) != "-") {
+		MeshOptions options;
+		options.tangents = true;
+		const Mesh mesh = BuildMesh(argv[0], options);
+
+		for (NormalEncoding encoding : {NormalEncoding::Float, NormalEncoding::Octahedral, NormalEncoding::Packed1010102}) {
+			VertexLayout layout;
+			layout.tangents = true;
+			layout.normals = encoding;
+			layout.halfUVs = encoding != NormalEncoding::Float;
+			const char* name = encoding == NormalEncoding::Float ? "float" : encoding == NormalEncoding::Octahedral ? "octahedral" : "10-10-10-2";
+			pass &= checkInterleaved(mesh, layout, name);
+		}
+	}
+
+	cout << (pass ? "All encodings within bounds" : "Some encodings exceed their bounds") << endl;
+	return pass ? 0 : 1;
+}
+
+#pragma endregion
+
+static void usage() {
+	cerr << "Usage: meshtool <command> [args]" << endl
+		<< "  convert <file.obj> [--tangents] [--no-uvs] [--no-optimize] [--offset x y z] [-o out]  write the preprocessed mesh cache" << endl
+		<< "  bench-weld [max linear triangles]  time indexVBO_TBN against the former linear search" << endl
+		<< "  bench-obj <file.obj>  time loadOBJ with 1 to all cores" << endl
+		<< "  bench-stl <file.stl>  time ReadStl and report its bandwidth" << endl
+		<< "  optimize <file.obj|file.stl> [--cache n] [--no-overdraw] [-o out]  reorder for the GPU caches and report ACMR/ATVR" << endl
+		<< "  meshlets <file.obj|file.stl> [--max-vertices n] [--max-triangles n] [--views n]  build meshlets and measure culling" << endl
+		<< "  lod <file.obj|file.stl> [--ratios r1,r2,...]  build a LOD chain and report its error and build time" << endl
+		<< "  bench-bvh <file.obj|file.stl> [rays]  time the BVH build and its rays per second" << endl
+		<< "  bench-cull [objects] [frames]  time frustum culling of a random scene" << endl
+		<< "  bench-batch [objects] [meshes] [materials]  check and time indirect draw command generation" << endl
+		<< "  bench-raster <file.obj|file.stl> [--size WxH] [--grid n] [--frames n] [-o out.bmp]  render a grid of the mesh with the software rasterizer" << endl
+		<< "  bench-lights [lights] [frames]  check and time the clustering of point lights" << endl
+		<< "  bench-queue [draws] [runs]  check the render queue sort and count the state changes it saves" << endl
+		<< "  bench-texture <file.bmp> [runs]  check the BMP decoder and mip filters, and time them" << endl
+		<< "  bench-image [size] [runs]  time CImg planes to RGB/RGBA rows and whole image loads" << endl
+		<< "  bench-bc <image> [runs]  BC1/BC3/BC5 quality (PSNR) and encoding throughput per thread count" << endl
+		<< "  bench-profiler [scopes]  cost of a profiler scope, disabled and enabled" << endl
+		<< "  quantization-error [file.obj|-] [samples]  check the vertex encodings against their error bounds" << endl;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	const string command = argv[1];
+	try {
+		if (command == "convert") return convert(argc - 2, argv + 2);
+		if (command == "bench-weld") return benchWeld(argc - 2, argv + 2);
+		if (command == "bench-obj") return benchObj(argc - 2, argv + 2);
+		if (command == "bench-stl") return benchStl(argc - 2, argv + 2);
+		if (command == "optimize") return optimize(argc - 2, argv + 2);
+		if (command == "meshlets") return meshlets(argc - 2, argv + 2);
+		if (command == "lod") return lod(argc - 2, argv + 2);
+		if (command == "bench-bvh") return benchBvh(argc - 2, argv + 2);
+		if (command == "bench-cull") return benchCull(argc - 2, argv + 2);
+		if (command == "bench-batch") return benchBatch(argc - 2, argv + 2);
+		if (command == "bench-raster") return benchRaster(argc - 2, argv + 2);
+		if (command == "bench-lights") return benchLights(argc - 2, argv + 2);
+		if (command == "bench-queue") return benchQueue(argc - 2, argv + 2);
+		if (command == "bench-texture") return benchTexture(argc - 2, argv + 2);
+		if (command == "bench-image") return benchImage(argc - 2, argv + 2);
+		if (command == "bench-bc") return benchBc(argc - 2, argv + 2);
+		if (command == "bench-profiler") return benchProfiler(argc - 2, argv + 2);
+		if (command == "quantization-error") return quantizationError(argc - 2, argv + 2);
+	} catch (const exception& e) {
+		cerr << "Error: " << e.what() << endl;
+		return 1;
+	}
+
+	usage();
+	return 1;
+}
@@ -1,136 +1,358 @@
 #include "vbo_indexer.h"
+#include "profiler.h"
 
+#include <cstring>
+#include <cstdint>
+#include <cmath>
 
 struct PackedVertex {
 	glm::vec3 position;
 	glm::vec2 uv;
 	glm::vec3 normal;
-	bool operator<(const PackedVertex that) const {
-		return memcmp((void*)this, (void*)&that, sizeof(PackedVertex)) > 0;
+};
+
+// Mixes the raw bits of a vertex, so welding stays as exact as the memcmp it replaces
+static uint32_t hashPackedVertex(const PackedVertex& v) {
+	uint32_t words[sizeof(PackedVertex) / 4];
+	memcpy(words, &v, sizeof(PackedVertex));
+
+	uint32_t h = 0x811C9DC5u;
+	for (uint32_t w : words) {
+		w *= 0xCC9E2D51u;
+		w = (w << 15) | (w >> 17);
+		h ^= w * 0x1B873593u;
+		h = ((h << 13) | (h >> 19)) * 5 + 0xE6546B64u;
+	}
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	return h;
+}
+
+static const uint32_t EMPTY_SLOT = 0xFFFFFFFFu;
+
+// Open addressing table from a vertex to its output index.
+// Slots only hold the hash and the index, the vertices themselves are read back from out_XXXX.
+// The table doubles when half full, so it stays cache sized for heavily shared vertices.
+class VertexWeldTable {
+public:
+	explicit VertexWeldTable(size_t expected) : used(0) {
+		size_t capacity = 16;
+		while (capacity < expected * 2) capacity <<= 1;
+		slots.assign(capacity, Slot{ 0, EMPTY_SLOT });
+		mask = (uint32_t)capacity - 1;
+	}
+
+	// Returns the index of a vertex equal to packed, or inserts candidate and returns it
+	uint32_t findOrInsert(
+		const PackedVertex& packed,
+		uint32_t candidate,
+		const std::vector<glm::vec3>& out_vertices,
+		const std::vector<glm::vec2>& out_uvs,
+		const std::vector<glm::vec3>& out_normals
+	) {
+		const uint32_t hash = hashPackedVertex(packed);
+		uint32_t slot = hash & mask;
+		while (slots[slot].index != EMPTY_SLOT) {
+			const uint32_t i = slots[slot].index;
+			if (slots[slot].hash == hash &&
+				memcmp(&out_vertices[i], &packed.position, sizeof(glm::vec3)) == 0 &&
+				memcmp(&out_uvs[i], &packed.uv, sizeof(glm::vec2)) == 0 &&
+				memcmp(&out_normals[i], &packed.normal, sizeof(glm::vec3)) == 0) {
+				return i;
+			}
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = Slot{ hash, candidate };
+		if (++used * 2 > slots.size()) grow();
+		return candidate;
+	}
+
+private:
+	struct Slot {
+		uint32_t hash;
+		uint32_t index;
 	};
+
+	void grow() {
+		std::vector<Slot> old;
+		old.swap(slots);
+		slots.assign(old.size() * 2, Slot{ 0, EMPTY_SLOT });
+		mask = (uint32_t)slots.size() - 1;
+		for (const Slot& s : old) {
+			if (s.index == EMPTY_SLOT) continue;
+			uint32_t slot = s.hash & mask;
+			while (slots[slot].index != EMPTY_SLOT) slot = (slot + 1) & mask;
+			slots[slot] = s;
+		}
+	}
+
+	std::vector<Slot> slots;
+	size_t used;
+	uint32_t mask;
 };
 
-bool getSimilarVertexIndex_fast(
-	PackedVertex& packed,
-	std::map<PackedVertex, unsigned short>& VertexToOutIndex,
-	unsigned short& result
-) {
-	std::map<PackedVertex, unsigned short>::iterator it = VertexToOutIndex.find(packed);
-	if (it == VertexToOutIndex.end()) {
-		return false;
+IndexBuffer packIndices(const std::vector<unsigned int>& indices, size_t vertexCount) {
+	IndexBuffer buffer;
+	buffer.wide = vertexCount > 0xFFFF;
+	if (buffer.wide) {
+		buffer.indices32 = indices;
 	} else {
-		result = it->second;
-		return true;
+		buffer.indices16.assign(indices.begin(), indices.end());
 	}
+	return buffer;
 }
+
+// Tolerance used by indexVBO_near and its WeldGrid to merge vertices
+static const float WELD_EPSILON = 0.01f;
+
 // Returns true iif v1 can be considered equal to v2
 bool is_near(float v1, float v2) {
-	return fabs(v1 - v2) < 0.01f;
+	return fabs(v1 - v2) < WELD_EPSILON;
 }
 
-// Searches through all already-exported vertices
-// for a similar one.
 // Similar = same position + same UVs + same normal
-bool getSimilarVertexIndex(
-	glm::vec3& in_vertex,
-	glm::vec2& in_uv,
-	glm::vec3& in_normal,
-	std::vector<glm::vec3>& out_vertices,
-	std::vector<glm::vec2>& out_uvs,
-	std::vector<glm::vec3>& out_normals,
-	unsigned short& result
+static bool isSimilarVertex(
+	const glm::vec3& in_vertex,
+	const glm::vec2& in_uv,
+	const glm::vec3& in_normal,
+	const glm::vec3& out_vertex,
+	const glm::vec2& out_uv,
+	const glm::vec3& out_normal
 ) {
-	// Lame linear search
-	for (unsigned int i = 0; i < out_vertices.size(); i++) {
-		if (
-			is_near(in_vertex.x, out_vertices[i].x) &&
-			is_near(in_vertex.y, out_vertices[i].y) &&
-			is_near(in_vertex.z, out_vertices[i].z) &&
-			is_near(in_uv.x, out_uvs[i].x) &&
-			is_near(in_uv.y, out_uvs[i].y) &&
-			is_near(in_normal.x, out_normals[i].x) &&
-			is_near(in_normal.y, out_normals[i].y) &&
-			is_near(in_normal.z, out_normals[i].z)
-			) {
-			result = i;
-			return true;
+	return
+		is_near(in_vertex.x, out_vertex.x) &&
+		is_near(in_vertex.y, out_vertex.y) &&
+		is_near(in_vertex.z, out_vertex.z) &&
+		is_near(in_uv.x, out_uv.x) &&
+		is_near(in_uv.y, out_uv.y) &&
+		is_near(in_normal.x, out_normal.x) &&
+		is_near(in_normal.y, out_normal.y) &&
+		is_near(in_normal.z, out_normal.z);
+}
+
+// Uniform grid over the exported positions.
+// Cells are twice the tolerance wide, so the vertices similar to a query lie in at most
+// two cells per axis. Each cell heads a linked list of the vertices it holds.
+class WeldGrid {
+public:
+	explicit WeldGrid(size_t expected) : used(0) {
+		size_t capacity = 16;
+		while (capacity < expected * 2) capacity <<= 1;
+		slots.assign(capacity, Cell{ 0, 0, 0, EMPTY_SLOT });
+		mask = (uint32_t)capacity - 1;
+		next.reserve(expected);
+	}
+
+	// Returns the lowest exported index similar to the vertex, like the linear search
+	// it replaces, or EMPTY_SLOT if there is none
+	uint32_t findSimilar(
+		const glm::vec3& in_vertex,
+		const glm::vec2& in_uv,
+		const glm::vec3& in_normal,
+		const std::vector<glm::vec3>& out_vertices,
+		const std::vector<glm::vec2>& out_uvs,
+		const std::vector<glm::vec3>& out_normals
+	) const {
+		// Slightly wider than the tolerance so rounding never hides a neighbour cell
+		const float reach = WELD_EPSILON * 1.01f;
+		int32_t x0, y0, z0, x1, y1, z1;
+		cellOf(in_vertex - glm::vec3(reach), x0, y0, z0);
+		cellOf(in_vertex + glm::vec3(reach), x1, y1, z1);
+
+		uint32_t result = EMPTY_SLOT;
+		for (int32_t z = z0; z <= z1; z++) {
+			for (int32_t y = y0; y <= y1; y++) {
+				for (int32_t x = x0; x <= x1; x++) {
+					const uint32_t slot = find(x, y, z);
+					if (slot == EMPTY_SLOT) continue;
+
+					for (uint32_t i = slots[slot].head; i != EMPTY_SLOT; i = next[i]) {
+						if (i < result && isSimilarVertex(in_vertex, in_uv, in_normal, out_vertices[i], out_uvs[i], out_normals[i])) {
+							result = i;
+						}
+					}
+				}
+			}
 		}
+		return result;
 	}
-	// No other vertex could be used instead.
-	// Looks like we'll have to add it to the VBO.
-	return false;
-}
+
+	// Adds the exported vertex index, which must be the next one
+	void insert(const glm::vec3& position, uint32_t index) {
+		int32_t x, y, z;
+		cellOf(position, x, y, z);
+
+		uint32_t slot = find(x, y, z);
+		if (slot == EMPTY_SLOT) {
+			slot = hashCell(x, y, z) & mask;
+			while (slots[slot].head != EMPTY_SLOT) slot = (slot + 1) & mask;
+			slots[slot] = Cell{ x, y, z, EMPTY_SLOT };
+			++used;
+		}
+
+		next.push_back(slots[slot].head);
+		slots[slot].head = index;
+
+		if (used * 2 > slots.size()) grow();
+	}
+
+private:
+	struct Cell {
+		int32_t x, y, z;
+		uint32_t head;
+	};
+
+	static void cellOf(const glm::vec3& p, int32_t& x, int32_t& y, int32_t& z) {
+		const double scale = 1.0 / (2.0 * WELD_EPSILON);
+		x = clampCell(floor(p.x * scale));
+		y = clampCell(floor(p.y * scale));
+		z = clampCell(floor(p.z * scale));
+	}
+
+	static int32_t clampCell(double c) {
+		if (c < -2147483647.0) return -2147483647;
+		if (c > 2147483646.0) return 2147483646;
+		return (int32_t)c;
+	}
+
+	static uint32_t hashCell(int32_t x, int32_t y, int32_t z) {
+		uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u;
+		h ^= h >> 16;
+		h *= 0x85EBCA6Bu;
+		h ^= h >> 13;
+		return h;
+	}
+
+	uint32_t find(int32_t x, int32_t y, int32_t z) const {
+		uint32_t slot = hashCell(x, y, z) & mask;
+		while (slots[slot].head != EMPTY_SLOT) {
+			const Cell& c = slots[slot];
+			if (c.x == x && c.y == y && c.z == z) return slot;
+			slot = (slot + 1) & mask;
+		}
+		return EMPTY_SLOT;
+	}
+
+	void grow() {
+		std::vector<Cell> old;
+		old.swap(slots);
+		slots.assign(old.size() * 2, Cell{ 0, 0, 0, EMPTY_SLOT });
+		mask = (uint32_t)slots.size() - 1;
+		for (const Cell& c : old) {
+			if (c.head == EMPTY_SLOT) continue;
+			uint32_t slot = hashCell(c.x, c.y, c.z) & mask;
+			while (slots[slot].head != EMPTY_SLOT) slot = (slot + 1) & mask;
+			slots[slot] = c;
+		}
+	}
+
+	std::vector<Cell> slots;
+	std::vector<uint32_t> next;
+	size_t used;
+	uint32_t mask;
+};
 
 
 void indexVBO(
-	std::vector<glm::vec3>& in_vertices,
-	std::vector<glm::vec2>& in_uvs,
-	std::vector<glm::vec3>& in_normals,
+	const std::vector<glm::vec3>& in_vertices,
+	const std::vector<glm::vec2>& in_uvs,
+	const std::vector<glm::vec3>& in_normals,
 
-	std::vector<unsigned short>& out_indices,
+	std::vector<unsigned int>& out_indices,
 	std::vector<glm::vec3>& out_vertices,
 	std::vector<glm::vec2>& out_uvs,
 	std::vector<glm::vec3>& out_normals
 ) {
-	std::map<PackedVertex, unsigned short> VertexToOutIndex;
+	PROFILE_SCOPE("indexVBO");
+	// OBJ exports usually share each vertex between several faces
+	VertexWeldTable VertexToOutIndex(in_vertices.size() / 4);
+
+	out_indices.reserve(out_indices.size() + in_vertices.size());
 
 	// For each input vertex
-	for (unsigned int i = 0; i < in_vertices.size(); i++) {
+	for (size_t i = 0; i < in_vertices.size(); i++) {
 
 		PackedVertex packed = { in_vertices[i], in_uvs[i], in_normals[i] };
 
+		// Try to find a similar vertex in out_XXXX, or reserve the next slot for it
+		const uint32_t newindex = (uint32_t)out_vertices.size();
+		const uint32_t index = VertexToOutIndex.findOrInsert(packed, newindex, out_vertices, out_uvs, out_normals);
 
-		// Try to find a similar vertex in out_XXXX
-		unsigned short index;
-		bool found = getSimilarVertexIndex_fast(packed, VertexToOutIndex, index);
-
-		if (found) { // A similar vertex is already in the VBO, use it instead !
-			out_indices.push_back(index);
-		} else { // If not, it needs to be added in the output data.
+		if (index == newindex) { // If not, it needs to be added in the output data.
 			out_vertices.push_back(in_vertices[i]);
 			out_uvs.push_back(in_uvs[i]);
 			out_normals.push_back(in_normals[i]);
-			unsigned short newindex = (unsigned short)out_vertices.size() - 1;
-			out_indices.push_back(newindex);
-			VertexToOutIndex[packed] = newindex;
 		}
+		out_indices.push_back(index);
 	}
 }
 
-void indexVBO_TBN(
-	std::vector<glm::vec3>& in_vertices,
-	std::vector<glm::vec2>& in_uvs,
-	std::vector<glm::vec3>& in_normals,
-	std::vector<glm::vec3>& in_tangents,
-	std::vector<glm::vec3>& in_bitangents,
+// Welds vertices within WELD_EPSILON of each other, the first one seen being kept
+void indexVBO_near(
+	const std::vector<glm::vec3>& in_vertices,
+	const std::vector<glm::vec2>& in_uvs,
+	const std::vector<glm::vec3>& in_normals,
 
-	std::vector<unsigned short>& out_indices,
+	std::vector<unsigned int>& out_indices,
 	std::vector<glm::vec3>& out_vertices,
 	std::vector<glm::vec2>& out_uvs,
-	std::vector<glm::vec3>& out_normals,
-	std::vector<glm::vec3>& out_tangents,
-	std::vector<glm::vec3>& out_bitangents
+	std::vector<glm::vec3>& out_normals
 ) {
+	PROFILE_SCOPE("indexVBO_near");
+	WeldGrid grid(in_vertices.size() / 4);
+
+	// Vertices already in out_XXXX are candidates too
+	for (size_t i = 0; i < out_vertices.size(); i++) {
+		grid.insert(out_vertices[i], (uint32_t)i);
+	}
+
+	out_indices.reserve(out_indices.size() + in_vertices.size());
+
 	// For each input vertex
-	for (unsigned int i = 0; i < in_vertices.size(); i++) {
+	for (size_t i = 0; i < in_vertices.size(); i++) {
 
 		// Try to find a similar vertex in out_XXXX
-		unsigned short index;
-		bool found = getSimilarVertexIndex(in_vertices[i], in_uvs[i], in_normals[i], out_vertices, out_uvs, out_normals, index);
+		const uint32_t index = grid.findSimilar(in_vertices[i], in_uvs[i], in_normals[i], out_vertices, out_uvs, out_normals);
 
-		if (found) { // A similar vertex is already in the VBO, use it instead !
+		if (index != EMPTY_SLOT) { // A similar vertex is already in the VBO, use it instead !
 			out_indices.push_back(index);
-
-			// Average the tangents and the bitangents
-			out_tangents[index] += in_tangents[i];
-			out_bitangents[index] += in_bitangents[i];
 		} else { // If not, it needs to be added in the output data.
+			const uint32_t newindex = (uint32_t)out_vertices.size();
 			out_vertices.push_back(in_vertices[i]);
 			out_uvs.push_back(in_uvs[i]);
 			out_normals.push_back(in_normals[i]);
-			out_tangents.push_back(in_tangents[i]);
-			out_bitangents.push_back(in_bitangents[i]);
-			out_indices.push_back((unsigned short)out_vertices.size() - 1);
+			out_indices.push_back(newindex);
+			grid.insert(in_vertices[i], newindex);
 		}
 	}
 }
+
+// Welds like indexVBO_near, then sums the tangents and bitangents of the welded vertices
+void indexVBO_TBN(
+	const std::vector<glm::vec3>& in_vertices,
+	const std::vector<glm::vec2>& in_uvs,
+	const std::vector<glm::vec3>& in_normals,
+	const std::vector<glm::vec3>& in_tangents,
+	const std::vector<glm::vec3>& in_bitangents,
+
+	std::vector<unsigned int>& out_indices,
+	std::vector<glm::vec3>& out_vertices,
+	std::vector<glm::vec2>& out_uvs,
+	std::vector<glm::vec3>& out_normals,
+	std::vector<glm::vec3>& out_tangents,
+	std::vector<glm::vec3>& out_bitangents
+) {
+	PROFILE_SCOPE("indexVBO_TBN");
+	const size_t firstIndex = out_indices.size();
+	indexVBO_near(in_vertices, in_uvs, in_normals, out_indices, out_vertices, out_uvs, out_normals);
+
+	// Average the tangents and the bitangents
+	out_tangents.resize(out_vertices.size(), glm::vec3(0.0f));
+	out_bitangents.resize(out_vertices.size(), glm::vec3(0.0f));
+	for (size_t i = 0; i < in_vertices.size(); i++) {
+		const unsigned int index = out_indices[firstIndex + i];
+		out_tangents[index] += in_tangents[i];
+		out_bitangents[index] += in_bitangents[i];
+	}
+}
@@ -1,31 +1,60 @@
 #pragma once
 #include <vector>
-#include <map>
 
+#include <glad/glad.h>
 #include <glm/glm.hpp>
 
+// Index data ready for glBufferData, stored on 16 bits when every vertex fits
+struct IndexBuffer {
+	std::vector<unsigned short> indices16;
+	std::vector<unsigned int> indices32;
+	bool wide = false;
+
+	size_t count() const { return wide ? indices32.size() : indices16.size(); }
+	size_t byteSize() const { return wide ? indices32.size() * sizeof(unsigned int) : indices16.size() * sizeof(unsigned short); }
+	const void* data() const { return wide ? (const void*)indices32.data() : (const void*)indices16.data(); }
+	GLenum type() const { return wide ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT; }
+};
+
+// Narrows the indices to unsigned short when vertexCount allows it
+IndexBuffer packIndices(const std::vector<unsigned int>& indices, size_t vertexCount);
+
+// Welds bitwise identical vertices in linear time
 void indexVBO(
-	std::vector<glm::vec3>& in_vertices,
-	std::vector<glm::vec2>& in_uvs,
-	std::vector<glm::vec3>& in_normals,
+	const std::vector<glm::vec3>& in_vertices,
+	const std::vector<glm::vec2>& in_uvs,
+	const std::vector<glm::vec3>& in_normals,
+
+	std::vector<unsigned int>& out_indices,
+	std::vector<glm::vec3>& out_vertices,
+	std::vector<glm::vec2>& out_uvs,
+	std::vector<glm::vec3>& out_normals
+);
 
-	std::vector<unsigned short>& out_indices,
+// Welds vertices within 0.01 of each other, in near-linear time
+void indexVBO_near(
+	const std::vector<glm::vec3>& in_vertices,
+	const std::vector<glm::vec2>& in_uvs,
+	const std::vector<glm::vec3>& in_normals,
+
+	std::vector<unsigned int>& out_indices,
 	std::vector<glm::vec3>& out_vertices,
 	std::vector<glm::vec2>& out_uvs,
 	std::vector<glm::vec3>& out_normals
 );
 
+// Welds vertices within 0.01 of each other and sums their tangents, in near-linear time
 void indexVBO_TBN(
-	std::vector<glm::vec3>& in_vertices,
-	std::vector<glm::vec2>& in_uvs,
-	std::vector<glm::vec3>& in_normals,
-	std::vector<glm::vec3>& in_tangents,
-	std::vector<glm::vec3>& in_bitangents,
+	const std::vector<glm::vec3>& in_vertices,
+	const std::vector<glm::vec2>& in_uvs,
+	const std::vector<glm::vec3>& in_normals,
+	const std::vector<glm::vec3>& in_tangents,
+	const std::vector<glm::vec3>& in_bitangents,
 
-	std::vector<unsigned short>& out_indices,
+	std::vector<unsigned int>& out_indices,
 	std::vector<glm::vec3>& out_vertices,
 	std::vector<glm::vec2>& out_uvs,
 	std::vector<glm::vec3>& out_normals,
 	std::vector<glm::vec3>& out_tangents,
 	std::vector<glm::vec3>& out_bitangents
-);
\ No newline at end of file
+);